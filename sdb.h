@@ -17,6 +17,18 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
 
 /*******************************************************************************
  * Constants
@@ -26,7 +38,53 @@
 #define MIN_MATCH 3
 #define POOL_BLOCK_SIZE 4096
 #define SDB_MAGIC 0x53444246  // "SDBF" in ASCII
-#define SDB_FILE_VERSION 1
+#define SDB_FILE_VERSION 3
+#define SDB_FOOTER_MAGIC 0x53444254  // "SDBT" in ASCII
+#define SDB_BLOCK_MAGIC 0x5344424B   // "SDBK" in ASCII
+#define SDB_BLOCK_SIZE (64 * 1024)
+#define SDB_SORTED_BLOCK_SIZE (16 * 1024)  // Snapshot blocks, small enough to decode per lookup
+#define SDB_KEYS_MAGIC 0x53444249    // "SDBI" in ASCII, sparse index in the footer
+#define SDB_RESTART_INTERVAL 16      // Entries between restart points of a sorted block
+#define SDB_PAGED_MAGIC 0x53444250  // "SDBP" in ASCII
+#define SDB_PAGED_VERSION 2
+#define SDB_MIN_POOL_PAGES 16
+#define SDB_DEFAULT_POOL_PAGES 1024
+#define SDB_WAL_MAGIC 0x53444257  // "SDBW" in ASCII
+#define SDB_WAL_VERSION 1
+#define SDB_DEFAULT_WAL_SIZE (1024 * 1024)
+#define SDB_DEFAULT_REPLAY_RATE (32 * 1024 * 1024)  // Log bytes replayed per second until measured
+#define SDB_DEFAULT_RECOVERY_MS 1000
+#define SDB_DEFAULT_CHECKPOINT_INTERVAL 60
+#define SDB_DEFAULT_MAX_WRITE_DELAY 1000  // Microseconds per write just below the hard limit
+#define SDB_REPLAY_MAX_THREADS 64
+#define SDB_REPLAY_MIN_BATCH 4096    // Fewer sets than this are replayed without threads
+#define SDB_MAX_HOT_KEYS 1024
+#define SDB_SKIP_HEIGHT 16           // Levels of an ordered table's skiplist
+#define SDB_RECLAIM_BYTES (4 * 1024 * 1024)  // Replaced values that make a writer reclaim memory
+#define SDB_HOT_KEY_SLOTS 4          // Counters kept per reported hot key
+#define SDB_HOT_KEY_FILTER 8         // Filter counters per key counter
+#define SDB_ARENA_BLOCK_SIZE (64 * 1024)
+#define SDB_NO_PAGE 0xFFFFFFFFu
+#define SDB_PAGED_NAME_MAX 255
+#define SDB_PAGED_INLINE_MAX 1024
+#define SDB_QUARANTINE_MAGIC 0x53444251  // "SDBQ" in ASCII
+
+// O_DIRECT is only exposed with _GNU_SOURCE; glibc always has the raw value
+#if defined(O_DIRECT)
+#define SDB_O_DIRECT O_DIRECT
+#elif defined(__O_DIRECT)
+#define SDB_O_DIRECT __O_DIRECT
+#else
+#define SDB_O_DIRECT 0
+#endif
+
+// Access pattern hints, e.g. SDB_FADVISE(fd, 0, 0, SEQUENTIAL); no-ops where unsupported
+#ifdef POSIX_FADV_NORMAL
+#define SDB_FADVISE(fd, offset, len, advice) \
+    ((void)posix_fadvise((fd), (off_t)(offset), (off_t)(len), POSIX_FADV_##advice))
+#else
+#define SDB_FADVISE(fd, offset, len, advice) ((void)0)
+#endif
 
 /*******************************************************************************
  * Type Definitions
@@ -37,31 +95,391 @@ typedef enum {
     SDB_COMPRESS_LZ77
 } SDBCompressType;
 
+typedef enum {
+    SDB_STORAGE_MEMORY,
+    SDB_STORAGE_PAGED
+} SDBStorageMode;
+
+typedef enum {
+    SDB_SHARD_BY_TABLE,
+    SDB_SHARD_BY_KEY
+} SDBShardMode;
+
 typedef struct SDBEntry {
     char *key;
-    char *value;
+    char *value;            // NULL while the value is demoted to the cold tier
     struct SDBEntry *next;
+    uint32_t hits;          // Access counter, halved on every demotion pass
+    uint32_t value_len;
+    uint32_t cold_len;
+    uint32_t expires;       // Clock second after which a loaded table reloads the value, 0 for unset
+    uint64_t cold_offset;   // Location of the value in the cold segment
 } SDBEntry;
 
+typedef struct SDBArenaBlock {
+    struct SDBArenaBlock *next;     // Older block
+    struct SDBArenaBlock *prev;
+    struct SDBArena *arena;
+    size_t size;            // Bytes mapped, including this header
+    size_t used;            // Bytes handed out, including this header
+    size_t live;            // Bytes of objects not freed yet
+} SDBArenaBlock;
+
+typedef struct SDBArena {
+    SDBArenaBlock *head;    // Newest block, where objects are allocated
+    SDBArenaBlock *cursor;  // Next block the compactor looks at
+    size_t mapped;
+    size_t live;
+    size_t released;        // Bytes of blocks returned to the system so far
+} SDBArena;
+
 typedef struct {
     SDBEntry *head;
     SDBEntry *tail;
     size_t capacity;
+    size_t count;
     SDBEntry** entries;
+    SDBArena arena;         // Keys and values of the entries
 } SDBEntryList;
 
+typedef struct {
+    char *key;
+    size_t key_size;        // Bytes allocated for key, reused when the slot is taken over
+    size_t hash;
+    uint64_t count;         // Estimated accesses, at most error too high
+    uint64_t error;
+    uint64_t reads;         // Exact since the key took over the slot
+    uint64_t writes;
+    uint32_t heap_pos;
+} SDBHotSlot;
+
+typedef struct {
+    SDBHotSlot *slots;
+    uint32_t *heap;         // Slot numbers, least counted first
+    int32_t *index;         // Open addressing by key hash, slot number or -1
+    uint64_t *filter;       // Accesses of untracked keys, by key hash
+    uint32_t slot_count;
+    uint32_t capacity;
+    uint32_t index_mask;
+    uint32_t filter_mask;
+    uint64_t accesses;
+} SDBHotKeys;
+
+/**
+ * @brief Fetches a value that is not in the table
+ * 
+ * @return The value, allocated with malloc() and freed by the database, or
+ *         NULL if there is none
+ */
+typedef char* (*SDBLoader)(void* context, const char* table, const char* key);
+
+typedef struct {
+    SDBLoader load;
+    void *context;
+    unsigned ttl;           // Seconds a value stays fresh, 0 for ever
+} SDBReadThrough;
+
+/**
+ * @brief Called by sdb_table_scan() for each key in the range, in key order
+ * 
+ * @return 0 to continue, anything else to stop the scan
+ */
+typedef int (*SDBScanFn)(const char* key, const char* value, void* ctx);
+
+typedef struct SDBLoad {
+    char *table;
+    char *key;
+    int done;
+    int waiters;            // Callers waiting for this load instead of starting their own
+    struct SDBLoad *next;
+} SDBLoad;
+
+/*
+ * Ordered tables keep their entries in a skiplist that writers change
+ * with compare-and-swap and readers walk without any lock. Nodes are never
+ * removed; a write to an existing key swaps in a new value, and the one it
+ * replaces is freed once no reader can still be looking at it.
+ */
+typedef struct SDBSkipValue {
+    struct SDBSkipValue *retired;   // Next replaced value waiting to be freed
+    uint64_t seq;           // Order of the write; a later write always wins
+    size_t len;             // The value follows the header
+} SDBSkipValue;
+
+typedef struct SDBSkipNode {
+    SDBSkipValue *value;
+    struct SDBSkipNode **next;      // One link per level, after the node
+    char *key;              // After the links
+    uint32_t key_len;
+    uint32_t height;
+} SDBSkipNode;
+
+typedef struct SDBSkiplist {
+    SDBSkipNode *head;      // Links of every level, no key
+    struct SDBSkiplist *retired;
+} SDBSkiplist;
+
+typedef struct SDBOrderedDir {
+    int count;
+    char **names;           // Copies, so readers never see a name being freed
+    SDBSkiplist **lists;
+    struct SDBOrderedDir *retired;
+} SDBOrderedDir;
+
+typedef struct {
+    SDBOrderedDir *dir;     // Published for lookups without the lock
+    uint64_t seq;           // Last sequence given to a write, under the lock
+    size_t pending;         // Writes in the log but not yet in their skiplist
+    size_t readers[2];      // Lock-free sections running, per epoch
+    unsigned epoch;
+    SDBSkipValue *retired;  // Replaced values, pushed by writers without the lock
+    size_t retired_bytes;
+    SDBOrderedDir *retired_dirs;    // Replaced under the lock
+    SDBSkiplist *retired_lists;
+    SDBSkipValue *limbo;    // Retired before the last epoch change; freed once
+    SDBOrderedDir *limbo_dirs;      // the readers of the old epoch are gone
+    SDBSkiplist *limbo_lists;
+    unsigned limbo_epoch;
+} SDBOrderedTables;
+
 typedef struct {
     char *name;
     SDBEntryList *entries;
+    SDBSkiplist *ordered;   // Entries of an ordered table, which leaves entries empty
+    SDBHotKeys *hot;        // Most accessed keys, created on first access
+    SDBReadThrough *loader; // Fills misses, NULL for none
+    uint32_t root_page;     // Table root page in paged mode
+    uint32_t block_reads;   // Blocks decoded by lookups while the table is unloaded
+    int frozen;             // Kept on disk with a key index until the next write
+    int lazy_index;         // Table's index in the block file until it is loaded, else -1
 } SDBTable;
 
+typedef struct {
+    uint32_t page_id;
+    int pin_count;
+    int hash_next;          // Next frame in the same lookup bucket
+    unsigned char ref;      // CLOCK reference bit
+    unsigned char dirty;
+    unsigned char* data;
+} SDBFrame;
+
+typedef struct {
+    int fd;
+    SDBFrame* frames;
+    size_t frame_count;
+    size_t clock_hand;
+    unsigned char* memory;
+    int* lookup;            // Page id hash -> first frame index
+    size_t lookup_size;
+    uint32_t page_count;
+    uint32_t free_head;     // First page of the on-disk free list
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t writebacks;
+} SDBPager;
+
+typedef struct {
+    SDBCompressType compress_type;
+    SDBStorageMode storage_mode;
+    size_t pool_pages;      // Buffer pool frames for SDB_STORAGE_PAGED
+    size_t memory_target;   // Resident value bytes in memory mode, 0 for no limit
+    int strict_verify;      // Check every block checksum on open and fail on corruption
+    size_t wal_size;        // Bytes reserved for the write-ahead log, 0 to save on every write
+    int wal_sync;           // Flush each log record to disk before the write returns
+    size_t checkpoint_log_size;     // Log bytes that trigger a checkpoint, 0 for half the ring
+    unsigned checkpoint_interval;   // Seconds between checkpoints of a non-empty log, 0 for none
+    unsigned recovery_target_ms;    // Checkpoint before replaying the log would take longer, 0 for none
+    unsigned replay_threads;        // Threads replaying the log on open, 0 for one per CPU
+    size_t log_soft_limit;          // Log bytes above which writes are slowed down, 0 for 3/4 of the ring
+    size_t log_hard_limit;          // Log bytes at which writes wait for a checkpoint, 0 for the full ring
+    unsigned max_write_delay_us;    // Delay of a write just below the hard limit
+    unsigned hot_keys;              // Most accessed keys tracked per table, 0 for none
+} SDBOptions;
+
+typedef struct {
+    uint32_t first;         // Index of the table's first block
+    uint32_t count;         // Blocks of the table, 0 unless they are sorted by key
+    uint32_t index_block;   // Block holding the key index of a frozen table, else SDB_NO_KEY
+    const unsigned char *key_index;     // That index once opened, mapped or in key_index_copy
+    size_t key_index_len;
+    unsigned char *key_index_copy;
+    uint64_t *ranks;        // Per block: keys in the blocks before it
+} SDBSortedRun;
+
+typedef struct {
+    uint64_t offset;        // Offset of the block header in the file
+    uint32_t table;
+    uint32_t entry_count;
+    uint32_t raw_len;
+    uint32_t comp_len;
+    uint32_t codec;
+    uint32_t crc;
+} SDBBlockInfo;
+
+/**
+ * @brief Called by the scrubber for every corrupt block it finds
+ * 
+ * Runs on the scrubber thread.
+ */
+typedef void (*SDBCorruptFn)(const char* path, uint64_t offset, const char* table, void* ctx);
+
+typedef struct {
+    size_t rate_limit;      // Bytes per second read by the scrubber, 0 for no limit
+    unsigned interval;      // Seconds between passes, 0 to scrub once
+    int quarantine;         // Copy corrupt blocks to <path>.quarantine
+    SDBCorruptFn on_corrupt;
+    void* ctx;
+} SDBScrubOptions;
+
+typedef struct {
+    size_t passes;
+    size_t blocks_checked;
+    uint64_t bytes_checked;
+    size_t corrupt_blocks;
+    size_t quarantined;
+} SDBScrubStats;
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int stop;
+    char* path;
+    SDBScrubOptions options;
+    SDBScrubStats stats;
+    dev_t reported_dev;     // File the reported offsets belong to
+    ino_t reported_ino;
+    uint64_t* reported;     // Offsets of corrupt blocks already reported
+    size_t reported_count;
+} SDBScrubber;
+
+typedef struct {
+    pthread_t thread;
+    pthread_cond_t wake;    // Signalled when records are waiting to be flushed
+    pthread_cond_t synced;  // Broadcast after every flush
+    int stop;
+    uint64_t synced_seq;    // Every record up to this one is on disk
+    uint64_t synced_bytes;  // SDBWal.written when that flush started
+} SDBSyncer;
+
+typedef struct {
+    int fd;
+    unsigned char* map;     // Whole file when mapped, else NULL and records use pwrite
+    size_t map_size;
+    uint64_t ring_size;     // Bytes available for records after the header page
+    uint64_t head;          // Ring offset of the oldest live record
+    uint64_t tail;          // Ring offset the next record goes to
+    uint64_t used;          // Bytes between head and tail, including wrap padding
+    uint64_t head_seq;      // Sequence number of the record at head
+    uint64_t next_seq;
+    uint64_t written;       // Bytes appended since open, including wrap padding
+    int sync;               // Flush every record in wal_append()
+    SDBSyncer* syncer;      // Flushes records in groups instead, if running
+    int replaying;          // Set while records are applied on open
+    int failed;             // A flush failed; changes are saved with snapshots instead
+    unsigned char* scratch; // Frame buffer for the pwrite path
+    size_t scratch_size;
+    size_t appends;
+    size_t checkpoints;
+    size_t syncs;           // Flushes done by the syncer
+} SDBWal;
+
+typedef struct {
+    size_t checkpoints;         // Snapshots written, in the background or by sdb_save()
+    size_t failures;
+    size_t write_waits;         // Writes stopped at the hard limit until a checkpoint made room
+    size_t write_delays;        // Writes slowed down past the soft limit
+    uint64_t stall_us;          // Time writers spent delayed or stopped
+    uint64_t log_bytes;         // Bytes in the log that a restart would replay
+    uint64_t replay_rate;       // Log bytes replayed per second, measured on open if possible
+    uint64_t replay_ms;         // Time the log replay took on open
+    uint64_t recovery_ms;       // Estimated replay time if the process stopped now
+    uint64_t last_duration_ms;  // Time taken by the last checkpoint
+    uint64_t last_pause_us;     // Time the last checkpoint held writers off
+} SDBCheckpointStats;
+
+typedef struct {
+    size_t acquisitions;        // Times the database lock was taken, also by background threads
+    size_t contended;           // Times it was held by another thread
+    uint64_t wait_us;           // Time spent waiting for it
+    uint64_t max_wait_us;       // Longest single wait
+} SDBLockStats;
+
+typedef struct {
+    uint64_t user_bytes;        // Keys and values passed to sets
+    uint64_t log_bytes;         // Log records appended, with their frames and padding
+    uint64_t snapshot_bytes;    // Snapshot files written by checkpoints and saves
+    uint64_t page_bytes;        // Pages written back in paged mode
+    uint64_t cold_bytes;        // Values demoted to the cold segment
+    uint64_t compaction_bytes;  // Cold segment records copied by its compaction
+    uint64_t live_bytes;        // Keys and values the database holds now
+    uint64_t file_bytes;        // Size of the database file, the log and the cold segment now
+} SDBWriteStats;
+
+typedef struct {
+    pthread_t thread;
+    pthread_cond_t wake;    // Signalled by writers when a checkpoint is due
+    int stop;
+    int requested;
+    uint64_t trigger_bytes; // Log size that starts a checkpoint
+    uint64_t soft_limit;    // Log size from which writers are slowed down
+    uint64_t hard_limit;    // Log size at which writers stop
+    unsigned max_delay_us;
+    unsigned interval;
+    uint64_t last_ms;       // When the last checkpoint finished
+} SDBCheckpointer;
+
 typedef struct {
     char *path;
     SDBTable *tables;
     int table_count;
     SDBCompressType compress_type;
+    SDBStorageMode storage_mode;
+    SDBPager *pager;
+    char *scratch;          // Holds the last value returned in paged mode or from a sorted block
+    size_t scratch_size;
+    size_t memory_target;
+    size_t memory_used;     // Bytes of values currently held in memory
+    int cold_fd;            // Cold segment, opened on first demotion
+    uint64_t cold_size;
+    uint64_t cold_dead;     // Bytes in the cold segment no longer referenced
+    size_t demotions;
+    size_t promotions;
+    size_t corrupt_blocks;  // Blocks skipped because they failed verification
+    SDBScrubber *scrubber;
+    int block_fd;           // Format 3 file that unloaded tables are read from, -1 if none
+    SDBBlockInfo *blocks;   // Block index of that file
+    unsigned char *block_verified;  // Per block: checksum already checked
+    uint32_t block_count;
+    char **block_keys;      // Sparse index: first key of each block of a sorted table
+    SDBSortedRun *sorted_runs;      // Per table of the block file
+    int sorted_run_count;
+    unsigned char *block_map;       // The block file mapped for lookups, or NULL
+    size_t block_map_size;
+    unsigned char *block_cache;     // Last block decoded by a lookup
+    int64_t cached_block;           // Its index, or -1
+    SDBWal *wal;
+    uint64_t log_seq;       // Last log record included in the snapshot on disk
+    pthread_mutex_t lock;   // Serializes the API with the checkpointer
+    pthread_cond_t checkpoint_done;
+    int checkpointing;      // A snapshot is being written with the lock released
+    SDBCheckpointer *checkpointer;
+    SDBCheckpointStats checkpoint_stats;
+    SDBLockStats lock_stats;
+    SDBWriteStats write_stats;      // Counters only; the rest is filled in by sdb_write_stats()
+    unsigned hot_keys;
+    SDBLoad *loads;         // Loads running with the lock released
+    pthread_cond_t load_done;
+    SDBOrderedTables *ordered;      // Created by the first ordered table
 } SDB;
 
+typedef struct {
+    SDB **shards;
+    int shard_count;
+    SDBShardMode shard_mode;
+} SDBShardSet;
+
 typedef struct {
     char* table;
     char* key;
@@ -81,12 +499,132 @@ typedef struct {
     SDBCompressType compress_type;
 } SDBInfo;
 
+typedef struct {
+    char* name;
+    uint64_t entry_count;
+    uint64_t data_size;     // Bytes of keys and values
+} SDBTableInfo;
+
+typedef struct {
+    char* key;
+    uint64_t count;         // Estimated reads and writes, never too low
+    uint64_t error;         // How much count may be too high
+    uint64_t reads;         // Counted exactly since the key became tracked
+    uint64_t writes;
+} SDBHotKey;
+
+typedef struct {
+    SDBHotKey* keys;        // Most accessed first
+    int key_count;
+    uint64_t accesses;      // All reads and writes of the table
+} SDBHotKeyStats;
+
+typedef struct {
+    FILE* file;
+    SDBCompressType compress_type;
+    size_t block_size;
+    unsigned char* buffer;  // Entries of the block being filled
+    size_t buffer_size;
+    size_t used;
+    uint32_t table;
+    uint32_t entry_count;
+    int sorted;             // Entries arrive in key order: add restart points and index first keys
+    uint32_t* restarts;     // Offsets of the restart points in the pending block
+    uint32_t restart_count;
+    uint32_t restart_capacity;
+    SDBBlockInfo* blocks;   // Index of the blocks written so far
+    uint32_t block_count;
+    uint32_t block_capacity;
+    unsigned char* keys;    // Sparse index section of the footer
+    size_t keys_size;
+    size_t keys_used;
+    uint32_t sorted_blocks;
+    SDBTableInfo* tables;   // Per table totals for the footer
+    int table_count;
+    uint64_t log_seq;       // Last log record the snapshot includes
+    int failed;
+} SDBBlockWriter;
+
+enum {
+    SDB_PART_ENTRIES,       // Copied entries of one table, in block format
+    SDB_PART_COLD,          // One demoted value, still in the cold segment
+    SDB_PART_BLOCK          // Stored block of a table that was never loaded
+};
+
+typedef struct {
+    int kind;
+    uint32_t table;
+    unsigned char* raw;     // Entries, or the key of a cold value
+    size_t raw_len;
+    size_t raw_size;
+    uint32_t value_len;     // Cold value: length, location and record size
+    uint32_t cold_len;
+    uint64_t cold_offset;
+    SDBBlockInfo block;     // Stored block in the block file
+    char* first_key;        // Its first key if its table is sorted, else NULL
+    int verify;
+} SDBSnapshotPart;
+
+/*
+ * Everything a checkpoint writes, copied while the database is locked so
+ * the file can be written without it.
+ */
+typedef struct {
+    char* path;
+    SDBCompressType compress_type;
+    char** names;
+    unsigned char* frozen;  // Per table: write a key index
+    int table_count;
+    SDBSnapshotPart* parts;
+    size_t part_count;
+    size_t part_capacity;
+    int block_fd;           // Duplicates, so the files outlive a concurrent swap
+    int cold_fd;
+    uint64_t log_seq;
+    uint64_t wal_tail;      // Log position the snapshot covers
+    uint64_t wal_used;
+    size_t corrupt_blocks;
+    uint64_t bytes;         // Size of the file once written
+    int failed;
+} SDBSnapshot;
+
+typedef struct {
+    uint32_t format_version; // 0 if the file could not be read
+    SDBStorageMode storage_mode;
+    SDBCompressType compress_type;
+    uint64_t file_size;
+    uint64_t compressed_size;
+    uint64_t original_size;
+    int table_count;        // -1 if the file predates the table directory
+    SDBTableInfo* tables;
+    uint32_t block_count;
+    uint64_t log_seq;       // Last write-ahead log record included in the snapshot
+    char** block_keys;      // First key of each block of a sorted table, else NULL; NULL without a sparse index
+} SDBFileInfo;
+
 /*******************************************************************************
  * Function Declarations
  ******************************************************************************/
 static void write_to_buffer(unsigned char** buffer, size_t* buffer_size, 
                           size_t* current_size, const void* data, size_t size);
 static size_t hash_string(const char* str);
+static void clock_now(struct timespec* now);
+static uint64_t clock_us(void);
+static void database_lock(SDB* sdb);
+static void block_source_close(SDB* sdb);
+static void block_source_index(SDB* sdb, int fd, char** keys, int table_count);
+static const SDBSortedRun* table_sorted_run(const SDB* sdb, const SDBTable* table);
+static void table_unload(SDB* sdb, SDBTable* table, int index);
+static void table_create(SDB* sdb, const char* name);
+static void table_destroy(SDB* sdb, const char* name);
+static void table_set(SDB* sdb, const char* table, const char* key, const char* value);
+static SDBEntry* table_insert(SDBTable* t, const char* key, const char* value,
+                              size_t* memory_used, uint64_t* cold_dead);
+static int checkpoint_run(SDB* sdb);
+SDBTable* sdb_table_find(SDB* sdb, const char* name);
+void sdb_free_file_info(SDBFileInfo info);
+void sdb_scrub_stop(SDB* sdb);
+void sdb_close(SDB* sdb);
 
 /*******************************************************************************
  * Compression Functions
@@ -223,17 +761,33 @@ static unsigned char* lz77_compress(const unsigned char* data, size_t data_len,
 static unsigned char* lz77_decompress(const unsigned char* compressed, size_t comp_len, size_t* out_len) {
     if (!compressed || comp_len == 0) return NULL;
     
-    unsigned char* decompressed = (unsigned char*)malloc(comp_len * 2); // Initial size estimate
+    size_t capacity = comp_len * 2; // Initial size estimate
+    unsigned char* decompressed = (unsigned char*)malloc(capacity);
+    if (!decompressed) return NULL;
     size_t decom_pos = 0;
     size_t pos = 0;
     
     while (pos < comp_len) {
+        // A single token expands to at most 255 bytes
+        if (decom_pos + 255 > capacity) {
+            capacity *= 2;
+            unsigned char* grown = (unsigned char*)realloc(decompressed, capacity);
+            if (!grown) {
+                free(decompressed);
+                return NULL;
+            }
+            decompressed = grown;
+        }
+
         if (compressed[pos] == 0) { // Literal
+            if (pos + 1 >= comp_len) break;
             decompressed[decom_pos++] = compressed[pos + 1];
             pos += 2;
         } else { // Match
+            if (pos + 3 >= comp_len) break;
             size_t offset = compressed[pos + 1] | (compressed[pos + 2] << 8);
             size_t length = compressed[pos + 3];
+            if (offset == 0 || offset > decom_pos) break;
             
             for (size_t i = 0; i < length; i++) {
                 decompressed[decom_pos] = decompressed[decom_pos - offset];
@@ -247,397 +801,7551 @@ static unsigned char* lz77_decompress(const unsigned char* compressed, size_t co
     return realloc(decompressed, decom_pos);
 }
 
+/**
+ * @brief Compresses data with the given codec
+ * 
+ * @param type The codec
+ * @param data Input data to compress
+ * @param data_len Length of input data
+ * @param out_len Pointer to store compressed length
+ * @return Compressed data buffer (a plain copy for SDB_COMPRESS_NONE)
+ */
+static unsigned char* sdb_compress(SDBCompressType type, const unsigned char* data,
+                                   size_t data_len, size_t* out_len) {
+    if (!data || data_len == 0) return NULL;
+    if (type == SDB_COMPRESS_RLE) return rle_compress(data, data_len, out_len);
+    if (type == SDB_COMPRESS_LZ77) return lz77_compress(data, data_len, out_len);
+
+    unsigned char* copy = (unsigned char*)malloc(data_len);
+    if (!copy) return NULL;
+    memcpy(copy, data, data_len);
+    *out_len = data_len;
+    return copy;
+}
+
+/**
+ * @brief Decompresses data produced by sdb_compress()
+ * 
+ * @param type The codec
+ * @param compressed Compressed input data
+ * @param comp_len Length of compressed data
+ * @param out_len Pointer to store decompressed length
+ * @return Decompressed data buffer
+ */
+static unsigned char* sdb_decompress(SDBCompressType type, const unsigned char* compressed,
+                                     size_t comp_len, size_t* out_len) {
+    return type == SDB_COMPRESS_NONE ? sdb_compress(type, compressed, comp_len, out_len)
+         : type == SDB_COMPRESS_RLE ? rle_decompress(compressed, comp_len, out_len)
+         : lz77_decompress(compressed, comp_len, out_len);
+}
+
 /*******************************************************************************
- * Database Core Functions
+ * Buffer Pool Functions
  ******************************************************************************/
+static uint16_t get_u16(const unsigned char* p) { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+static uint32_t get_u32(const unsigned char* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+static uint64_t get_u64(const unsigned char* p) { uint64_t v; memcpy(&v, p, sizeof(v)); return v; }
+static void put_u16(unsigned char* p, uint16_t v) { memcpy(p, &v, sizeof(v)); }
+static void put_u32(unsigned char* p, uint32_t v) { memcpy(p, &v, sizeof(v)); }
+static void put_u64(unsigned char* p, uint64_t v) { memcpy(p, &v, sizeof(v)); }
+
+static size_t pager_slot(const SDBPager* pager, uint32_t page_id) {
+    return (page_id * 2654435761u) & (pager->lookup_size - 1);
+}
+
 /**
- * @brief Opens a database file
+ * @brief Releases a pager without writing anything back
  * 
- * @param path The path to the database file
- * @return The database
+ * @param pager The pager
  */
-SDB* sdb_open(const char* path, SDBCompressType compress_type) {
-    SDB* sdb = (SDB*)malloc(sizeof(SDB));
-    if (sdb == NULL) {
+static void pager_close(SDBPager* pager) {
+    if (!pager) return;
+    if (pager->fd >= 0) close(pager->fd);
+    free(pager->frames);
+    free(pager->memory);
+    free(pager->lookup);
+    free(pager);
+}
+
+/**
+ * @brief Opens the page file backing a paged database
+ * 
+ * @param path Path to the page file
+ * @param frame_count Number of frames in the buffer pool
+ * @return The pager, or NULL on failure
+ */
+static SDBPager* pager_open(const char* path, size_t frame_count) {
+    if (frame_count < SDB_MIN_POOL_PAGES) frame_count = SDB_MIN_POOL_PAGES;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return NULL;
+
+    // Page accesses are random; readahead would only pull in unrelated pages
+    SDB_FADVISE(fd, 0, 0, RANDOM);
+
+    SDBPager* pager = (SDBPager*)calloc(1, sizeof(SDBPager));
+    if (!pager) {
+        close(fd);
+        return NULL;
+    }
+    pager->fd = fd;
+    pager->frame_count = frame_count;
+    pager->lookup_size = 1;
+    while (pager->lookup_size < frame_count * 2) {
+        pager->lookup_size <<= 1;
+    }
+    pager->frames = (SDBFrame*)calloc(frame_count, sizeof(SDBFrame));
+    pager->memory = (unsigned char*)malloc(frame_count * POOL_BLOCK_SIZE);
+    pager->lookup = (int*)malloc(pager->lookup_size * sizeof(int));
+    if (!pager->frames || !pager->memory || !pager->lookup) {
+        pager_close(pager);
         return NULL;
     }
-    
-    sdb->path = strdup(path);
-    sdb->tables = NULL;
-    sdb->table_count = 0;
-    sdb->compress_type = compress_type;
 
-    FILE* file = fopen(path, "rb");
-    if (file != NULL) {
-        // Read and verify file header
-        uint32_t magic, version;
-        SDBCompressType stored_compress_type;
-        
-        if (fread(&magic, sizeof(uint32_t), 1, file) != 1 ||
-            fread(&version, sizeof(uint32_t), 1, file) != 1 ||
-            fread(&stored_compress_type, sizeof(SDBCompressType), 1, file) != 1) {
-            fclose(file);
-            return sdb;  // Return empty database if header read fails
-        }
+    for (size_t i = 0; i < pager->lookup_size; i++) {
+        pager->lookup[i] = -1;
+    }
+    for (size_t i = 0; i < frame_count; i++) {
+        pager->frames[i].page_id = SDB_NO_PAGE;
+        pager->frames[i].hash_next = -1;
+        pager->frames[i].data = pager->memory + i * POOL_BLOCK_SIZE;
+    }
 
-        // Verify magic number and version
-        if (magic != SDB_MAGIC || version > SDB_FILE_VERSION) {
-            fclose(file);
-            return sdb;  // Return empty database if validation fails
-        }
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        pager->page_count = (uint32_t)(st.st_size / POOL_BLOCK_SIZE);
+    }
+    return pager;
+}
 
-        // Use stored compression type if it exists
-        sdb->compress_type = stored_compress_type;
+static int pager_find(const SDBPager* pager, uint32_t page_id) {
+    int idx = pager->lookup[pager_slot(pager, page_id)];
+    while (idx >= 0 && pager->frames[idx].page_id != page_id) {
+        idx = pager->frames[idx].hash_next;
+    }
+    return idx;
+}
 
-        // Read compressed data
-        size_t compressed_size, original_size;
-        fread(&compressed_size, sizeof(size_t), 1, file);
-        fread(&original_size, sizeof(size_t), 1, file);
-        
-        unsigned char* compressed = (unsigned char*)malloc(compressed_size);
-        fread(compressed, 1, compressed_size, file);
-        
-        // Decompress data using the specified compression type
-        size_t decompressed_size;
-        unsigned char* buffer;
-        if (compress_type == SDB_COMPRESS_RLE) {
-            buffer = rle_decompress(compressed, compressed_size, &decompressed_size);
-        } else {
-            buffer = lz77_decompress(compressed, compressed_size, &decompressed_size);
-        }
-        free(compressed);
-        
-        if (buffer && decompressed_size == original_size) {
-            size_t pos = 0;
-            
-            // Read table count
-            memcpy(&sdb->table_count, buffer + pos, sizeof(int));
-            pos += sizeof(int);
-            
-            if (sdb->table_count > 0) {
-                sdb->tables = (SDBTable*)malloc(sizeof(SDBTable) * sdb->table_count);
-                
-                // Read each table
-                for (int i = 0; i < sdb->table_count; i++) {
-                    int name_len;
-                    memcpy(&name_len, buffer + pos, sizeof(int));
-                    pos += sizeof(int);
-                    
-                    sdb->tables[i].name = (char*)malloc(name_len + 1);
-                    memcpy(sdb->tables[i].name, buffer + pos, name_len);
-                    pos += name_len;
-                    sdb->tables[i].name[name_len] = '\0';
-                    
-                    sdb->tables[i].entries = (SDBEntryList*)malloc(sizeof(SDBEntryList));
-                    sdb->tables[i].entries->head = NULL;
-                    sdb->tables[i].entries->tail = NULL;
-                    
-                    // Read entries
-                    int entry_count;
-                    memcpy(&entry_count, buffer + pos, sizeof(int));
-                    pos += sizeof(int);
-                    
-                    SDBEntry* current = NULL;
-                    for (int j = 0; j < entry_count; j++) {
-                        SDBEntry* entry = (SDBEntry*)malloc(sizeof(SDBEntry));
-                        
-                        int key_len, value_len;
-                        memcpy(&key_len, buffer + pos, sizeof(int));
-                        pos += sizeof(int);
-                        memcpy(&value_len, buffer + pos, sizeof(int));
-                        pos += sizeof(int);
-                        
-                        entry->key = (char*)malloc(key_len + 1);
-                        entry->value = (char*)malloc(value_len + 1);
-                        
-                        memcpy(entry->key, buffer + pos, key_len);
-                        pos += key_len;
-                        memcpy(entry->value, buffer + pos, value_len);
-                        pos += value_len;
-                        
-                        entry->key[key_len] = '\0';
-                        entry->value[value_len] = '\0';
-                        entry->next = NULL;
-                        
-                        if (current == NULL) {
-                            sdb->tables[i].entries->head = entry;
-                        } else {
-                            current->next = entry;
-                        }
-                        current = entry;
-                    }
-                    sdb->tables[i].entries->tail = current;
-                }
-            }
-            free(buffer);
-        }
-        fclose(file);
+static void pager_unlink(SDBPager* pager, int idx) {
+    int* link = &pager->lookup[pager_slot(pager, pager->frames[idx].page_id)];
+    while (*link != idx) {
+        link = &pager->frames[*link].hash_next;
     }
-    
-    return sdb;
+    *link = pager->frames[idx].hash_next;
+    pager->frames[idx].hash_next = -1;
+    pager->frames[idx].page_id = SDB_NO_PAGE;
+}
+
+static int pager_write_frame(SDBPager* pager, SDBFrame* frame) {
+    off_t offset = (off_t)frame->page_id * POOL_BLOCK_SIZE;
+    if (pwrite(pager->fd, frame->data, POOL_BLOCK_SIZE, offset) != POOL_BLOCK_SIZE) {
+        return -1;
+    }
+    frame->dirty = 0;
+    pager->writebacks++;
+    return 0;
 }
 
 /**
- * @brief Closes the database
+ * @brief Picks a frame to reuse with the CLOCK algorithm
  * 
- * @param sdb The database
+ * Pinned frames are never chosen. A frame with its reference bit set gets
+ * a second chance: the bit is cleared and the hand moves on.
+ * 
+ * @param pager The pager
+ * @return Frame index, or -1 if every frame is pinned
  */
-void sdb_close(SDB* sdb) {
-    if (!sdb) return;
+static int pager_victim(SDBPager* pager) {
+    for (size_t step = 0; step < pager->frame_count * 2; step++) {
+        int idx = (int)pager->clock_hand;
+        SDBFrame* frame = &pager->frames[idx];
+        pager->clock_hand = (pager->clock_hand + 1) % pager->frame_count;
 
-    // Free all tables and their entries
-    for (int i = 0; i < sdb->table_count; i++) {
-        // Free all entries in the table
-        SDBEntry* current = sdb->tables[i].entries->head;
-        while (current != NULL) {
-            SDBEntry* next = current->next;
-            free(current->key);
-            free(current->value);
-            free(current);
-            current = next;
+        if (frame->pin_count > 0) continue;
+        if (frame->ref) {
+            frame->ref = 0;
+            continue;
         }
-        
-        // Free table structure
-        free(sdb->tables[i].name);
-        free(sdb->tables[i].entries);
+        return idx;
     }
-
-    // Free tables array
-    free(sdb->tables);
-    
-    // Free path
-    free(sdb->path);
-    
-    // Finally free the SDB structure
-    free(sdb);
+    return -1;
 }
 
 /**
- * @brief Saves the database
+ * @brief Pins a page in the buffer pool, reading it from disk if needed
  * 
- * @param sdb The database
+ * Pages past the end of the file read as zeros. Every successful pin must
+ * be matched by a pager_unpin() call.
+ * 
+ * @param pager The pager
+ * @param page_id The page to pin
+ * @return Pointer to the page contents, or NULL if no frame is available
  */
-void sdb_save(SDB* sdb) {
-    FILE* file = fopen(sdb->path, "wb");
-    if (file == NULL) {
-        return;
+static unsigned char* pager_pin(SDBPager* pager, uint32_t page_id) {
+    int idx = pager_find(pager, page_id);
+    if (idx >= 0) {
+        SDBFrame* frame = &pager->frames[idx];
+        frame->pin_count++;
+        frame->ref = 1;
+        pager->hits++;
+        return frame->data;
     }
 
-    // Write file header
-    uint32_t magic = SDB_MAGIC;
-    uint32_t version = SDB_FILE_VERSION;
-    fwrite(&magic, sizeof(uint32_t), 1, file);
-    fwrite(&version, sizeof(uint32_t), 1, file);
-    fwrite(&sdb->compress_type, sizeof(SDBCompressType), 1, file);
+    pager->misses++;
+    idx = pager_victim(pager);
+    if (idx < 0) return NULL;
 
-    size_t buffer_size = 1024;  // Initial size
-    size_t current_size = 0;
-    unsigned char* buffer = (unsigned char*)malloc(buffer_size);
-    
-    // Write table count
-    write_to_buffer(&buffer, &buffer_size, &current_size, 
-                   &sdb->table_count, sizeof(int));
-    
-    // Write each table
-    for (int i = 0; i < sdb->table_count; i++) {
-        // Write table name
-        int name_len = strlen(sdb->tables[i].name);
-        write_to_buffer(&buffer, &buffer_size, &current_size, 
-                       &name_len, sizeof(int));
-        write_to_buffer(&buffer, &buffer_size, &current_size, 
-                       sdb->tables[i].name, name_len);
-        
-        // Count and write entries
-        int entry_count = 0;
-        SDBEntry* current = sdb->tables[i].entries->head;
+    SDBFrame* frame = &pager->frames[idx];
+    if (frame->page_id != SDB_NO_PAGE) {
+        // Dirty pages are written back before the frame is reused
+        if (frame->dirty && pager_write_frame(pager, frame) != 0) {
+            return NULL;
+        }
+        pager_unlink(pager, idx);
+        pager->evictions++;
+    }
+
+    ssize_t n = 0;
+    if (page_id < pager->page_count) {
+        n = pread(pager->fd, frame->data, POOL_BLOCK_SIZE, (off_t)page_id * POOL_BLOCK_SIZE);
+        if (n < 0) return NULL;
+    }
+    memset(frame->data + n, 0, POOL_BLOCK_SIZE - n);
+
+    size_t slot = pager_slot(pager, page_id);
+    frame->page_id = page_id;
+    frame->pin_count = 1;
+    frame->ref = 1;
+    frame->dirty = 0;
+    frame->hash_next = pager->lookup[slot];
+    pager->lookup[slot] = idx;
+    return frame->data;
+}
+
+/**
+ * @brief Unpins a page previously returned by pager_pin()
+ * 
+ * @param pager The pager
+ * @param page_id The page to unpin
+ * @param dirty Non-zero if the page was modified
+ */
+static void pager_unpin(SDBPager* pager, uint32_t page_id, int dirty) {
+    int idx = pager_find(pager, page_id);
+    if (idx < 0) return;
+
+    SDBFrame* frame = &pager->frames[idx];
+    if (dirty) frame->dirty = 1;
+    if (frame->pin_count > 0) frame->pin_count--;
+}
+
+/**
+ * @brief Allocates a zeroed page, reusing the free list when possible
+ * 
+ * @param pager The pager
+ * @return The new page id, or 0 on failure (page 0 is always the meta page)
+ */
+static uint32_t pager_alloc(SDBPager* pager) {
+    uint32_t page_id;
+    unsigned char* page;
+
+    if (pager->free_head != 0) {
+        page_id = pager->free_head;
+        page = pager_pin(pager, page_id);
+        if (!page) return 0;
+        pager->free_head = get_u32(page);
+    } else {
+        page_id = pager->page_count++;
+        page = pager_pin(pager, page_id);
+        if (!page) {
+            pager->page_count--;
+            return 0;
+        }
+    }
+
+    memset(page, 0, POOL_BLOCK_SIZE);
+    pager_unpin(pager, page_id, 1);
+    return page_id;
+}
+
+/**
+ * @brief Returns a page to the free list
+ * 
+ * @param pager The pager
+ * @param page_id The page to free
+ */
+static void pager_free(SDBPager* pager, uint32_t page_id) {
+    unsigned char* page = pager_pin(pager, page_id);
+    if (!page) return;
+
+    memset(page, 0, POOL_BLOCK_SIZE);
+    put_u32(page, pager->free_head);
+    pager->free_head = page_id;
+    pager_unpin(pager, page_id, 1);
+}
+
+/**
+ * @brief Writes every dirty frame back and syncs the page file
+ * 
+ * @param pager The pager
+ * @return 0 on success, -1 on failure
+ */
+static int pager_flush(SDBPager* pager) {
+    for (size_t i = 0; i < pager->frame_count; i++) {
+        SDBFrame* frame = &pager->frames[i];
+        if (frame->page_id != SDB_NO_PAGE && frame->dirty) {
+            if (pager_write_frame(pager, frame) != 0) return -1;
+        }
+    }
+    return fsync(pager->fd);
+}
+
+/*******************************************************************************
+ * Paged Storage Functions
+ ******************************************************************************/
+/*
+ * Page file layout (all pages are POOL_BLOCK_SIZE bytes):
+ * 
+ * - Page 0 is the meta page: magic, version, page size, page count, free
+ *   list head, table count and the root page of every table.
+ * - Each table has a root page holding its linear hashing state (level and
+ *   split pointer), entry count, stored bytes, name and the ids of the map
+ *   pages. Map pages translate bucket numbers to bucket pages.
+ * - Bucket pages hold packed records and chain to overflow pages.
+ * - Values that do not fit inline are stored in a chain of blob pages.
+ *   Keys that do not fit are stored in one too, and their record holds the
+ *   key length and blob page in place of the key, followed by a value blob.
+ * 
+ * Page id 0 doubles as "no page" inside these structures.
+ */
+enum {
+    SDB_META_MAGIC = 0,
+    SDB_META_VERSION = 4,
+    SDB_META_PAGE_SIZE = 8,
+    SDB_META_PAGE_COUNT = 12,
+    SDB_META_FREE_HEAD = 16,
+    SDB_META_TABLE_COUNT = 20,
+    SDB_META_ROOTS = 24,
+
+    SDB_ROOT_LEVEL = 0,
+    SDB_ROOT_SPLIT = 4,
+    SDB_ROOT_COUNT = 8,
+    SDB_ROOT_BYTES = 16,
+    SDB_ROOT_NAME_LEN = 24,
+    SDB_ROOT_NAME = 26,
+    SDB_ROOT_MAPS = 512,
+
+    SDB_BUCKET_NEXT = 0,
+    SDB_BUCKET_COUNT = 4,
+    SDB_BUCKET_USED = 6,
+    SDB_BUCKET_HEADER = 8,
+
+    SDB_RECORD_HEADER = 8,
+    SDB_RECORD_BLOB = 1,
+    SDB_RECORD_LONG_KEY = 2,
+    SDB_BLOB_DATA = POOL_BLOCK_SIZE - 4,
+
+    SDB_MAP_SLOTS = POOL_BLOCK_SIZE / 4,
+    SDB_MAX_PAGED_TABLES = (POOL_BLOCK_SIZE - SDB_META_ROOTS) / 4,
+    SDB_MAX_MAP_PAGES = (POOL_BLOCK_SIZE - SDB_ROOT_MAPS) / 4
+};
+
+static size_t hash_bytes(const char* data, size_t len);
+
+static uint32_t paged_bucket_index(size_t hash, uint32_t level, uint32_t split) {
+    size_t bucket = hash & (((size_t)1 << level) - 1);
+    if (bucket < split) {
+        bucket = hash & (((size_t)2 << level) - 1);
+    }
+    return (uint32_t)bucket;
+}
+
+static size_t paged_record_size(const unsigned char* rec) {
+    size_t key_len = get_u16(rec);
+    if (get_u16(rec + 2) & SDB_RECORD_BLOB) {
+        return SDB_RECORD_HEADER + key_len + 4;
+    }
+    return SDB_RECORD_HEADER + key_len + get_u32(rec + 4);
+}
+
+/**
+ * @brief Resolves the first page of a bucket through the table's map pages
+ * 
+ * @param pager The pager
+ * @param root The pinned root page of the table
+ * @param bucket The bucket number
+ * @param create Allocate missing map and bucket pages when non-zero
+ * @return The bucket's first page, or 0 if it has none
+ */
+static uint32_t paged_bucket_head(SDBPager* pager, unsigned char* root, uint32_t bucket, int create) {
+    unsigned char* map_slot = root + SDB_ROOT_MAPS + (bucket / SDB_MAP_SLOTS) * 4;
+    uint32_t map_page = get_u32(map_slot);
+    if (map_page == 0) {
+        if (!create) return 0;
+        map_page = pager_alloc(pager);
+        if (map_page == 0) return 0;
+        put_u32(map_slot, map_page);
+    }
+
+    unsigned char* map = pager_pin(pager, map_page);
+    if (!map) return 0;
+
+    unsigned char* slot = map + (bucket % SDB_MAP_SLOTS) * 4;
+    uint32_t head = get_u32(slot);
+    int dirty = 0;
+    if (head == 0 && create) {
+        head = pager_alloc(pager);
+        put_u32(slot, head);
+        dirty = 1;
+    }
+    pager_unpin(pager, map_page, dirty);
+    return head;
+}
+
+/**
+ * @brief Compares a key with the key of a record
+ * 
+ * @param pager The pager
+ * @param rec The record, inside a pinned page
+ * @param key The key
+ * @param key_len Length of the key
+ * @return 1 if the keys are equal, 0 otherwise
+ */
+static int paged_key_equal(SDBPager* pager, const unsigned char* rec, const char* key, size_t key_len) {
+    if (!(get_u16(rec + 2) & SDB_RECORD_LONG_KEY)) {
+        return get_u16(rec) == key_len && memcmp(rec + SDB_RECORD_HEADER, key, key_len) == 0;
+    }
+    if (get_u32(rec + SDB_RECORD_HEADER) != key_len) return 0;
+
+    uint32_t page_id = get_u32(rec + SDB_RECORD_HEADER + 4);
+    size_t pos = 0;
+    while (pos < key_len) {
+        unsigned char* page = page_id ? pager_pin(pager, page_id) : NULL;
+        if (!page) return 0;
+        size_t chunk = key_len - pos < SDB_BLOB_DATA ? key_len - pos : SDB_BLOB_DATA;
+        int equal = memcmp(page + 4, key + pos, chunk) == 0;
+        uint32_t next = get_u32(page);
+        pager_unpin(pager, page_id, 0);
+        if (!equal) return 0;
+        pos += chunk;
+        page_id = next;
+    }
+    return 1;
+}
+
+/**
+ * @brief Returns the key of a record
+ * 
+ * @param pager The pager
+ * @param rec The record, inside a pinned page
+ * @param len Set to the length of the key
+ * @param owned Set to a buffer the caller frees when the key was read from
+ *              blob pages, else to NULL
+ * @return The key, or NULL on failure
+ */
+static const char* paged_record_key(SDBPager* pager, const unsigned char* rec, size_t* len, char** owned) {
+    *owned = NULL;
+    if (!(get_u16(rec + 2) & SDB_RECORD_LONG_KEY)) {
+        *len = get_u16(rec);
+        return (const char*)rec + SDB_RECORD_HEADER;
+    }
+
+    size_t key_len = get_u32(rec + SDB_RECORD_HEADER);
+    char* key = (char*)malloc(key_len + 1);
+    if (!key) return NULL;
+    uint32_t page_id = get_u32(rec + SDB_RECORD_HEADER + 4);
+    size_t pos = 0;
+    while (pos < key_len) {
+        unsigned char* page = page_id ? pager_pin(pager, page_id) : NULL;
+        if (!page) {
+            free(key);
+            return NULL;
+        }
+        size_t chunk = key_len - pos < SDB_BLOB_DATA ? key_len - pos : SDB_BLOB_DATA;
+        memcpy(key + pos, page + 4, chunk);
+        uint32_t next = get_u32(page);
+        pager_unpin(pager, page_id, 0);
+        pos += chunk;
+        page_id = next;
+    }
+    key[key_len] = '\0';
+    *len = key_len;
+    *owned = key;
+    return key;
+}
+
+/**
+ * @brief Locates a key in a bucket chain
+ * 
+ * @param pager The pager
+ * @param page_id First page of the chain
+ * @param key The key
+ * @param key_len Length of the key
+ * @param out_page Set to the page holding the record
+ * @param out_off Set to the record offset within that page
+ * @return 1 if the key was found, 0 otherwise
+ */
+static int paged_find(SDBPager* pager, uint32_t page_id, const char* key, size_t key_len,
+                      uint32_t* out_page, size_t* out_off) {
+    while (page_id != 0) {
+        unsigned char* page = pager_pin(pager, page_id);
+        if (!page) return 0;
+
+        uint16_t count = get_u16(page + SDB_BUCKET_COUNT);
+        size_t off = SDB_BUCKET_HEADER;
+        for (uint16_t i = 0; i < count; i++) {
+            unsigned char* rec = page + off;
+            if (paged_key_equal(pager, rec, key, key_len)) {
+                *out_page = page_id;
+                *out_off = off;
+                pager_unpin(pager, page_id, 0);
+                return 1;
+            }
+            off += paged_record_size(rec);
+        }
+
+        uint32_t next = get_u32(page + SDB_BUCKET_NEXT);
+        pager_unpin(pager, page_id, 0);
+        page_id = next;
+    }
+    return 0;
+}
+
+static void paged_free_chain(SDBPager* pager, uint32_t page_id) {
+    while (page_id != 0) {
+        unsigned char* page = pager_pin(pager, page_id);
+        if (!page) return;
+        uint32_t next = get_u32(page);
+        pager_unpin(pager, page_id, 0);
+        pager_free(pager, page_id);
+        page_id = next;
+    }
+}
+
+/**
+ * @brief Frees the blob pages a record refers to
+ */
+static void paged_free_record(SDBPager* pager, const unsigned char* rec) {
+    uint16_t flags = get_u16(rec + 2);
+    if (flags & SDB_RECORD_LONG_KEY) {
+        paged_free_chain(pager, get_u32(rec + SDB_RECORD_HEADER + 4));
+    }
+    if (flags & SDB_RECORD_BLOB) {
+        paged_free_chain(pager, get_u32(rec + SDB_RECORD_HEADER + get_u16(rec)));
+    }
+}
+
+/**
+ * @brief Writes a value into a freshly allocated chain of blob pages
+ * 
+ * @return The first blob page, or 0 on failure
+ */
+static uint32_t paged_write_blob(SDBPager* pager, const char* value, size_t len) {
+    uint32_t first = 0;
+    uint32_t prev = 0;
+    size_t pos = 0;
+
+    while (pos < len) {
+        uint32_t page_id = pager_alloc(pager);
+        unsigned char* page = page_id ? pager_pin(pager, page_id) : NULL;
+        if (!page) {
+            paged_free_chain(pager, first);
+            return 0;
+        }
+
+        size_t chunk = len - pos < SDB_BLOB_DATA ? len - pos : SDB_BLOB_DATA;
+        memcpy(page + 4, value + pos, chunk);
+        pager_unpin(pager, page_id, 1);
+
+        if (prev != 0) {
+            unsigned char* prev_page = pager_pin(pager, prev);
+            if (prev_page) {
+                put_u32(prev_page, page_id);
+                pager_unpin(pager, prev, 1);
+            }
+        } else {
+            first = page_id;
+        }
+        prev = page_id;
+        pos += chunk;
+    }
+    return first;
+}
+
+/**
+ * @brief Copies a record's value into the database scratch buffer
+ * 
+ * @param sdb The database
+ * @param rec The record, inside a pinned page
+ * @return The NUL-terminated value, or NULL on failure
+ */
+static char* paged_read_value(SDB* sdb, const unsigned char* rec) {
+    size_t key_len = get_u16(rec);
+    size_t value_len = get_u32(rec + 4);
+
+    if (sdb->scratch_size < value_len + 1) {
+        char* scratch = (char*)realloc(sdb->scratch, value_len + 1);
+        if (!scratch) return NULL;
+        sdb->scratch = scratch;
+        sdb->scratch_size = value_len + 1;
+    }
+
+    if (!(get_u16(rec + 2) & SDB_RECORD_BLOB)) {
+        memcpy(sdb->scratch, rec + SDB_RECORD_HEADER + key_len, value_len);
+    } else {
+        uint32_t page_id = get_u32(rec + SDB_RECORD_HEADER + key_len);
+        size_t pos = 0;
+        while (pos < value_len && page_id != 0) {
+            unsigned char* page = pager_pin(sdb->pager, page_id);
+            if (!page) return NULL;
+            size_t chunk = value_len - pos < SDB_BLOB_DATA ? value_len - pos : SDB_BLOB_DATA;
+            memcpy(sdb->scratch + pos, page + 4, chunk);
+            uint32_t next = get_u32(page);
+            pager_unpin(sdb->pager, page_id, 0);
+            pos += chunk;
+            page_id = next;
+        }
+    }
+    sdb->scratch[value_len] = '\0';
+    return sdb->scratch;
+}
+
+/**
+ * @brief Removes a record from a bucket page
+ * 
+ * @return Size of the removed record in bytes
+ */
+static size_t paged_remove(SDBPager* pager, uint32_t page_id, size_t off) {
+    unsigned char* page = pager_pin(pager, page_id);
+    if (!page) return 0;
+
+    unsigned char* rec = page + off;
+    size_t size = paged_record_size(rec);
+    paged_free_record(pager, rec);
+
+    uint16_t used = get_u16(page + SDB_BUCKET_USED);
+    memmove(rec, rec + size, used - off - size);
+    put_u16(page + SDB_BUCKET_COUNT, get_u16(page + SDB_BUCKET_COUNT) - 1);
+    put_u16(page + SDB_BUCKET_USED, (uint16_t)(used - size));
+    pager_unpin(pager, page_id, 1);
+    return size;
+}
+
+/**
+ * @brief Appends an encoded record to a bucket chain, growing it if full
+ * 
+ * @return 0 on success, -1 on failure
+ */
+static int paged_insert(SDBPager* pager, uint32_t page_id, const unsigned char* rec, size_t rec_size) {
+    for (;;) {
+        unsigned char* page = pager_pin(pager, page_id);
+        if (!page) return -1;
+
+        uint16_t used = get_u16(page + SDB_BUCKET_USED);
+        if (used < SDB_BUCKET_HEADER) used = SDB_BUCKET_HEADER;
+        if (used + rec_size <= POOL_BLOCK_SIZE) {
+            memcpy(page + used, rec, rec_size);
+            put_u16(page + SDB_BUCKET_COUNT, get_u16(page + SDB_BUCKET_COUNT) + 1);
+            put_u16(page + SDB_BUCKET_USED, (uint16_t)(used + rec_size));
+            pager_unpin(pager, page_id, 1);
+            return 0;
+        }
+
+        uint32_t next = get_u32(page + SDB_BUCKET_NEXT);
+        int dirty = 0;
+        if (next == 0) {
+            next = pager_alloc(pager);
+            if (next == 0) {
+                pager_unpin(pager, page_id, 0);
+                return -1;
+            }
+            put_u32(page + SDB_BUCKET_NEXT, next);
+            dirty = 1;
+        }
+        pager_unpin(pager, page_id, dirty);
+        page_id = next;
+    }
+}
+
+/**
+ * @brief Pins the map page holding a bucket's slot, allocating it if missing
+ * 
+ * @param pager The pager
+ * @param root The pinned root page of the table
+ * @param bucket The bucket number
+ * @param map_page Set to the pinned map page
+ * @return Pointer to the bucket's slot, or NULL on failure
+ */
+static unsigned char* paged_map_slot(SDBPager* pager, unsigned char* root, uint32_t bucket,
+                                     uint32_t* map_page) {
+    unsigned char* map_slot = root + SDB_ROOT_MAPS + (bucket / SDB_MAP_SLOTS) * 4;
+    *map_page = get_u32(map_slot);
+    if (*map_page == 0) {
+        *map_page = pager_alloc(pager);
+        if (*map_page == 0) return NULL;
+        put_u32(map_slot, *map_page);
+    }
+
+    unsigned char* map = pager_pin(pager, *map_page);
+    if (!map) return NULL;
+    return map + (bucket % SDB_MAP_SLOTS) * 4;
+}
+
+/**
+ * @brief Splits the bucket under the split pointer (linear hashing)
+ * 
+ * Records of the split bucket are copied into new chains for it and the
+ * newly added bucket, and the map only switches to them once both are
+ * complete, so a failed split leaves the table as it was. The old chain
+ * then returns to the free list.
+ * 
+ * @param pager The pager
+ * @param root The pinned root page of the table
+ */
+static void paged_split(SDBPager* pager, unsigned char* root) {
+    uint32_t level = get_u32(root + SDB_ROOT_LEVEL);
+    uint32_t split = get_u32(root + SDB_ROOT_SPLIT);
+    uint32_t bucket_count = (1u << level) + split;
+    if (bucket_count >= (uint32_t)SDB_MAX_MAP_PAGES * SDB_MAP_SLOTS) return;
+
+    uint32_t old_bucket = split;
+    uint32_t next_level = level;
+    uint32_t next_split = split + 1;
+    if (next_split == (1u << level)) {
+        next_level++;
+        next_split = 0;
+    }
+
+    uint32_t old_map, new_map;
+    unsigned char* old_slot = paged_map_slot(pager, root, old_bucket, &old_map);
+    unsigned char* new_slot = old_slot ? paged_map_slot(pager, root, old_bucket + (1u << level), &new_map) : NULL;
+    if (!new_slot) {
+        if (old_slot) pager_unpin(pager, old_map, 0);
+        return;
+    }
+
+    // heads[0] is the new chain of the split bucket, heads[1] the added bucket
+    uint32_t heads[2] = {0, 0};
+    uint32_t old_head = get_u32(old_slot);
+    uint32_t page_id = old_head;
+    int failed = 0;
+    while (!failed && page_id != 0) {
+        unsigned char* page = pager_pin(pager, page_id);
+        if (!page) {
+            failed = 1;
+            break;
+        }
+
+        size_t off = SDB_BUCKET_HEADER;
+        for (uint16_t i = 0; i < get_u16(page + SDB_BUCKET_COUNT); i++) {
+            unsigned char* rec = page + off;
+            size_t size = paged_record_size(rec);
+            size_t key_len;
+            char* owned;
+            const char* key = paged_record_key(pager, rec, &key_len, &owned);
+            if (!key) {
+                failed = 1;
+                break;
+            }
+            int side = paged_bucket_index(hash_bytes(key, key_len), next_level, next_split) != old_bucket;
+            free(owned);
+
+            if (heads[side] == 0) heads[side] = pager_alloc(pager);
+            if (heads[side] == 0 || paged_insert(pager, heads[side], rec, size) != 0) {
+                failed = 1;
+                break;
+            }
+            off += size;
+        }
+
+        uint32_t next = get_u32(page + SDB_BUCKET_NEXT);
+        pager_unpin(pager, page_id, 0);
+        page_id = next;
+    }
+
+    if (failed) {
+        paged_free_chain(pager, heads[0]);
+        paged_free_chain(pager, heads[1]);
+        pager_unpin(pager, new_map, 0);
+        pager_unpin(pager, old_map, 0);
+        return;
+    }
+
+    put_u32(old_slot, heads[0]);
+    put_u32(new_slot, heads[1]);
+    pager_unpin(pager, new_map, 1);
+    pager_unpin(pager, old_map, 1);
+    put_u32(root + SDB_ROOT_LEVEL, next_level);
+    put_u32(root + SDB_ROOT_SPLIT, next_split);
+
+    // The records were copied as they are, so their blob pages stay in use
+    paged_free_chain(pager, old_head);
+}
+
+/**
+ * @brief Encodes a record, spilling large keys and values into blob pages
+ * 
+ * @param pager The pager
+ * @param rec Output buffer of SDB_PAGED_INLINE_MAX bytes
+ * @return Encoded record size, or 0 if allocation failed
+ */
+static size_t paged_encode(SDBPager* pager, unsigned char* rec, const char* key, size_t key_len,
+                           const char* value, size_t value_len) {
+    if (SDB_RECORD_HEADER + key_len + 4 > SDB_PAGED_INLINE_MAX) {
+        uint32_t key_blob = paged_write_blob(pager, key, key_len);
+        if (key_blob == 0) return 0;
+        uint32_t blob = value_len > 0 ? paged_write_blob(pager, value, value_len) : 0;
+        if (blob == 0 && value_len > 0) {
+            paged_free_chain(pager, key_blob);
+            return 0;
+        }
+
+        put_u16(rec, 8);
+        put_u16(rec + 2, SDB_RECORD_BLOB | SDB_RECORD_LONG_KEY);
+        put_u32(rec + 4, (uint32_t)value_len);
+        put_u32(rec + SDB_RECORD_HEADER, (uint32_t)key_len);
+        put_u32(rec + SDB_RECORD_HEADER + 4, key_blob);
+        put_u32(rec + SDB_RECORD_HEADER + 8, blob);
+        return SDB_RECORD_HEADER + 12;
+    }
+
+    put_u16(rec, (uint16_t)key_len);
+    put_u32(rec + 4, (uint32_t)value_len);
+    memcpy(rec + SDB_RECORD_HEADER, key, key_len);
+
+    if (SDB_RECORD_HEADER + key_len + value_len <= SDB_PAGED_INLINE_MAX) {
+        put_u16(rec + 2, 0);
+        memcpy(rec + SDB_RECORD_HEADER + key_len, value, value_len);
+        return SDB_RECORD_HEADER + key_len + value_len;
+    }
+
+    uint32_t blob = paged_write_blob(pager, value, value_len);
+    if (blob == 0) return 0;
+    put_u16(rec + 2, SDB_RECORD_BLOB);
+    put_u32(rec + SDB_RECORD_HEADER + key_len, blob);
+    return SDB_RECORD_HEADER + key_len + 4;
+}
+
+static void paged_table_create(SDB* sdb, const char* name) {
+    SDBPager* pager = sdb->pager;
+    size_t name_len = strlen(name);
+    if (name_len > SDB_PAGED_NAME_MAX || sdb->table_count >= SDB_MAX_PAGED_TABLES) return;
+
+    SDBTable* tables = (SDBTable*)realloc(sdb->tables, sizeof(SDBTable) * (sdb->table_count + 1));
+    if (!tables) return;
+    sdb->tables = tables;
+
+    uint32_t root_page = pager_alloc(pager);
+    unsigned char* root = root_page ? pager_pin(pager, root_page) : NULL;
+    unsigned char* meta = root ? pager_pin(pager, 0) : NULL;
+    if (!meta) {
+        if (root) pager_unpin(pager, root_page, 0);
+        return;
+    }
+
+    put_u16(root + SDB_ROOT_NAME_LEN, (uint16_t)name_len);
+    memcpy(root + SDB_ROOT_NAME, name, name_len);
+    pager_unpin(pager, root_page, 1);
+
+    put_u32(meta + SDB_META_ROOTS + sdb->table_count * 4, root_page);
+    put_u32(meta + SDB_META_TABLE_COUNT, sdb->table_count + 1);
+    pager_unpin(pager, 0, 1);
+
+    SDBTable* table = &sdb->tables[sdb->table_count++];
+    table->name = strdup(name);
+    table->entries = NULL;
+    table->hot = NULL;
+    table->loader = NULL;
+    table->block_reads = 0;
+    table->frozen = 0;
+    table->ordered = NULL;
+    table->root_page = root_page;
+    table->lazy_index = -1;
+}
+
+static void paged_table_destroy(SDB* sdb, SDBTable* table) {
+    SDBPager* pager = sdb->pager;
+    unsigned char* root = pager_pin(pager, table->root_page);
+    if (!root) return;
+
+    uint32_t bucket_count = (1u << get_u32(root + SDB_ROOT_LEVEL)) + get_u32(root + SDB_ROOT_SPLIT);
+    for (uint32_t b = 0; b < bucket_count; b++) {
+        uint32_t page_id = paged_bucket_head(pager, root, b, 0);
+        while (page_id != 0) {
+            unsigned char* page = pager_pin(pager, page_id);
+            if (!page) break;
+            size_t off = SDB_BUCKET_HEADER;
+            for (uint16_t i = 0; i < get_u16(page + SDB_BUCKET_COUNT); i++) {
+                unsigned char* rec = page + off;
+                paged_free_record(pager, rec);
+                off += paged_record_size(rec);
+            }
+            uint32_t next = get_u32(page + SDB_BUCKET_NEXT);
+            pager_unpin(pager, page_id, 0);
+            pager_free(pager, page_id);
+            page_id = next;
+        }
+    }
+    for (int m = 0; m < SDB_MAX_MAP_PAGES; m++) {
+        uint32_t map_page = get_u32(root + SDB_ROOT_MAPS + m * 4);
+        if (map_page != 0) pager_free(pager, map_page);
+    }
+    pager_unpin(pager, table->root_page, 0);
+    pager_free(pager, table->root_page);
+
+    unsigned char* meta = pager_pin(pager, 0);
+    if (!meta) return;
+    uint32_t count = get_u32(meta + SDB_META_TABLE_COUNT);
+    for (uint32_t i = 0; i < count; i++) {
+        if (get_u32(meta + SDB_META_ROOTS + i * 4) == table->root_page) {
+            memmove(meta + SDB_META_ROOTS + i * 4, meta + SDB_META_ROOTS + (i + 1) * 4,
+                    (count - i - 1) * 4);
+            put_u32(meta + SDB_META_TABLE_COUNT, count - 1);
+            break;
+        }
+    }
+    pager_unpin(pager, 0, 1);
+}
+
+static void paged_table_set(SDB* sdb, SDBTable* table, const char* key, const char* value) {
+    SDBPager* pager = sdb->pager;
+    size_t key_len = strlen(key);
+    size_t value_len = strlen(value);
+    unsigned char rec[SDB_PAGED_INLINE_MAX];
+
+    unsigned char* root = pager_pin(pager, table->root_page);
+    if (!root) return;
+
+    uint32_t level = get_u32(root + SDB_ROOT_LEVEL);
+    uint32_t split = get_u32(root + SDB_ROOT_SPLIT);
+    uint64_t count = get_u64(root + SDB_ROOT_COUNT);
+    uint64_t bytes = get_u64(root + SDB_ROOT_BYTES);
+
+    uint32_t bucket = paged_bucket_index(hash_bytes(key, key_len), level, split);
+    uint32_t head = paged_bucket_head(pager, root, bucket, 1);
+    if (head == 0) {
+        pager_unpin(pager, table->root_page, 1);
+        return;
+    }
+
+    size_t rec_size = paged_encode(pager, rec, key, key_len, value, value_len);
+    if (rec_size == 0) {
+        pager_unpin(pager, table->root_page, 1);
+        return;
+    }
+
+    // Overwrites drop the old record once the new one is in; records are
+    // appended, so the old one keeps its offset
+    uint32_t found_page;
+    size_t found_off;
+    int found = paged_find(pager, head, key, key_len, &found_page, &found_off);
+    if (paged_insert(pager, head, rec, rec_size) != 0) {
+        paged_free_record(pager, rec);
+        pager_unpin(pager, table->root_page, 1);
+        return;
+    }
+    bytes += rec_size;
+    count++;
+    if (found) {
+        bytes -= paged_remove(pager, found_page, found_off);
+        count--;
+    }
+    put_u64(root + SDB_ROOT_COUNT, count);
+    put_u64(root + SDB_ROOT_BYTES, bytes);
+
+    // Grow by one bucket once the table is about three quarters full
+    uint64_t bucket_count = (1u << level) + split;
+    if (bytes > bucket_count * (POOL_BLOCK_SIZE - SDB_BUCKET_HEADER) * 3 / 4) {
+        paged_split(pager, root);
+    }
+    pager_unpin(pager, table->root_page, 1);
+}
+
+static char* paged_table_get(SDB* sdb, SDBTable* table, const char* key) {
+    SDBPager* pager = sdb->pager;
+    size_t key_len = strlen(key);
+
+    unsigned char* root = pager_pin(pager, table->root_page);
+    if (!root) return NULL;
+    uint32_t bucket = paged_bucket_index(hash_bytes(key, key_len),
+                                         get_u32(root + SDB_ROOT_LEVEL),
+                                         get_u32(root + SDB_ROOT_SPLIT));
+    uint32_t head = paged_bucket_head(pager, root, bucket, 0);
+    pager_unpin(pager, table->root_page, 0);
+
+    uint32_t found_page;
+    size_t found_off;
+    if (head == 0 || !paged_find(pager, head, key, key_len, &found_page, &found_off)) {
+        return NULL;
+    }
+
+    unsigned char* page = pager_pin(pager, found_page);
+    if (!page) return NULL;
+    char* value = paged_read_value(sdb, page + found_off);
+    pager_unpin(pager, found_page, 0);
+    return value;
+}
+
+/**
+ * @brief Records allocation state in the meta page and flushes the pool
+ * 
+ * @param sdb The database
+ */
+static void paged_sync(SDB* sdb) {
+    SDBPager* pager = sdb->pager;
+    unsigned char* meta = pager_pin(pager, 0);
+    if (!meta) return;
+    put_u32(meta + SDB_META_VERSION, SDB_PAGED_VERSION);  // Older files may now hold long keys
+    put_u32(meta + SDB_META_PAGE_COUNT, pager->page_count);
+    put_u32(meta + SDB_META_FREE_HEAD, pager->free_head);
+    pager_unpin(pager, 0, 1);
+    pager_flush(pager);
+}
+
+/**
+ * @brief Opens or initializes the page file of a paged database
+ * 
+ * @param sdb The database, with its path already set
+ * @param pool_pages Number of buffer pool frames
+ * @return 0 on success, -1 if the file is not a valid page file
+ */
+static int paged_open(SDB* sdb, size_t pool_pages) {
+    SDBPager* pager = pager_open(sdb->path, pool_pages);
+    if (!pager) return -1;
+    sdb->pager = pager;
+    sdb->storage_mode = SDB_STORAGE_PAGED;
+
+    int is_new = pager->page_count == 0;
+    if (is_new) pager->page_count = 1;
+
+    unsigned char* meta = pager_pin(pager, 0);
+    if (!meta) return -1;
+
+    if (is_new) {
+        put_u32(meta + SDB_META_MAGIC, SDB_PAGED_MAGIC);
+        put_u32(meta + SDB_META_VERSION, SDB_PAGED_VERSION);
+        put_u32(meta + SDB_META_PAGE_SIZE, POOL_BLOCK_SIZE);
+        put_u32(meta + SDB_META_PAGE_COUNT, 1);
+        pager_unpin(pager, 0, 1);
+        return 0;
+    }
+
+    if (get_u32(meta + SDB_META_MAGIC) != SDB_PAGED_MAGIC ||
+        get_u32(meta + SDB_META_VERSION) > SDB_PAGED_VERSION ||
+        get_u32(meta + SDB_META_PAGE_SIZE) != POOL_BLOCK_SIZE) {
+        pager_unpin(pager, 0, 0);
+        return -1;
+    }
+
+    pager->page_count = get_u32(meta + SDB_META_PAGE_COUNT);
+    pager->free_head = get_u32(meta + SDB_META_FREE_HEAD);
+    uint32_t table_count = get_u32(meta + SDB_META_TABLE_COUNT);
+    if (table_count > SDB_MAX_PAGED_TABLES) table_count = SDB_MAX_PAGED_TABLES;
+
+    sdb->tables = (SDBTable*)calloc(table_count ? table_count : 1, sizeof(SDBTable));
+    for (uint32_t i = 0; sdb->tables && i < table_count; i++) {
+        uint32_t root_page = get_u32(meta + SDB_META_ROOTS + i * 4);
+        unsigned char* root = pager_pin(pager, root_page);
+        if (!root) break;
+
+        // A damaged name length fails the open rather than read past the page
+        uint16_t name_len = get_u16(root + SDB_ROOT_NAME_LEN);
+        char* name = name_len <= SDB_PAGED_NAME_MAX && SDB_ROOT_NAME + name_len <= POOL_BLOCK_SIZE
+                   ? (char*)malloc(name_len + 1) : NULL;
+        if (!name) {
+            pager_unpin(pager, root_page, 0);
+            pager_unpin(pager, 0, 0);
+            return -1;
+        }
+        SDBTable* table = &sdb->tables[sdb->table_count++];
+        table->name = name;
+        memcpy(table->name, root + SDB_ROOT_NAME, name_len);
+        table->name[name_len] = '\0';
+        table->entries = NULL;
+        table->hot = NULL;
+        table->loader = NULL;
+        table->block_reads = 0;
+        table->frozen = 0;
+        table->ordered = NULL;
+        table->root_page = root_page;
+        table->lazy_index = -1;
+        pager_unpin(pager, root_page, 0);
+    }
+    pager_unpin(pager, 0, 0);
+    return 0;
+}
+
+/*******************************************************************************
+ * Arena Functions
+ ******************************************************************************/
+/*
+ * Keys and values of a table are allocated from its arena: blocks of
+ * SDB_ARENA_BLOCK_SIZE bytes, aligned to their size, so the block of any
+ * object is found by masking its address. Each object starts with a
+ * header naming the entry that owns it. Freed objects leave holes; once a
+ * block is mostly holes, its live objects are copied into the newest block
+ * and the owners' pointers updated, and the empty block is returned to
+ * the system.
+ */
+typedef struct {
+    SDBEntry* owner;        // NULL once freed
+    uint32_t size;          // Bytes including this header, a multiple of 8
+    uint32_t is_value;      // Whether owner->value or owner->key points here
+} SDBArenaObject;
+
+static SDBArenaBlock* arena_block_map(SDBArena* arena, size_t size) {
+    size = (size + SDB_ARENA_BLOCK_SIZE - 1) & ~(size_t)(SDB_ARENA_BLOCK_SIZE - 1);
+#ifdef MAP_ANONYMOUS
+    // Map one block more than needed and trim both ends to the alignment
+    unsigned char* raw = (unsigned char*)mmap(NULL, size + SDB_ARENA_BLOCK_SIZE,
+                                              PROT_READ | PROT_WRITE,
+                                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED) return NULL;
+    uintptr_t start = ((uintptr_t)raw + SDB_ARENA_BLOCK_SIZE - 1) &
+                      ~(uintptr_t)(SDB_ARENA_BLOCK_SIZE - 1);
+    size_t lead = start - (uintptr_t)raw;
+    if (lead > 0) munmap(raw, lead);
+    if (lead < SDB_ARENA_BLOCK_SIZE) munmap((unsigned char*)start + size, SDB_ARENA_BLOCK_SIZE - lead);
+    SDBArenaBlock* block = (SDBArenaBlock*)start;
+#else
+    void* memory = NULL;
+    if (posix_memalign(&memory, SDB_ARENA_BLOCK_SIZE, size) != 0) return NULL;
+    SDBArenaBlock* block = (SDBArenaBlock*)memory;
+#endif
+    block->next = NULL;
+    block->prev = NULL;
+    block->arena = arena;
+    block->size = size;
+    block->used = sizeof(SDBArenaBlock);
+    block->live = 0;
+    arena->mapped += size;
+    return block;
+}
+
+static void arena_block_unmap(SDBArenaBlock* block) {
+    SDBArena* arena = block->arena;
+    if (block->prev) block->prev->next = block->next;
+    else arena->head = block->next;
+    if (block->next) block->next->prev = block->prev;
+    if (arena->cursor == block) arena->cursor = block->next;
+    arena->mapped -= block->size;
+    arena->released += block->size;
+#ifdef MAP_ANONYMOUS
+    munmap(block, block->size);
+#else
+    free(block);
+#endif
+}
+
+/**
+ * @brief Copies a key or value into an arena
+ * 
+ * @param arena The arena
+ * @param owner The entry that will point to the copy
+ * @param is_value Whether the copy becomes the value or the key of owner
+ * @param data The bytes to copy
+ * @param len Number of bytes; a terminating zero is added
+ * @return The copy, or NULL if out of memory
+ */
+static char* arena_copy(SDBArena* arena, SDBEntry* owner, int is_value, const char* data, size_t len) {
+    size_t size = sizeof(SDBArenaObject) + ((len + 8) & ~(size_t)7);
+    SDBArenaBlock* block = arena->head;
+    if (!block || block->used + size > block->size) {
+        SDBArenaBlock* fresh = arena_block_map(arena, sizeof(SDBArenaBlock) + size);
+        if (!fresh) return NULL;
+
+        // Large objects get a block of their own behind the one being filled
+        if (block && size > SDB_ARENA_BLOCK_SIZE / 4) {
+            fresh->prev = block;
+            fresh->next = block->next;
+            if (block->next) block->next->prev = fresh;
+            block->next = fresh;
+        } else {
+            fresh->next = block;
+            if (block) block->prev = fresh;
+            arena->head = fresh;
+            if (block && block->live == 0) arena_block_unmap(block);
+        }
+        block = fresh;
+    }
+
+    SDBArenaObject* object = (SDBArenaObject*)((unsigned char*)block + block->used);
+    object->owner = owner;
+    object->size = (uint32_t)size;
+    object->is_value = (uint32_t)is_value;
+    block->used += size;
+    block->live += size;
+    arena->live += size;
+
+    char* copy = (char*)(object + 1);
+    memcpy(copy, data, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+/**
+ * @brief Hands an arena object over to another entry
+ */
+static void arena_adopt(char* data, SDBEntry* owner) {
+    ((SDBArenaObject*)data - 1)->owner = owner;
+}
+
+/**
+ * @brief Frees an arena object; a block left empty is returned right away
+ * 
+ * @param data The key or value, or NULL
+ */
+static void arena_release(char* data) {
+    if (!data) return;
+    SDBArenaObject* object = (SDBArenaObject*)data - 1;
+    SDBArenaBlock* block = (SDBArenaBlock*)((uintptr_t)object & ~(uintptr_t)(SDB_ARENA_BLOCK_SIZE - 1));
+    object->owner = NULL;
+    block->live -= object->size;
+    block->arena->live -= object->size;
+    if (block->live == 0 && block != block->arena->head) arena_block_unmap(block);
+}
+
+/**
+ * @brief Moves the live objects of a block to the newest block and frees it
+ */
+static int arena_evacuate(SDBArenaBlock* block) {
+    SDBArena* arena = block->arena;
+    for (size_t pos = sizeof(SDBArenaBlock); pos < block->used; ) {
+        SDBArenaObject* object = (SDBArenaObject*)((unsigned char*)block + pos);
+        pos += object->size;
+        if (!object->owner) continue;
+
+        char* data = (char*)(object + 1);
+        char* copy = arena_copy(arena, object->owner, (int)object->is_value, data, strlen(data));
+        if (!copy) return -1;
+        if (object->is_value) object->owner->value = copy;
+        else object->owner->key = copy;
+
+        // The block is unmapped together with its last object
+        int last = block->live == object->size;
+        arena_release(data);
+        if (last) return 0;
+    }
+    if (block->live == 0) arena_block_unmap(block);
+    return 0;
+}
+
+/**
+ * @brief Evacuates every half-empty block of an arena
+ * 
+ * Moving objects invalidates pointers returned by earlier gets, so this
+ * only runs from the calls documented to do so, never from plain writes.
+ * 
+ * @param arena The arena
+ * @return Bytes returned to the system
+ */
+static size_t arena_compact(SDBArena* arena) {
+    // The cursor walks from the newest block to the oldest
+    size_t released = arena->released;
+    arena->cursor = arena->head ? arena->head->next : NULL;
+    while (arena->cursor) {
+        SDBArenaBlock* block = arena->cursor;
+        arena->cursor = block->next;
+
+        // The newest block is where objects move to; half-empty ones move out
+        if (block->live * 2 < block->used - sizeof(SDBArenaBlock)) {
+            if (arena_evacuate(block) != 0) break;
+        }
+    }
+    return arena->released - released;
+}
+
+/**
+ * @brief Frees every block of an arena at once
+ */
+static void arena_destroy(SDBArena* arena) {
+    while (arena->head) arena_block_unmap(arena->head);
+}
+
+/*******************************************************************************
+ * Tiered Storage Functions
+ ******************************************************************************/
+/*
+ * In memory mode every value starts out resident. When the bytes held by
+ * resident values exceed the memory target, the least accessed values are
+ * compressed into an append-only cold segment next to the database file
+ * and read back (promoted) on their next access. Keys and entries always
+ * stay in memory; the database file on disk remains the source of truth,
+ * so the cold segment is discarded on close.
+ * 
+ * Cold segment records are a codec byte followed by the encoded value.
+ */
+/**
+ * @brief Builds the path of a file stored next to the database file
+ * 
+ * @param sdb The database
+ * @param suffix Suffix appended to the database path
+ * @return Newly allocated path
+ */
+static char* sidecar_path(const SDB* sdb, const char* suffix) {
+    size_t len = strlen(sdb->path) + strlen(suffix) + 1;
+    char* path = (char*)malloc(len);
+    if (path) snprintf(path, len, "%s%s", sdb->path, suffix);
+    return path;
+}
+
+/**
+ * @brief Syncs the directory holding a file, so a rename or creation of
+ *        the file survives a crash
+ * 
+ * @param path The path of the file
+ * @return 0 on success, -1 on failure
+ */
+static int sync_parent_dir(const char* path) {
+    const char* slash = strrchr(path, '/');
+    char* dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    if (!dir) return -1;
+    int fd = open(dir, O_RDONLY);
+    free(dir);
+    if (fd < 0) return -1;
+    int result = fsync(fd);
+    close(fd);
+    return result;
+}
+
+static int tier_open_cold(SDB* sdb) {
+    if (sdb->cold_fd >= 0) return 0;
+
+    char* path = sidecar_path(sdb, ".cold");
+    if (!path) return -1;
+    sdb->cold_fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    free(path);
+    if (sdb->cold_fd >= 0) SDB_FADVISE(sdb->cold_fd, 0, 0, RANDOM);
+    sdb->cold_size = 0;
+    sdb->cold_dead = 0;
+    return sdb->cold_fd >= 0 ? 0 : -1;
+}
+
+/**
+ * @brief Reads and decodes a cold segment record
+ * 
+ * @param fd The cold segment
+ * @param offset Offset of the record
+ * @param cold_len Size of the record
+ * @param value_len Size of the decoded value
+ * @return Newly allocated NUL-terminated value, or NULL on failure
+ */
+static char* tier_read_record(int fd, uint64_t offset, uint32_t cold_len, uint32_t value_len) {
+    unsigned char* record = (unsigned char*)malloc(cold_len);
+    if (!record) return NULL;
+    if (pread(fd, record, cold_len, (off_t)offset) != (ssize_t)cold_len) {
+        free(record);
+        return NULL;
+    }
+
+    char* value = (char*)malloc(value_len + 1);
+    if (value) {
+        size_t len = 0;
+        unsigned char* decoded = NULL;
+        if (cold_len > 1) {
+            decoded = sdb_decompress((SDBCompressType)record[0], record + 1, cold_len - 1, &len);
+        }
+        if (decoded && len == value_len) {
+            memcpy(value, decoded, len);
+            value[len] = '\0';
+        } else if (value_len == 0) {
+            value[0] = '\0';
+        } else {
+            free(value);
+            value = NULL;
+        }
+        free(decoded);
+    }
+    free(record);
+    return value;
+}
+
+/**
+ * @brief Reads a demoted value without promoting it
+ * 
+ * @param sdb The database
+ * @param entry The demoted entry
+ * @return Newly allocated NUL-terminated value, or NULL on failure
+ */
+static char* tier_read_cold(SDB* sdb, const SDBEntry* entry) {
+    return tier_read_record(sdb->cold_fd, entry->cold_offset, entry->cold_len, entry->value_len);
+}
+
+/**
+ * @brief Moves a resident value into the cold segment
+ * 
+ * @param sdb The database
+ * @param entry The entry to demote
+ * @return 0 on success, -1 on failure (the value stays resident)
+ */
+static int tier_demote(SDB* sdb, SDBEntry* entry) {
+    if (!entry->value || tier_open_cold(sdb) != 0) return -1;
+
+    // Store raw when the codec does not pay off for this value
+    size_t comp_len = 0;
+    unsigned char* comp = sdb_compress(sdb->compress_type, (const unsigned char*)entry->value,
+                                       entry->value_len, &comp_len);
+    unsigned char codec = (unsigned char)sdb->compress_type;
+    const unsigned char* payload = comp;
+    if (!comp || comp_len >= entry->value_len) {
+        codec = SDB_COMPRESS_NONE;
+        payload = (const unsigned char*)entry->value;
+        comp_len = entry->value_len;
+    }
+
+    int ok = pwrite(sdb->cold_fd, &codec, 1, (off_t)sdb->cold_size) == 1 &&
+             pwrite(sdb->cold_fd, payload, comp_len, (off_t)sdb->cold_size + 1) == (ssize_t)comp_len;
+    free(comp);
+    if (!ok) return -1;
+
+    entry->cold_offset = sdb->cold_size;
+    entry->cold_len = (uint32_t)(comp_len + 1);
+    sdb->cold_size += entry->cold_len;
+    sdb->write_stats.cold_bytes += entry->cold_len;
+
+    arena_release(entry->value);
+    entry->value = NULL;
+    sdb->memory_used -= entry->value_len + 1;
+    sdb->demotions++;
+    return 0;
+}
+
+/**
+ * @brief Brings a demoted value back into memory
+ * 
+ * @param sdb The database
+ * @param entry The entry to promote
+ * @return 0 on success, -1 on failure
+ */
+static int tier_promote(SDB* sdb, SDBArena* arena, SDBEntry* entry) {
+    char* value = tier_read_cold(sdb, entry);
+    if (!value) return -1;
+
+    entry->value = arena_copy(arena, entry, 1, value, entry->value_len);
+    free(value);
+    if (!entry->value) return -1;
+    sdb->cold_dead += entry->cold_len;
+    sdb->memory_used += entry->value_len + 1;
+    sdb->promotions++;
+    return 0;
+}
+
+/**
+ * @brief Drops a value from the accounting before it is replaced or freed
+ * 
+ * @param sdb The database
+ * @param entry The entry
+ */
+static void tier_forget(SDB* sdb, const SDBEntry* entry) {
+    if (entry->value) {
+        sdb->memory_used -= entry->value_len + 1;
+    } else {
+        sdb->cold_dead += entry->cold_len;
+    }
+}
+
+/**
+ * @brief Rewrites the cold segment without the records nobody references
+ * 
+ * @param sdb The database
+ */
+static void tier_compact_cold(SDB* sdb) {
+    char* path = sidecar_path(sdb, ".cold");
+    char* tmp_path = sidecar_path(sdb, ".cold.tmp");
+    int fd = (path && tmp_path) ? open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0644) : -1;
+    if (fd < 0) {
+        free(path);
+        free(tmp_path);
+        return;
+    }
+
+    uint64_t size = 0;
+    int ok = 1;
+    unsigned char* record = NULL;
+    for (int i = 0; ok && i < sdb->table_count; i++) {
+        for (SDBEntry* e = sdb->tables[i].entries->head; ok && e != NULL; e = e->next) {
+            if (e->value) continue;
+            unsigned char* grown = (unsigned char*)realloc(record, e->cold_len);
+            ok = grown != NULL;
+            if (!ok) break;
+            record = grown;
+            ok = pread(sdb->cold_fd, record, e->cold_len, (off_t)e->cold_offset) == (ssize_t)e->cold_len &&
+                 pwrite(fd, record, e->cold_len, (off_t)size) == (ssize_t)e->cold_len;
+            size += e->cold_len;
+        }
+    }
+    free(record);
+    sdb->write_stats.compaction_bytes += size;
+
+    if (ok && rename(tmp_path, path) == 0) {
+        // Offsets are only updated once the new segment is in place
+        size = 0;
+        for (int i = 0; i < sdb->table_count; i++) {
+            for (SDBEntry* e = sdb->tables[i].entries->head; e != NULL; e = e->next) {
+                if (e->value) continue;
+                e->cold_offset = size;
+                size += e->cold_len;
+            }
+        }
+        close(sdb->cold_fd);
+        SDB_FADVISE(fd, 0, 0, RANDOM);
+        sdb->cold_fd = fd;
+        sdb->cold_size = size;
+        sdb->cold_dead = 0;
+    } else {
+        close(fd);
+        unlink(tmp_path);
+    }
+    free(path);
+    free(tmp_path);
+}
+
+/**
+ * @brief Demotes the coldest values until memory use is under the target
+ * 
+ * Each pass demotes values that have not been accessed since the previous
+ * pass and halves the access counter of the others, so values age out
+ * after a few passes without hits. Memory is brought down to 90% of the
+ * target to avoid demoting on every write.
+ * 
+ * @param sdb The database
+ * @param keep Entry that must stay resident (e.g. one about to be returned)
+ */
+static void tier_rebalance(SDB* sdb, const SDBEntry* keep) {
+    if (sdb->memory_target == 0 || sdb->memory_used <= sdb->memory_target) return;
+
+    size_t goal = sdb->memory_target - sdb->memory_target / 10;
+    for (int pass = 0; pass < 33 && sdb->memory_used > goal; pass++) {
+        for (int i = 0; i < sdb->table_count && sdb->memory_used > goal; i++) {
+            for (SDBEntry* e = sdb->tables[i].entries->head; e != NULL; e = e->next) {
+                if (!e->value || e == keep) continue;
+                if (e->hits == 0) {
+                    if (tier_demote(sdb, e) != 0) return;
+                    if (sdb->memory_used <= goal) break;
+                } else {
+                    e->hits >>= 1;
+                }
+            }
+        }
+    }
+
+    if (sdb->cold_dead > sdb->cold_size / 2) {
+        tier_compact_cold(sdb);
+    }
+}
+
+/*******************************************************************************
+ * Block Format Functions
+ ******************************************************************************/
+/*
+ * Format 3 files are a header followed by independently compressed blocks
+ * and a footer:
+ * 
+ *   header   magic, version, codec
+ *   block    SDB_BLOCK_HEADER bytes (magic, table, entry count, raw length,
+ *            compressed length, codec, CRC32 of header and payload), then
+ *            the compressed entries of a single table
+ *   footer   table directory as in format 2, block count, block index,
+ *            last log record, then optionally the sparse index
+ *   trailer  footer offset, footer length, footer magic
+ * 
+ * A block holds about SDB_BLOCK_SIZE bytes of entries, or
+ * SDB_SORTED_BLOCK_SIZE in snapshots, so readers and writers only ever
+ * need one block in memory. Entries are encoded as in
+ * the format 2 payload: key length, value length, key, value.
+ * 
+ * Snapshots write each table sorted by key. Such a block ends with its
+ * restart points, the offsets of every SDB_RESTART_INTERVAL-th entry
+ * followed by their count, so a lookup can binary search the block. The
+ * sparse index holds the first key of every sorted block (length, then
+ * bytes; SDB_NO_KEY for other blocks), so a lookup finds its block
+ * without reading any other. Readers that stop after entry_count entries
+ * and ignore the rest of the footer read these files unchanged.
+ */
+enum {
+    SDB_BLOCK_HEADER = 28,
+    SDB_BLOCK_INDEX_ENTRY = 32,
+    SDB_TRAILER_SIZE = 16
+};
+
+#define SDB_NO_KEY 0xFFFFFFFFu
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_table_once = PTHREAD_ONCE_INIT;
+
+static void crc_table_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+/**
+ * @brief Continues a CRC-32 (IEEE) over more data
+ * 
+ * @param crc The CRC so far (0 to start)
+ * @param data The data
+ * @param len Length of the data
+ * @return The updated CRC
+ */
+static uint32_t sdb_crc32(uint32_t crc, const unsigned char* data, size_t len) {
+    pthread_once(&crc_table_once, crc_table_init);
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = crc_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+static void block_encode_header(unsigned char* header, const SDBBlockInfo* info) {
+    put_u32(header, SDB_BLOCK_MAGIC);
+    put_u32(header + 4, info->table);
+    put_u32(header + 8, info->entry_count);
+    put_u32(header + 12, info->raw_len);
+    put_u32(header + 16, info->comp_len);
+    put_u32(header + 20, info->codec);
+    put_u32(header + 24, info->crc);
+}
+
+/**
+ * @brief Starts a format 3 file and prepares a writer for its blocks
+ * 
+ * @param writer The writer
+ * @param file Output file, positioned at its start
+ * @param compress_type Codec for the blocks
+ * @param block_size Target raw size of a block
+ */
+static void block_writer_init(SDBBlockWriter* writer, FILE* file, SDBCompressType compress_type,
+                              size_t block_size) {
+    memset(writer, 0, sizeof(SDBBlockWriter));
+    writer->file = file;
+    writer->compress_type = compress_type;
+    writer->block_size = block_size;
+    writer->buffer_size = block_size + 1024;
+    writer->buffer = (unsigned char*)malloc(writer->buffer_size);
+    writer->keys_size = 256;
+    writer->keys = (unsigned char*)malloc(writer->keys_size);
+    if (!writer->buffer || !writer->keys) writer->failed = 1;
+
+    uint32_t magic = SDB_MAGIC;
+    uint32_t version = SDB_FILE_VERSION;
+    fwrite(&magic, sizeof(uint32_t), 1, file);
+    fwrite(&version, sizeof(uint32_t), 1, file);
+    fwrite(&compress_type, sizeof(SDBCompressType), 1, file);
+}
+
+/**
+ * @brief Adds a written block to the index that goes into the footer
+ * 
+ * @param writer The writer
+ * @param info The block
+ * @param first_key Its first key if its table is sorted, else NULL
+ * @param key_len Length of first_key
+ */
+static void block_writer_record(SDBBlockWriter* writer, const SDBBlockInfo* info,
+                                const char* first_key, uint32_t key_len) {
+    uint32_t len = first_key ? key_len : SDB_NO_KEY;
+    write_to_buffer(&writer->keys, &writer->keys_size, &writer->keys_used, &len, sizeof(uint32_t));
+    if (first_key) {
+        write_to_buffer(&writer->keys, &writer->keys_size, &writer->keys_used, first_key, key_len);
+        writer->sorted_blocks++;
+    }
+
+    if (writer->block_count == writer->block_capacity) {
+        uint32_t capacity = writer->block_capacity ? writer->block_capacity * 2 : 64;
+        SDBBlockInfo* blocks = (SDBBlockInfo*)realloc(writer->blocks, sizeof(SDBBlockInfo) * capacity);
+        if (!blocks) {
+            writer->failed = 1;
+            return;
+        }
+        writer->blocks = blocks;
+        writer->block_capacity = capacity;
+    }
+    writer->blocks[writer->block_count++] = *info;
+}
+
+/**
+ * @brief Compresses and writes the pending block
+ * 
+ * @param writer The writer
+ */
+static void block_writer_flush(SDBBlockWriter* writer) {
+    if (writer->entry_count == 0 || writer->failed) return;
+
+    // Sorted blocks end with their restart points
+    const char* first_key = NULL;
+    int first_len = 0;
+    if (writer->sorted) {
+        memcpy(&first_len, writer->buffer, sizeof(int));
+        write_to_buffer(&writer->buffer, &writer->buffer_size, &writer->used, writer->restarts,
+                        sizeof(uint32_t) * writer->restart_count);
+        write_to_buffer(&writer->buffer, &writer->buffer_size, &writer->used, &writer->restart_count,
+                        sizeof(uint32_t));
+        first_key = (const char*)writer->buffer + 2 * sizeof(int);
+        writer->restart_count = 0;
+    }
+
+    // Store raw when the codec does not pay off for this block
+    size_t comp_len = 0;
+    unsigned char* comp = sdb_compress(writer->compress_type, writer->buffer, writer->used, &comp_len);
+    const unsigned char* payload = comp;
+    SDBBlockInfo info;
+    info.codec = writer->compress_type;
+    if (!comp || comp_len >= writer->used) {
+        payload = writer->buffer;
+        comp_len = writer->used;
+        info.codec = SDB_COMPRESS_NONE;
+    }
+
+    info.offset = (uint64_t)ftello(writer->file);
+    info.table = writer->table;
+    info.entry_count = writer->entry_count;
+    info.raw_len = (uint32_t)writer->used;
+    info.comp_len = (uint32_t)comp_len;
+    info.crc = 0;
+
+    unsigned char header[SDB_BLOCK_HEADER];
+    block_encode_header(header, &info);
+    info.crc = sdb_crc32(sdb_crc32(0, header, SDB_BLOCK_HEADER - 4), payload, comp_len);
+    put_u32(header + SDB_BLOCK_HEADER - 4, info.crc);
+
+    if (fwrite(header, 1, SDB_BLOCK_HEADER, writer->file) != SDB_BLOCK_HEADER ||
+        fwrite(payload, 1, comp_len, writer->file) != comp_len) {
+        writer->failed = 1;
+    }
+    free(comp);
+
+    block_writer_record(writer, &info, first_key, (uint32_t)first_len);
+    writer->used = 0;
+    writer->entry_count = 0;
+}
+
+/**
+ * @brief Says whether the entries added next come in key order
+ * 
+ * Call it before the first entry of each table. A table is only indexed
+ * as sorted if all of its entries are added with the flag set.
+ */
+static void block_writer_sort(SDBBlockWriter* writer, int sorted) {
+    block_writer_flush(writer);
+    writer->sorted = sorted;
+}
+
+static int block_writer_reserve_tables(SDBBlockWriter* writer, int table_count) {
+    if (table_count <= writer->table_count) return 0;
+
+    SDBTableInfo* tables = (SDBTableInfo*)realloc(writer->tables, sizeof(SDBTableInfo) * table_count);
+    if (!tables) return -1;
+    memset(tables + writer->table_count, 0, sizeof(SDBTableInfo) * (table_count - writer->table_count));
+    writer->tables = tables;
+    writer->table_count = table_count;
+    return 0;
+}
+
+/**
+ * @brief Adds an entry to the current block, starting a new one as needed
+ * 
+ * @param writer The writer
+ * @param table Index of the entry's table in the final table directory
+ */
+static void block_writer_add(SDBBlockWriter* writer, uint32_t table, const char* key, uint32_t key_len,
+                             const char* value, uint32_t value_len) {
+    if (writer->failed) return;
+    if (writer->entry_count > 0 && table != writer->table) {
+        block_writer_flush(writer);
+    }
+    if (block_writer_reserve_tables(writer, (int)table + 1) != 0) {
+        writer->failed = 1;
+        return;
+    }
+
+    if (writer->sorted && writer->entry_count % SDB_RESTART_INTERVAL == 0) {
+        if (writer->restart_count == writer->restart_capacity) {
+            uint32_t capacity = writer->restart_capacity ? writer->restart_capacity * 2 : 64;
+            uint32_t* restarts = (uint32_t*)realloc(writer->restarts, sizeof(uint32_t) * capacity);
+            if (!restarts) {
+                writer->failed = 1;
+                return;
+            }
+            writer->restarts = restarts;
+            writer->restart_capacity = capacity;
+        }
+        writer->restarts[writer->restart_count++] = (uint32_t)writer->used;
+    }
+
+    int k = (int)key_len;
+    int v = (int)value_len;
+    writer->table = table;
+    write_to_buffer(&writer->buffer, &writer->buffer_size, &writer->used, &k, sizeof(int));
+    write_to_buffer(&writer->buffer, &writer->buffer_size, &writer->used, &v, sizeof(int));
+    write_to_buffer(&writer->buffer, &writer->buffer_size, &writer->used, key, key_len);
+    write_to_buffer(&writer->buffer, &writer->buffer_size, &writer->used, value, value_len);
+    writer->entry_count++;
+    writer->tables[table].entry_count++;
+    writer->tables[table].data_size += key_len + value_len;
+
+    if (writer->used >= writer->block_size) {
+        block_writer_flush(writer);
+    }
+}
+
+/**
+ * @brief Writes a table's key index as a block without entries
+ * 
+ * The index is stored uncompressed, so it can be used in place.
+ * 
+ * @param writer The writer
+ * @param table Index of the table in the final table directory
+ * @param data The index
+ * @param len Its length
+ */
+static void block_writer_index(SDBBlockWriter* writer, uint32_t table, const unsigned char* data, size_t len) {
+    block_writer_flush(writer);
+    if (writer->failed || len > UINT32_MAX) {
+        writer->failed = 1;
+        return;
+    }
+
+    SDBBlockInfo info;
+    info.offset = (uint64_t)ftello(writer->file);
+    info.table = table;
+    info.entry_count = 0;
+    info.raw_len = (uint32_t)len;
+    info.comp_len = (uint32_t)len;
+    info.codec = SDB_COMPRESS_NONE;
+    info.crc = 0;
+
+    unsigned char header[SDB_BLOCK_HEADER];
+    block_encode_header(header, &info);
+    info.crc = sdb_crc32(sdb_crc32(0, header, SDB_BLOCK_HEADER - 4), data, len);
+    put_u32(header + SDB_BLOCK_HEADER - 4, info.crc);
+    if (fwrite(header, 1, SDB_BLOCK_HEADER, writer->file) != SDB_BLOCK_HEADER ||
+        fwrite(data, 1, len, writer->file) != len) {
+        writer->failed = 1;
+    }
+    block_writer_record(writer, &info, NULL, 0);
+}
+
+/**
+ * @brief Checks a block as read from disk against its index entry
+ * 
+ * @param data The block header followed by its payload
+ * @param block The block's index entry
+ * @return 1 if the header matches the index and the checksum matches the bytes
+ */
+static int block_check(const unsigned char* data, const SDBBlockInfo* block) {
+    unsigned char expected[SDB_BLOCK_HEADER];
+    block_encode_header(expected, block);
+    return memcmp(data, expected, SDB_BLOCK_HEADER) == 0 &&
+           sdb_crc32(sdb_crc32(0, data, SDB_BLOCK_HEADER - 4),
+                     data + SDB_BLOCK_HEADER, block->comp_len) == block->crc;
+}
+
+/**
+ * @brief Reads a stored block without decoding it
+ * 
+ * @param fd The database file
+ * @param block The block's index entry
+ * @param verify Check the block with block_check()
+ * @return The header and payload, or NULL if the block is damaged
+ */
+static unsigned char* block_read_stored(int fd, const SDBBlockInfo* block, int verify) {
+    size_t len = SDB_BLOCK_HEADER + (size_t)block->comp_len;
+    unsigned char* data = (unsigned char*)malloc(len);
+    if (!data || pread(fd, data, len, (off_t)block->offset) != (ssize_t)len ||
+        (verify && !block_check(data, block))) {
+        free(data);
+        return NULL;
+    }
+    return data;
+}
+
+/**
+ * @brief Copies a stored block from another file without decoding it
+ * 
+ * The block is renumbered to its table's new index. That changes the
+ * header, so the checksum is recomputed.
+ * 
+ * @param writer The writer
+ * @param fd The file holding the block
+ * @param block The block's index entry in that file
+ * @param table Index of the block's table in the new table directory
+ * @param first_key The block's first key if it is a sorted block, else NULL
+ * @param verify Check the block against its index entry before copying
+ * @return 0 on success, -1 if the block is damaged or the write failed
+ */
+static int block_writer_copy(SDBBlockWriter* writer, int fd, const SDBBlockInfo* block,
+                             uint32_t table, const char* first_key, int verify) {
+    if (writer->failed) return -1;
+    block_writer_flush(writer);
+    if (block_writer_reserve_tables(writer, (int)table + 1) != 0) {
+        writer->failed = 1;
+        return -1;
+    }
+
+    unsigned char* data = block_read_stored(fd, block, verify);
+    if (!data) return -1;
+
+    SDBBlockInfo info = *block;
+    info.offset = (uint64_t)ftello(writer->file);
+    info.table = table;
+    info.crc = 0;
+    block_encode_header(data, &info);
+    info.crc = sdb_crc32(sdb_crc32(0, data, SDB_BLOCK_HEADER - 4), data + SDB_BLOCK_HEADER, info.comp_len);
+    put_u32(data + SDB_BLOCK_HEADER - 4, info.crc);
+
+    size_t len = SDB_BLOCK_HEADER + (size_t)info.comp_len;
+    if (fwrite(data, 1, len, writer->file) != len) writer->failed = 1;
+    free(data);
+
+    // Restart points and key indexes are not key or value bytes
+    uint64_t overhead = info.entry_count ? 2 * sizeof(int) * (uint64_t)info.entry_count : info.raw_len;
+    if (first_key) {
+        overhead += sizeof(uint32_t) * ((info.entry_count + SDB_RESTART_INTERVAL - 1) / SDB_RESTART_INTERVAL + 1);
+    }
+    block_writer_record(writer, &info, first_key, first_key ? (uint32_t)strlen(first_key) : 0);
+    writer->tables[table].entry_count += info.entry_count;
+    writer->tables[table].data_size += info.raw_len - overhead;
+    return writer->failed ? -1 : 0;
+}
+
+/**
+ * @brief Writes the last block, the footer and the trailer
+ * 
+ * Releases the writer's buffers; the file itself stays open.
+ * 
+ * @param writer The writer
+ * @param names Name of every table, in table index order
+ * @param table_count Number of tables
+ * @return 0 on success, -1 if any write failed
+ */
+static int block_writer_finish(SDBBlockWriter* writer, char* const* names, int table_count) {
+    block_writer_flush(writer);
+    if (block_writer_reserve_tables(writer, table_count) != 0) writer->failed = 1;
+
+    size_t footer_size = 256;
+    size_t footer_used = 0;
+    unsigned char* footer = (unsigned char*)malloc(footer_size);
+    if (!footer) writer->failed = 1;
+
+    if (!writer->failed) {
+        write_to_buffer(&footer, &footer_size, &footer_used, &table_count, sizeof(int));
+        for (int i = 0; i < table_count; i++) {
+            int name_len = (int)strlen(names[i]);
+            write_to_buffer(&footer, &footer_size, &footer_used, &name_len, sizeof(int));
+            write_to_buffer(&footer, &footer_size, &footer_used, names[i], name_len);
+            write_to_buffer(&footer, &footer_size, &footer_used, &writer->tables[i].entry_count, sizeof(uint64_t));
+            write_to_buffer(&footer, &footer_size, &footer_used, &writer->tables[i].data_size, sizeof(uint64_t));
+        }
+
+        write_to_buffer(&footer, &footer_size, &footer_used, &writer->block_count, sizeof(uint32_t));
+        for (uint32_t b = 0; b < writer->block_count; b++) {
+            unsigned char entry[SDB_BLOCK_INDEX_ENTRY];
+            const SDBBlockInfo* info = &writer->blocks[b];
+            put_u64(entry, info->offset);
+            put_u32(entry + 8, info->table);
+            put_u32(entry + 12, info->entry_count);
+            put_u32(entry + 16, info->raw_len);
+            put_u32(entry + 20, info->comp_len);
+            put_u32(entry + 24, info->codec);
+            put_u32(entry + 28, info->crc);
+            write_to_buffer(&footer, &footer_size, &footer_used, entry, SDB_BLOCK_INDEX_ENTRY);
+        }
+        write_to_buffer(&footer, &footer_size, &footer_used, &writer->log_seq, sizeof(uint64_t));
+        if (writer->sorted_blocks > 0) {
+            uint32_t keys_magic = SDB_KEYS_MAGIC;
+            write_to_buffer(&footer, &footer_size, &footer_used, &keys_magic, sizeof(uint32_t));
+            write_to_buffer(&footer, &footer_size, &footer_used, writer->keys, writer->keys_used);
+        }
+
+        // Footer followed by a fixed-size trailer locating it
+        uint64_t footer_offset = (uint64_t)ftello(writer->file);
+        uint32_t footer_len = (uint32_t)footer_used;
+        uint32_t footer_magic = SDB_FOOTER_MAGIC;
+        fwrite(footer, 1, footer_used, writer->file);
+        fwrite(&footer_offset, sizeof(uint64_t), 1, writer->file);
+        fwrite(&footer_len, sizeof(uint32_t), 1, writer->file);
+        fwrite(&footer_magic, sizeof(uint32_t), 1, writer->file);
+    }
+
+    free(footer);
+    free(writer->buffer);
+    free(writer->restarts);
+    free(writer->blocks);
+    free(writer->keys);
+    free(writer->tables);
+    writer->buffer = NULL;
+    writer->restarts = NULL;
+    writer->blocks = NULL;
+    writer->keys = NULL;
+    writer->tables = NULL;
+    return writer->failed || ferror(writer->file) ? -1 : 0;
+}
+
+/**
+ * @brief Reads, verifies and decodes the block at an offset
+ * 
+ * @param fd The database file
+ * @param offset Offset of the block header
+ * @param info Filled with the block header as stored on disk
+ * @param verify Check the CRC before decoding
+ * @return The raw entries (info->raw_len bytes), or NULL if the block is
+ *         damaged or cannot be read
+ */
+static unsigned char* block_read(int fd, uint64_t offset, SDBBlockInfo* info, int verify) {
+    unsigned char header[SDB_BLOCK_HEADER];
+    if (pread(fd, header, SDB_BLOCK_HEADER, (off_t)offset) != SDB_BLOCK_HEADER ||
+        get_u32(header) != SDB_BLOCK_MAGIC) {
+        return NULL;
+    }
+
+    info->offset = offset;
+    info->table = get_u32(header + 4);
+    info->entry_count = get_u32(header + 8);
+    info->raw_len = get_u32(header + 12);
+    info->comp_len = get_u32(header + 16);
+    info->codec = get_u32(header + 20);
+    info->crc = get_u32(header + 24);
+    if (info->codec > SDB_COMPRESS_LZ77 || info->comp_len == 0) return NULL;
+
+    unsigned char* payload = (unsigned char*)malloc(info->comp_len);
+    if (!payload) return NULL;
+    if (pread(fd, payload, info->comp_len, (off_t)(offset + SDB_BLOCK_HEADER)) != (ssize_t)info->comp_len ||
+        (verify && sdb_crc32(sdb_crc32(0, header, SDB_BLOCK_HEADER - 4), payload, info->comp_len) != info->crc)) {
+        free(payload);
+        return NULL;
+    }
+
+    size_t raw_len = 0;
+    unsigned char* raw = sdb_decompress((SDBCompressType)info->codec, payload, info->comp_len, &raw_len);
+    free(payload);
+    if (raw && raw_len != info->raw_len) {
+        free(raw);
+        raw = NULL;
+    }
+    return raw;
+}
+
+/**
+ * @brief Orders keys bytewise, like strcmp() but without terminators
+ */
+static int key_compare(const char* a, uint32_t a_len, const char* b, uint32_t b_len) {
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) return c;
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+/**
+ * @brief Finds the restart points at the end of a sorted block
+ * 
+ * @param raw The decoded block
+ * @param raw_len Its length
+ * @param count Receives the number of restart points
+ * @return Where the entries end and the restart points start, or 0 if the
+ *         block has none
+ */
+static size_t block_restarts(const unsigned char* raw, size_t raw_len, uint32_t* count) {
+    if (raw_len < 2 * sizeof(uint32_t)) return 0;
+    *count = get_u32(raw + raw_len - sizeof(uint32_t));
+    if (*count == 0 || *count >= raw_len / sizeof(uint32_t)) return 0;
+    return raw_len - sizeof(uint32_t) * ((size_t)*count + 1);
+}
+
+/**
+ * @brief Steps to the next entry of a decoded block or format 2 payload
+ * 
+ * @param raw The raw entries
+ * @param raw_len Length of the raw entries
+ * @param pos Offset of the entry to decode
+ * @return Offset of the following entry, or 0 if the entry is malformed
+ */
+static size_t block_next_entry(const unsigned char* raw, size_t raw_len, size_t pos,
+                               const char** key, uint32_t* key_len,
+                               const char** value, uint32_t* value_len) {
+    int k, v;
+    if (pos + 2 * sizeof(int) > raw_len) return 0;
+    memcpy(&k, raw + pos, sizeof(int));
+    memcpy(&v, raw + pos + sizeof(int), sizeof(int));
+    pos += 2 * sizeof(int);
+    if (k < 0 || v < 0 || (size_t)k + (size_t)v > raw_len - pos) return 0;
+
+    *key = (const char*)raw + pos;
+    *key_len = (uint32_t)k;
+    *value = (const char*)raw + pos + k;
+    *value_len = (uint32_t)v;
+    return pos + k + v;
+}
+
+/**
+ * @brief Decodes the sparse index section of a footer
+ * 
+ * @param data The section after its magic
+ * @param len Bytes left in the footer
+ * @param count Number of blocks
+ * @return First key of every block, NULL for blocks without one, in a
+ *         single allocation; NULL if the section is damaged
+ */
+static char** footer_read_keys(const unsigned char* data, size_t len, uint32_t count) {
+    // One pass to size the allocation, one to fill it
+    size_t bytes = 0;
+    size_t pos = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        if (pos + sizeof(uint32_t) > len) return NULL;
+        uint32_t key_len = get_u32(data + pos);
+        pos += sizeof(uint32_t);
+        if (key_len == SDB_NO_KEY) continue;
+        if (key_len > len - pos) return NULL;
+        pos += key_len;
+        bytes += key_len + 1;
+    }
+
+    char** keys = (char**)malloc(sizeof(char*) * (count ? count : 1) + bytes);
+    if (!keys) return NULL;
+    char* next = (char*)(keys + count);
+    pos = 0;
+    for (uint32_t b = 0; b < count; b++) {
+        uint32_t key_len = get_u32(data + pos);
+        pos += sizeof(uint32_t);
+        if (key_len == SDB_NO_KEY) {
+            keys[b] = NULL;
+            continue;
+        }
+        keys[b] = next;
+        memcpy(next, data + pos, key_len);
+        next[key_len] = '\0';
+        next += key_len + 1;
+        pos += key_len;
+    }
+    return keys;
+}
+
+/**
+ * @brief Reads the table directory and, optionally, the block index
+ * 
+ * @param fd The database file
+ * @param version Format version from the header (2 or later)
+ * @param info Receives table_count, tables and, if present, block_keys
+ * @param blocks If not NULL, receives the block index (format 3)
+ * @param block_count Receives the number of blocks
+ * @param footer_offset If not NULL, receives where the footer starts
+ * @return 0 on success, -1 if the trailer or footer is damaged
+ */
+static int footer_read(int fd, uint32_t version, SDBFileInfo* info, SDBBlockInfo** blocks,
+                       uint32_t* block_count, uint64_t* footer_offset) {
+    struct stat st;
+    unsigned char trailer[SDB_TRAILER_SIZE];
+    if (fstat(fd, &st) != 0 || st.st_size < SDB_TRAILER_SIZE ||
+        pread(fd, trailer, SDB_TRAILER_SIZE, st.st_size - SDB_TRAILER_SIZE) != SDB_TRAILER_SIZE ||
+        get_u32(trailer + 12) != SDB_FOOTER_MAGIC) {
+        return -1;
+    }
+
+    uint64_t offset = get_u64(trailer);
+    uint32_t footer_len = get_u32(trailer + 8);
+    if (footer_len < sizeof(int) || offset + footer_len + SDB_TRAILER_SIZE > (uint64_t)st.st_size) {
+        return -1;
+    }
+
+    unsigned char* footer = (unsigned char*)malloc(footer_len);
+    if (!footer || pread(fd, footer, footer_len, (off_t)offset) != (ssize_t)footer_len) {
+        free(footer);
+        return -1;
+    }
+    if (footer_offset) *footer_offset = offset;
+
+    int table_count;
+    size_t pos = 0;
+    memcpy(&table_count, footer, sizeof(int));
+    pos += sizeof(int);
+    if (table_count < 0 || (size_t)table_count > footer_len) {
+        free(footer);
+        return -1;
+    }
+    info->tables = (SDBTableInfo*)calloc(table_count > 0 ? table_count : 1, sizeof(SDBTableInfo));
+    info->table_count = 0;
+    if (!info->tables) {
+        free(footer);
+        return -1;
+    }
+
+    int ok = 1;
+    for (int i = 0; i < table_count; i++) {
+        int name_len;
+        if (pos + sizeof(int) > footer_len) { ok = 0; break; }
+        memcpy(&name_len, footer + pos, sizeof(int));
+        pos += sizeof(int);
+        if (name_len < 0 || pos + name_len + 2 * sizeof(uint64_t) > footer_len) { ok = 0; break; }
+
+        SDBTableInfo* table = &info->tables[info->table_count++];
+        table->name = (char*)malloc(name_len + 1);
+        if (table->name) {
+            memcpy(table->name, footer + pos, name_len);
+            table->name[name_len] = '\0';
+        }
+        pos += name_len;
+        memcpy(&table->entry_count, footer + pos, sizeof(uint64_t));
+        pos += sizeof(uint64_t);
+        memcpy(&table->data_size, footer + pos, sizeof(uint64_t));
+        pos += sizeof(uint64_t);
+    }
+
+    if (ok && version >= 3) {
+        uint32_t count = 0;
+        if (pos + sizeof(uint32_t) > footer_len) ok = 0;
+        if (ok) {
+            memcpy(&count, footer + pos, sizeof(uint32_t));
+            pos += sizeof(uint32_t);
+            if ((uint64_t)count * SDB_BLOCK_INDEX_ENTRY > footer_len - pos) ok = 0;
+        }
+        if (ok) *block_count = count;
+        if (ok && blocks) {
+            *blocks = (SDBBlockInfo*)malloc(sizeof(SDBBlockInfo) * (count ? count : 1));
+            if (!*blocks) ok = 0;
+            for (uint32_t b = 0; ok && b < count; b++) {
+                const unsigned char* entry = footer + pos + (size_t)b * SDB_BLOCK_INDEX_ENTRY;
+                SDBBlockInfo* block = &(*blocks)[b];
+                block->offset = get_u64(entry);
+                block->table = get_u32(entry + 8);
+                block->entry_count = get_u32(entry + 12);
+                block->raw_len = get_u32(entry + 16);
+                block->comp_len = get_u32(entry + 20);
+                block->codec = get_u32(entry + 24);
+                block->crc = get_u32(entry + 28);
+            }
+        }
+
+        // Files written before the write-ahead log end after the index
+        pos += (size_t)count * SDB_BLOCK_INDEX_ENTRY;
+        if (ok && pos + sizeof(uint64_t) <= footer_len) {
+            memcpy(&info->log_seq, footer + pos, sizeof(uint64_t));
+            pos += sizeof(uint64_t);
+        }
+        if (ok && pos + sizeof(uint32_t) <= footer_len && get_u32(footer + pos) == SDB_KEYS_MAGIC) {
+            info->block_keys = footer_read_keys(footer + pos + sizeof(uint32_t),
+                                                footer_len - pos - sizeof(uint32_t), count);
+        }
+    }
+
+    free(footer);
+    return ok ? 0 : -1;
+}
+
+/*******************************************************************************
+ * Key Index Functions
+ ******************************************************************************/
+/*
+ * A frozen table carries a key index: a minimal acyclic finite state
+ * transducer over its sorted keys, built in one pass as the snapshot is
+ * written. Each key is a path of byte-labelled arcs from the root to a
+ * final state. Keys share their prefixes along the path and, because
+ * equal states are merged, their suffixes too, so the index usually takes
+ * a fraction of the key bytes. The outputs on the arcs of a path add up
+ * to the key's rank, the number of smaller keys, which locates the entry
+ * in the table's blocks.
+ * 
+ * States are stored children first, so every arc points backwards:
+ * 
+ *   state    varint arc count, final flag byte, then per arc the label
+ *            byte, varint output and varint distance back to the target
+ *   trailer  root offset, key count (uint64 each)
+ * 
+ * The index goes into a block of its own after the table's data blocks,
+ * stored uncompressed and with no entries, so it can be used in place in
+ * the mapped file and older readers pass over it.
+ */
+enum {
+    SDB_KEY_INDEX_TRAILER = 16,
+    SDB_KEY_INDEX_STATE_MAX = 3 + 256 * 21     // Arc count, final flag, 256 full-width arcs
+};
+
+typedef struct {
+    unsigned char label;
+    uint64_t target;        // Offset of the target state once it is compiled
+    uint64_t count;         // Keys accepted from the target state
+} SDBKeyArc;
+
+typedef struct {
+    SDBKeyArc* arcs;
+    uint32_t arc_count;
+    uint32_t arc_capacity;
+    int final;
+} SDBKeyState;
+
+typedef struct {
+    uint64_t offset;
+    uint32_t len;
+    uint32_t hash;
+} SDBKeyRegister;
+
+typedef struct {
+    unsigned char* out;     // Compiled states
+    size_t out_size;
+    size_t out_used;
+    SDBKeyState* path;      // States of the last key that may still change, by depth
+    size_t path_size;
+    char* last;             // Last key added
+    size_t last_len;
+    size_t last_size;
+    SDBKeyRegister* reg;    // Compiled states by content, to merge equal ones
+    size_t reg_capacity;
+    size_t reg_count;
+    uint64_t keys;
+    int failed;
+} SDBKeyIndexBuilder;
+
+static size_t varint_put(unsigned char* p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char)v;
+    return n;
+}
+
+static int varint_get(const unsigned char* p, size_t len, size_t* pos, uint64_t* v) {
+    *v = 0;
+    for (int shift = 0; shift < 64 && *pos < len; shift += 7) {
+        unsigned char b = p[(*pos)++];
+        *v |= (uint64_t)(b & 0x7F) << shift;
+        if (!(b & 0x80)) return 0;
+    }
+    return -1;
+}
+
+static void key_index_init(SDBKeyIndexBuilder* builder) {
+    memset(builder, 0, sizeof(SDBKeyIndexBuilder));
+    builder->out_size = 4096;
+    builder->out = (unsigned char*)malloc(builder->out_size);
+    builder->path_size = 64;
+    builder->path = (SDBKeyState*)calloc(builder->path_size, sizeof(SDBKeyState));
+    builder->last_size = 64;
+    builder->last = (char*)malloc(builder->last_size);
+    builder->reg_capacity = 1024;
+    builder->reg = (SDBKeyRegister*)calloc(builder->reg_capacity, sizeof(SDBKeyRegister));
+    if (!builder->out || !builder->path || !builder->last || !builder->reg) builder->failed = 1;
+}
+
+static void key_index_free(SDBKeyIndexBuilder* builder) {
+    for (size_t d = 0; builder->path && d < builder->path_size; d++) {
+        free(builder->path[d].arcs);
+    }
+    free(builder->out);
+    free(builder->path);
+    free(builder->last);
+    free(builder->reg);
+    memset(builder, 0, sizeof(SDBKeyIndexBuilder));
+}
+
+static int key_index_grow_register(SDBKeyIndexBuilder* builder) {
+    size_t capacity = builder->reg_capacity * 2;
+    SDBKeyRegister* reg = (SDBKeyRegister*)calloc(capacity, sizeof(SDBKeyRegister));
+    if (!reg) return -1;
+    for (size_t i = 0; i < builder->reg_capacity; i++) {
+        if (builder->reg[i].len == 0) continue;
+        size_t slot = builder->reg[i].hash & (capacity - 1);
+        while (reg[slot].len) slot = (slot + 1) & (capacity - 1);
+        reg[slot] = builder->reg[i];
+    }
+    free(builder->reg);
+    builder->reg = reg;
+    builder->reg_capacity = capacity;
+    return 0;
+}
+
+/**
+ * @brief Decodes a compiled state with its targets made absolute again
+ * 
+ * @param out The index built so far
+ * @param offset Offset of the state
+ * @param buf Receives the state, SDB_KEY_INDEX_STATE_MAX bytes at most
+ * @return Length of the state in buf
+ */
+static size_t key_index_absolute(const unsigned char* out, uint64_t offset, unsigned char* buf) {
+    size_t pos = (size_t)offset;
+    uint64_t arcs, value;
+    varint_get(out, SIZE_MAX, &pos, &arcs);
+    size_t len = varint_put(buf, arcs);
+    buf[len++] = out[pos++];
+    for (uint64_t i = 0; i < arcs; i++) {
+        buf[len++] = out[pos++];
+        varint_get(out, SIZE_MAX, &pos, &value);
+        len += varint_put(buf + len, value);
+        varint_get(out, SIZE_MAX, &pos, &value);
+        len += varint_put(buf + len, offset - value);
+    }
+    return len;
+}
+
+/**
+ * @brief Compiles a state that can no longer change, merging it with an
+ *        equal one compiled before
+ * 
+ * @param builder The builder
+ * @param state The state; its arcs point to compiled states
+ * @param count Receives the number of keys accepted from the state
+ * @return Offset of the compiled state
+ */
+static uint64_t key_index_compile(SDBKeyIndexBuilder* builder, const SDBKeyState* state, uint64_t* count) {
+    unsigned char buf[SDB_KEY_INDEX_STATE_MAX];
+    size_t len = varint_put(buf, state->arc_count);
+    buf[len++] = (unsigned char)(state->final != 0);
+
+    // An arc's output counts the keys of the arcs before it, and the state's own
+    uint64_t below = state->final ? 1 : 0;
+    for (uint32_t i = 0; i < state->arc_count; i++) {
+        buf[len++] = state->arcs[i].label;
+        len += varint_put(buf + len, below);
+        len += varint_put(buf + len, state->arcs[i].target);
+        below += state->arcs[i].count;
+    }
+    *count = below;
+
+    // Equal states are found by their arcs with absolute targets
+    uint32_t hash = (uint32_t)hash_bytes((const char*)buf, len);
+    size_t mask = builder->reg_capacity - 1;
+    size_t slot = hash & mask;
+    for (; builder->reg[slot].len; slot = (slot + 1) & mask) {
+        const SDBKeyRegister* r = &builder->reg[slot];
+        unsigned char stored[SDB_KEY_INDEX_STATE_MAX];
+        if (r->hash == hash && key_index_absolute(builder->out, r->offset, stored) == len &&
+            memcmp(stored, buf, len) == 0) {
+            return r->offset;
+        }
+    }
+
+    // It is written with each target as its distance back from the state,
+    // which is short for the states compiled just before it
+    uint64_t offset = builder->out_used;
+    unsigned char rel[SDB_KEY_INDEX_STATE_MAX];
+    size_t rel_len = varint_put(rel, state->arc_count);
+    rel[rel_len++] = (unsigned char)(state->final != 0);
+    below = state->final ? 1 : 0;
+    for (uint32_t i = 0; i < state->arc_count; i++) {
+        rel[rel_len++] = state->arcs[i].label;
+        rel_len += varint_put(rel + rel_len, below);
+        rel_len += varint_put(rel + rel_len, offset - state->arcs[i].target);
+        below += state->arcs[i].count;
+    }
+    write_to_buffer(&builder->out, &builder->out_size, &builder->out_used, rel, rel_len);
+    builder->reg[slot].offset = offset;
+    builder->reg[slot].len = (uint32_t)len;
+    builder->reg[slot].hash = hash;
+    if (++builder->reg_count * 2 > builder->reg_capacity && key_index_grow_register(builder) != 0) {
+        builder->failed = 1;
+    }
+    return offset;
+}
+
+/**
+ * @brief Compiles the states of the last key deeper than a depth
+ */
+static void key_index_freeze(SDBKeyIndexBuilder* builder, size_t depth) {
+    for (size_t d = builder->last_len; d > depth; d--) {
+        SDBKeyState* parent = &builder->path[d - 1];
+        SDBKeyArc* arc = &parent->arcs[parent->arc_count - 1];
+        arc->target = key_index_compile(builder, &builder->path[d], &arc->count);
+        builder->path[d].arc_count = 0;
+        builder->path[d].final = 0;
+    }
+}
+
+/**
+ * @brief Adds the next key; keys must come in strictly ascending order
+ * 
+ * @param builder The builder
+ * @param key The key
+ * @param key_len Its length
+ */
+static void key_index_add(SDBKeyIndexBuilder* builder, const char* key, size_t key_len) {
+    if (builder->failed) return;
+
+    size_t common = 0;
+    while (common < key_len && common < builder->last_len && key[common] == builder->last[common]) common++;
+    if (builder->keys > 0 && key_compare(key, (uint32_t)key_len, builder->last, (uint32_t)builder->last_len) <= 0) {
+        builder->failed = 1;
+        return;
+    }
+    key_index_freeze(builder, common);
+
+    if (key_len + 1 > builder->path_size) {
+        size_t size = (key_len + 1) * 2;
+        SDBKeyState* path = (SDBKeyState*)realloc(builder->path, sizeof(SDBKeyState) * size);
+        if (!path) {
+            builder->failed = 1;
+            return;
+        }
+        memset(path + builder->path_size, 0, sizeof(SDBKeyState) * (size - builder->path_size));
+        builder->path = path;
+        builder->path_size = size;
+    }
+    for (size_t d = common; d < key_len; d++) {
+        SDBKeyState* state = &builder->path[d];
+        if (state->arc_count == state->arc_capacity) {
+            uint32_t capacity = state->arc_capacity ? state->arc_capacity * 2 : 4;
+            SDBKeyArc* arcs = (SDBKeyArc*)realloc(state->arcs, sizeof(SDBKeyArc) * capacity);
+            if (!arcs) {
+                builder->failed = 1;
+                return;
+            }
+            state->arcs = arcs;
+            state->arc_capacity = capacity;
+        }
+        SDBKeyArc* arc = &state->arcs[state->arc_count++];
+        arc->label = (unsigned char)key[d];
+        arc->target = 0;
+        arc->count = 0;
+    }
+    builder->path[key_len].final = 1;
+
+    if (key_len > builder->last_size) {
+        char* last = (char*)realloc(builder->last, key_len * 2);
+        if (!last) {
+            builder->failed = 1;
+            return;
+        }
+        builder->last = last;
+        builder->last_size = key_len * 2;
+    }
+    memcpy(builder->last, key, key_len);
+    builder->last_len = key_len;
+    builder->keys++;
+}
+
+/**
+ * @brief Compiles the remaining states and appends the trailer
+ * 
+ * @param builder The builder
+ * @param len Receives the length of the index
+ * @return The index, allocated with malloc(), or NULL on failure
+ */
+static unsigned char* key_index_finish(SDBKeyIndexBuilder* builder, size_t* len) {
+    unsigned char* out = NULL;
+    if (!builder->failed) {
+        key_index_freeze(builder, 0);
+        uint64_t count;
+        uint64_t root = key_index_compile(builder, &builder->path[0], &count);
+        unsigned char trailer[SDB_KEY_INDEX_TRAILER];
+        put_u64(trailer, root);
+        put_u64(trailer + 8, builder->keys);
+        write_to_buffer(&builder->out, &builder->out_size, &builder->out_used, trailer, SDB_KEY_INDEX_TRAILER);
+    }
+    if (!builder->failed) {
+        out = builder->out;
+        *len = builder->out_used;
+        builder->out = NULL;
+    }
+    key_index_free(builder);
+    return out;
+}
+
+/**
+ * @brief Counts the keys of an index that are less than a key
+ * 
+ * Follows the key's path from the root. Where the path leaves the index,
+ * the output of the next greater arc, or of the next greater arc further
+ * up, is the answer.
+ * 
+ * @param index The index
+ * @param len Its length
+ * @param key The key
+ * @param key_len Its length
+ * @param exact Set to 1 if the key is in the index, else 0
+ * @return The rank of the key, or of the first greater key; UINT64_MAX if
+ *         the index is damaged
+ */
+static uint64_t key_index_rank(const unsigned char* index, size_t len, const char* key, size_t key_len,
+                               int* exact) {
+    *exact = 0;
+    if (len < SDB_KEY_INDEX_TRAILER) return UINT64_MAX;
+    size_t end = len - SDB_KEY_INDEX_TRAILER;
+    uint64_t state = get_u64(index + end);
+    uint64_t upper = get_u64(index + end + 8);
+    uint64_t rank = 0;
+
+    // Targets point backwards, so a damaged index cannot loop
+    for (size_t depth = 0;; depth++) {
+        if (state >= end) return UINT64_MAX;
+        size_t pos = (size_t)state;
+        uint64_t arcs;
+        if (varint_get(index, end, &pos, &arcs) != 0 || pos >= end) return UINT64_MAX;
+        int final = index[pos++] != 0;
+        if (depth == key_len) {
+            *exact = final;
+            return rank;
+        }
+
+        unsigned char c = (unsigned char)key[depth];
+        int found = 0;
+        uint64_t output = 0, target = 0;
+        int prev = -1;
+        for (uint64_t i = 0; i < arcs; i++) {
+            uint64_t out, to;
+            if (pos >= end) return UINT64_MAX;
+            int label = index[pos++];
+            if (label <= prev || varint_get(index, end, &pos, &out) != 0 ||
+                varint_get(index, end, &pos, &to) != 0 || to == 0 || to > state) {
+                return UINT64_MAX;
+            }
+            prev = label;
+            if (label < c) continue;
+            if (found) {
+                upper = rank + out;     // First key after the subtree the key goes into
+                break;
+            }
+            if (label > c) return rank + out;
+            found = 1;
+            output = out;
+            target = state - to;
+        }
+        if (!found) return upper;
+        rank += output;
+        state = target;
+    }
+}
+
+/*******************************************************************************
+ * Ordered Table Functions
+ ******************************************************************************/
+/**
+ * @brief Picks the height of a key's node
+ * 
+ * Every fourth node reaches one level higher. The height comes from the
+ * key's hash, so writers share no random state.
+ */
+static uint32_t skip_height(const char* key, uint32_t key_len) {
+    // Similar keys differ in the low bits of the hash only, so they are mixed up
+    uint64_t hash = ((uint64_t)hash_bytes(key, key_len) * 0x9E3779B97F4A7C15ULL) >> 32;
+    uint32_t height = 1;
+    while (height < SDB_SKIP_HEIGHT && (hash & 3) == 0) {
+        height++;
+        hash >>= 2;
+    }
+    return height;
+}
+
+static SDBSkipNode* skip_node_create(const char* key, uint32_t key_len, uint32_t height) {
+    size_t links = sizeof(SDBSkipNode*) * height;
+    SDBSkipNode* node = (SDBSkipNode*)malloc(sizeof(SDBSkipNode) + links + key_len + 1);
+    if (!node) return NULL;
+    node->value = NULL;
+    node->next = (SDBSkipNode**)(node + 1);
+    memset(node->next, 0, links);
+    node->key = (char*)(node->next + height);
+    memcpy(node->key, key, key_len);
+    node->key[key_len] = '\0';
+    node->key_len = key_len;
+    node->height = height;
+    return node;
+}
+
+static SDBSkipValue* skip_value_create(const char* value, size_t len, uint64_t seq) {
+    SDBSkipValue* copy = (SDBSkipValue*)malloc(sizeof(SDBSkipValue) + len + 1);
+    if (!copy) return NULL;
+    copy->retired = NULL;
+    copy->seq = seq;
+    copy->len = len;
+    memcpy(copy + 1, value, len);
+    ((char*)(copy + 1))[len] = '\0';
+    return copy;
+}
+
+static char* skip_value_data(SDBSkipValue* value) {
+    return (char*)(value + 1);
+}
+
+static SDBSkiplist* skiplist_create(void) {
+    SDBSkiplist* list = (SDBSkiplist*)calloc(1, sizeof(SDBSkiplist));
+    if (!list) return NULL;
+    list->head = skip_node_create("", 0, SDB_SKIP_HEIGHT);
+    if (!list->head) {
+        free(list);
+        return NULL;
+    }
+    return list;
+}
+
+static void skiplist_free(SDBSkiplist* list) {
+    SDBSkipNode* node = list->head->next[0];
+    while (node) {
+        SDBSkipNode* next = node->next[0];
+        free(node->value);
+        free(node);
+        node = next;
+    }
+    free(list->head);
+    free(list);
+}
+
+/**
+ * @brief Finds the first node whose key is not less than a key
+ * 
+ * @param list The skiplist
+ * @param key The key, or NULL for the first node
+ * @param key_len Its length
+ * @param preds Receives the last node before the key on every level, or NULL
+ * @param succs Receives the node after those, or NULL
+ * @return The node, or NULL if every key is less
+ */
+static SDBSkipNode* skiplist_seek(const SDBSkiplist* list, const char* key, uint32_t key_len,
+                                  SDBSkipNode** preds, SDBSkipNode** succs) {
+    SDBSkipNode* x = list->head;
+    SDBSkipNode* next = NULL;
+    for (int level = SDB_SKIP_HEIGHT - 1; level >= 0; level--) {
+        next = __atomic_load_n(&x->next[level], __ATOMIC_ACQUIRE);
+        while (key && next && key_compare(next->key, next->key_len, key, key_len) < 0) {
+            x = next;
+            next = __atomic_load_n(&x->next[level], __ATOMIC_ACQUIRE);
+        }
+        if (preds) {
+            preds[level] = x;
+            succs[level] = next;
+        }
+    }
+    return next;
+}
+
+static SDBSkipValue* skiplist_get(const SDBSkiplist* list, const char* key) {
+    uint32_t key_len = (uint32_t)strlen(key);
+    SDBSkipNode* node = skiplist_seek(list, key, key_len, NULL, NULL);
+    if (!node || key_compare(node->key, node->key_len, key, key_len) != 0) return NULL;
+    return __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * @brief Inserts or replaces the value of a key without locking
+ * 
+ * A new node becomes visible once it is linked on the bottom level, and is
+ * then linked on the levels above. When a compare-and-swap fails, another
+ * writer changed the list right there, so the neighbours are looked up
+ * again. Of two writes to one key, the one with the higher sequence stays.
+ * 
+ * @param list The skiplist
+ * @param key The key
+ * @param key_len Its length
+ * @param value The new value
+ * @return The value nobody can reach any more, which the caller retires:
+ *         the replaced one, or the new one if a later write won or memory
+ *         ran out. NULL if the key is new.
+ */
+static SDBSkipValue* skiplist_insert(SDBSkiplist* list, const char* key, uint32_t key_len, SDBSkipValue* value) {
+    SDBSkipNode* preds[SDB_SKIP_HEIGHT];
+    SDBSkipNode* succs[SDB_SKIP_HEIGHT];
+    SDBSkipNode* node = NULL;
+    for (;;) {
+        SDBSkipNode* found = skiplist_seek(list, key, key_len, preds, succs);
+        if (found && key_compare(found->key, found->key_len, key, key_len) == 0) {
+            free(node);
+            SDBSkipValue* old = __atomic_load_n(&found->value, __ATOMIC_ACQUIRE);
+            for (;;) {
+                if (old->seq > value->seq) return value;
+                if (__atomic_compare_exchange_n(&found->value, &old, value, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+                    return old;
+                }
+            }
+        }
+        if (!node) {
+            node = skip_node_create(key, key_len, skip_height(key, key_len));
+            if (!node) return value;
+            node->value = value;
+        }
+        __atomic_store_n(&node->next[0], succs[0], __ATOMIC_RELAXED);
+        SDBSkipNode* expected = succs[0];
+        if (__atomic_compare_exchange_n(&preds[0]->next[0], &expected, node, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+
+    for (uint32_t level = 1; level < node->height; level++) {
+        for (;;) {
+            __atomic_store_n(&node->next[level], succs[level], __ATOMIC_RELAXED);
+            SDBSkipNode* expected = succs[level];
+            if (__atomic_compare_exchange_n(&preds[level]->next[level], &expected, node, 0, __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+            skiplist_seek(list, key, key_len, preds, succs);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Starts a section that uses ordered tables without the lock
+ * 
+ * Readers count themselves in the current epoch. Whatever was retired
+ * before the epoch changed is freed once the readers of the old epoch
+ * are gone, see ordered_reclaim().
+ * 
+ * @return The epoch, for ordered_exit()
+ */
+static unsigned ordered_enter(SDBOrderedTables* ord) {
+    for (;;) {
+        unsigned epoch = __atomic_load_n(&ord->epoch, __ATOMIC_SEQ_CST);
+        __atomic_fetch_add(&ord->readers[epoch], 1, __ATOMIC_SEQ_CST);
+
+        // Had the epoch changed meanwhile, the reclaimer might have missed us
+        if (__atomic_load_n(&ord->epoch, __ATOMIC_SEQ_CST) == epoch) return epoch;
+        __atomic_fetch_sub(&ord->readers[epoch], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+static void ordered_exit(SDBOrderedTables* ord, unsigned epoch) {
+    __atomic_fetch_sub(&ord->readers[epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * @brief Finds the skiplist of an ordered table without the lock
+ * 
+ * @return The skiplist, valid until ordered_exit(), or NULL if the table
+ *         is not ordered
+ */
+static SDBSkiplist* ordered_find(SDBOrderedTables* ord, const char* table) {
+    SDBOrderedDir* dir = __atomic_load_n(&ord->dir, __ATOMIC_ACQUIRE);
+    for (int i = 0; dir && i < dir->count; i++) {
+        if (strcmp(dir->names[i], table) == 0) return dir->lists[i];
+    }
+    return NULL;
+}
+
+/**
+ * @brief Hands a value nobody can reach any more to the reclaimer
+ */
+static void ordered_retire(SDBOrderedTables* ord, SDBSkipValue* value) {
+    if (!value) return;
+    SDBSkipValue* head = __atomic_load_n(&ord->retired, __ATOMIC_RELAXED);
+    do {
+        value->retired = head;
+    } while (!__atomic_compare_exchange_n(&ord->retired, &head, value, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&ord->retired_bytes, sizeof(SDBSkipValue) + value->len + 1, __ATOMIC_RELAXED);
+}
+
+static void ordered_dir_free(SDBOrderedDir* dir) {
+    for (int i = 0; i < dir->count; i++) free(dir->names[i]);
+    free(dir->names);
+    free(dir->lists);
+    free(dir);
+}
+
+static void ordered_free_retired(SDBSkipValue* values, SDBOrderedDir* dirs, SDBSkiplist* lists) {
+    while (values) {
+        SDBSkipValue* next = values->retired;
+        free(values);
+        values = next;
+    }
+    while (dirs) {
+        SDBOrderedDir* next = dirs->retired;
+        ordered_dir_free(dirs);
+        dirs = next;
+    }
+    while (lists) {
+        SDBSkiplist* next = lists->retired;
+        skiplist_free(lists);
+        lists = next;
+    }
+}
+
+/**
+ * @brief Frees what was retired once no reader can still see it; the caller
+ *        holds sdb->lock
+ * 
+ * Retired objects move to limbo and the epoch changes. Readers that came
+ * after the change cannot reach them, so limbo is freed as soon as the
+ * readers of the old epoch are gone. Nothing here waits for them, so a
+ * scan callback may call into the database.
+ * 
+ * @param ord The ordered tables
+ */
+static void ordered_reclaim(SDBOrderedTables* ord) {
+    if (ord->limbo || ord->limbo_dirs || ord->limbo_lists) {
+        if (__atomic_load_n(&ord->readers[ord->limbo_epoch], __ATOMIC_SEQ_CST) != 0) return;
+        ordered_free_retired(ord->limbo, ord->limbo_dirs, ord->limbo_lists);
+        ord->limbo = NULL;
+        ord->limbo_dirs = NULL;
+        ord->limbo_lists = NULL;
+    }
+
+    __atomic_store_n(&ord->retired_bytes, 0, __ATOMIC_RELAXED);
+    ord->limbo = __atomic_exchange_n(&ord->retired, NULL, __ATOMIC_ACQUIRE);
+    ord->limbo_dirs = ord->retired_dirs;
+    ord->limbo_lists = ord->retired_lists;
+    ord->retired_dirs = NULL;
+    ord->retired_lists = NULL;
+    if (!ord->limbo && !ord->limbo_dirs && !ord->limbo_lists) return;
+
+    ord->limbo_epoch = __atomic_load_n(&ord->epoch, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&ord->epoch, ord->limbo_epoch ^ 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ord->readers[ord->limbo_epoch], __ATOMIC_SEQ_CST) == 0) {
+        ordered_free_retired(ord->limbo, ord->limbo_dirs, ord->limbo_lists);
+        ord->limbo = NULL;
+        ord->limbo_dirs = NULL;
+        ord->limbo_lists = NULL;
+    }
+}
+
+/**
+ * @brief Publishes the ordered tables for lookups without the lock; the
+ *        caller holds sdb->lock
+ * 
+ * @param sdb The database
+ * @return 0 on success, -1 if out of memory
+ */
+static int ordered_publish(SDB* sdb) {
+    SDBOrderedTables* ord = sdb->ordered;
+    SDBOrderedDir* dir = (SDBOrderedDir*)calloc(1, sizeof(SDBOrderedDir));
+    if (!dir) return -1;
+    dir->names = (char**)calloc(sdb->table_count ? sdb->table_count : 1, sizeof(char*));
+    dir->lists = (SDBSkiplist**)calloc(sdb->table_count ? sdb->table_count : 1, sizeof(SDBSkiplist*));
+    int failed = !dir->names || !dir->lists;
+    for (int i = 0; !failed && i < sdb->table_count; i++) {
+        if (!sdb->tables[i].ordered) continue;
+        dir->names[dir->count] = strdup(sdb->tables[i].name);
+        if (!dir->names[dir->count]) failed = 1;
+        else dir->lists[dir->count++] = sdb->tables[i].ordered;
+    }
+    if (failed) {
+        ordered_dir_free(dir);
+        return -1;
+    }
+
+    SDBOrderedDir* old = ord->dir;
+    __atomic_store_n(&ord->dir, dir, __ATOMIC_RELEASE);
+    if (old) {
+        old->retired = ord->retired_dirs;
+        ord->retired_dirs = old;
+    }
+    return 0;
+}
+
+/**
+ * @brief Frees the ordered tables' shared state when the database closes
+ * 
+ * The skiplists of the tables are freed with the tables.
+ */
+static void ordered_free(SDBOrderedTables* ord) {
+    if (!ord) return;
+    ordered_free_retired(ord->retired, ord->retired_dirs, ord->retired_lists);
+    ordered_free_retired(ord->limbo, ord->limbo_dirs, ord->limbo_lists);
+    if (ord->dir) ordered_dir_free(ord->dir);
+    free(ord);
+}
+
+/*******************************************************************************
+ * Write-Ahead Log Functions
+ ******************************************************************************/
+enum {
+    SDB_WAL_HEADER = POOL_BLOCK_SIZE,   // Header page in front of the ring
+    SDB_WAL_FRAME = 32,                 // Frame header: len, crc, seq, type, three lengths
+    SDB_WAL_SET = 1,
+    SDB_WAL_CREATE = 2,
+    SDB_WAL_DESTROY = 3,
+    SDB_WAL_WRAP = 4                    // Rest of the ring is padding; continue at 0
+};
+
+/**
+ * @brief Writes the header page: where the live records start
+ * 
+ * Only done at checkpoints, never per append.
+ */
+static int wal_write_header(SDBWal* wal) {
+    unsigned char header[40];
+    put_u32(header, SDB_WAL_MAGIC);
+    put_u32(header + 4, SDB_WAL_VERSION);
+    put_u64(header + 8, wal->ring_size);
+    put_u64(header + 16, wal->head);
+    put_u64(header + 24, wal->head_seq);
+    put_u32(header + 32, sdb_crc32(0, header, 32));
+    put_u32(header + 36, 0);
+
+    if (wal->map) {
+        memcpy(wal->map, header, sizeof(header));
+        return msync(wal->map, SDB_WAL_HEADER, MS_SYNC);
+    }
+    if (pwrite(wal->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) return -1;
+    return fdatasync(wal->fd);
+}
+
+/**
+ * @brief Flushes part of the ring to disk
+ * 
+ * @return 0 on success, -1 if the pages could not be written
+ */
+static int wal_flush(SDBWal* wal, uint64_t offset, uint64_t len) {
+    if (!wal->map) return fdatasync(wal->fd);
+    // msync wants a page-aligned start
+    uint64_t start = (SDB_WAL_HEADER + offset) & ~(uint64_t)(POOL_BLOCK_SIZE - 1);
+    return msync(wal->map + start, (size_t)(SDB_WAL_HEADER + offset + len - start), MS_SYNC);
+}
+
+/**
+ * @brief Creates a log file and reserves all of its space up front
+ * 
+ * The ring is written with zeros once, so later appends only overwrite
+ * allocated, initialized blocks and never change the file's metadata.
+ */
+static int wal_create(SDBWal* wal, uint64_t ring_size) {
+    uint64_t file_size = SDB_WAL_HEADER + ring_size;
+    if (ftruncate(wal->fd, 0) != 0) return -1;
+    int err = posix_fallocate(wal->fd, 0, (off_t)file_size);
+    if (err != 0 && err != EINVAL && err != EOPNOTSUPP) return -1;
+
+    unsigned char* zeros = (unsigned char*)calloc(1, 1024 * 1024);
+    if (!zeros) return -1;
+    uint64_t offset = 0;
+    while (offset < file_size) {
+        size_t chunk = file_size - offset < 1024 * 1024 ? (size_t)(file_size - offset) : 1024 * 1024;
+        if (pwrite(wal->fd, zeros, chunk, (off_t)offset) != (ssize_t)chunk) {
+            free(zeros);
+            return -1;
+        }
+        offset += chunk;
+    }
+    free(zeros);
+    SDB_FADVISE(wal->fd, 0, 0, DONTNEED);
+
+    wal->ring_size = ring_size;
+    wal->head = 0;
+    if (fsync(wal->fd) != 0) return -1;
+    return 0;
+}
+
+/**
+ * @brief Opens the log next to a database, creating it if needed
+ * 
+ * An existing log keeps its size. A log whose header fails its checks, or
+ * whose head is past the snapshot's sequence number, is left alone, since
+ * records the snapshot lacks are missing or may still be in it; only a log
+ * whose header was never written is recreated. The ring is mapped
+ * when possible, so an append is a memcpy; otherwise records are written
+ * with pwrite.
+ * 
+ * @param sdb The database
+ * @param ring_size Bytes for records when the log is created
+ * @param sync Flush every record before the append returns
+ * @param damaged Set to 1 if an existing log has a damaged header
+ * @return The log, or NULL on failure
+ */
+static SDBWal* wal_open(SDB* sdb, uint64_t ring_size, int sync, int* damaged) {
+    char* path = sidecar_path(sdb, ".wal");
+    if (!path) return NULL;
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        free(path);
+        return NULL;
+    }
+
+    SDBWal* wal = (SDBWal*)calloc(1, sizeof(SDBWal));
+    if (!wal) {
+        close(fd);
+        free(path);
+        return NULL;
+    }
+    wal->fd = fd;
+    wal->sync = sync;
+
+    // Reuse the existing log if its header is intact
+    unsigned char header[40];
+    struct stat st;
+    ssize_t got = fstat(fd, &st) == 0 ? pread(fd, header, sizeof(header), 0) : -1;
+    int valid = got == (ssize_t)sizeof(header) &&
+                get_u32(header) == SDB_WAL_MAGIC && get_u32(header + 4) == SDB_WAL_VERSION &&
+                get_u32(header + 32) == sdb_crc32(0, header, 32) &&
+                (uint64_t)st.st_size == SDB_WAL_HEADER + get_u64(header + 8) &&
+                get_u64(header + 16) < get_u64(header + 8);
+
+    // wal_create() writes the header last, so a new or unfinished log reads as zeros
+    int blank = got == 0 || got == (ssize_t)sizeof(header);
+    for (ssize_t i = 0; blank && i < got; i++) {
+        if (header[i] != 0) blank = 0;
+    }
+
+    // A head past the snapshot means records between them were lost
+    if ((!valid && !blank) || (valid && get_u64(header + 24) > sdb->log_seq + 1)) {
+        *damaged = 1;
+        close(fd);
+        free(wal);
+        free(path);
+        return NULL;
+    }
+
+    if (valid) {
+        wal->ring_size = get_u64(header + 8);
+        wal->head = get_u64(header + 16);
+        wal->head_seq = get_u64(header + 24);
+    } else {
+        ring_size &= ~(uint64_t)(POOL_BLOCK_SIZE - 1);
+        if (ring_size < 4 * POOL_BLOCK_SIZE) ring_size = 4 * POOL_BLOCK_SIZE;
+        // Sequence numbers continue after the snapshot's, so no new record
+        // is mistaken for one the snapshot already contains
+        wal->head_seq = sdb->log_seq + 1;
+        if (wal_create(wal, ring_size) != 0 || wal_write_header(wal) != 0 || sync_parent_dir(path) != 0) {
+            close(fd);
+            free(wal);
+            free(path);
+            return NULL;
+        }
+    }
+    free(path);
+
+    wal->map_size = (size_t)(SDB_WAL_HEADER + wal->ring_size);
+    void* map = mmap(NULL, wal->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+        wal->map = (unsigned char*)map;
+#ifdef MADV_SEQUENTIAL
+        // Records are written and replayed front to back
+        madvise(wal->map, wal->map_size, MADV_SEQUENTIAL);
+#endif
+    }
+    wal->tail = wal->head;
+    wal->next_seq = wal->head_seq;
+    return wal;
+}
+
+static void wal_close(SDBWal* wal) {
+    if (!wal) return;
+    if (wal->map) munmap(wal->map, wal->map_size);
+    close(wal->fd);
+    free(wal->scratch);
+    free(wal);
+}
+
+/**
+ * @brief Reads the frame at a ring offset, copying it out if not mapped
+ * 
+ * @return The frame, or NULL if it cannot be read
+ */
+static const unsigned char* wal_frame(SDBWal* wal, uint64_t offset, uint64_t len) {
+    if (wal->map) return wal->map + SDB_WAL_HEADER + offset;
+    if (len > wal->scratch_size) {
+        unsigned char* grown = (unsigned char*)realloc(wal->scratch, (size_t)len);
+        if (!grown) return NULL;
+        wal->scratch = grown;
+        wal->scratch_size = (size_t)len;
+    }
+    if (pread(wal->fd, wal->scratch, (size_t)len, (off_t)(SDB_WAL_HEADER + offset)) != (ssize_t)len) return NULL;
+    return wal->scratch;
+}
+
+/**
+ * @brief Steps through the live records from head to the last valid one
+ * 
+ * A record is valid if its sequence number is the next one expected and its
+ * CRC matches, so a torn append or records left over from an earlier lap
+ * of the ring end the log. Afterwards tail, used and next_seq point past
+ * the last valid record.
+ * 
+ * @param wal The log
+ * @param apply Called for each record, may be NULL
+ * @param ctx Passed to apply
+ */
+static void wal_scan(SDBWal* wal,
+                     void (*apply)(void* ctx, uint64_t seq, uint32_t type, const char* table,
+                                   const char* key, const char* value),
+                     void* ctx) {
+    uint64_t offset = wal->head;
+    uint64_t seq = wal->head_seq;
+    uint64_t used = 0;
+    char* strings = NULL;
+    size_t strings_size = 0;
+
+    while (used < wal->ring_size) {
+        if (wal->ring_size - offset < SDB_WAL_FRAME) {
+            // Too little room left for a frame; the writer wrapped
+            used += wal->ring_size - offset;
+            offset = 0;
+            continue;
+        }
+
+        const unsigned char* frame = wal_frame(wal, offset, SDB_WAL_FRAME);
+        if (!frame) break;
+        uint32_t len = get_u32(frame);
+        uint32_t crc = get_u32(frame + 4);
+        uint32_t type = get_u32(frame + 16);
+        uint64_t content = (uint64_t)SDB_WAL_FRAME + get_u32(frame + 20) + get_u32(frame + 24) + get_u32(frame + 28);
+        if (get_u64(frame + 8) != seq || len < SDB_WAL_FRAME || len % 8 != 0 ||
+            len > wal->ring_size - offset || content > len || used + len > wal->ring_size) {
+            break;
+        }
+        frame = wal_frame(wal, offset, len);
+        if (!frame || sdb_crc32(0, frame + 8, (size_t)content - 8) != crc) break;
+
+        used += len;
+        if (type == SDB_WAL_WRAP) {
+            offset = 0;
+            continue;
+        }
+
+        if (apply) {
+            // Copy the strings out so they are NUL-terminated
+            uint32_t table_len = get_u32(frame + 20);
+            uint32_t key_len = get_u32(frame + 24);
+            uint32_t value_len = get_u32(frame + 28);
+            size_t need = (size_t)table_len + key_len + value_len + 3;
+            if (need > strings_size) {
+                char* grown = (char*)realloc(strings, need);
+                if (!grown) break;
+                strings = grown;
+                strings_size = need;
+            }
+            char* table = strings;
+            char* key = table + table_len + 1;
+            char* value = key + key_len + 1;
+            memcpy(table, frame + SDB_WAL_FRAME, table_len);
+            memcpy(key, frame + SDB_WAL_FRAME + table_len, key_len);
+            memcpy(value, frame + SDB_WAL_FRAME + table_len + key_len, value_len);
+            table[table_len] = key[key_len] = value[value_len] = '\0';
+            apply(ctx, seq, type, table, key, value);
+        }
+
+        seq++;
+        offset += len;
+        if (offset == wal->ring_size) offset = 0;
+    }
+
+    free(strings);
+    wal->tail = offset;
+    wal->used = used;
+    wal->next_seq = seq;
+}
+
+/**
+ * @brief Appends a record to the ring
+ * 
+ * The space is preallocated, so this is a memcpy into the mapping plus,
+ * with sync enabled and no syncer running, an msync of the pages written.
+ * A failed flush marks the log failed, and from then on nothing is appended,
+ * so that the caller saves a snapshot instead.
+ * 
+ * @return 0 on success, -1 if the ring has no room left for the record or
+ *         the log has failed
+ */
+static int wal_append(SDBWal* wal, uint32_t type, const char* table, const char* key, const char* value) {
+    uint32_t table_len = (uint32_t)strlen(table);
+    uint32_t key_len = key ? (uint32_t)strlen(key) : 0;
+    uint32_t value_len = value ? (uint32_t)strlen(value) : 0;
+    uint64_t content = (uint64_t)SDB_WAL_FRAME + table_len + key_len + value_len;
+    uint64_t len = (content + 7) & ~(uint64_t)7;
+    if (wal->failed) return -1;
+
+    // A record never straddles the end of the ring
+    uint64_t waste = wal->tail + len > wal->ring_size ? wal->ring_size - wal->tail : 0;
+    if (len > wal->ring_size || wal->used + waste + len > wal->ring_size) return -1;
+
+    if (waste >= SDB_WAL_FRAME) {
+        unsigned char wrap[SDB_WAL_FRAME] = {0};
+        put_u32(wrap, (uint32_t)waste);
+        put_u64(wrap + 8, wal->next_seq);
+        put_u32(wrap + 16, SDB_WAL_WRAP);
+        put_u32(wrap + 4, sdb_crc32(0, wrap + 8, SDB_WAL_FRAME - 8));
+        if (wal->map) {
+            memcpy(wal->map + SDB_WAL_HEADER + wal->tail, wrap, SDB_WAL_FRAME);
+        } else if (pwrite(wal->fd, wrap, SDB_WAL_FRAME, (off_t)(SDB_WAL_HEADER + wal->tail)) != SDB_WAL_FRAME) {
+            return -1;
+        }
+        if (wal->sync && !wal->syncer && wal_flush(wal, wal->tail, SDB_WAL_FRAME) != 0) {
+            wal->failed = 1;
+            return -1;
+        }
+    }
+    if (waste > 0) {
+        wal->used += waste;
+        wal->written += waste;
+        wal->tail = 0;
+    }
+
+    unsigned char* frame;
+    if (wal->map) {
+        frame = wal->map + SDB_WAL_HEADER + wal->tail;
+    } else {
+        if (len > wal->scratch_size) {
+            unsigned char* grown = (unsigned char*)realloc(wal->scratch, (size_t)len);
+            if (!grown) return -1;
+            wal->scratch = grown;
+            wal->scratch_size = (size_t)len;
+        }
+        frame = wal->scratch;
+    }
+
+    put_u32(frame, (uint32_t)len);
+    put_u64(frame + 8, wal->next_seq);
+    put_u32(frame + 16, type);
+    put_u32(frame + 20, table_len);
+    put_u32(frame + 24, key_len);
+    put_u32(frame + 28, value_len);
+    memcpy(frame + SDB_WAL_FRAME, table, table_len);
+    if (key_len) memcpy(frame + SDB_WAL_FRAME + table_len, key, key_len);
+    if (value_len) memcpy(frame + SDB_WAL_FRAME + table_len + key_len, value, value_len);
+    memset(frame + content, 0, (size_t)(len - content));
+    put_u32(frame + 4, sdb_crc32(0, frame + 8, (size_t)content - 8));
+
+    if (!wal->map && pwrite(wal->fd, frame, (size_t)len, (off_t)(SDB_WAL_HEADER + wal->tail)) != (ssize_t)len) {
+        return -1;
+    }
+    if (wal->sync && !wal->syncer && wal_flush(wal, wal->tail, len) != 0) {
+        wal->failed = 1;
+        return -1;
+    }
+
+    wal->tail += len;
+    if (wal->tail == wal->ring_size) wal->tail = 0;
+    wal->used += len;
+    wal->written += len;
+    wal->next_seq++;
+    wal->appends++;
+    return 0;
+}
+
+/**
+ * @brief Flushes the last bytes appended to the ring, which may wrap
+ * 
+ * @param wal The log
+ * @param tail Ring offset the bytes end at
+ * @param len Number of bytes
+ * @return 0 on success, -1 if a flush failed
+ */
+static int wal_flush_back(SDBWal* wal, uint64_t tail, uint64_t len) {
+    if (!wal->map || len >= wal->ring_size) return wal_flush(wal, 0, wal->ring_size);
+    if (len <= tail) return wal_flush(wal, tail - len, len);
+    if (wal_flush(wal, wal->ring_size - (len - tail), len - tail) != 0) return -1;
+    return tail > 0 ? wal_flush(wal, 0, tail) : 0;
+}
+
+/*
+ * With wal_sync, records are flushed by a sync thread rather than by each
+ * writer. A writer appends its record under the database lock and then
+ * waits, with the lock released, until the syncer reports it on disk.
+ * While one flush is in flight the next writers append behind it, and the
+ * following flush covers all of them, so commits are not limited to one
+ * flush each. If a flush fails, the records it covered are not reported
+ * synced; the log is marked failed and the waiting writers save a snapshot.
+ */
+static void* wal_sync_worker(void* arg) {
+    SDB* sdb = (SDB*)arg;
+    SDBWal* wal = sdb->wal;
+    SDBSyncer* syncer = wal->syncer;
+
+    database_lock(sdb);
+    for (;;) {
+        uint64_t seq = wal->next_seq - 1;
+        if (seq <= syncer->synced_seq || wal->failed) {
+            if (syncer->stop) break;  // Nothing left to flush
+            pthread_cond_wait(&syncer->wake, &sdb->lock);
+            continue;
+        }
+
+        // Records appended during the flush go with the next one
+        uint64_t tail = wal->tail;
+        uint64_t written = wal->written;
+        pthread_mutex_unlock(&sdb->lock);
+        int result = wal_flush_back(wal, tail, written - syncer->synced_bytes);
+        database_lock(sdb);
+
+        if (result == 0) {
+            syncer->synced_seq = seq;
+            syncer->synced_bytes = written;
+            wal->syncs++;
+        } else {
+            wal->failed = 1;
+        }
+        pthread_cond_broadcast(&syncer->synced);
+    }
+    pthread_mutex_unlock(&sdb->lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts flushing the log from a sync thread
+ * 
+ * Without the thread, records are flushed by wal_append() instead.
+ * 
+ * @param sdb The database, with its log replayed
+ */
+static void wal_sync_start(SDB* sdb) {
+    SDBWal* wal = sdb->wal;
+    SDBSyncer* syncer = (SDBSyncer*)calloc(1, sizeof(SDBSyncer));
+    if (!syncer) return;
+    syncer->synced_seq = wal->next_seq - 1;
+    syncer->synced_bytes = wal->written;
+    pthread_cond_init(&syncer->wake, NULL);
+    pthread_cond_init(&syncer->synced, NULL);
+
+    wal->syncer = syncer;
+    if (pthread_create(&syncer->thread, NULL, wal_sync_worker, sdb) != 0) {
+        pthread_cond_destroy(&syncer->wake);
+        pthread_cond_destroy(&syncer->synced);
+        free(syncer);
+        wal->syncer = NULL;
+    }
+}
+
+/**
+ * @brief Stops the sync thread once every record is flushed
+ * 
+ * @param sdb The database, not locked
+ */
+static void wal_sync_stop(SDB* sdb) {
+    SDBSyncer* syncer = sdb->wal ? sdb->wal->syncer : NULL;
+    if (!syncer) return;
+
+    database_lock(sdb);
+    syncer->stop = 1;
+    pthread_cond_signal(&syncer->wake);
+    pthread_mutex_unlock(&sdb->lock);
+    pthread_join(syncer->thread, NULL);
+
+    pthread_cond_destroy(&syncer->wake);
+    pthread_cond_destroy(&syncer->synced);
+    free(syncer);
+    sdb->wal->syncer = NULL;
+}
+
+/**
+ * @brief Waits until the records appended so far are durable
+ * 
+ * A record is durable once the syncer has flushed it or a snapshot
+ * contains it. If the log fails first, a snapshot is saved instead.
+ * 
+ * @param sdb The database, locked; the lock is released while waiting
+ */
+static void wal_wait_synced(SDB* sdb) {
+    SDBWal* wal = sdb->wal;
+    if (!wal || !wal->syncer) return;
+    SDBSyncer* syncer = wal->syncer;
+
+    uint64_t seq = wal->next_seq - 1;
+    if (seq > syncer->synced_seq) pthread_cond_signal(&syncer->wake);
+    while (seq > syncer->synced_seq && seq > sdb->log_seq && !syncer->stop && !wal->failed) {
+        pthread_cond_wait(&syncer->synced, &sdb->lock);
+    }
+    if (wal->failed && seq > syncer->synced_seq && seq > sdb->log_seq) checkpoint_run(sdb);
+}
+
+/**
+ * @brief Recycles the part of the ring a snapshot covers
+ * 
+ * Records appended after the snapshot was taken stay live.
+ * 
+ * @param wal The log
+ * @param offset Ring offset the snapshot reaches to
+ * @param seq Sequence number of the first record not in the snapshot
+ * @param covered Bytes from head to offset
+ */
+static void wal_checkpoint(SDBWal* wal, uint64_t offset, uint64_t seq, uint64_t covered) {
+    wal->head = offset;
+    wal->head_seq = seq;
+    wal->used -= covered;
+    wal->checkpoints++;
+    wal_write_header(wal);
+}
+
+/*******************************************************************************
+ * Checkpoint Functions
+ ******************************************************************************/
+/*
+ * A checkpoint folds the log into a new snapshot. It runs in three steps:
+ * the tables are copied while the database is locked, the copy is written
+ * and synced with the lock released, and the lock is taken again to
+ * recycle the part of the ring the snapshot covers. Writers therefore only
+ * wait for the copy, never for compression or disk I/O.
+ * 
+ * Checkpoints are scheduled by a background thread. It starts one when the
+ * log outgrows the size that can be replayed within the recovery target,
+ * when the log reaches checkpoint_log_size, or when checkpoint_interval has
+ * passed since the last one. The caller of a write only takes part when the
+ * ring is completely full, and then it waits instead of checkpointing.
+ */
+static SDBSnapshotPart* snapshot_part_add(SDBSnapshot* snap, int kind, uint32_t table) {
+    if (snap->part_count == snap->part_capacity) {
+        size_t capacity = snap->part_capacity ? snap->part_capacity * 2 : 64;
+        SDBSnapshotPart* parts = (SDBSnapshotPart*)realloc(snap->parts, sizeof(SDBSnapshotPart) * capacity);
+        if (!parts) {
+            snap->failed = 1;
+            return NULL;
+        }
+        snap->parts = parts;
+        snap->part_capacity = capacity;
+    }
+    SDBSnapshotPart* part = &snap->parts[snap->part_count++];
+    memset(part, 0, sizeof(SDBSnapshotPart));
+    part->kind = kind;
+    part->table = table;
+    return part;
+}
+
+static void snapshot_free(SDBSnapshot* snap) {
+    for (int i = 0; snap->names && i < snap->table_count; i++) {
+        free(snap->names[i]);
+    }
+    for (size_t i = 0; i < snap->part_count; i++) {
+        free(snap->parts[i].raw);
+        free(snap->parts[i].first_key);
+    }
+    if (snap->block_fd >= 0) close(snap->block_fd);
+    if (snap->cold_fd >= 0) close(snap->cold_fd);
+    free(snap->names);
+    free(snap->frozen);
+    free(snap->parts);
+    free(snap->path);
+}
+
+/**
+ * @brief Copies one resident entry into the snapshot
+ * 
+ * Entries are grouped into pieces about the size of a block.
+ * 
+ * @param snap The snapshot
+ * @param part The piece the previous entry went to, or NULL
+ * @param table Index of the entry's table
+ * @return The piece the entry went to, or NULL if memory ran out
+ */
+static SDBSnapshotPart* snapshot_add_entry(SDBSnapshot* snap, SDBSnapshotPart* part, uint32_t table,
+                                           const char* key, uint32_t key_len, const char* value,
+                                           uint32_t value_len) {
+    if (!part || part->raw_len >= SDB_BLOCK_SIZE) {
+        part = snapshot_part_add(snap, SDB_PART_ENTRIES, table);
+        if (!part) return NULL;
+        part->raw_size = SDB_BLOCK_SIZE + 1024;
+        part->raw = (unsigned char*)malloc(part->raw_size);
+        if (!part->raw) {
+            snap->failed = 1;
+            return NULL;
+        }
+    }
+    int lengths[2] = { (int)key_len, (int)value_len };
+    write_to_buffer(&part->raw, &part->raw_size, &part->raw_len, &lengths[0], sizeof(int));
+    write_to_buffer(&part->raw, &part->raw_size, &part->raw_len, &lengths[1], sizeof(int));
+    write_to_buffer(&part->raw, &part->raw_size, &part->raw_len, key, key_len);
+    write_to_buffer(&part->raw, &part->raw_size, &part->raw_len, value, value_len);
+    return part;
+}
+
+/**
+ * @brief Copies what the next snapshot must contain
+ * 
+ * Resident values are copied in block format. Demoted values and tables
+ * that were never loaded are only referenced: the cold segment is append
+ * only and block files are never modified, so duplicated descriptors keep
+ * the referenced bytes readable until the snapshot is written.
+ * 
+ * @param sdb The database, locked
+ * @param snap Filled with the copy; release it with snapshot_free()
+ * @return 0 on success, -1 if memory ran out
+ */
+static int snapshot_capture(SDB* sdb, SDBSnapshot* snap) {
+    memset(snap, 0, sizeof(SDBSnapshot));
+    snap->block_fd = -1;
+    snap->cold_fd = -1;
+    snap->path = strdup(sdb->path);
+    snap->compress_type = sdb->compress_type;
+    snap->names = (char**)calloc(sdb->table_count ? sdb->table_count : 1, sizeof(char*));
+    snap->frozen = (unsigned char*)calloc(sdb->table_count ? sdb->table_count : 1, 1);
+    if (!snap->path || !snap->names || !snap->frozen) return -1;
+    if (sdb->block_fd >= 0) snap->block_fd = dup(sdb->block_fd);
+    if (sdb->cold_fd >= 0) snap->cold_fd = dup(sdb->cold_fd);
+
+    // Writers to ordered tables log under the lock but insert after it
+    while (sdb->ordered && __atomic_load_n(&sdb->ordered->pending, __ATOMIC_ACQUIRE) != 0) sched_yield();
+
+    for (int i = 0; i < sdb->table_count && !snap->failed; i++) {
+        SDBTable* table = &sdb->tables[i];
+        snap->names[i] = strdup(table->name);
+        snap->frozen[i] = (unsigned char)table->frozen;
+        snap->table_count = i + 1;
+        if (!snap->names[i]) snap->failed = 1;
+
+        if (table->lazy_index >= 0) {
+            // Sorted tables stay sorted, so their blocks keep their first keys
+            int sorted = table->lazy_index < sdb->sorted_run_count &&
+                         sdb->sorted_runs[table->lazy_index].count > 0;
+            for (uint32_t b = 0; b < sdb->block_count && !snap->failed; b++) {
+                if (sdb->blocks[b].table != (uint32_t)table->lazy_index) continue;
+                SDBSnapshotPart* part = snapshot_part_add(snap, SDB_PART_BLOCK, (uint32_t)i);
+                if (!part) break;
+                part->block = sdb->blocks[b];
+                part->verify = !sdb->block_verified[b];
+                if (sorted && sdb->block_keys[b]) {  // Not the key index
+                    part->first_key = strdup(sdb->block_keys[b]);
+                    if (!part->first_key) snap->failed = 1;
+                }
+            }
+            continue;
+        }
+
+        SDBSnapshotPart* part = NULL;
+        if (table->ordered) {
+            SDBSkipNode* node = __atomic_load_n(&table->ordered->head->next[0], __ATOMIC_ACQUIRE);
+            for (; node && !snap->failed; node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE)) {
+                SDBSkipValue* value = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+                part = snapshot_add_entry(snap, part, (uint32_t)i, node->key, node->key_len,
+                                          skip_value_data(value), (uint32_t)value->len);
+            }
+            continue;
+        }
+        for (SDBEntry* e = table->entries->head; e != NULL && !snap->failed; e = e->next) {
+            int key_len = (int)strlen(e->key);
+            if (!e->value) {
+                SDBSnapshotPart* cold = snapshot_part_add(snap, SDB_PART_COLD, (uint32_t)i);
+                if (!cold) break;
+                cold->raw = (unsigned char*)malloc(key_len ? key_len : 1);
+                if (!cold->raw) snap->failed = 1;
+                else memcpy(cold->raw, e->key, key_len);
+                cold->raw_len = key_len;
+                cold->value_len = e->value_len;
+                cold->cold_len = e->cold_len;
+                cold->cold_offset = e->cold_offset;
+                part = NULL;
+                continue;
+            }
+
+            part = snapshot_add_entry(snap, part, (uint32_t)i, e->key, (uint32_t)key_len, e->value, e->value_len);
+        }
+    }
+
+    if (sdb->wal) {
+        snap->log_seq = sdb->wal->next_seq - 1;
+        snap->wal_tail = sdb->wal->tail;
+        snap->wal_used = sdb->wal->used;
+    } else {
+        snap->log_seq = sdb->log_seq;
+    }
+    return snap->failed ? -1 : 0;
+}
+
+typedef struct {
+    const char* key;
+    const char* value;      // NULL for a demoted value
+    uint32_t key_len;
+    uint32_t value_len;
+    const SDBSnapshotPart* part;
+} SDBSortedEntry;
+
+static int sorted_entry_compare(const void* a, const void* b) {
+    const SDBSortedEntry* x = (const SDBSortedEntry*)a;
+    const SDBSortedEntry* y = (const SDBSortedEntry*)b;
+    return key_compare(x->key, x->key_len, y->key, y->key_len);
+}
+
+/**
+ * @brief Writes the copied entries of one table in key order
+ * 
+ * @param snap The snapshot
+ * @param writer The writer
+ * @param first First part of the table
+ * @param end Part after its last one
+ */
+static void snapshot_write_sorted(SDBSnapshot* snap, SDBBlockWriter* writer, size_t first, size_t end) {
+    size_t count = 0;
+    for (size_t i = first; i < end; i++) {
+        const SDBSnapshotPart* part = &snap->parts[i];
+        if (part->kind == SDB_PART_COLD) {
+            count++;
+            continue;
+        }
+        size_t pos = 0;
+        const char *key, *value;
+        uint32_t key_len, value_len;
+        while ((pos = block_next_entry(part->raw, part->raw_len, pos, &key, &key_len, &value, &value_len)) != 0) {
+            count++;
+        }
+    }
+
+    SDBSortedEntry* entries = (SDBSortedEntry*)malloc(sizeof(SDBSortedEntry) * (count ? count : 1));
+    if (!entries) {
+        writer->failed = 1;
+        return;
+    }
+    size_t n = 0;
+    for (size_t i = first; i < end; i++) {
+        const SDBSnapshotPart* part = &snap->parts[i];
+        if (part->kind == SDB_PART_COLD) {
+            SDBSortedEntry* e = &entries[n++];
+            e->key = (const char*)part->raw;
+            e->key_len = (uint32_t)part->raw_len;
+            e->value = NULL;
+            e->value_len = 0;
+            e->part = part;
+            continue;
+        }
+        size_t pos = 0;
+        const char *key, *value;
+        uint32_t key_len, value_len;
+        while ((pos = block_next_entry(part->raw, part->raw_len, pos, &key, &key_len, &value, &value_len)) != 0) {
+            SDBSortedEntry* e = &entries[n++];
+            e->key = key;
+            e->key_len = key_len;
+            e->value = value;
+            e->value_len = value_len;
+            e->part = part;
+        }
+    }
+    qsort(entries, n, sizeof(SDBSortedEntry), sorted_entry_compare);
+
+    // Frozen tables get their key index, built from the same sorted keys
+    uint32_t table = snap->parts[first].table;
+    SDBKeyIndexBuilder builder;
+    if (snap->frozen[table]) key_index_init(&builder);
+
+    block_writer_sort(writer, 1);
+    for (size_t i = 0; i < n && !writer->failed; i++) {
+        const SDBSortedEntry* e = &entries[i];
+        if (snap->frozen[table]) key_index_add(&builder, e->key, e->key_len);
+        if (e->value) {
+            block_writer_add(writer, e->part->table, e->key, e->key_len, e->value, e->value_len);
+            continue;
+        }
+
+        // Demoted values are read back without promoting them
+        const SDBSnapshotPart* part = e->part;
+        char* value = tier_read_record(snap->cold_fd, part->cold_offset, part->cold_len, part->value_len);
+        block_writer_add(writer, part->table, e->key, e->key_len, value ? value : "", value ? part->value_len : 0);
+        free(value);
+    }
+    block_writer_sort(writer, 0);
+    free(entries);
+
+    if (snap->frozen[table]) {
+        size_t len = 0;
+        unsigned char* index = key_index_finish(&builder, &len);
+        if (index && n > 0) block_writer_index(writer, table, index, len);
+        free(index);
+    }
+}
+
+/**
+ * @brief Copies the stored blocks of an unloaded table
+ * 
+ * A table frozen since it was loaded last has no key index yet. It is
+ * built from the keys of the blocks, which are sorted already.
+ * 
+ * @param snap The snapshot
+ * @param writer The writer
+ * @param first First block of the table
+ * @param end Part after its last block
+ */
+static void snapshot_write_blocks(SDBSnapshot* snap, SDBBlockWriter* writer, size_t first, size_t end) {
+    uint32_t table = snap->parts[first].table;
+    int build = snap->frozen[table];
+    for (size_t i = first; i < end; i++) {
+        if (snap->parts[i].block.entry_count == 0 || !snap->parts[i].first_key) build = 0;
+    }
+    SDBKeyIndexBuilder builder;
+    if (build) key_index_init(&builder);
+
+    for (size_t i = first; i < end && !writer->failed; i++) {
+        SDBSnapshotPart* part = &snap->parts[i];
+        if (part->block.entry_count == 0 && !snap->frozen[table]) continue;  // Index of a thawed table
+
+        SDB_FADVISE(snap->block_fd, part->block.offset, SDB_BLOCK_HEADER + (uint64_t)part->block.comp_len, WILLNEED);
+        if (build) {
+            SDBBlockInfo stored;
+            unsigned char* raw = block_read(snap->block_fd, part->block.offset, &stored, part->verify);
+            size_t pos = 0;
+            for (uint32_t j = 0; raw && j < stored.entry_count; j++) {
+                const char *key, *value;
+                uint32_t key_len, value_len;
+                pos = block_next_entry(raw, stored.raw_len, pos, &key, &key_len, &value, &value_len);
+                if (pos == 0) break;
+                key_index_add(&builder, key, key_len);
+            }
+            free(raw);
+        }
+        if (block_writer_copy(writer, snap->block_fd, &part->block, part->table, part->first_key,
+                              part->verify) != 0 && !writer->failed) {
+            snap->corrupt_blocks++;
+        }
+        SDB_FADVISE(snap->block_fd, part->block.offset, SDB_BLOCK_HEADER + (uint64_t)part->block.comp_len, DONTNEED);
+    }
+
+    // A damaged block leaves the index without its keys; the table then stays unindexed
+    if (build) {
+        size_t len = 0;
+        unsigned char* index = key_index_finish(&builder, &len);
+        if (index && snap->corrupt_blocks == 0) block_writer_index(writer, table, index, len);
+        free(index);
+    }
+}
+
+/**
+ * @brief Writes a captured snapshot and renames it over the database file
+ * 
+ * Touches nothing but the snapshot, so it runs without the database lock.
+ * 
+ * @param snap The snapshot
+ * @return 0 on success, -1 on failure
+ */
+static int snapshot_write(SDBSnapshot* snap) {
+    // Write to a temporary file and rename it over the old snapshot, so the
+    // file at the database path is always a complete snapshot
+    size_t path_len = strlen(snap->path) + sizeof(".tmp");
+    char* tmp_path = (char*)malloc(path_len);
+    if (tmp_path) snprintf(tmp_path, path_len, "%s.tmp", snap->path);
+    FILE* file = tmp_path ? fopen(tmp_path, "wb") : NULL;
+    if (file == NULL) {
+        free(tmp_path);
+        return -1;
+    }
+
+    // Entries are written block by block, so only one block is buffered
+    SDBBlockWriter writer;
+    block_writer_init(&writer, file, snap->compress_type, SDB_SORTED_BLOCK_SIZE);
+    for (size_t i = 0; i < snap->part_count && !writer.failed; i++) {
+        SDBSnapshotPart* part = &snap->parts[i];
+        if (part->kind != SDB_PART_BLOCK) {
+            // The parts of a loaded table are adjacent and are sorted together
+            size_t end = i + 1;
+            while (end < snap->part_count && snap->parts[end].table == part->table &&
+                   snap->parts[end].kind != SDB_PART_BLOCK) {
+                end++;
+            }
+            snapshot_write_sorted(snap, &writer, i, end);
+            i = end - 1;
+            continue;
+        }
+
+        // Tables that were never loaded are copied block by block
+        size_t end = i + 1;
+        while (end < snap->part_count && snap->parts[end].table == part->table &&
+               snap->parts[end].kind == SDB_PART_BLOCK) {
+            end++;
+        }
+        snapshot_write_blocks(snap, &writer, i, end);
+        i = end - 1;
+    }
+    writer.log_seq = snap->log_seq;
+    int written = block_writer_finish(&writer, snap->names, snap->table_count) == 0;
+
+    int ok = written && fflush(file) == 0 && !ferror(file) && fsync(fileno(file)) == 0;
+    if (ok) snap->bytes = (uint64_t)ftell(file);
+
+    // The pages are clean after fsync; drop them instead of letting a full
+    // copy of the database push the application's data out of the cache
+    if (ok) SDB_FADVISE(fileno(file), 0, 0, DONTNEED);
+    if (fclose(file) != 0) ok = 0;
+    if (!ok || rename(tmp_path, snap->path) != 0) {
+        unlink(tmp_path);
+        free(tmp_path);
+        return -1;
+    }
+    free(tmp_path);
+
+    // The log is only recycled once the rename itself is durable
+    return sync_parent_dir(snap->path);
+}
+
+/**
+ * @brief Switches the database over to a snapshot that is now on disk
+ * 
+ * Recycles the log up to the position the snapshot covers; records
+ * appended while it was written stay. Tables that are still unloaded are
+ * read from the new file from now on.
+ * 
+ * @param sdb The database, locked
+ * @param snap The written snapshot
+ */
+static void snapshot_install(SDB* sdb, const SDBSnapshot* snap) {
+    sdb->corrupt_blocks += snap->corrupt_blocks;
+    sdb->log_seq = snap->log_seq;
+    if (sdb->wal) wal_checkpoint(sdb->wal, snap->wal_tail, snap->log_seq + 1, snap->wal_used);
+
+    int lazy_tables = 0;
+    for (int i = 0; i < sdb->table_count; i++) {
+        if (sdb->tables[i].lazy_index >= 0 || sdb->tables[i].frozen) lazy_tables++;
+    }
+    if (lazy_tables == 0) {
+        block_source_close(sdb);
+        return;
+    }
+
+    // Unloaded tables now live in the new file, under their new indices
+    int fd = open(sdb->path, O_RDONLY);
+    SDBFileInfo info = {0};
+    SDBBlockInfo* blocks = NULL;
+    uint32_t block_count = 0;
+    unsigned char* verified = NULL;
+    if (fd >= 0 && footer_read(fd, 3, &info, &blocks, &block_count, NULL) == 0 &&
+        (verified = (unsigned char*)calloc(block_count ? block_count : 1, 1)) != NULL) {
+        block_source_close(sdb);
+        sdb->block_fd = fd;
+        sdb->blocks = blocks;
+        sdb->block_verified = verified;
+        sdb->block_count = block_count;
+        block_source_index(sdb, fd, info.block_keys, info.table_count);
+        info.block_keys = NULL;
+
+        // A table unloaded now was unloaded when the snapshot was taken.
+        // Frozen tables not written since are dropped from memory; their
+        // lookups go through the key index from now on.
+        for (int i = 0; i < sdb->table_count; i++) {
+            SDBTable* table = &sdb->tables[i];
+            if (table->lazy_index < 0 && !table->frozen) continue;
+            for (int j = 0; j < snap->table_count; j++) {
+                if (strcmp(snap->names[j], table->name) != 0) continue;
+                if (table->lazy_index >= 0) {
+                    table->lazy_index = j;
+                } else if (snap->frozen[j] && j < sdb->sorted_run_count &&
+                           sdb->sorted_runs[j].count > 0 && sdb->sorted_runs[j].index_block != SDB_NO_KEY) {
+                    table_unload(sdb, table, j);
+                }
+                break;
+            }
+            const SDBSortedRun* run = table_sorted_run(sdb, table);
+            if (table->lazy_index >= 0) table->frozen = run && run->index_block != SDB_NO_KEY;
+        }
+    } else {
+        free(blocks);
+        if (fd >= 0) close(fd);
+    }
+    sdb_free_file_info(info);
+}
+
+/**
+ * @brief Writes a snapshot of the database and recycles the log
+ * 
+ * The lock is released while the snapshot is written, so other threads
+ * keep reading and writing. Only one checkpoint runs at a time.
+ * 
+ * @param sdb The database, locked; still locked on return
+ * @return 0 on success, -1 on failure
+ */
+static int checkpoint_run(SDB* sdb) {
+    // A busy checkpointer starts the next checkpoint before waiters get the
+    // lock back. The second one to finish was captured after this call
+    // began, so it covers the call.
+    size_t arrived = sdb->checkpoint_stats.checkpoints;
+    while (sdb->checkpointing) {
+        pthread_cond_wait(&sdb->checkpoint_done, &sdb->lock);
+        if (sdb->checkpoint_stats.checkpoints >= arrived + 2) return 0;
+    }
+
+    uint64_t start = clock_us();
+    SDBSnapshot snap;
+    int ok = snapshot_capture(sdb, &snap) == 0;
+    uint64_t pause = clock_us() - start;
+
+    if (ok) {
+        sdb->checkpointing = 1;
+        pthread_mutex_unlock(&sdb->lock);
+        ok = snapshot_write(&snap) == 0;
+        database_lock(sdb);
+        sdb->checkpointing = 0;
+    }
+    if (ok) {
+        uint64_t installed = clock_us();
+        snapshot_install(sdb, &snap);
+        pause += clock_us() - installed;
+        sdb->write_stats.snapshot_bytes += snap.bytes;
+    }
+    snapshot_free(&snap);
+
+    SDBCheckpointStats* stats = &sdb->checkpoint_stats;
+    if (ok) {
+        stats->checkpoints++;
+        stats->last_duration_ms = (clock_us() - start) / 1000;
+        stats->last_pause_us = pause;
+    } else {
+        stats->failures++;
+    }
+    if (sdb->checkpointer) sdb->checkpointer->last_ms = clock_us() / 1000;
+    if (sdb->ordered) ordered_reclaim(sdb->ordered);
+    pthread_cond_broadcast(&sdb->checkpoint_done);
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Waits until the checkpointer has finished its next checkpoint
+ * 
+ * @param sdb The database, locked
+ * @return 0 if the checkpoint succeeded, -1 if it failed or the
+ *         checkpointer is stopping
+ */
+static int checkpoint_wait(SDB* sdb) {
+    SDBCheckpointer* cp = sdb->checkpointer;
+    SDBCheckpointStats* stats = &sdb->checkpoint_stats;
+    size_t checkpoints = stats->checkpoints;
+    size_t failures = stats->failures;
+
+    cp->requested = 1;
+    pthread_cond_signal(&cp->wake);
+    while (!cp->stop && stats->checkpoints == checkpoints && stats->failures == failures) {
+        pthread_cond_wait(&sdb->checkpoint_done, &sdb->lock);
+    }
+    return stats->checkpoints != checkpoints ? 0 : -1;
+}
+
+static void* checkpoint_worker(void* arg) {
+    SDB* sdb = (SDB*)arg;
+    SDBCheckpointer* cp = sdb->checkpointer;
+
+    database_lock(sdb);
+    cp->last_ms = clock_us() / 1000;
+    while (!cp->stop) {
+        uint64_t now = clock_us() / 1000;
+        uint64_t interval = (uint64_t)cp->interval * 1000;
+        uint64_t used = sdb->wal->used;
+        int due = cp->requested || used >= cp->trigger_bytes ||
+                  (interval > 0 && used > 0 && now - cp->last_ms >= interval);
+
+        // Sleep until the interval is up or a writer asks for a checkpoint;
+        // after a failure, wait a second before trying again
+        uint64_t wait_ms = 0;
+        if (!due) {
+            wait_ms = interval > 0 && now - cp->last_ms < interval ? interval - (now - cp->last_ms) : 3600 * 1000;
+        } else {
+            cp->requested = 0;
+            if (checkpoint_run(sdb) != 0) wait_ms = 1000;
+        }
+        if (wait_ms == 0 || cp->stop) continue;
+
+        struct timespec deadline;
+        clock_now(&deadline);
+        deadline.tv_sec += (time_t)(wait_ms / 1000);
+        deadline.tv_nsec += (long)(wait_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        pthread_cond_timedwait(&cp->wake, &sdb->lock, &deadline);
+    }
+    pthread_mutex_unlock(&sdb->lock);
+    return NULL;
+}
+
+/**
+ * @brief Starts the background checkpointer of a database with a log
+ * 
+ * The size trigger is the smaller of checkpoint_log_size and the log that
+ * can be replayed within recovery_target_ms at the measured replay rate.
+ * 
+ * @param sdb The database
+ * @param opts The open options
+ */
+static void checkpoint_start(SDB* sdb, const SDBOptions* opts) {
+    SDBCheckpointer* cp = (SDBCheckpointer*)calloc(1, sizeof(SDBCheckpointer));
+    if (!cp) return;
+
+    uint64_t ring = sdb->wal->ring_size;
+    cp->trigger_bytes = opts->checkpoint_log_size ? opts->checkpoint_log_size : ring / 2;
+    if (opts->recovery_target_ms > 0) {
+        uint64_t budget = sdb->checkpoint_stats.replay_rate * opts->recovery_target_ms / 1000;
+        if (budget < cp->trigger_bytes) cp->trigger_bytes = budget;
+    }
+    if (cp->trigger_bytes > ring) cp->trigger_bytes = ring;
+    if (cp->trigger_bytes < POOL_BLOCK_SIZE) cp->trigger_bytes = POOL_BLOCK_SIZE;
+
+    // Writers are only held back once a checkpoint is already due
+    cp->hard_limit = opts->log_hard_limit && opts->log_hard_limit < ring ? opts->log_hard_limit : ring;
+    cp->soft_limit = opts->log_soft_limit ? opts->log_soft_limit : ring / 4 * 3;
+    if (cp->soft_limit > cp->hard_limit) cp->soft_limit = cp->hard_limit;
+    if (cp->trigger_bytes > cp->soft_limit) cp->trigger_bytes = cp->soft_limit;
+    cp->max_delay_us = opts->max_write_delay_us;
+    cp->interval = opts->checkpoint_interval;
+    pthread_cond_init(&cp->wake, NULL);
+
+    sdb->checkpointer = cp;
+    if (pthread_create(&cp->thread, NULL, checkpoint_worker, sdb) != 0) {
+        pthread_cond_destroy(&cp->wake);
+        free(cp);
+        sdb->checkpointer = NULL;
+    }
+}
+
+/**
+ * @brief Stops the checkpointer and waits for it to exit
+ * 
+ * A checkpoint in progress is finished first.
+ * 
+ * @param sdb The database, not locked
+ */
+static void checkpoint_stop(SDB* sdb) {
+    SDBCheckpointer* cp = sdb->checkpointer;
+    if (!cp) return;
+
+    database_lock(sdb);
+    cp->stop = 1;
+    pthread_cond_signal(&cp->wake);
+    pthread_cond_broadcast(&sdb->checkpoint_done);
+    pthread_mutex_unlock(&sdb->lock);
+    pthread_join(cp->thread, NULL);
+
+    pthread_cond_destroy(&cp->wake);
+    free(cp);
+    sdb->checkpointer = NULL;
+}
+
+/**
+ * @brief Holds a writer back while the checkpointer falls behind
+ * 
+ * Past the soft limit each write is delayed in proportion to how close the
+ * log is to the hard limit, so writers slow down gradually instead of
+ * running into a full ring. The delay ends early when a checkpoint
+ * finishes. At the hard limit writers stop until a checkpoint has brought
+ * the log back under it.
+ * 
+ * @param sdb The database, locked; the lock is released while waiting
+ */
+static void wal_throttle(SDB* sdb) {
+    SDBWal* wal = sdb->wal;
+    SDBCheckpointer* cp = sdb->checkpointer;
+    if (!cp || wal->used < cp->soft_limit) return;
+
+    SDBCheckpointStats* stats = &sdb->checkpoint_stats;
+    uint64_t start = clock_us();
+    if (wal->used >= cp->hard_limit) {
+        stats->write_waits++;
+        while (wal->used >= cp->hard_limit && checkpoint_wait(sdb) == 0) {
+        }
+    } else if (cp->max_delay_us > 0) {
+        stats->write_delays++;
+        if (!cp->requested) {
+            cp->requested = 1;
+            pthread_cond_signal(&cp->wake);
+        }
+
+        uint64_t delay = (uint64_t)cp->max_delay_us * (wal->used - cp->soft_limit) /
+                         (cp->hard_limit - cp->soft_limit);
+        size_t checkpoints = stats->checkpoints;
+        struct timespec deadline;
+        clock_now(&deadline);
+        deadline.tv_sec += (time_t)(delay / 1000000);
+        deadline.tv_nsec += (long)(delay % 1000000) * 1000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        while (stats->checkpoints == checkpoints && !cp->stop &&
+               pthread_cond_timedwait(&sdb->checkpoint_done, &sdb->lock, &deadline) != ETIMEDOUT) {
+        }
+    }
+    stats->stall_us += clock_us() - start;
+}
+
+/**
+ * @brief Wakes the checkpointer once the log has reached its trigger size
+ * 
+ * @param sdb The database, locked
+ */
+static void wal_request_checkpoint(SDB* sdb) {
+    SDBCheckpointer* cp = sdb->checkpointer;
+    if (cp && !cp->requested && sdb->wal->used >= cp->trigger_bytes) {
+        cp->requested = 1;
+        pthread_cond_signal(&cp->wake);
+    }
+}
+
+/**
+ * @brief Makes a change durable
+ * 
+ * The change is appended to the log, and the checkpointer is woken once
+ * the log has reached its trigger size. Past the soft limit the writer is
+ * throttled, and when the ring is full it waits for the checkpointer to
+ * recycle it. The caller only saves a snapshot itself when there is no log
+ * or no checkpointer, when the log has failed, or when a checkpoint could
+ * not make room.
+ * 
+ * @param sdb The database, locked
+ * @param type SDB_WAL_SET, SDB_WAL_CREATE or SDB_WAL_DESTROY
+ */
+static void wal_commit(SDB* sdb, uint32_t type, const char* table, const char* key, const char* value) {
+    SDBWal* wal = sdb->wal;
+    if (wal && wal->replaying) return;
+
+    char* held = NULL;
+    while (wal) {
+        if (wal_append(wal, type, table, key, value) == 0) {
+            free(held);
+            wal_request_checkpoint(sdb);
+            wal_throttle(sdb);
+            return;
+        }
+
+        // An empty ring that still has no room means the record is too big
+        if (!sdb->checkpointer || wal->used == 0 || wal->failed) break;
+
+        // A stored value may be replaced or moved while the lock is released
+        if (value && !held) {
+            held = strdup(value);
+            if (!held) break;
+            value = held;
+        }
+        uint64_t start = clock_us();
+        sdb->checkpoint_stats.write_waits++;
+        int waited = checkpoint_wait(sdb);
+        sdb->checkpoint_stats.stall_us += clock_us() - start;
+        if (waited != 0) break;
+    }
+    free(held);
+    checkpoint_run(sdb);
+}
+
+/**
+ * @brief Returns the checkpoint counters and the current recovery estimate
+ * 
+ * @param sdb The database
+ * @return The counters; all zero for databases without a log
+ */
+SDBCheckpointStats sdb_checkpoint_stats(SDB* sdb) {
+    SDBCheckpointStats stats = {0};
+    if (!sdb) return stats;
+
+    database_lock(sdb);
+    stats = sdb->checkpoint_stats;
+    if (sdb->wal) {
+        stats.log_bytes = sdb->wal->used;
+        if (stats.replay_rate > 0) stats.recovery_ms = stats.log_bytes * 1000 / stats.replay_rate;
+    }
+    pthread_mutex_unlock(&sdb->lock);
+    return stats;
+}
+
+/**
+ * @brief Adds up the keys and values a table holds
+ * 
+ * Tables that are still in the block file are estimated from the sizes of
+ * their blocks. The caller holds sdb->lock, so no replaced value of an
+ * ordered table is freed meanwhile.
+ */
+static uint64_t table_live_bytes(const SDB* sdb, const SDBTable* table) {
+    uint64_t bytes = 0;
+    if (table->ordered) {
+        SDBSkipNode* node = __atomic_load_n(&table->ordered->head->next[0], __ATOMIC_ACQUIRE);
+        for (; node; node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE)) {
+            bytes += node->key_len + __atomic_load_n(&node->value, __ATOMIC_ACQUIRE)->len;
+        }
+        return bytes;
+    }
+    if (table->lazy_index >= 0) {
+        // Each entry is stored behind its key and value lengths
+        for (uint32_t b = 0; b < sdb->block_count; b++) {
+            const SDBBlockInfo* block = &sdb->blocks[b];
+            if ((int)block->table != table->lazy_index || block->entry_count == 0) continue;
+            bytes += block->raw_len - (uint64_t)block->entry_count * 2 * sizeof(int);
+        }
+        return bytes;
+    }
+    for (const SDBEntry* e = table->entries->head; e; e = e->next) {
+        bytes += strlen(e->key) + e->value_len;
+    }
+    return bytes;
+}
+
+static uint64_t path_size(const char* path) {
+    struct stat st;
+    return path && stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/**
+ * @brief Returns the bytes written to disk next to the bytes written by callers
+ * 
+ * Write amplification is the bytes written to the log, snapshots, pages,
+ * cold segment and its compaction over user_bytes; space amplification
+ * is file_bytes over live_bytes. Bytes are counted at record granularity:
+ * the zeros that reserve the log's space when it is created, and the
+ * pages an msync rounds small records up to, are not included.
+ * 
+ * @param sdb The database
+ * @return The counters since the database was opened, with the live and
+ *         file bytes of now; live_bytes is 0 in paged mode
+ */
+SDBWriteStats sdb_write_stats(SDB* sdb) {
+    SDBWriteStats stats = {0};
+    if (!sdb) return stats;
+
+    database_lock(sdb);
+    stats = sdb->write_stats;
+    if (sdb->wal) stats.log_bytes = sdb->wal->written;
+    if (sdb->pager) {
+        stats.page_bytes = (uint64_t)sdb->pager->writebacks * POOL_BLOCK_SIZE;
+    } else {
+        for (int i = 0; i < sdb->table_count; i++) stats.live_bytes += table_live_bytes(sdb, &sdb->tables[i]);
+    }
+    char* wal_path = sidecar_path(sdb, ".wal");
+    char* cold_path = sidecar_path(sdb, ".cold");
+    stats.file_bytes = path_size(sdb->path) + path_size(wal_path) + path_size(cold_path);
+    free(wal_path);
+    free(cold_path);
+    pthread_mutex_unlock(&sdb->lock);
+    return stats;
+}
+
+/*******************************************************************************
+ * Hot Key Functions
+ ******************************************************************************/
+/*
+ * Each table counts its most accessed keys with filtered space-saving: a
+ * fixed number of key counters in a min-heap, found through a small hash
+ * index. Accesses of keys without a counter are added up in a filter of
+ * counters by key hash, and a key takes over the smallest key counter once
+ * its filter counter exceeds it. The filter count becomes the key's error,
+ * so counts are never too low. Most accesses of cold keys only increment
+ * the filter.
+ */
+static SDBHotKeys* hot_keys_create(uint32_t capacity) {
+    SDBHotKeys* hot = (SDBHotKeys*)calloc(1, sizeof(SDBHotKeys));
+    if (!hot) return NULL;
+
+    uint32_t index_size = 1;
+    while (index_size < capacity * 2) index_size <<= 1;
+    uint32_t filter_size = index_size * (SDB_HOT_KEY_FILTER / 2);
+    hot->slots = (SDBHotSlot*)calloc(capacity, sizeof(SDBHotSlot));
+    hot->heap = (uint32_t*)malloc(sizeof(uint32_t) * capacity);
+    hot->index = (int32_t*)malloc(sizeof(int32_t) * index_size);
+    hot->filter = (uint64_t*)calloc(filter_size, sizeof(uint64_t));
+    if (!hot->slots || !hot->heap || !hot->index || !hot->filter) {
+        free(hot->slots);
+        free(hot->heap);
+        free(hot->index);
+        free(hot->filter);
+        free(hot);
+        return NULL;
+    }
+    memset(hot->index, 0xFF, sizeof(int32_t) * index_size);
+    hot->capacity = capacity;
+    hot->index_mask = index_size - 1;
+    hot->filter_mask = filter_size - 1;
+    return hot;
+}
+
+static void hot_keys_free(SDBHotKeys* hot) {
+    if (!hot) return;
+    for (uint32_t i = 0; i < hot->slot_count; i++) free(hot->slots[i].key);
+    free(hot->slots);
+    free(hot->heap);
+    free(hot->index);
+    free(hot->filter);
+    free(hot);
+}
+
+static void hot_heap_swap(SDBHotKeys* hot, uint32_t a, uint32_t b) {
+    uint32_t slot = hot->heap[a];
+    hot->heap[a] = hot->heap[b];
+    hot->heap[b] = slot;
+    hot->slots[hot->heap[a]].heap_pos = a;
+    hot->slots[hot->heap[b]].heap_pos = b;
+}
+
+static void hot_heap_up(SDBHotKeys* hot, uint32_t pos) {
+    while (pos > 0) {
+        uint32_t parent = (pos - 1) / 2;
+        if (hot->slots[hot->heap[parent]].count <= hot->slots[hot->heap[pos]].count) break;
+        hot_heap_swap(hot, pos, parent);
+        pos = parent;
+    }
+}
+
+static void hot_heap_down(SDBHotKeys* hot, uint32_t pos) {
+    for (;;) {
+        uint32_t least = pos;
+        uint32_t child = pos * 2 + 1;
+        for (uint32_t c = child; c < child + 2 && c < hot->slot_count; c++) {
+            if (hot->slots[hot->heap[c]].count < hot->slots[hot->heap[least]].count) least = c;
+        }
+        if (least == pos) return;
+        hot_heap_swap(hot, pos, least);
+        pos = least;
+    }
+}
+
+/**
+ * @brief Removes a slot from the hash index, closing the gap it leaves
+ */
+static void hot_index_remove(SDBHotKeys* hot, uint32_t slot) {
+    uint32_t mask = hot->index_mask;
+    uint32_t gap = (uint32_t)hot->slots[slot].hash & mask;
+    while (hot->index[gap] != (int32_t)slot) gap = (gap + 1) & mask;
+
+    // Move later entries of the probe run back unless that would pass their home bucket
+    for (uint32_t i = (gap + 1) & mask; hot->index[i] >= 0; i = (i + 1) & mask) {
+        uint32_t home = (uint32_t)hot->slots[hot->index[i]].hash & mask;
+        if (((i - home) & mask) >= ((i - gap) & mask)) {
+            hot->index[gap] = hot->index[i];
+            gap = i;
+        }
+    }
+    hot->index[gap] = -1;
+}
+
+/**
+ * @brief Counts a read or write of a key; the caller holds sdb->lock
+ * 
+ * Records applied while the log is replayed are not counted.
+ * 
+ * @param sdb The database
+ * @param table The table
+ * @param key The key
+ * @param write Whether the access is a write
+ */
+static void hot_keys_track(SDB* sdb, SDBTable* table, const char* key, int write) {
+    if (sdb->hot_keys == 0 || (sdb->wal && sdb->wal->replaying)) return;
+    if (!table->hot) {
+        table->hot = hot_keys_create(sdb->hot_keys * SDB_HOT_KEY_SLOTS);
+        if (!table->hot) return;
+    }
+    SDBHotKeys* hot = table->hot;
+    hot->accesses++;
+
+    size_t hash = hash_string(key);
+    uint32_t bucket = (uint32_t)hash & hot->index_mask;
+    SDBHotSlot* slot = NULL;
+    while (hot->index[bucket] >= 0) {
+        SDBHotSlot* candidate = &hot->slots[hot->index[bucket]];
+        if (candidate->hash == hash && strcmp(candidate->key, key) == 0) {
+            slot = candidate;
+            break;
+        }
+        bucket = (bucket + 1) & hot->index_mask;
+    }
+
+    if (!slot) {
+        uint64_t* filtered = &hot->filter[(hash >> 7) & hot->filter_mask];
+        int full = hot->slot_count == hot->capacity;
+        if (full && *filtered + 1 <= hot->slots[hot->heap[0]].count) {
+            (*filtered)++;
+            return;
+        }
+
+        uint32_t n = full ? hot->heap[0] : hot->slot_count;
+        size_t key_size = strlen(key) + 1;
+        slot = &hot->slots[n];
+        if (slot->key_size < key_size) {
+            char* buffer = (char*)realloc(slot->key, key_size);
+            if (!buffer) return;
+            slot->key = buffer;
+            slot->key_size = key_size;
+        }
+
+        if (!full) {
+            // A free slot: the key goes to the top of the heap until counted
+            hot->slot_count++;
+            hot->heap[n] = n;
+            slot->heap_pos = n;
+            slot->count = 0;
+            hot_heap_up(hot, n);
+        } else {
+            // The evicted key's count stays with its filter counter
+            hot_index_remove(hot, n);
+            hot->filter[(slot->hash >> 7) & hot->filter_mask] = slot->count;
+            bucket = (uint32_t)hash & hot->index_mask;
+            while (hot->index[bucket] >= 0) bucket = (bucket + 1) & hot->index_mask;
+        }
+        slot->count = *filtered;
+        slot->error = *filtered;
+        memcpy(slot->key, key, key_size);
+        slot->hash = hash;
+        slot->reads = 0;
+        slot->writes = 0;
+        hot->index[bucket] = (int32_t)n;
+    }
+
+    slot->count++;
+    if (write) slot->writes++;
+    else slot->reads++;
+    hot_heap_down(hot, slot->heap_pos);
+}
+
+static int hot_key_compare(const void* a, const void* b) {
+    uint64_t x = ((const SDBHotKey*)a)->count;
+    uint64_t y = ((const SDBHotKey*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/**
+ * @brief Returns the most accessed keys of a table
+ * 
+ * Counts are estimates from a fixed number of counters per table: a key
+ * is reported with at most error more accesses than it had, and every key
+ * with more than a small fraction of the accesses is reported. Keys are
+ * only counted when the database is opened with the hot_keys option, from
+ * the time it is opened.
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @return Up to the hot_keys option of keys, most accessed first; free
+ *         with sdb_free_hot_keys()
+ */
+SDBHotKeyStats sdb_hot_keys(SDB* sdb, const char* table) {
+    SDBHotKeyStats stats = {0};
+    if (!sdb) return stats;
+
+    database_lock(sdb);
+    SDBTable* t = sdb_table_find(sdb, table);
+    SDBHotKeys* hot = t ? t->hot : NULL;
+    if (hot && hot->slot_count > 0) {
+        stats.keys = (SDBHotKey*)malloc(sizeof(SDBHotKey) * hot->slot_count);
+    }
+    if (stats.keys) {
+        stats.accesses = hot->accesses;
+        for (uint32_t i = 0; i < hot->slot_count; i++) {
+            stats.keys[i].key = hot->slots[i].key;
+            stats.keys[i].count = hot->slots[i].count;
+            stats.keys[i].error = hot->slots[i].error;
+            stats.keys[i].reads = hot->slots[i].reads;
+            stats.keys[i].writes = hot->slots[i].writes;
+        }
+        qsort(stats.keys, hot->slot_count, sizeof(SDBHotKey), hot_key_compare);
+        stats.key_count = (int)(hot->slot_count < sdb->hot_keys ? hot->slot_count : sdb->hot_keys);
+        for (int i = 0; i < stats.key_count; i++) stats.keys[i].key = strdup(stats.keys[i].key);
+    }
+    pthread_mutex_unlock(&sdb->lock);
+    return stats;
+}
+
+/**
+ * @brief Frees the keys returned by sdb_hot_keys()
+ */
+void sdb_free_hot_keys(SDBHotKeyStats stats) {
+    for (int i = 0; i < stats.key_count; i++) free(stats.keys[i].key);
+    free(stats.keys);
+}
+
+/*******************************************************************************
+ * Database Core Functions
+ ******************************************************************************/
+/**
+ * @brief Creates an empty entry list with its hash index
+ * 
+ * @return The entry list
+ */
+static SDBEntryList* entry_list_create(void) {
+    SDBEntryList* list = (SDBEntryList*)malloc(sizeof(SDBEntryList));
+    if (!list) return NULL;
+    list->head = NULL;
+    list->tail = NULL;
+    list->capacity = 16;  // Initial capacity, can be adjusted
+    list->count = 0;
+    list->entries = (SDBEntry**)calloc(list->capacity, sizeof(SDBEntry*));
+    memset(&list->arena, 0, sizeof(SDBArena));
+    return list;
+}
+
+/**
+ * @brief Finds an entry by key in a table's hash index
+ * 
+ * @param list The entry list
+ * @param key The key
+ * @return The entry, or NULL if the key is not present
+ */
+static SDBEntry* entry_list_find(const SDBEntryList* list, const char* key) {
+    size_t hash = hash_string(key) % list->capacity;
+    SDBEntry* entry = list->entries[hash];
+
+    // Handle collision with linear probing
+    while (entry && strcmp(entry->key, key) != 0) {
+        hash = (hash + 1) % list->capacity;
+        entry = list->entries[hash];
+    }
+    return entry;
+}
+
+/**
+ * @brief Appends a new entry and adds it to the hash index
+ * 
+ * The index doubles once it is three quarters full.
+ * 
+ * @param list The entry list
+ * @param entry The entry, whose key must not be present yet
+ */
+static void entry_list_append(SDBEntryList* list, SDBEntry* entry) {
+    if ((list->count + 1) * 4 > list->capacity * 3) {
+        size_t capacity = list->capacity * 2;
+        SDBEntry** entries = (SDBEntry**)calloc(capacity, sizeof(SDBEntry*));
+        if (entries) {
+            for (size_t i = 0; i < list->capacity; i++) {
+                SDBEntry* e = list->entries[i];
+                if (!e) continue;
+                size_t hash = hash_string(e->key) % capacity;
+                while (entries[hash]) hash = (hash + 1) % capacity;
+                entries[hash] = e;
+            }
+            free(list->entries);
+            list->entries = entries;
+            list->capacity = capacity;
+        }
+    }
+
+    size_t hash = hash_string(entry->key) % list->capacity;
+    while (list->entries[hash]) hash = (hash + 1) % list->capacity;
+    list->entries[hash] = entry;
+    list->count++;
+
+    entry->next = NULL;
+    if (list->head == NULL) {
+        list->head = entry;
+    } else {
+        list->tail->next = entry;
+    }
+    list->tail = entry;
+}
+
+/**
+ * @brief Adds an entry read from a database file to a table
+ * 
+ * Older files may hold a key more than once; the last copy wins. An entry
+ * that already holds the same value, such as a lookup of the unloaded
+ * table left behind, is kept as it is, so its value does not move.
+ * 
+ * @param sdb The database
+ * @param table The table
+ * @return The key's entry, or NULL when out of memory
+ */
+static SDBEntry* table_load_entry(SDB* sdb, SDBTable* table, const char* key, uint32_t key_len,
+                                  const char* value, uint32_t value_len) {
+    SDBArena* arena = &table->entries->arena;
+    SDBEntry* entry = (SDBEntry*)calloc(1, sizeof(SDBEntry));
+    if (!entry) return NULL;
+    entry->key = arena_copy(arena, entry, 0, key, key_len);
+    entry->value = arena_copy(arena, entry, 1, value, value_len);
+    if (!entry->key || !entry->value) {
+        arena_release(entry->key);
+        arena_release(entry->value);
+        free(entry);
+        return NULL;
+    }
+    entry->value_len = value_len;
+
+    SDBEntry* existing = entry_list_find(table->entries, entry->key);
+    if (existing && existing->value && existing->value_len == value_len &&
+        memcmp(existing->value, value, value_len) == 0) {
+        arena_release(entry->key);
+        arena_release(entry->value);
+        free(entry);
+        return existing;
+    }
+    sdb->memory_used += value_len + 1;
+    if (existing) {
+        tier_forget(sdb, existing);
+        arena_release(existing->value);
+        existing->value = entry->value;
+        existing->value_len = entry->value_len;
+        arena_adopt(existing->value, existing);
+        arena_release(entry->key);
+        free(entry);
+        return existing;
+    }
+    entry_list_append(table->entries, entry);
+    return entry;
+}
+
+/**
+ * @brief Forgets the file that unloaded tables are read from
+ * 
+ * @param sdb The database
+ */
+static void block_source_close(SDB* sdb) {
+    if (sdb->block_fd >= 0) close(sdb->block_fd);
+    if (sdb->block_map) munmap(sdb->block_map, sdb->block_map_size);
+    free(sdb->blocks);
+    free(sdb->block_verified);
+    free(sdb->block_keys);
+    for (int i = 0; i < sdb->sorted_run_count; i++) {
+        free(sdb->sorted_runs[i].key_index_copy);
+        free(sdb->sorted_runs[i].ranks);
+    }
+    free(sdb->sorted_runs);
+    free(sdb->block_cache);
+    sdb->block_fd = -1;
+    sdb->blocks = NULL;
+    sdb->block_verified = NULL;
+    sdb->block_count = 0;
+    sdb->block_keys = NULL;
+    sdb->sorted_runs = NULL;
+    sdb->sorted_run_count = 0;
+    sdb->block_map = NULL;
+    sdb->block_map_size = 0;
+    sdb->block_cache = NULL;
+    sdb->cached_block = -1;
+}
+
+/**
+ * @brief Finds the sorted tables of the block file and maps it for lookups
+ * 
+ * A table is sorted if its blocks are adjacent in the index, each has a
+ * first key in the sparse index, and those keys ascend. A frozen table
+ * ends with one more block without entries, which holds its key index.
+ * 
+ * @param sdb The database, whose block file and index are set up
+ * @param fd The block file
+ * @param keys Sparse index of the file, taken over; NULL if it has none
+ * @param table_count Number of tables in the file
+ */
+static void block_source_index(SDB* sdb, int fd, char** keys, int table_count) {
+    sdb->block_keys = keys;
+    if (!keys || table_count <= 0) return;
+
+    uint32_t* counts = (uint32_t*)calloc(table_count, sizeof(uint32_t));
+    sdb->sorted_runs = (SDBSortedRun*)calloc(table_count, sizeof(SDBSortedRun));
+    if (!counts || !sdb->sorted_runs) {
+        free(counts);
+        return;
+    }
+    sdb->sorted_run_count = table_count;
+    for (int i = 0; i < table_count; i++) sdb->sorted_runs[i].index_block = SDB_NO_KEY;
+    for (uint32_t b = 0; b < sdb->block_count; b++) {
+        if (sdb->blocks[b].table < (uint32_t)table_count) counts[sdb->blocks[b].table]++;
+    }
+
+    int sorted = 0;
+    for (uint32_t b = 0; b < sdb->block_count;) {
+        uint32_t table = sdb->blocks[b].table;
+        uint32_t end = b + 1;
+        int ascending = keys[b] != NULL;
+        while (end < sdb->block_count && sdb->blocks[end].table == table) end++;
+        uint32_t data_end = end;
+        if (end - b > 1 && sdb->blocks[end - 1].entry_count == 0) data_end = end - 1;
+        for (uint32_t i = b + 1; i < data_end; i++) {
+            if (!keys[i] || (keys[i - 1] && strcmp(keys[i - 1], keys[i]) >= 0)) ascending = 0;
+        }
+        if (ascending && table < (uint32_t)table_count && end - b == counts[table]) {
+            sdb->sorted_runs[table].first = b;
+            sdb->sorted_runs[table].count = data_end - b;
+            if (data_end < end) sdb->sorted_runs[table].index_block = data_end;
+            sorted = 1;
+        }
+        b = end;
+    }
+    free(counts);
+
+    // Lookups jump around the file, so readahead would only waste I/O
+    struct stat st;
+    if (sorted && fstat(fd, &st) == 0 && st.st_size > 0) {
+        void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        if (map != MAP_FAILED) {
+            sdb->block_map = (unsigned char*)map;
+            sdb->block_map_size = (size_t)st.st_size;
+#ifdef MADV_RANDOM
+            madvise(map, sdb->block_map_size, MADV_RANDOM);
+#endif
+        }
+    }
+}
+
+/**
+ * @brief Opens the tables of a format 3 file without loading them
+ * 
+ * Only the footer is read. Each table is loaded from its blocks the first
+ * time it is used, see table_load_blocks(). In strict mode every block's
+ * checksum is checked up front instead.
+ * 
+ * @param sdb The database
+ * @param fd The database file; it is duplicated, not taken over
+ * @param strict Verify every block now
+ * @return 0 on success, -1 if strict verification failed
+ */
+static int blocked_load(SDB* sdb, int fd, int strict) {
+    SDBFileInfo info = {0};
+    SDBBlockInfo* blocks = NULL;
+    uint32_t block_count = 0;
+    if (footer_read(fd, 3, &info, &blocks, &block_count, NULL) != 0) {
+        sdb_free_file_info(info);
+        free(blocks);
+        return strict ? -1 : 0;
+    }
+
+    sdb->tables = (SDBTable*)malloc(sizeof(SDBTable) * (info.table_count ? info.table_count : 1));
+    for (int i = 0; sdb->tables && i < info.table_count; i++) {
+        sdb->tables[i].name = info.tables[i].name ? strdup(info.tables[i].name) : strdup("");
+        sdb->tables[i].entries = entry_list_create();
+        sdb->tables[i].hot = NULL;
+        sdb->tables[i].loader = NULL;
+        sdb->tables[i].root_page = 0;
+        sdb->tables[i].block_reads = 0;
+        sdb->tables[i].frozen = 0;
+        sdb->tables[i].ordered = NULL;
+        sdb->tables[i].lazy_index = i;
+        sdb->table_count++;
+    }
+    sdb->log_seq = info.log_seq;
+
+    sdb->block_fd = dup(fd);
+    sdb->blocks = blocks;
+    sdb->block_count = block_count;
+    sdb->block_verified = (unsigned char*)calloc(block_count ? block_count : 1, 1);
+    if (sdb->block_fd >= 0) block_source_index(sdb, sdb->block_fd, info.block_keys, info.table_count);
+    else free(info.block_keys);
+    info.block_keys = NULL;
+    sdb_free_file_info(info);
+    if (sdb->block_fd < 0 || !sdb->block_verified) return -1;
+    for (int i = 0; i < sdb->table_count; i++) {
+        const SDBSortedRun* run = table_sorted_run(sdb, &sdb->tables[i]);
+        sdb->tables[i].frozen = run && run->index_block != SDB_NO_KEY;
+    }
+
+    if (!strict) return 0;
+
+    // Strict mode reads the whole file once; keep none of it cached
+    SDB_FADVISE(fd, 0, 0, SEQUENTIAL);
+    int result = 0;
+    for (uint32_t b = 0; b < block_count; b++) {
+        unsigned char* data = block_read_stored(fd, &blocks[b], 1);
+        if (!data) {
+            sdb->corrupt_blocks++;
+            result = -1;
+            break;
+        }
+        free(data);
+        sdb->block_verified[b] = 1;
+    }
+    SDB_FADVISE(fd, 0, 0, DONTNEED);
+    return result;
+}
+
+/**
+ * @brief Hints the kernel about the blocks of an unloaded table
+ * 
+ * Blocks of a table are mostly adjacent, so they are merged into runs.
+ * 
+ * @param sdb The database
+ * @param index The table's index in the block file
+ * @param done 0 to start readahead before reading the blocks, 1 to drop
+ *        them from the page cache once they have been read
+ */
+static void table_advise_blocks(SDB* sdb, uint32_t index, int done) {
+    uint64_t start = 0;
+    uint64_t end = 0;
+    for (uint32_t b = 0; b <= sdb->block_count; b++) {
+        const SDBBlockInfo* block = b < sdb->block_count ? &sdb->blocks[b] : NULL;
+        if (block && block->table != index) continue;
+        if (block && block->offset == end) {
+            end += SDB_BLOCK_HEADER + (uint64_t)block->comp_len;
+            continue;
+        }
+        if (end > start) {
+            if (done) {
+                SDB_FADVISE(sdb->block_fd, start, end - start, DONTNEED);
+            } else {
+                SDB_FADVISE(sdb->block_fd, start, end - start, WILLNEED);
+            }
+        }
+        if (block) {
+            start = block->offset;
+            end = start + SDB_BLOCK_HEADER + (uint64_t)block->comp_len;
+        }
+    }
+}
+
+/**
+ * @brief Loads a table that is still only in the database file
+ * 
+ * A block's checksum is checked the first time the block is read and the
+ * result is remembered, so no block is verified twice. Blocks that fail
+ * are skipped and counted in sdb->corrupt_blocks.
+ * 
+ * @param sdb The database
+ * @param table The table
+ */
+static void table_load_blocks(SDB* sdb, SDBTable* table) {
+    if (table->lazy_index < 0) return;
+    uint32_t index = (uint32_t)table->lazy_index;
+    table->lazy_index = -1;
+    table->frozen = 0;
+
+    // The decoded entries are all that is needed afterwards
+    table_advise_blocks(sdb, index, 0);
+    for (uint32_t b = 0; b < sdb->block_count; b++) {
+        if (sdb->blocks[b].table != index || sdb->blocks[b].entry_count == 0) continue;
+
+        SDBBlockInfo stored;
+        unsigned char* raw = block_read(sdb->block_fd, sdb->blocks[b].offset, &stored, !sdb->block_verified[b]);
+        if (!raw || stored.crc != sdb->blocks[b].crc || stored.table != index) {
+            free(raw);
+            sdb->corrupt_blocks++;
+            continue;
+        }
+        sdb->block_verified[b] = 1;
+
+        size_t pos = 0;
+        for (uint32_t j = 0; j < stored.entry_count; j++) {
+            const char *key, *value;
+            uint32_t key_len, value_len;
+            pos = block_next_entry(raw, stored.raw_len, pos, &key, &key_len, &value, &value_len);
+            if (pos == 0) break;
+            table_load_entry(sdb, table, key, key_len, value, value_len);
+        }
+        free(raw);
+    }
+    table_advise_blocks(sdb, index, 1);
+    tier_rebalance(sdb, NULL);
+}
+
+/**
+ * @brief Drops the entries of a loaded table that now lives in the file
+ * 
+ * @param sdb The database
+ * @param table The table
+ * @param index The table's index in the block file
+ */
+static void table_unload(SDB* sdb, SDBTable* table, int index) {
+    SDBEntryList* list = entry_list_create();
+    if (!list) return;
+
+    SDBEntry* current = table->entries->head;
+    while (current != NULL) {
+        SDBEntry* next = current->next;
+        tier_forget(sdb, current);
+        free(current);
+        current = next;
+    }
+    arena_destroy(&table->entries->arena);
+    free(table->entries->entries);
+    free(table->entries);
+    table->entries = list;
+    table->lazy_index = index;
+    table->block_reads = 0;
+}
+
+/**
+ * @brief Returns the block range of a table that is unloaded and sorted
+ * 
+ * @return The range, or NULL if the table is loaded or not sorted
+ */
+static const SDBSortedRun* table_sorted_run(const SDB* sdb, const SDBTable* table) {
+    if (table->lazy_index < 0 || table->lazy_index >= sdb->sorted_run_count) return NULL;
+    const SDBSortedRun* run = &sdb->sorted_runs[table->lazy_index];
+    return run->count > 0 ? run : NULL;
+}
+
+/**
+ * @brief Decodes a block of a sorted table for a lookup
+ * 
+ * Uncompressed blocks are used in place in the mapped file. Others are
+ * decompressed into a cache holding the last one, and counted in the
+ * table's block_reads. The checksum is checked on first use, as in
+ * table_load_blocks().
+ * 
+ * @param sdb The database
+ * @param table The table
+ * @param b The block
+ * @param entries_end Receives where the entries of the block end
+ * @return The decoded block, valid until the next call, or NULL if it is
+ *         damaged
+ */
+static const unsigned char* sorted_block(SDB* sdb, SDBTable* table, uint32_t b, size_t* entries_end) {
+    const SDBBlockInfo* block = &sdb->blocks[b];
+    uint32_t restarts;
+    if (sdb->cached_block == (int64_t)b) {
+        *entries_end = block_restarts(sdb->block_cache, block->raw_len, &restarts);
+        return sdb->block_cache;
+    }
+
+    size_t len = SDB_BLOCK_HEADER + (size_t)block->comp_len;
+    unsigned char* data = NULL;
+    const unsigned char* stored = NULL;
+    if (sdb->block_map && block->offset <= sdb->block_map_size && len <= sdb->block_map_size - block->offset) {
+        stored = sdb->block_map + block->offset;
+    } else {
+        stored = data = block_read_stored(sdb->block_fd, block, 0);
+    }
+    if (!stored || block->codec > SDB_COMPRESS_LZ77 ||
+        (!sdb->block_verified[b] && !block_check(stored, block))) {
+        free(data);
+        sdb->corrupt_blocks++;
+        return NULL;
+    }
+    sdb->block_verified[b] = 1;
+
+    const unsigned char* payload = stored + SDB_BLOCK_HEADER;
+    if (block->codec == SDB_COMPRESS_NONE && !data) {
+        *entries_end = block_restarts(payload, block->comp_len, &restarts);
+        return *entries_end ? payload : NULL;
+    }
+
+    unsigned char* raw = NULL;
+    size_t raw_len = 0;
+    if (block->codec == SDB_COMPRESS_NONE) {
+        memmove(data, payload, block->comp_len);
+        raw = data;
+        raw_len = block->comp_len;
+    } else {
+        raw = sdb_decompress((SDBCompressType)block->codec, payload, block->comp_len, &raw_len);
+        free(data);
+    }
+    *entries_end = raw && raw_len == block->raw_len ? block_restarts(raw, raw_len, &restarts) : 0;
+    if (*entries_end == 0) {
+        free(raw);
+        sdb->corrupt_blocks++;
+        return NULL;
+    }
+
+    free(sdb->block_cache);
+    sdb->block_cache = raw;
+    sdb->cached_block = b;
+    table->block_reads++;
+    return raw;
+}
+
+/**
+ * @brief Opens the key index of a frozen, unloaded table
+ * 
+ * An uncompressed index is used in place in the mapped file, otherwise it
+ * is read into key_index_copy. Its checksum is checked on first use, and
+ * the number of keys before each block is summed up for locating entries
+ * by rank.
+ * 
+ * @param sdb The database
+ * @param table The table
+ * @return Its blocks with the index opened, or NULL if it has none or the
+ *         index is damaged
+ */
+static const SDBSortedRun* sorted_key_index(SDB* sdb, const SDBTable* table) {
+    const SDBSortedRun* found = table_sorted_run(sdb, table);
+    if (!found || found->index_block == SDB_NO_KEY) return NULL;
+    SDBSortedRun* run = &sdb->sorted_runs[table->lazy_index];
+    if (run->key_index) return run;
+
+    const SDBBlockInfo* block = &sdb->blocks[run->index_block];
+    size_t len = SDB_BLOCK_HEADER + (size_t)block->comp_len;
+    unsigned char* data = NULL;
+    const unsigned char* stored = NULL;
+    if (sdb->block_map && block->offset <= sdb->block_map_size && len <= sdb->block_map_size - block->offset) {
+        stored = sdb->block_map + block->offset;
+    } else {
+        stored = data = block_read_stored(sdb->block_fd, block, 0);
+    }
+    uint64_t* ranks = (uint64_t*)malloc(sizeof(uint64_t) * ((size_t)run->count + 1));
+    int valid = stored && ranks && block->codec == SDB_COMPRESS_NONE &&
+                block->comp_len >= SDB_KEY_INDEX_TRAILER &&
+                (sdb->block_verified[run->index_block] || block_check(stored, block));
+    if (valid) {
+        ranks[0] = 0;
+        for (uint32_t i = 0; i < run->count; i++) ranks[i + 1] = ranks[i] + sdb->blocks[run->first + i].entry_count;
+        valid = get_u64(stored + len - 8) == ranks[run->count];
+    }
+    if (!valid) {
+        free(data);
+        free(ranks);
+        if (ranks) sdb->corrupt_blocks++;
+        run->index_block = SDB_NO_KEY;  // Lookups fall back to the sparse index
+        return NULL;
+    }
+    sdb->block_verified[run->index_block] = 1;
+
+    if (data) {
+        memmove(data, data + SDB_BLOCK_HEADER, block->comp_len);
+        run->key_index_copy = data;
+    }
+    run->key_index = data ? data : stored + SDB_BLOCK_HEADER;
+    run->key_index_len = block->comp_len;
+    run->ranks = ranks;
+    return run;
+}
+
+/**
+ * @brief Finds the entry of a frozen table with a given rank
+ * 
+ * @param sdb The database
+ * @param table The table
+ * @param run Its blocks, with the key index opened
+ * @param rank Number of keys before the entry
+ * @param block Receives the block of the entry
+ * @param pos Receives the offset of the entry in the decoded block
+ * @return 0 on success, -1 if there are not that many keys or the block
+ *         is damaged
+ */
+static int sorted_locate(SDB* sdb, SDBTable* table, const SDBSortedRun* run, uint64_t rank,
+                         uint32_t* block, size_t* pos) {
+    if (rank >= run->ranks[run->count]) return -1;
+
+    // Last block with no more keys before it than the rank
+    uint32_t low = 0;
+    uint32_t high = run->count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (run->ranks[mid] <= rank) low = mid;
+        else high = mid;
+    }
+
+    size_t entries_end;
+    const unsigned char* raw = sorted_block(sdb, table, run->first + low, &entries_end);
+    if (!raw) return -1;
+
+    // Restart points are every SDB_RESTART_INTERVAL-th entry
+    uint64_t skip = rank - run->ranks[low];
+    uint32_t count = (uint32_t)((sdb->blocks[run->first + low].raw_len - entries_end) / sizeof(uint32_t)) - 1;
+    if (skip / SDB_RESTART_INTERVAL >= count) return -1;
+    size_t at = get_u32(raw + entries_end + (size_t)(skip / SDB_RESTART_INTERVAL) * sizeof(uint32_t));
+    for (uint64_t i = 0; i < skip % SDB_RESTART_INTERVAL && at < entries_end; i++) {
+        const char *k, *v;
+        uint32_t k_len, v_len;
+        at = block_next_entry(raw, entries_end, at, &k, &k_len, &v, &v_len);
+        if (at == 0) return -1;
+    }
+    if (at >= entries_end) return -1;
+    *block = run->first + low;
+    *pos = at;
+    return 0;
+}
+
+/**
+ * @brief Finds the first entry of a sorted table that is not less than a key
+ * 
+ * One binary search over the first keys of the table's blocks picks the
+ * block, a second one over the block's restart points picks where to
+ * start, and at most SDB_RESTART_INTERVAL entries are stepped over.
+ * Frozen tables take the rank of the key from their key index instead.
+ * 
+ * @param sdb The database
+ * @param table The table
+ * @param run Its blocks
+ * @param key The key, or NULL for the first entry
+ * @param block Receives the block of the entry
+ * @param pos Receives the offset of the entry in the decoded block
+ * @return 0 on success, -1 if every key is less or the block is damaged
+ */
+static int sorted_seek(SDB* sdb, SDBTable* table, const SDBSortedRun* run, const char* key,
+                       uint32_t* block, size_t* pos) {
+    *block = run->first;
+    *pos = 0;
+    if (!key) return 0;
+
+    const SDBSortedRun* indexed = sorted_key_index(sdb, table);
+    int exact;
+    uint64_t rank = indexed ? key_index_rank(indexed->key_index, indexed->key_index_len, key, strlen(key), &exact)
+                            : UINT64_MAX;
+    if (rank != UINT64_MAX) return sorted_locate(sdb, table, indexed, rank, block, pos);
+
+    // Last block whose first key is not greater than the key
+    uint32_t low = run->first;
+    uint32_t high = run->first + run->count;
+    while (high - low > 1) {
+        uint32_t mid = low + (high - low) / 2;
+        if (strcmp(sdb->block_keys[mid], key) <= 0) low = mid;
+        else high = mid;
+    }
+    if (strcmp(sdb->block_keys[low], key) > 0) return 0;
+
+    size_t entries_end;
+    const unsigned char* raw = sorted_block(sdb, table, low, &entries_end);
+    if (!raw) return -1;
+
+    // Last restart point whose key is not greater than the key
+    uint32_t key_len = (uint32_t)strlen(key);
+    uint32_t count = (uint32_t)((sdb->blocks[low].raw_len - entries_end) / sizeof(uint32_t)) - 1;
+    const unsigned char* restarts = raw + entries_end;
+    uint32_t left = 0;
+    uint32_t right = count;
+    while (right - left > 1) {
+        uint32_t mid = left + (right - left) / 2;
+        size_t at = get_u32(restarts + (size_t)mid * sizeof(uint32_t));
+        const char *k, *v;
+        uint32_t k_len, v_len;
+        if (at >= entries_end || block_next_entry(raw, entries_end, at, &k, &k_len, &v, &v_len) == 0) return -1;
+        if (key_compare(k, k_len, key, key_len) <= 0) left = mid;
+        else right = mid;
+    }
+
+    size_t at = get_u32(restarts + (size_t)left * sizeof(uint32_t));
+    while (at < entries_end) {
+        const char *k, *v;
+        uint32_t k_len, v_len;
+        size_t next = block_next_entry(raw, entries_end, at, &k, &k_len, &v, &v_len);
+        if (next == 0) return -1;
+        if (key_compare(k, k_len, key, key_len) >= 0) {
+            *block = low;
+            *pos = at;
+            return 0;
+        }
+        at = next;
+    }
+
+    // Every key of the block is less; the next block starts with a greater one
+    if (low + 1 == run->first + run->count) return -1;
+    *block = low + 1;
+    return 0;
+}
+
+/**
+ * @brief Copies a key and value out of a block into sdb->scratch
+ * 
+ * @return The value; the key is at sdb->scratch. NULL if out of memory
+ */
+static char* sorted_copy(SDB* sdb, const char* key, uint32_t key_len, const char* value, uint32_t value_len) {
+    size_t size = (size_t)key_len + value_len + 2;
+    if (sdb->scratch_size < size) {
+        char* scratch = (char*)realloc(sdb->scratch, size);
+        if (!scratch) return NULL;
+        sdb->scratch = scratch;
+        sdb->scratch_size = size;
+    }
+    memcpy(sdb->scratch, key, key_len);
+    sdb->scratch[key_len] = '\0';
+    memcpy(sdb->scratch + key_len + 1, value, value_len);
+    sdb->scratch[key_len + 1 + value_len] = '\0';
+    return sdb->scratch + key_len + 1;
+}
+
+/**
+ * @brief Looks a key up in an unloaded sorted table without loading it
+ * 
+ * A hit is kept as an entry of the table, so its value stays valid like
+ * that of a loaded table, and the next lookup of the key reads no block.
+ * 
+ * @return The value, or NULL if it is missing
+ */
+static char* sorted_get(SDB* sdb, SDBTable* table, const SDBSortedRun* run, const char* key) {
+    uint32_t b;
+    size_t pos, entries_end;
+    const SDBSortedRun* indexed = sorted_key_index(sdb, table);
+    int exact = 0;
+    uint64_t rank = indexed ? key_index_rank(indexed->key_index, indexed->key_index_len, key, strlen(key), &exact)
+                            : UINT64_MAX;
+    if (rank != UINT64_MAX) {
+        // The key index of a frozen table answers misses without reading a block
+        if (!exact || sorted_locate(sdb, table, indexed, rank, &b, &pos) != 0) return NULL;
+    } else if (sorted_seek(sdb, table, run, key, &b, &pos) != 0) {
+        return NULL;
+    }
+
+    const unsigned char* raw = sorted_block(sdb, table, b, &entries_end);
+    const char *k, *v;
+    uint32_t k_len, v_len;
+    if (!raw || block_next_entry(raw, entries_end, pos, &k, &k_len, &v, &v_len) == 0 ||
+        key_compare(k, k_len, key, (uint32_t)strlen(key)) != 0) {
+        return NULL;
+    }
+    SDBEntry* e = table_load_entry(sdb, table, k, k_len, v, v_len);
+    if (!e) return NULL;
+    if (e->hits < UINT32_MAX) e->hits++;
+    tier_rebalance(sdb, e);
+    return e->value;
+}
+
+static void wal_replay_record(void* ctx, uint64_t seq, uint32_t type, const char* table,
+                              const char* key, const char* value) {
+    SDB* sdb = (SDB*)ctx;
+    if (seq <= sdb->log_seq) return;  // Already in the snapshot
+
+    if (type == SDB_WAL_SET) {
+        table_set(sdb, table, key, value);
+    } else if (type == SDB_WAL_CREATE) {
+        table_create(sdb, table);
+    } else if (type == SDB_WAL_DESTROY) {
+        table_destroy(sdb, table);
+    }
+}
+
+/*
+ * Replay reads the whole log first and then applies it in runs of sets
+ * between table creates and destroys. Within a run, all sets of one table
+ * go to the same worker in log order, so updates of a key keep their order
+ * while different tables are replayed, and loaded, in parallel.
+ */
+typedef struct {
+    uint32_t type;
+    size_t table;           // Offsets of the strings in the arena
+    size_t key;
+    size_t value;
+} SDBReplayRecord;
+
+typedef struct {
+    SDB* sdb;
+    SDBReplayRecord* records;
+    size_t count;
+    size_t capacity;
+    unsigned char* arena;
+    size_t arena_size;
+    size_t arena_used;
+    int failed;
+} SDBReplayLog;
+
+typedef struct {
+    SDBTable* table;
+    size_t start;           // First entry of the group in SDBReplayJob.order
+    size_t count;
+} SDBReplayGroup;
+
+typedef struct {
+    SDB* sdb;
+    const SDBReplayLog* log;
+    const size_t* order;    // Record indices, grouped by table
+    SDBReplayGroup* groups;
+    size_t group_count;
+    size_t next_group;
+    pthread_mutex_t lock;
+    size_t memory_used;     // Counters gathered from the workers
+    uint64_t cold_dead;
+} SDBReplayJob;
+
+static void replay_collect(void* ctx, uint64_t seq, uint32_t type, const char* table,
+                           const char* key, const char* value) {
+    SDBReplayLog* log = (SDBReplayLog*)ctx;
+    if (seq <= log->sdb->log_seq || log->failed) return;  // Already in the snapshot
+
+    if (log->count == log->capacity) {
+        size_t capacity = log->capacity ? log->capacity * 2 : 1024;
+        SDBReplayRecord* records = (SDBReplayRecord*)realloc(log->records, sizeof(SDBReplayRecord) * capacity);
+        if (!records) {
+            log->failed = 1;
+            return;
+        }
+        log->records = records;
+        log->capacity = capacity;
+    }
+    SDBReplayRecord* record = &log->records[log->count++];
+    record->type = type;
+    record->table = log->arena_used;
+    write_to_buffer(&log->arena, &log->arena_size, &log->arena_used, table, strlen(table) + 1);
+    record->key = log->arena_used;
+    write_to_buffer(&log->arena, &log->arena_size, &log->arena_used, key, strlen(key) + 1);
+    record->value = log->arena_used;
+    write_to_buffer(&log->arena, &log->arena_size, &log->arena_used, value, strlen(value) + 1);
+}
+
+static int replay_group_compare(const void* a, const void* b) {
+    size_t x = ((const SDBReplayGroup*)a)->count;
+    size_t y = ((const SDBReplayGroup*)b)->count;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void* replay_worker(void* arg) {
+    SDBReplayJob* job = (SDBReplayJob*)arg;
+
+    // Tables were loaded before the workers started, and each group is one
+    // table, so workers insert directly and only keep their own counters.
+    // Nothing is demoted until the replay is done.
+    size_t memory_used = 0;
+    uint64_t cold_dead = 0;
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        size_t g = job->next_group++;
+        pthread_mutex_unlock(&job->lock);
+        if (g >= job->group_count) break;
+
+        const SDBReplayGroup* group = &job->groups[g];
+        for (size_t i = group->start; i < group->start + group->count; i++) {
+            const SDBReplayRecord* record = &job->log->records[job->order[i]];
+            const char* arena = (const char*)job->log->arena;
+            table_insert(group->table, arena + record->key, arena + record->value, &memory_used, &cold_dead);
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->memory_used += memory_used;
+    job->cold_dead += cold_dead;
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/**
+ * @brief Applies a run of sets, one table per worker at a time
+ * 
+ * Tables are handed out largest first, so one big table does not end up
+ * last on a single thread.
+ * 
+ * @param sdb The database
+ * @param log The collected log
+ * @param first First record of the run
+ * @param end One past the last record of the run
+ * @param threads Maximum number of threads
+ * @return 0 on success, -1 if memory ran out before anything was applied
+ */
+static int replay_sets(SDB* sdb, const SDBReplayLog* log, size_t first, size_t end, int threads) {
+    size_t count = end - first;
+    size_t* table_of = (size_t*)malloc(sizeof(size_t) * (count ? count : 1));
+    size_t* order = (size_t*)malloc(sizeof(size_t) * (count ? count : 1));
+    size_t* offsets = (size_t*)calloc((size_t)sdb->table_count + 1, sizeof(size_t));
+    SDBReplayGroup* groups = (SDBReplayGroup*)malloc(sizeof(SDBReplayGroup) * ((size_t)sdb->table_count + 1));
+    if (!table_of || !order || !offsets || !groups) {
+        free(table_of);
+        free(order);
+        free(offsets);
+        free(groups);
+        return -1;
+    }
+
+    // Counting sort by table; sets of tables that do not exist are dropped
+    for (size_t i = 0; i < count; i++) {
+        SDBTable* table = sdb_table_find(sdb, (const char*)log->arena + log->records[first + i].table);
+        table_of[i] = table ? (size_t)(table - sdb->tables) : (size_t)sdb->table_count;
+        offsets[table_of[i]]++;
+    }
+    size_t group_count = 0;
+    size_t position = 0;
+    for (int t = 0; t < sdb->table_count; t++) {
+        size_t n = offsets[t];
+        offsets[t] = position;
+        if (n > 0) {
+            // Loading touches the database, so it happens before the workers start
+            table_load_blocks(sdb, &sdb->tables[t]);
+            sdb->tables[t].frozen = 0;
+            groups[group_count].table = &sdb->tables[t];
+            groups[group_count].start = position;
+            groups[group_count].count = n;
+            group_count++;
+        }
+        position += n;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (table_of[i] < (size_t)sdb->table_count) order[offsets[table_of[i]]++] = first + i;
+    }
+    qsort(groups, group_count, sizeof(SDBReplayGroup), replay_group_compare);
+
+    SDBReplayJob job;
+    memset(&job, 0, sizeof(job));
+    job.sdb = sdb;
+    job.log = log;
+    job.order = order;
+    job.groups = groups;
+    job.group_count = group_count;
+    pthread_mutex_init(&job.lock, NULL);
+
+    int workers = threads;
+    if ((size_t)workers > group_count) workers = (int)group_count;
+    if (count < SDB_REPLAY_MIN_BATCH) workers = 1;
+    pthread_t* pool = workers > 1 ? (pthread_t*)malloc(sizeof(pthread_t) * workers) : NULL;
+    int started = 0;
+    while (pool && started < workers - 1 && pthread_create(&pool[started], NULL, replay_worker, &job) == 0) {
+        started++;
+    }
+    replay_worker(&job);
+    for (int i = 0; i < started; i++) {
+        pthread_join(pool[i], NULL);
+    }
+    sdb->memory_used += job.memory_used;
+    sdb->cold_dead += job.cold_dead;
+
+    pthread_mutex_destroy(&job.lock);
+    free(pool);
+    free(table_of);
+    free(order);
+    free(offsets);
+    free(groups);
+    return 0;
+}
+
+/**
+ * @brief Replays the log over the snapshot
+ * 
+ * @param sdb The database
+ * @param threads Maximum number of threads applying sets
+ */
+static void replay_log(SDB* sdb, int threads) {
+    SDBReplayLog log;
+    memset(&log, 0, sizeof(log));
+    log.sdb = sdb;
+    log.arena_size = 64 * 1024;
+    log.arena = (unsigned char*)malloc(log.arena_size);
+
+    sdb->wal->replaying = 1;
+    wal_scan(sdb->wal, log.arena ? replay_collect : NULL, &log);
+
+    size_t i = 0;
+    while (!log.failed && log.arena && i < log.count) {
+        const SDBReplayRecord* record = &log.records[i];
+        if (record->type == SDB_WAL_SET) {
+            size_t end = i;
+            while (end < log.count && log.records[end].type == SDB_WAL_SET) end++;
+            if (replay_sets(sdb, &log, i, end, threads) != 0) break;
+            i = end;
+            continue;
+        }
+        if (record->type == SDB_WAL_CREATE) {
+            table_create(sdb, (const char*)log.arena + record->table);
+        } else if (record->type == SDB_WAL_DESTROY) {
+            table_destroy(sdb, (const char*)log.arena + record->table);
+        }
+        i++;
+    }
+    int complete = !log.failed && log.arena && i == log.count;
+    free(log.arena);
+    free(log.records);
+
+    // Out of memory: replay the whole log again, one record at a time.
+    // Applying a prefix twice gives the same tables as applying it once.
+    if (!complete) wal_scan(sdb->wal, wal_replay_record, sdb);
+    sdb->wal->replaying = 0;
+}
+
+/**
+ * @brief Attaches the write-ahead log and replays it over the snapshot
+ * 
+ * The replay is timed; the rate sizes the log the checkpointer lets grow.
+ * 
+ * @param sdb The database, in memory mode
+ * @param opts The open options
+ * @return The database, or NULL (after closing it) if the log is damaged
+ */
+static SDB* sdb_open_finish(SDB* sdb, const SDBOptions* opts) {
+    if (opts->wal_size > 0) {
+        int damaged = 0;
+        sdb->wal = wal_open(sdb, opts->wal_size, opts->wal_sync, &damaged);
+        if (damaged) {
+            sdb_close(sdb);
+            return NULL;
+        }
+        if (sdb->wal) {
+            int threads = (int)opts->replay_threads;
+            if (threads <= 0) {
+                long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+                threads = cpus > 0 ? (int)cpus : 1;
+            }
+            if (threads > SDB_REPLAY_MAX_THREADS) threads = SDB_REPLAY_MAX_THREADS;
+
+            uint64_t start = clock_us();
+            replay_log(sdb, threads);
+            uint64_t elapsed = clock_us() - start;
+            sdb->checkpoint_stats.replay_ms = elapsed / 1000;
+
+            // Short replays are dominated by noise; keep the default for those
+            uint64_t measured = sdb->wal->ring_size / 2 < 1024 * 1024 ? sdb->wal->ring_size / 2 : 1024 * 1024;
+            sdb->checkpoint_stats.replay_rate = SDB_DEFAULT_REPLAY_RATE;
+            if (sdb->wal->used >= measured && elapsed > 0) {
+                sdb->checkpoint_stats.replay_rate = sdb->wal->used * 1000000 / elapsed;
+            }
+            if (opts->wal_sync) wal_sync_start(sdb);
+            checkpoint_start(sdb, opts);
+        }
+    }
+    tier_rebalance(sdb, NULL);
+    return sdb;
+}
+
+/**
+ * @brief Returns the default open options
+ * 
+ * @return Options for an in-memory database with LZ77 compression
+ */
+SDBOptions sdb_options_default(void) {
+    SDBOptions options;
+    options.compress_type = SDB_COMPRESS_LZ77;
+    options.storage_mode = SDB_STORAGE_MEMORY;
+    options.pool_pages = SDB_DEFAULT_POOL_PAGES;
+    options.memory_target = 0;
+    options.strict_verify = 0;
+    options.wal_size = SDB_DEFAULT_WAL_SIZE;
+    options.wal_sync = 1;
+    options.checkpoint_log_size = 0;
+    options.checkpoint_interval = SDB_DEFAULT_CHECKPOINT_INTERVAL;
+    options.recovery_target_ms = SDB_DEFAULT_RECOVERY_MS;
+    options.replay_threads = 0;
+    options.log_soft_limit = 0;
+    options.log_hard_limit = 0;
+    options.max_write_delay_us = SDB_DEFAULT_MAX_WRITE_DELAY;
+    options.hot_keys = 0;
+    return options;
+}
+
+/**
+ * @brief Opens a database file with explicit options
+ * 
+ * With SDB_STORAGE_PAGED the database lives in fixed-size pages on disk and
+ * only the pages held by the buffer pool are kept in memory, so tables can
+ * grow larger than RAM. Existing page files are always opened in paged mode.
+ * 
+ * In memory mode only the footer of a format 3 file is read on open; each
+ * table is loaded, and its blocks verified, when it is first used. With
+ * strict_verify every block is verified before sdb_open_ex returns.
+ * 
+ * Unless wal_size is 0, writes in memory mode go to a write-ahead log at
+ * <path>.wal, which is replayed here over the last snapshot, with the
+ * tables spread over replay_threads threads. A background
+ * thread folds the log into the snapshot often enough that this replay
+ * stays within recovery_target_ms. If the header of an existing log is
+ * damaged, the open fails instead of dropping the records in it.
+ * 
+ * @param path The path to the database file
+ * @param options The open options, or NULL for the defaults
+ * @return The database, or NULL on failure (including a failed strict
+ *         verification or a damaged log)
+ */
+SDB* sdb_open_ex(const char* path, const SDBOptions* options) {
+    SDBOptions opts = options ? *options : sdb_options_default();
+
+    SDB* sdb = (SDB*)calloc(1, sizeof(SDB));
+    if (sdb == NULL) {
+        return NULL;
+    }
+    
+    sdb->path = strdup(path);
+    sdb->tables = NULL;
+    sdb->table_count = 0;
+    sdb->compress_type = opts.compress_type;
+    sdb->storage_mode = SDB_STORAGE_MEMORY;
+    sdb->memory_target = opts.memory_target;
+    sdb->hot_keys = opts.hot_keys < SDB_MAX_HOT_KEYS ? opts.hot_keys : SDB_MAX_HOT_KEYS;
+    sdb->cold_fd = -1;
+    sdb->block_fd = -1;
+    sdb->cached_block = -1;
+    pthread_mutex_init(&sdb->lock, NULL);
+    pthread_cond_init(&sdb->checkpoint_done, NULL);
+    pthread_cond_init(&sdb->load_done, NULL);
+
+    FILE* file = fopen(path, "rb");
+
+    // Page files carry their own magic, so they are recognized regardless of mode
+    uint32_t magic = 0;
+    if (file != NULL && fread(&magic, sizeof(uint32_t), 1, file) == 1) {
+        rewind(file);
+    }
+    if (opts.storage_mode == SDB_STORAGE_PAGED || magic == SDB_PAGED_MAGIC) {
+        if (file != NULL) fclose(file);
+        if (paged_open(sdb, opts.pool_pages) != 0) {
+            for (int i = 0; i < sdb->table_count; i++) {
+                free(sdb->tables[i].name);
+                hot_keys_free(sdb->tables[i].hot);
+                free(sdb->tables[i].loader);
+            }
+            pager_close(sdb->pager);
+            pthread_cond_destroy(&sdb->checkpoint_done);
+            pthread_cond_destroy(&sdb->load_done);
+            pthread_mutex_destroy(&sdb->lock);
+            free(sdb->tables);
+            free(sdb->path);
+            free(sdb);
+            return NULL;
+        }
+        return sdb;
+    }
+
+    if (file != NULL) {
+        // Read and verify file header
+        uint32_t version;
+        SDBCompressType stored_compress_type;
+        
+        if (fread(&magic, sizeof(uint32_t), 1, file) != 1 ||
+            fread(&version, sizeof(uint32_t), 1, file) != 1 ||
+            fread(&stored_compress_type, sizeof(SDBCompressType), 1, file) != 1) {
+            fclose(file);
+            return sdb_open_finish(sdb, &opts);  // Return empty database if header read fails
+        }
+
+        // Verify magic number and version
+        if (magic != SDB_MAGIC || version > SDB_FILE_VERSION) {
+            fclose(file);
+            return sdb_open_finish(sdb, &opts);  // Return empty database if validation fails
+        }
+
+        // Use stored compression type if it exists
+        sdb->compress_type = stored_compress_type;
+
+        if (version >= 3) {
+            int loaded = blocked_load(sdb, fileno(file), opts.strict_verify);
+            fclose(file);
+            if (loaded != 0) {
+                sdb_close(sdb);
+                return NULL;
+            }
+            return sdb_open_finish(sdb, &opts);
+        }
+
+        // Older formats are one stream that is read front to back
+        SDB_FADVISE(fileno(file), 0, 0, SEQUENTIAL);
+
+        // Read compressed data
+        size_t compressed_size, original_size;
+        fread(&compressed_size, sizeof(size_t), 1, file);
+        fread(&original_size, sizeof(size_t), 1, file);
+        
+        unsigned char* compressed = (unsigned char*)malloc(compressed_size);
+        fread(compressed, 1, compressed_size, file);
+        
+        // Decompress data using the stored compression type; format 1
+        // files used LZ77 for everything but RLE
+        size_t decompressed_size;
+        unsigned char* buffer;
+        if (version >= 2) {
+            buffer = sdb_decompress(sdb->compress_type, compressed, compressed_size, &decompressed_size);
+        } else if (sdb->compress_type == SDB_COMPRESS_RLE) {
+            buffer = rle_decompress(compressed, compressed_size, &decompressed_size);
+        } else {
+            buffer = lz77_decompress(compressed, compressed_size, &decompressed_size);
+        }
+        free(compressed);
+        
+        if (buffer && decompressed_size == original_size) {
+            size_t pos = 0;
+            
+            // Read table count
+            memcpy(&sdb->table_count, buffer + pos, sizeof(int));
+            pos += sizeof(int);
+            
+            if (sdb->table_count > 0) {
+                sdb->tables = (SDBTable*)malloc(sizeof(SDBTable) * sdb->table_count);
+                
+                // Read each table
+                for (int i = 0; i < sdb->table_count; i++) {
+                    int name_len;
+                    memcpy(&name_len, buffer + pos, sizeof(int));
+                    pos += sizeof(int);
+                    
+                    sdb->tables[i].name = (char*)malloc(name_len + 1);
+                    memcpy(sdb->tables[i].name, buffer + pos, name_len);
+                    pos += name_len;
+                    sdb->tables[i].name[name_len] = '\0';
+                    
+                    sdb->tables[i].entries = entry_list_create();
+                    sdb->tables[i].hot = NULL;
+                    sdb->tables[i].loader = NULL;
+                    sdb->tables[i].block_reads = 0;
+                    sdb->tables[i].frozen = 0;
+                    sdb->tables[i].ordered = NULL;
+                    sdb->tables[i].root_page = 0;
+                    sdb->tables[i].lazy_index = -1;
+                    
+                    // Read entries
+                    int entry_count;
+                    memcpy(&entry_count, buffer + pos, sizeof(int));
+                    pos += sizeof(int);
+                    
+                    for (int j = 0; j < entry_count; j++) {
+                        const char *key, *value;
+                        uint32_t key_len, value_len;
+                        size_t next = block_next_entry(buffer, decompressed_size, pos,
+                                                       &key, &key_len, &value, &value_len);
+                        if (next == 0) break;
+                        pos = next;
+                        table_load_entry(sdb, &sdb->tables[i], key, key_len, value, value_len);
+                    }
+                }
+            }
+            free(buffer);
+        }
+        SDB_FADVISE(fileno(file), 0, 0, DONTNEED);
+        fclose(file);
+    }
+
+    return sdb_open_finish(sdb, &opts);
+}
+
+/**
+ * @brief Opens a database file
+ * 
+ * @param path The path to the database file
+ * @param compress_type Compression used when saving
+ * @return The database
+ */
+SDB* sdb_open(const char* path, SDBCompressType compress_type) {
+    SDBOptions options = sdb_options_default();
+    options.compress_type = compress_type;
+    return sdb_open_ex(path, &options);
+}
+
+/**
+ * @brief Closes the database
+ * 
+ * @param sdb The database
+ */
+void sdb_close(SDB* sdb) {
+    if (!sdb) return;
+    sdb_scrub_stop(sdb);
+    checkpoint_stop(sdb);
+    wal_sync_stop(sdb);
+
+    // A final checkpoint leaves the snapshot complete on its own
+    database_lock(sdb);
+    if (sdb->wal) {
+        if (sdb->wal->used > 0) checkpoint_run(sdb);
+        wal_close(sdb->wal);
+        sdb->wal = NULL;
+    }
+    pthread_mutex_unlock(&sdb->lock);
+    pthread_cond_destroy(&sdb->checkpoint_done);
+    pthread_cond_destroy(&sdb->load_done);
+    pthread_mutex_destroy(&sdb->lock);
+
+    if (sdb->pager) {
+        paged_sync(sdb);
+        pager_close(sdb->pager);
+        for (int i = 0; i < sdb->table_count; i++) {
+            free(sdb->tables[i].name);
+            hot_keys_free(sdb->tables[i].hot);
+            free(sdb->tables[i].loader);
+        }
+        free(sdb->tables);
+        free(sdb->scratch);
+        free(sdb->path);
+        free(sdb);
+        return;
+    }
+
+    // Free all tables and their entries
+    for (int i = 0; i < sdb->table_count; i++) {
+        // Free all entries in the table
+        SDBEntry* current = sdb->tables[i].entries->head;
         while (current != NULL) {
-            entry_count++;
-            current = current->next;
+            SDBEntry* next = current->next;
+            free(current);
+            current = next;
+        }
+        
+        // Free table structure
+        if (sdb->tables[i].ordered) skiplist_free(sdb->tables[i].ordered);
+        arena_destroy(&sdb->tables[i].entries->arena);
+        free(sdb->tables[i].name);
+        hot_keys_free(sdb->tables[i].hot);
+        free(sdb->tables[i].loader);
+        free(sdb->tables[i].entries->entries);
+        free(sdb->tables[i].entries);
+    }
+
+    // Free tables array
+    free(sdb->tables);
+    free(sdb->scratch);
+    ordered_free(sdb->ordered);
+    block_source_close(sdb);
+
+    // The cold segment only mirrors data that is in the database file
+    if (sdb->cold_fd >= 0) {
+        char* cold_path = sidecar_path(sdb, ".cold");
+        close(sdb->cold_fd);
+        if (cold_path) unlink(cold_path);
+        free(cold_path);
+    }
+    
+    // Free path
+    free(sdb->path);
+    
+    // Finally free the SDB structure
+    free(sdb);
+}
+
+/**
+ * @brief Saves the database
+ * 
+ * In memory mode this is a checkpoint: a complete snapshot replaces the
+ * database file and the log is recycled. Other threads can keep using the
+ * database while the snapshot is written. Afterwards the arenas are
+ * compacted as by sdb_compact(), so pointers returned by earlier gets are
+ * no longer valid.
+ * 
+ * @param sdb The database
+ */
+void sdb_save(SDB* sdb) {
+    database_lock(sdb);
+    if (sdb->pager) {
+        // Paged databases only write back the pages that changed
+        paged_sync(sdb);
+    } else {
+        checkpoint_run(sdb);
+        for (int i = 0; i < sdb->table_count; i++) {
+            arena_compact(&sdb->tables[i].entries->arena);
+        }
+    }
+    pthread_mutex_unlock(&sdb->lock);
+}
+
+/**
+ * @brief Copies a byte range between file descriptors inside the kernel
+ * 
+ * Regular file targets use copy_file_range, which lets the filesystem share
+ * extents instead of copying them. Sockets and pipes use sendfile. The
+ * function falls back to a read/write loop when neither is available.
+ * 
+ * @param out_fd Destination descriptor
+ * @param in_fd Source descriptor, read from offset 0
+ * @param size Number of bytes to copy
+ * @return 0 on success, -1 on failure
+ */
+static int copy_fd_range(int out_fd, int in_fd, off_t size) {
+    off_t offset = 0;
+
+#ifdef __linux__
+    struct stat st;
+    int regular = fstat(out_fd, &st) == 0 && S_ISREG(st.st_mode);
+    while (offset < size) {
+        ssize_t n;
+#ifdef SYS_copy_file_range
+        if (regular) {
+            int64_t in_off = offset;
+            n = syscall(SYS_copy_file_range, in_fd, &in_off, out_fd, NULL, (size_t)(size - offset), 0u);
+            if (n > 0) offset = in_off;
+        } else
+#endif
+        {
+            n = sendfile(out_fd, in_fd, &offset, (size_t)(size - offset));
+        }
+        if (n > 0) continue;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && regular) {
+            regular = 0;  // Not supported for this pair, retry with sendfile
+            continue;
+        }
+        if (n < 0 && (errno == EINVAL || errno == ENOSYS)) break;
+        return -1;
+    }
+#endif
+
+    // Portable fallback through a user space buffer
+    unsigned char buffer[POOL_BLOCK_SIZE * 16];
+    while (offset < size) {
+        size_t want = size - offset < (off_t)sizeof(buffer) ? (size_t)(size - offset) : sizeof(buffer);
+        ssize_t n = pread(in_fd, buffer, want, offset);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            return -1;
+        }
+        for (ssize_t done = 0; done < n;) {
+            ssize_t w = write(out_fd, buffer + done, n - done);
+            if (w < 0 && errno == EINTR) continue;
+            if (w <= 0) return -1;
+            done += w;
+        }
+        offset += n;
+    }
+    return 0;
+}
+
+/**
+ * @brief Streams the on-disk snapshot of the database to a descriptor
+ * 
+ * Useful for seeding replicas and backups: the data never passes through
+ * user space when the kernel can copy it directly. Paged databases are
+ * synced first and copied with the lock held, since page writes go to the
+ * file in place. In memory mode pending log records are saved into the
+ * snapshot first; the file is opened before the lock is released, and
+ * since saves replace the file atomically, the export is never a
+ * half-written snapshot.
+ * 
+ * @param sdb The database
+ * @param fd Destination socket, pipe or file, written from its current position
+ * @return 0 on success, -1 on failure
+ */
+int sdb_export_snapshot(SDB* sdb, int fd) {
+    database_lock(sdb);
+    int paged = sdb->pager != NULL;
+    if (paged) {
+        paged_sync(sdb);
+    } else if (sdb->wal && sdb->wal->used > 0) {
+        // Fold the log into the snapshot so the export is current
+        checkpoint_run(sdb);
+    }
+
+    int in_fd = open(sdb->path, O_RDONLY);
+    if (!paged) pthread_mutex_unlock(&sdb->lock);
+
+    int result = -1;
+    struct stat st;
+    if (in_fd >= 0 && fstat(in_fd, &st) == 0) {
+        SDB_FADVISE(in_fd, 0, 0, SEQUENTIAL);
+        result = copy_fd_range(fd, in_fd, st.st_size);
+    }
+    if (in_fd >= 0) close(in_fd);
+    if (paged) pthread_mutex_unlock(&sdb->lock);
+    return result;
+}
+
+/**
+ * @brief Fills table information from the meta and root pages of a page file
+ * 
+ * @param file The open page file
+ * @param info The info to fill
+ */
+static void peek_paged_info(FILE* file, SDBFileInfo* info) {
+    unsigned char meta[POOL_BLOCK_SIZE];
+    unsigned char root[POOL_BLOCK_SIZE];
+    if (fseek(file, 0, SEEK_SET) != 0 || fread(meta, 1, POOL_BLOCK_SIZE, file) != POOL_BLOCK_SIZE) {
+        return;
+    }
+
+    info->format_version = get_u32(meta + SDB_META_VERSION);
+    info->storage_mode = SDB_STORAGE_PAGED;
+    info->compress_type = SDB_COMPRESS_NONE;
+    uint32_t table_count = get_u32(meta + SDB_META_TABLE_COUNT);
+    if (table_count > SDB_MAX_PAGED_TABLES) return;
+
+    info->tables = (SDBTableInfo*)calloc(table_count ? table_count : 1, sizeof(SDBTableInfo));
+    if (!info->tables) return;
+    info->table_count = 0;
+    for (uint32_t i = 0; i < table_count; i++) {
+        off_t offset = (off_t)get_u32(meta + SDB_META_ROOTS + i * 4) * POOL_BLOCK_SIZE;
+        if (fseeko(file, offset, SEEK_SET) != 0 || fread(root, 1, POOL_BLOCK_SIZE, file) != POOL_BLOCK_SIZE) {
+            break;
+        }
+        uint16_t name_len = get_u16(root + SDB_ROOT_NAME_LEN);
+        if (name_len > SDB_PAGED_NAME_MAX || SDB_ROOT_NAME + name_len > POOL_BLOCK_SIZE) break;
+        SDBTableInfo* table = &info->tables[info->table_count++];
+        table->name = (char*)malloc(name_len + 1);
+        if (table->name) {
+            memcpy(table->name, root + SDB_ROOT_NAME, name_len);
+            table->name[name_len] = '\0';
+        }
+        table->entry_count = get_u64(root + SDB_ROOT_COUNT);
+        table->data_size = get_u64(root + SDB_ROOT_BYTES);
+    }
+}
+
+/**
+ * @brief Reads a database file's metadata without loading its data
+ * 
+ * Only the header and the footer are read; the payload is never
+ * decompressed. For page files the meta and table root pages are read.
+ * Format 1 files have no footer, so their table_count is -1.
+ * 
+ * @param path The path to the database file
+ * @return The file info; format_version is 0 if the file is not readable.
+ *         Release it with sdb_free_file_info().
+ */
+SDBFileInfo sdb_peek_info(const char* path) {
+    SDBFileInfo info = {0};
+    info.table_count = -1;
+
+    FILE* file = fopen(path, "rb");
+    if (!file) return info;
+
+    struct stat st;
+    uint32_t magic, version;
+    SDBCompressType compress_type;
+    if (fstat(fileno(file), &st) != 0 ||
+        fread(&magic, sizeof(uint32_t), 1, file) != 1 ||
+        fread(&version, sizeof(uint32_t), 1, file) != 1) {
+        fclose(file);
+        return info;
+    }
+    info.file_size = (uint64_t)st.st_size;
+
+    if (magic == SDB_PAGED_MAGIC) {
+        peek_paged_info(file, &info);
+        fclose(file);
+        return info;
+    }
+
+    if (magic != SDB_MAGIC || version > SDB_FILE_VERSION ||
+        fread(&compress_type, sizeof(SDBCompressType), 1, file) != 1) {
+        fclose(file);
+        return info;
+    }
+    info.format_version = version;
+    info.storage_mode = SDB_STORAGE_MEMORY;
+    info.compress_type = compress_type;
+
+    if (version < 3) {
+        size_t compressed_size, original_size;
+        if (fread(&compressed_size, sizeof(size_t), 1, file) != 1 ||
+            fread(&original_size, sizeof(size_t), 1, file) != 1) {
+            fclose(file);
+            return info;
+        }
+        info.compressed_size = compressed_size;
+        info.original_size = original_size;
+    }
+
+    // Format 1 has no footer; later formats locate it through the trailer
+    SDBBlockInfo* blocks = NULL;
+    if (version >= 2 &&
+        footer_read(fileno(file), version, &info, version >= 3 ? &blocks : NULL,
+                    &info.block_count, NULL) != 0) {
+        sdb_free_file_info(info);
+        info.tables = NULL;
+        info.block_keys = NULL;
+        info.table_count = -1;
+        info.block_count = 0;
+    }
+    for (uint32_t b = 0; blocks && b < info.block_count; b++) {
+        info.compressed_size += blocks[b].comp_len;
+        info.original_size += blocks[b].raw_len;
+    }
+    free(blocks);
+    fclose(file);
+    return info;
+}
+
+/**
+ * @brief Frees the memory held by an SDBFileInfo
+ * 
+ * @param info The file info
+ */
+void sdb_free_file_info(SDBFileInfo info) {
+    for (int i = 0; i < info.table_count; i++) {
+        free(info.tables[i].name);
+    }
+    free(info.tables);
+    free(info.block_keys);
+}
+
+/*******************************************************************************
+ * Table Management Functions
+ ******************************************************************************/
+/**
+ * @brief Creates a table; the caller holds sdb->lock
+ */
+static void table_create(SDB* sdb, const char* name) {
+    if (sdb_table_find(sdb, name)) return;
+
+    if (sdb->pager) {
+        paged_table_create(sdb, name);
+        return;
+    }
+
+    sdb->table_count++;
+    sdb->tables = (SDBTable*)realloc(sdb->tables, sizeof(SDBTable) * sdb->table_count);
+    
+    // Initialize the new table
+    SDBTable* table = &sdb->tables[sdb->table_count - 1];
+    table->name = strdup(name);
+    table->entries = entry_list_create();
+    table->hot = NULL;
+    table->loader = NULL;
+    table->block_reads = 0;
+    table->frozen = 0;
+    table->ordered = NULL;
+    table->root_page = 0;
+    table->lazy_index = -1;
+
+    wal_commit(sdb, SDB_WAL_CREATE, name, NULL, NULL);
+}
+
+/**
+ * @brief Creates a table in the database
+ * 
+ * @param sdb The database
+ * @param name The name of the table
+ */
+void sdb_table_create(SDB* sdb, const char* name) {
+    database_lock(sdb);
+    table_create(sdb, name);
+    wal_wait_synced(sdb);
+    pthread_mutex_unlock(&sdb->lock);
+}
+
+/**
+ * @brief Destroys a table; the caller holds sdb->lock
+ */
+static void table_destroy(SDB* sdb, const char* name) {
+    for (int i = 0; i < sdb->table_count; i++) {
+        if (strcmp(sdb->tables[i].name, name) == 0) {
+            if (sdb->pager) {
+                paged_table_destroy(sdb, &sdb->tables[i]);
+            } else {
+                // Free entries
+                SDBEntry* current = sdb->tables[i].entries->head;
+                while (current != NULL) {
+                    SDBEntry* next = current->next;
+                    tier_forget(sdb, current);
+                    free(current);
+                    current = next;
+                }
+                
+                // Free keys, values and hash table array
+                arena_destroy(&sdb->tables[i].entries->arena);
+                free(sdb->tables[i].entries->entries);
+                free(sdb->tables[i].entries);
+            }
+            char* table_name = sdb->tables[i].name;
+            SDBSkiplist* list = sdb->tables[i].ordered;
+            hot_keys_free(sdb->tables[i].hot);
+            free(sdb->tables[i].loader);
+
+            // Close the gap in the tables array
+            memmove(&sdb->tables[i], &sdb->tables[i + 1],
+                    sizeof(SDBTable) * (sdb->table_count - i - 1));
+            sdb->table_count--;
+
+            // Lock-free readers may still be in the skiplist. If the table
+            // cannot be unpublished, they may keep finding it, so it leaks.
+            if (list && ordered_publish(sdb) == 0) {
+                list->retired = sdb->ordered->retired_lists;
+                sdb->ordered->retired_lists = list;
+            }
+
+            if (!sdb->pager) wal_commit(sdb, SDB_WAL_DESTROY, table_name, NULL, NULL);
+            free(table_name);
+            return;
+        }
+    }
+}
+
+/**
+ * @brief Destroys a table in the database
+ * 
+ * @param sdb The database
+ * @param name The name of the table
+ */
+void sdb_table_destroy(SDB* sdb, const char* name) {
+    database_lock(sdb);
+    table_destroy(sdb, name);
+    wal_wait_synced(sdb);
+    pthread_mutex_unlock(&sdb->lock);
+}
+
+/**
+ * @brief Finds a table in the database
+ * 
+ * @param sdb The database
+ * @param name The name of the table
+ * @return The table
+ */
+SDBTable* sdb_table_find(SDB* sdb, const char* name) {
+    for (int i = 0; i < sdb->table_count; i++) {
+        if (strcmp(sdb->tables[i].name, name) == 0) {
+            return &sdb->tables[i];
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+ * Data Access Functions
+ ******************************************************************************/
+/**
+ * @brief Returns when a value stored now goes stale, or 0 if it never does
+ */
+static uint32_t table_expiry(const SDBTable* t) {
+    if (!t->loader || t->loader->ttl == 0) return 0;
+    return (uint32_t)(clock_us() / 1000000) + t->loader->ttl;
+}
+
+/**
+ * @brief Stores a value in a loaded table
+ * 
+ * Only the table and the counters passed in are touched, so replay workers
+ * can insert into different tables at once.
+ * 
+ * @param t The table, with its blocks loaded
+ * @param memory_used Charged for the new value and credited for the old one
+ * @param cold_dead Grows by the old value's size if it was cold
+ * @return The entry, or NULL when out of memory
+ */
+static SDBEntry* table_insert(SDBTable* t, const char* key, const char* value,
+                              size_t* memory_used, uint64_t* cold_dead) {
+    // Overwrites replace the value in place, once the new one is copied
+    SDBArena* arena = &t->entries->arena;
+    SDBEntry* e = entry_list_find(t->entries, key);
+    SDBEntry* fresh = NULL;
+    if (!e) {
+        fresh = e = (SDBEntry*)calloc(1, sizeof(SDBEntry));
+        if (!e) return NULL;
+        e->key = arena_copy(arena, e, 0, key, strlen(key));
+        if (!e->key) {
+            free(e);
+            return NULL;
         }
-        
-        write_to_buffer(&buffer, &buffer_size, &current_size, 
-                       &entry_count, sizeof(int));
-        
-        // Write each entry
-        current = sdb->tables[i].entries->head;
-        while (current != NULL) {
-            int key_len = strlen(current->key);
-            int value_len = strlen(current->value);
-            
-            write_to_buffer(&buffer, &buffer_size, &current_size, 
-                           &key_len, sizeof(int));
-            write_to_buffer(&buffer, &buffer_size, &current_size, 
-                           &value_len, sizeof(int));
-            write_to_buffer(&buffer, &buffer_size, &current_size, 
-                           current->key, key_len);
-            write_to_buffer(&buffer, &buffer_size, &current_size, 
-                           current->value, value_len);
-            
-            current = current->next;
+    }
+    size_t value_len = strlen(value);
+    char* copy = arena_copy(arena, e, 1, value, value_len);
+    if (!copy) {
+        if (fresh) {
+            arena_release(fresh->key);
+            free(fresh);
+        }
+        return NULL;
+    }
+    if (fresh) {
+        entry_list_append(t->entries, fresh);
+    } else {
+        if (e->value) *memory_used -= e->value_len + 1;
+        else *cold_dead += e->cold_len;
+        arena_release(e->value);
+    }
+    e->value = copy;
+    e->value_len = (uint32_t)value_len;
+    e->expires = table_expiry(t);
+    if (e->hits < UINT32_MAX) e->hits++;
+    *memory_used += e->value_len + 1;
+    return e;
+}
+
+/**
+ * @brief Stores a value without logging it; the caller holds sdb->lock
+ * 
+ * @return The stored copy of value, which stays in place until the next
+ *         compaction, or NULL in paged mode or when out of memory
+ */
+static const char* table_put(SDB* sdb, SDBTable* t, const char* key, const char* value) {
+    if (sdb->pager) {
+        paged_table_set(sdb, t, key, value);
+        return NULL;
+    }
+    table_load_blocks(sdb, t);
+    t->frozen = 0;  // Until the next freeze, the table stays in memory
+
+    SDBEntry* e = table_insert(t, key, value, &sdb->memory_used, &sdb->cold_dead);
+    if (!e) return NULL;
+    tier_rebalance(sdb, e);
+    return e->value;
+}
+
+/**
+ * @brief Logs a write to an ordered table; the caller holds sdb->lock
+ * 
+ * The value gets its sequence number together with its log record, so
+ * the order of the log decides which of two writes to a key stays. When
+ * the ring is full, this waits for a checkpoint with the lock released
+ * and tries again. Without a log, or if the record does not fit, the
+ * value is inserted here and a snapshot is saved instead.
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @param key The key
+ * @param value The new value, owned by the callee
+ * @return The table, whose skiplist the caller inserts the value into, or
+ *         NULL if the write was completed or dropped here
+ */
+static SDBTable* ordered_log(SDB* sdb, const char* table, const char* key, SDBSkipValue* value) {
+    SDBOrderedTables* ord = sdb->ordered;
+    SDBWal* wal = sdb->wal;
+    for (;;) {
+        SDBTable* t = sdb_table_find(sdb, table);
+        if (!t || !t->ordered) {
+            // Destroyed while waiting for room
+            if (t) table_set(sdb, table, key, skip_value_data(value));
+            free(value);
+            return NULL;
+        }
+
+        value->seq = ++ord->seq;
+        if (wal && wal_append(wal, SDB_WAL_SET, table, key, skip_value_data(value)) == 0) {
+            wal_request_checkpoint(sdb);
+            return t;
+        }
+        if (wal && sdb->checkpointer && wal->used > 0 && !wal->failed) {
+            uint64_t start = clock_us();
+            sdb->checkpoint_stats.write_waits++;
+            int waited = checkpoint_wait(sdb);
+            sdb->checkpoint_stats.stall_us += clock_us() - start;
+            if (waited == 0) continue;
+            t = sdb_table_find(sdb, table);
+            if (!t || !t->ordered) continue;
+        }
+
+        ordered_retire(ord, skiplist_insert(t->ordered, key, (uint32_t)strlen(key), value));
+        checkpoint_run(sdb);
+        return NULL;
+    }
+}
+
+/**
+ * @brief Sets a value; the caller holds sdb->lock
+ */
+static void table_set(SDB* sdb, const char* table, const char* key, const char* value) {
+    SDBTable* t = sdb_table_find(sdb, table);
+    if (!t) return;
+    hot_keys_track(sdb, t, key, 1);
+    if (!sdb->wal || !sdb->wal->replaying) sdb->write_stats.user_bytes += strlen(key) + strlen(value);
+
+    if (t->ordered) {
+        SDBSkipValue* copy = skip_value_create(value, strlen(value), 0);
+        if (!copy) return;
+        t = ordered_log(sdb, table, key, copy);
+        if (!t) return;
+        ordered_retire(sdb->ordered, skiplist_insert(t->ordered, key, (uint32_t)strlen(key), copy));
+        wal_throttle(sdb);
+        return;
+    }
+
+    // The stored copy is logged, since value may be the old value just freed
+    const char* stored = table_put(sdb, t, key, value);
+    if (!stored) return;
+    wal_commit(sdb, SDB_WAL_SET, table, key, stored);
+}
+
+/**
+ * @brief Sets a value in the database
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @param key The key
+ * @param value The value
+ */
+void sdb_table_set(SDB* sdb, const char* table, const char* key, const char* value) {
+    // Values of ordered tables are copied before the lock is taken
+    SDBOrderedTables* ord = __atomic_load_n(&sdb->ordered, __ATOMIC_ACQUIRE);
+    SDBSkipValue* copy = NULL;
+    if (ord) {
+        unsigned epoch = ordered_enter(ord);
+        if (ordered_find(ord, table)) copy = skip_value_create(value, strlen(value), 0);
+        ordered_exit(ord, epoch);
+    }
+
+    database_lock(sdb);
+    SDBTable* t = copy ? sdb_table_find(sdb, table) : NULL;
+    if (!t || !t->ordered) {
+        free(copy);
+        table_set(sdb, table, key, value);
+        wal_wait_synced(sdb);
+        pthread_mutex_unlock(&sdb->lock);
+        return;
+    }
+
+    // Only logging holds the lock; the insert runs alongside other writers
+    hot_keys_track(sdb, t, key, 1);
+    sdb->write_stats.user_bytes += strlen(key) + copy->len;
+    t = ordered_log(sdb, table, key, copy);
+    if (!t) {
+        wal_wait_synced(sdb);
+        pthread_mutex_unlock(&sdb->lock);
+        return;
+    }
+    SDBSkiplist* list = t->ordered;
+    SDBCheckpointer* cp = sdb->checkpointer;
+    int relock = sdb->wal->syncer || (cp && sdb->wal->used >= cp->soft_limit) ||
+                 __atomic_load_n(&ord->retired_bytes, __ATOMIC_RELAXED) >= SDB_RECLAIM_BYTES;
+    __atomic_fetch_add(&ord->pending, 1, __ATOMIC_RELAXED);
+    unsigned epoch = ordered_enter(ord);
+    pthread_mutex_unlock(&sdb->lock);
+
+    ordered_retire(ord, skiplist_insert(list, key, (uint32_t)strlen(key), copy));
+    __atomic_fetch_sub(&ord->pending, 1, __ATOMIC_RELEASE);
+    ordered_exit(ord, epoch);
+    if (!relock) return;
+
+    database_lock(sdb);
+    if (sdb->wal) wal_throttle(sdb);
+    ordered_reclaim(ord);
+    wal_wait_synced(sdb);
+    pthread_mutex_unlock(&sdb->lock);
+}
+
+/**
+ * @brief Gets a value; the caller holds sdb->lock
+ */
+static char* table_get(SDB* sdb, const char* table, const char* key) {
+    SDBTable* t = sdb_table_find(sdb, table);
+    if (t == NULL) {
+        return NULL;
+    }
+    hot_keys_track(sdb, t, key, 0);
+
+    if (t->ordered) {
+        SDBSkipValue* found = skiplist_get(t->ordered, key);
+        return found ? skip_value_data(found) : NULL;
+    }
+
+    // Paged values are copied out; the pointer is valid until the next get
+    if (sdb->pager) {
+        return paged_table_get(sdb, t, key);
+    }
+
+    // Sorted tables are read from disk without loading them, keeping the
+    // hits as entries. Without a memory target, a table is loaded once
+    // lookups have decoded as many blocks as loading it would, unless it
+    // is frozen. TTLs need entries.
+    const SDBSortedRun* run = table_sorted_run(sdb, t);
+    int on_disk = run && (sdb->memory_target || t->frozen || t->block_reads < run->count) &&
+                  !(t->loader && t->loader->ttl);
+    if (!on_disk) table_load_blocks(sdb, t);
+
+    SDBEntry* e = entry_list_find(t->entries, key);
+    if (e == NULL) {
+        return on_disk ? sorted_get(sdb, t, run, key) : NULL;
+    }
+
+    // Values from before the loader, or from disk, go stale a TTL after first use
+    if (t->loader && t->loader->ttl) {
+        if (e->expires == 0) e->expires = table_expiry(t);
+        else if ((uint32_t)(clock_us() / 1000000) >= e->expires) return NULL;
+    }
+
+    if (e->hits < UINT32_MAX) e->hits++;
+    if (e->value == NULL) {
+        if (tier_promote(sdb, &t->entries->arena, e) != 0) return NULL;
+        tier_rebalance(sdb, e);
+    }
+    return e->value;
+}
+
+/**
+ * @brief Fills a miss through the table's loader; the caller holds sdb->lock
+ * 
+ * The lock is released while the loader runs. Callers that miss a key
+ * which is already being loaded wait for that load instead of starting
+ * another one. Loaded values are not logged; they reach the file with the
+ * next checkpoint or save.
+ * 
+ * @return The value, or NULL if the table has no loader or the loader
+ *         found nothing
+ */
+static char* table_load(SDB* sdb, const char* table, const char* key) {
+    SDBTable* t = sdb_table_find(sdb, table);
+    if (!t || !t->loader) return NULL;
+
+    for (SDBLoad* load = sdb->loads; load; load = load->next) {
+        if (strcmp(load->key, key) != 0 || strcmp(load->table, table) != 0) continue;
+
+        load->waiters++;
+        while (!load->done) pthread_cond_wait(&sdb->load_done, &sdb->lock);
+        if (--load->waiters == 0) {
+            free(load->table);
+            free(load->key);
+            free(load);
+        }
+        return table_get(sdb, table, key);
+    }
+
+    SDBLoad* load = (SDBLoad*)calloc(1, sizeof(SDBLoad));
+    if (!load) return NULL;
+    load->table = strdup(table);
+    load->key = strdup(key);
+    load->next = sdb->loads;
+    sdb->loads = load;
+
+    SDBReadThrough loader = *t->loader;
+    pthread_mutex_unlock(&sdb->lock);
+    char* value = loader.load(loader.context, table, key);
+    database_lock(sdb);
+
+    // The table may have moved or gone while unlocked
+    t = sdb_table_find(sdb, table);
+    if (value && t) table_put(sdb, t, key, value);
+    free(value);
+
+    SDBLoad** link = &sdb->loads;
+    while (*link != load) link = &(*link)->next;
+    *link = load->next;
+    load->done = 1;
+    pthread_cond_broadcast(&sdb->load_done);
+    if (load->waiters == 0) {
+        free(load->table);
+        free(load->key);
+        free(load);
+    }
+    return value && t ? table_get(sdb, table, key) : NULL;
+}
+
+/**
+ * @brief Gets a value from the database
+ * 
+ * The value belongs to the database. In memory mode it stays valid until
+ * its key is overwritten, its table is unloaded or destroyed, or
+ * sdb_compact(), sdb_save() or sdb_set_memory_target() moves values; with
+ * a memory target, any call may also demote it. In paged mode it is a
+ * buffer that the next get reuses.
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @param key The key
+ * @return The value
+ */
+char* sdb_table_get(SDB* sdb, const char* table, const char* key) {
+    // Ordered tables are read without the lock
+    SDBOrderedTables* ord = __atomic_load_n(&sdb->ordered, __ATOMIC_ACQUIRE);
+    if (ord) {
+        unsigned epoch = ordered_enter(ord);
+        SDBSkiplist* list = ordered_find(ord, table);
+        SDBSkipValue* found = list ? skiplist_get(list, key) : NULL;
+        ordered_exit(ord, epoch);
+        if (list) return found ? skip_value_data(found) : NULL;
+    }
+
+    database_lock(sdb);
+    char* value = table_get(sdb, table, key);
+    if (value == NULL) value = table_load(sdb, table, key);
+    pthread_mutex_unlock(&sdb->lock);
+    return value;
+}
+
+/**
+ * @brief Gets a copy of a value from the database
+ * 
+ * The copy is made before the lock is released, so unlike the value of
+ * sdb_table_get() it stays valid whatever other threads do meanwhile.
+ * Threads that share a database should read through this.
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @param key The key
+ * @return The value, to be freed by the caller, or NULL if it is missing
+ *         or out of memory
+ */
+char* sdb_table_get_copy(SDB* sdb, const char* table, const char* key) {
+    SDBOrderedTables* ord = __atomic_load_n(&sdb->ordered, __ATOMIC_ACQUIRE);
+    if (ord) {
+        unsigned epoch = ordered_enter(ord);
+        SDBSkiplist* list = ordered_find(ord, table);
+        SDBSkipValue* found = list ? skiplist_get(list, key) : NULL;
+        char* copy = found ? strdup(skip_value_data(found)) : NULL;
+        ordered_exit(ord, epoch);
+        if (list) return copy;
+    }
+
+    database_lock(sdb);
+    char* value = table_get(sdb, table, key);
+    if (value == NULL) value = table_load(sdb, table, key);
+    char* copy = value ? strdup(value) : NULL;
+    pthread_mutex_unlock(&sdb->lock);
+    return copy;
+}
+
+static int entry_compare(const void* a, const void* b) {
+    return strcmp((*(SDBEntry* const*)a)->key, (*(SDBEntry* const*)b)->key);
+}
+
+/**
+ * @brief Calls a function for every key of a table in a range, in key order
+ * 
+ * Unloaded tables of a sorted snapshot are read block by block from the
+ * first block that can hold start, without loading them. Other tables
+ * are sorted in memory. The database stays locked during the scan, so fn
+ * must not call into it. Needs memory mode.
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @param start First key of the range, or NULL to start at the smallest
+ * @param end Key the range stops before, or NULL to go to the largest
+ * @param fn Called with each key and value
+ * @param ctx Passed to fn
+ * @return 0 on success, -1 if the table does not exist or the database is paged
+ */
+int sdb_table_scan(SDB* sdb, const char* table, const char* start, const char* end,
+                   SDBScanFn fn, void* ctx) {
+    // Ordered tables are walked without the lock, so fn may use the database
+    SDBOrderedTables* ord = __atomic_load_n(&sdb->ordered, __ATOMIC_ACQUIRE);
+    if (ord) {
+        unsigned epoch = ordered_enter(ord);
+        SDBSkiplist* list = ordered_find(ord, table);
+        SDBSkipNode* node = list ? skiplist_seek(list, start, start ? (uint32_t)strlen(start) : 0, NULL, NULL) : NULL;
+        uint32_t end_len = end ? (uint32_t)strlen(end) : 0;
+        for (; node; node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE)) {
+            if (end && key_compare(node->key, node->key_len, end, end_len) >= 0) break;
+            SDBSkipValue* value = __atomic_load_n(&node->value, __ATOMIC_ACQUIRE);
+            if (fn(node->key, skip_value_data(value), ctx) != 0) break;
+        }
+        ordered_exit(ord, epoch);
+        if (list) return 0;
+    }
+
+    database_lock(sdb);
+    SDBTable* t = sdb_table_find(sdb, table);
+    if (!t || sdb->pager) {
+        pthread_mutex_unlock(&sdb->lock);
+        return -1;
+    }
+
+    const SDBSortedRun* run = table_sorted_run(sdb, t);
+    if (run && !(t->loader && t->loader->ttl)) {
+        uint32_t b = run->first + run->count;
+        size_t pos = 0;
+        int stop = 0;
+        if (sorted_seek(sdb, t, run, start, &b, &pos) != 0) stop = 1;
+        for (; b < run->first + run->count && !stop; b++, pos = 0) {
+            // The mapping is read randomly by lookups; a scan reads one block ahead
+            if (b + 1 < run->first + run->count) {
+                const SDBBlockInfo* next = &sdb->blocks[b + 1];
+                SDB_FADVISE(sdb->block_fd, next->offset, SDB_BLOCK_HEADER + (uint64_t)next->comp_len, WILLNEED);
+            }
+            size_t entries_end;
+            const unsigned char* raw = sorted_block(sdb, t, b, &entries_end);
+            while (raw && pos < entries_end && !stop) {
+                const char *k, *v;
+                uint32_t k_len, v_len;
+                pos = block_next_entry(raw, entries_end, pos, &k, &k_len, &v, &v_len);
+                if (pos == 0) break;
+                if (end && key_compare(k, k_len, end, (uint32_t)strlen(end)) >= 0) {
+                    stop = 1;
+                    break;
+                }
+                char* value = sorted_copy(sdb, k, k_len, v, v_len);
+                stop = !value || fn(sdb->scratch, value, ctx) != 0;
+            }
+        }
+        pthread_mutex_unlock(&sdb->lock);
+        return 0;
+    }
+    table_load_blocks(sdb, t);
+
+    // Loaded tables are hashed, so the keys in range are collected and sorted
+    SDBEntry** entries = (SDBEntry**)malloc(sizeof(SDBEntry*) * (t->entries->count ? t->entries->count : 1));
+    int result = entries ? 0 : -1;
+    size_t count = 0;
+    uint32_t now = (uint32_t)(clock_us() / 1000000);
+    for (SDBEntry* e = t->entries->head; entries && e; e = e->next) {
+        if (start && strcmp(e->key, start) < 0) continue;
+        if (end && strcmp(e->key, end) >= 0) continue;
+        if (t->loader && t->loader->ttl && e->expires && now >= e->expires) continue;
+        entries[count++] = e;
+    }
+    qsort(entries, count, sizeof(SDBEntry*), entry_compare);
+
+    for (size_t i = 0; i < count; i++) {
+        // Demoted values are read back without promoting them
+        SDBEntry* e = entries[i];
+        char* cold = e->value ? NULL : tier_read_cold(sdb, e);
+        int stop = fn(e->key, e->value ? e->value : cold ? cold : "", ctx) != 0;
+        free(cold);
+        if (stop) break;
+    }
+    free(entries);
+    pthread_mutex_unlock(&sdb->lock);
+    return result;
+}
+
+/**
+ * @brief Visits the keys of a table that start with a prefix, in key order
+ * 
+ * See sdb_table_scan().
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @param prefix The prefix; "" visits every key
+ * @param fn Called for each key
+ * @param ctx Passed to fn
+ * @return 0 on success, -1 if the table does not exist, the database is
+ *         paged or memory ran out
+ */
+int sdb_table_scan_prefix(SDB* sdb, const char* table, const char* prefix, SDBScanFn fn, void* ctx) {
+    // Keys with the prefix sort before the prefix with its last byte below
+    // 0xFF incremented and the bytes after it dropped
+    size_t len = strlen(prefix);
+    char* end = (char*)malloc(len + 1);
+    if (!end) return -1;
+    memcpy(end, prefix, len + 1);
+    while (len > 0 && (unsigned char)end[len - 1] == 0xFF) len--;
+    end[len] = '\0';
+    if (len > 0) end[len - 1] = (char)((unsigned char)end[len - 1] + 1);
+
+    int result = sdb_table_scan(sdb, table, prefix, len > 0 ? end : NULL, fn, ctx);
+    free(end);
+    return result;
+}
+
+/**
+ * @brief Freezes a table that is only read from now on
+ * 
+ * A checkpoint writes the table sorted and with a key index, and drops it
+ * from memory. Lookups then find the rank of a key in the index, so a miss
+ * reads no block and a hit reads one, and reads never load the table. The
+ * next write to the table loads it again and thaws it. Freezing survives
+ * reopening the database.
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @return 0 on success, -1 if the table does not exist or is ordered, the
+ *         database is paged, the checkpoint failed or a write thawed the
+ *         table meanwhile
+ */
+int sdb_table_freeze(SDB* sdb, const char* table) {
+    database_lock(sdb);
+    SDBTable* t = sdb_table_find(sdb, table);
+    if (!t || t->ordered || sdb->pager) {
+        pthread_mutex_unlock(&sdb->lock);
+        return -1;
+    }
+    const SDBSortedRun* run = table_sorted_run(sdb, t);
+    if (run && run->index_block != SDB_NO_KEY) {
+        pthread_mutex_unlock(&sdb->lock);
+        return 0;
+    }
+
+    // The index is built from sorted blocks, so unsorted files are read first
+    if (!run) table_load_blocks(sdb, t);
+    t->frozen = 1;
+    int result = checkpoint_run(sdb);
+
+    // The checkpoint let go of the lock, so the table may have moved
+    t = sdb_table_find(sdb, table);
+    if (!t || !t->frozen) result = -1;
+    pthread_mutex_unlock(&sdb->lock);
+    return result;
+}
+
+/**
+ * @brief Registers a loader that fills a table on misses
+ * 
+ * When sdb_table_get() misses, the loader is called and its value stored
+ * in the table. Concurrent misses of the same key share one call. With a
+ * TTL, values are loaded again once they are older than ttl seconds;
+ * values already in the table count from their first read. TTLs need
+ * memory mode.
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @param loader The loader, or NULL to remove it
+ * @param context Passed to every call of the loader
+ * @param ttl Seconds a value stays fresh, or 0 to keep values for ever
+ * @return 0 on success, -1 if the table does not exist or is ordered, or a
+ *         TTL is asked for in paged mode
+ */
+int sdb_table_set_loader(SDB* sdb, const char* table, SDBLoader loader, void* context,
+                         unsigned ttl) {
+    database_lock(sdb);
+    SDBTable* t = sdb_table_find(sdb, table);
+    if (!t || (loader && t->ordered) || (ttl && sdb->pager)) {
+        pthread_mutex_unlock(&sdb->lock);
+        return -1;
+    }
+
+    if (loader == NULL) {
+        free(t->loader);
+        t->loader = NULL;
+    } else {
+        if (!t->loader) t->loader = (SDBReadThrough*)malloc(sizeof(SDBReadThrough));
+        if (!t->loader) {
+            pthread_mutex_unlock(&sdb->lock);
+            return -1;
+        }
+        t->loader->load = loader;
+        t->loader->context = context;
+        t->loader->ttl = ttl;
+    }
+    pthread_mutex_unlock(&sdb->lock);
+    return 0;
+}
+
+/**
+ * @brief Keeps a table in a skiplist that writers update concurrently
+ * 
+ * Writes to an ordered table only hold the database lock while appending
+ * to the log; they insert into the skiplist alongside each other, and
+ * reads and scans of it take no lock at all. A scan therefore sees the
+ * table in key order as it changes, and its callback may call into the
+ * database. A value returned by sdb_table_get() stays valid until its key
+ * is written again.
+ * 
+ * Ordered tables stay in memory regardless of the memory target, cannot
+ * have a loader or be frozen, and count only writes as hot-key accesses.
+ * Like loaders, the setting is not saved and is made again after opening.
+ * 
+ * @param sdb The database
+ * @param table The name of the table
+ * @return 0 on success, -1 if the table does not exist or has a loader,
+ *         the database is paged or memory ran out
+ */
+int sdb_table_set_ordered(SDB* sdb, const char* table) {
+    database_lock(sdb);
+    SDBTable* t = sdb_table_find(sdb, table);
+    if (!t || t->loader || sdb->pager) {
+        pthread_mutex_unlock(&sdb->lock);
+        return -1;
+    }
+    if (t->ordered) {
+        pthread_mutex_unlock(&sdb->lock);
+        return 0;
+    }
+    if (!sdb->ordered) {
+        SDBOrderedTables* ord = (SDBOrderedTables*)calloc(1, sizeof(SDBOrderedTables));
+        if (!ord) {
+            pthread_mutex_unlock(&sdb->lock);
+            return -1;
+        }
+        __atomic_store_n(&sdb->ordered, ord, __ATOMIC_RELEASE);
+    }
+
+    table_load_blocks(sdb, t);
+    SDBSkiplist* list = skiplist_create();
+    int result = list ? 0 : -1;
+    for (SDBEntry* e = t->entries->head; list && e && result == 0; e = e->next) {
+        char* cold = e->value ? NULL : tier_read_cold(sdb, e);
+        const char* value = e->value ? e->value : cold;
+        SDBSkipValue* copy = value ? skip_value_create(value, e->value_len, 0) : NULL;
+        if (!copy || skiplist_insert(list, e->key, (uint32_t)strlen(e->key), copy) != NULL) result = -1;
+        free(cold);
+    }
+    if (result == 0) {
+        t->ordered = list;
+        result = ordered_publish(sdb);
+        if (result != 0) t->ordered = NULL;
+    }
+    if (result != 0) {
+        if (list) skiplist_free(list);
+        pthread_mutex_unlock(&sdb->lock);
+        return -1;
+    }
+    table_unload(sdb, t, -1);
+    pthread_mutex_unlock(&sdb->lock);
+    return 0;
+}
+
+/**
+ * @brief Sets the amount of memory values may occupy in memory mode
+ * 
+ * Values beyond the target are demoted to a compressed cold segment,
+ * least accessed first, and promoted again when they are read. The memory
+ * they held is returned to the system right away.
+ * 
+ * @param sdb The database
+ * @param bytes The target in bytes, or 0 to keep everything in memory
+ */
+void sdb_set_memory_target(SDB* sdb, size_t bytes) {
+    database_lock(sdb);
+    sdb->memory_target = bytes;
+    if (!sdb->pager) {
+        tier_rebalance(sdb, NULL);
+        for (int i = 0; i < sdb->table_count; i++) {
+            arena_compact(&sdb->tables[i].entries->arena);
+        }
+    }
+    pthread_mutex_unlock(&sdb->lock);
+}
+
+/**
+ * @brief Returns the memory freed by overwrites and demotions to the system
+ * 
+ * Blocks whose objects were all freed are returned right away. This moves
+ * the keys and values of every half-empty block, so pointers returned by
+ * earlier gets are no longer valid afterwards.
+ * 
+ * @param sdb The database
+ * @return Bytes returned to the system
+ */
+size_t sdb_compact(SDB* sdb) {
+    size_t released = 0;
+    database_lock(sdb);
+    if (sdb->ordered) ordered_reclaim(sdb->ordered);
+    for (int i = 0; !sdb->pager && i < sdb->table_count; i++) {
+        released += arena_compact(&sdb->tables[i].entries->arena);
+    }
+    pthread_mutex_unlock(&sdb->lock);
+    return released;
+}
+
+/*******************************************************************************
+ * Batch Operations
+ ******************************************************************************/
+void sdb_batch_execute(SDB* sdb, SDBOperation* ops, size_t count) {
+    database_lock(sdb);
+    SDBWal* wal = sdb->wal;
+    uint64_t written = wal ? wal->written : 0;
+    for (size_t i = 0; i < count; i++) {
+        table_set(sdb, ops[i].table, ops[i].key, ops[i].value);
+    }
+    // Every set is already in the log; one flush of what the batch appended
+    // makes all of it durable
+    if (wal && !wal->sync && wal->written > written &&
+        wal_flush_back(wal, wal->tail, wal->written - written) != 0) {
+        wal->failed = 1;
+        checkpoint_run(sdb);
+    }
+    wal_wait_synced(sdb);
+    pthread_mutex_unlock(&sdb->lock);
+}
+
+/*******************************************************************************
+ * Sharding Functions
+ ******************************************************************************/
+typedef struct {
+    const char* path;
+    const SDBOptions* options;
+    SDB* sdb;
+} SDBShardJob;
+
+static void* shard_open_worker(void* arg) {
+    SDBShardJob* job = (SDBShardJob*)arg;
+    job->sdb = sdb_open_ex(job->path, job->options);
+    return NULL;
+}
+
+static void* shard_save_worker(void* arg) {
+    sdb_save(((SDBShardJob*)arg)->sdb);
+    return NULL;
+}
+
+static void* shard_close_worker(void* arg) {
+    sdb_close(((SDBShardJob*)arg)->sdb);
+    return NULL;
+}
+
+/**
+ * @brief Runs a job per shard, each on its own thread
+ * 
+ * Falls back to running the job inline if a thread cannot be started.
+ * 
+ * @param jobs One job per shard
+ * @param count Number of shards
+ * @param worker The job function
+ */
+static void shard_run(SDBShardJob* jobs, int count, void* (*worker)(void*)) {
+    pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * count);
+    int* started = (int*)calloc(count, sizeof(int));
+
+    for (int i = 0; i < count; i++) {
+        if (threads && started && pthread_create(&threads[i], NULL, worker, &jobs[i]) == 0) {
+            started[i] = 1;
+        } else {
+            worker(&jobs[i]);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        if (started && started[i]) pthread_join(threads[i], NULL);
+    }
+
+    free(threads);
+    free(started);
+}
+
+/**
+ * @brief Opens a database spread over several files
+ * 
+ * Every shard is a complete database file that is loaded, saved and closed
+ * independently; shards are opened in parallel. The same paths must be
+ * passed in the same order on every open, since routing depends on them.
+ * 
+ * @param paths Path of each shard file, possibly on different disks
+ * @param count Number of shards
+ * @param mode Whether tables or keys are spread over the shards
+ * @param options Options applied to every shard, or NULL for the defaults
+ * @return The shard set, or NULL if any shard fails to open
+ */
+SDBShardSet* sdb_sharded_open(const char** paths, int count, SDBShardMode mode,
+                              const SDBOptions* options) {
+    if (count <= 0) return NULL;
+
+    SDBShardSet* set = (SDBShardSet*)malloc(sizeof(SDBShardSet));
+    SDBShardJob* jobs = (SDBShardJob*)calloc(count, sizeof(SDBShardJob));
+    if (!set || !jobs) {
+        free(set);
+        free(jobs);
+        return NULL;
+    }
+
+    for (int i = 0; i < count; i++) {
+        jobs[i].path = paths[i];
+        jobs[i].options = options;
+    }
+    shard_run(jobs, count, shard_open_worker);
+
+    set->shards = (SDB**)malloc(sizeof(SDB*) * count);
+    set->shard_count = count;
+    set->shard_mode = mode;
+
+    int failed = set->shards == NULL;
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].sdb == NULL) failed = 1;
+        if (set->shards) set->shards[i] = jobs[i].sdb;
+    }
+    if (failed) {
+        for (int i = 0; i < count; i++) {
+            sdb_close(jobs[i].sdb);
         }
+        free(set->shards);
+        free(set);
+        set = NULL;
     }
+    free(jobs);
+    return set;
+}
 
-    // Compress the buffer
-    size_t compressed_size;
-    unsigned char* compressed;
-    
-    if (sdb->compress_type == SDB_COMPRESS_RLE) {
-        compressed = rle_compress(buffer, current_size, &compressed_size);
+/**
+ * @brief Saves and closes every shard in parallel
+ * 
+ * @param set The shard set
+ */
+void sdb_sharded_close(SDBShardSet* set) {
+    if (!set) return;
+
+    SDBShardJob* jobs = (SDBShardJob*)calloc(set->shard_count, sizeof(SDBShardJob));
+    if (jobs) {
+        for (int i = 0; i < set->shard_count; i++) {
+            jobs[i].sdb = set->shards[i];
+        }
+        shard_run(jobs, set->shard_count, shard_close_worker);
+        free(jobs);
     } else {
-        compressed = lz77_compress(buffer, current_size, &compressed_size);
+        for (int i = 0; i < set->shard_count; i++) {
+            sdb_close(set->shards[i]);
+        }
     }
-    
-    // Write compressed size followed by compressed data
-    fwrite(&compressed_size, sizeof(size_t), 1, file);
-    fwrite(&current_size, sizeof(size_t), 1, file);  // Original size
-    fwrite(compressed, 1, compressed_size, file);
-    
-    free(buffer);
-    free(compressed);
-    fclose(file);
+    free(set->shards);
+    free(set);
 }
 
-/*******************************************************************************
- * Table Management Functions
- ******************************************************************************/
 /**
- * @brief Creates a table in the database
+ * @brief Saves every shard in parallel
  * 
- * @param sdb The database
- * @param name The name of the table
+ * @param set The shard set
  */
-void sdb_table_create(SDB* sdb, const char* name) {
-    sdb->table_count++;
-    sdb->tables = (SDBTable*)realloc(sdb->tables, sizeof(SDBTable) * sdb->table_count);
-    
-    // Initialize the new table
-    SDBTable* table = &sdb->tables[sdb->table_count - 1];
-    table->name = strdup(name);
-    table->entries = (SDBEntryList*)malloc(sizeof(SDBEntryList));
-    
-    // Initialize hash table components
-    table->entries->head = NULL;
-    table->entries->tail = NULL;
-    table->entries->capacity = 16;  // Initial capacity, can be adjusted
-    table->entries->entries = (SDBEntry**)calloc(table->entries->capacity, sizeof(SDBEntry*));
+void sdb_sharded_save(SDBShardSet* set) {
+    SDBShardJob* jobs = (SDBShardJob*)calloc(set->shard_count, sizeof(SDBShardJob));
+    if (!jobs) {
+        for (int i = 0; i < set->shard_count; i++) {
+            sdb_save(set->shards[i]);
+        }
+        return;
+    }
+    for (int i = 0; i < set->shard_count; i++) {
+        jobs[i].sdb = set->shards[i];
+    }
+    shard_run(jobs, set->shard_count, shard_save_worker);
+    free(jobs);
 }
 
 /**
- * @brief Destroys a table in the database
+ * @brief Returns the shard responsible for a key of a table
  * 
- * @param sdb The database
+ * @param set The shard set
+ * @param table The name of the table
+ * @param key The key (ignored when sharding by table)
+ * @return The shard
+ */
+SDB* sdb_sharded_route(SDBShardSet* set, const char* table, const char* key) {
+    const char* routing_key = set->shard_mode == SDB_SHARD_BY_KEY ? key : table;
+    return set->shards[hash_string(routing_key) % set->shard_count];
+}
+
+/**
+ * @brief Creates a table; with key sharding it exists in every shard
+ * 
+ * @param set The shard set
  * @param name The name of the table
  */
-void sdb_table_destroy(SDB* sdb, const char* name) {
-    for (int i = 0; i < sdb->table_count; i++) {
-        if (strcmp(sdb->tables[i].name, name) == 0) {
-            free(sdb->tables[i].name);
-            
-            // Free entries
-            SDBEntry* current = sdb->tables[i].entries->head;
-            while (current != NULL) {
-                SDBEntry* next = current->next;
-                free(current->key);
-                free(current->value);
-                free(current);
-                current = next;
-            }
-            
-            // Free hash table array
-            free(sdb->tables[i].entries->entries);
-            free(sdb->tables[i].entries);
-        }
+void sdb_sharded_table_create(SDBShardSet* set, const char* name) {
+    if (set->shard_mode == SDB_SHARD_BY_TABLE) {
+        sdb_table_create(sdb_sharded_route(set, name, NULL), name);
+        return;
+    }
+    for (int i = 0; i < set->shard_count; i++) {
+        sdb_table_create(set->shards[i], name);
     }
 }
 
 /**
- * @brief Finds a table in the database
+ * @brief Destroys a table in every shard holding it
  * 
- * @param sdb The database
+ * @param set The shard set
  * @param name The name of the table
- * @return The table
  */
-SDBTable* sdb_table_find(SDB* sdb, const char* name) {
-    for (int i = 0; i < sdb->table_count; i++) {
-        if (strcmp(sdb->tables[i].name, name) == 0) {
-            return &sdb->tables[i];
-        }
+void sdb_sharded_table_destroy(SDBShardSet* set, const char* name) {
+    for (int i = 0; i < set->shard_count; i++) {
+        sdb_table_destroy(set->shards[i], name);
     }
-    return NULL;
 }
 
-/*******************************************************************************
- * Data Access Functions
- ******************************************************************************/
 /**
- * @brief Sets a value in the database
+ * @brief Sets a value; only the owning shard is written
  * 
- * @param sdb The database
+ * @param set The shard set
  * @param table The name of the table
  * @param key The key
  * @param value The value
  */
-void sdb_table_set(SDB* sdb, const char* table, const char* key, const char* value) {
-    SDBTable* t = sdb_table_find(sdb, table);
-    if (!t) return;
-    
-    size_t hash = hash_string(key) % t->entries->capacity;
-    SDBEntry* entry = t->entries->entries[hash];
-    
-    // Handle collision with linear probing
-    while (entry && strcmp(entry->key, key) != 0) {
-        hash = (hash + 1) % t->entries->capacity;
-        entry = t->entries->entries[hash];
+void sdb_sharded_table_set(SDBShardSet* set, const char* table, const char* key, const char* value) {
+    sdb_table_set(sdb_sharded_route(set, table, key), table, key, value);
+}
+
+/**
+ * @brief Gets a value from the owning shard
+ * 
+ * @param set The shard set
+ * @param table The name of the table
+ * @param key The key
+ * @return The value
+ */
+char* sdb_sharded_table_get(SDBShardSet* set, const char* table, const char* key) {
+    return sdb_table_get(sdb_sharded_route(set, table, key), table, key);
+}
+
+/**
+ * @brief Gets a copy of a value from the shard that owns the key
+ * 
+ * See sdb_table_get_copy().
+ * 
+ * @param set The shard set
+ * @param table The name of the table
+ * @param key The key
+ * @return The value, to be freed by the caller, or NULL
+ */
+char* sdb_sharded_table_get_copy(SDBShardSet* set, const char* table, const char* key) {
+    return sdb_table_get_copy(sdb_sharded_route(set, table, key), table, key);
+}
+
+/**
+ * @brief Registers a loader for a table on every shard
+ * 
+ * See sdb_table_set_loader().
+ * 
+ * @return 0 on success, -1 if any shard refused it
+ */
+int sdb_sharded_table_set_loader(SDBShardSet* set, const char* table, SDBLoader loader,
+                                 void* context, unsigned ttl) {
+    int result = 0;
+    for (int i = 0; i < set->shard_count; i++) {
+        if (sdb_table_set_loader(set->shards[i], table, loader, context, ttl) != 0) result = -1;
     }
-    
-    SDBEntry* e = (SDBEntry*)malloc(sizeof(SDBEntry));
-    e->key = strdup(key);
-    e->value = strdup(value);
-    e->next = NULL;
+    return result;
+}
 
-    if (t->entries->head == NULL) {
-        t->entries->head = e;
-    } else {
-        t->entries->tail->next = e;
+/**
+ * @brief Makes a table ordered on every shard holding it
+ * 
+ * See sdb_table_set_ordered().
+ * 
+ * @return 0 on success, -1 if any shard failed
+ */
+int sdb_sharded_table_set_ordered(SDBShardSet* set, const char* table) {
+    if (set->shard_mode == SDB_SHARD_BY_TABLE) {
+        return sdb_table_set_ordered(sdb_sharded_route(set, table, NULL), table);
+    }
+    int result = 0;
+    for (int i = 0; i < set->shard_count; i++) {
+        if (sdb_table_set_ordered(set->shards[i], table) != 0) result = -1;
     }
-    t->entries->tail = e;
+    return result;
+}
 
-    sdb_save(sdb);
+/**
+ * @brief Freezes a table on every shard holding it
+ * 
+ * See sdb_table_freeze().
+ * 
+ * @return 0 on success, -1 if any shard failed
+ */
+int sdb_sharded_table_freeze(SDBShardSet* set, const char* table) {
+    if (set->shard_mode == SDB_SHARD_BY_TABLE) {
+        return sdb_table_freeze(sdb_sharded_route(set, table, NULL), table);
+    }
+    int result = 0;
+    for (int i = 0; i < set->shard_count; i++) {
+        if (sdb_table_freeze(set->shards[i], table) != 0) result = -1;
+    }
+    return result;
 }
 
 /**
- * @brief Gets a value from the database
+ * @brief Returns the most accessed keys of a table across all shards
  * 
- * @param sdb The database
+ * Each key lives on one shard, so the shards' hot keys are merged as they
+ * are. See sdb_hot_keys().
+ * 
+ * @param set The shard set
  * @param table The name of the table
- * @param key The key
- * @return The value
+ * @return The hot keys; free with sdb_free_hot_keys()
  */
-char* sdb_table_get(SDB* sdb, const char* table, const char* key) {
-    SDBTable* t = sdb_table_find(sdb, table);
-    if (t == NULL) {
-        return NULL;
+SDBHotKeyStats sdb_sharded_hot_keys(SDBShardSet* set, const char* table) {
+    if (set->shard_mode == SDB_SHARD_BY_TABLE) {
+        return sdb_hot_keys(sdb_sharded_route(set, table, NULL), table);
     }
 
-    SDBEntry* e = t->entries->head;
-    while (e != NULL) {
-        if (strcmp(e->key, key) == 0) {
-            return e->value;
+    SDBHotKeyStats merged = {0};
+    for (int i = 0; i < set->shard_count; i++) {
+        SDBHotKeyStats stats = sdb_hot_keys(set->shards[i], table);
+        SDBHotKey* keys = (SDBHotKey*)realloc(merged.keys,
+            sizeof(SDBHotKey) * (merged.key_count + stats.key_count + 1));
+        if (!keys) {
+            sdb_free_hot_keys(stats);
+            continue;
         }
-        e = e->next;
+        merged.keys = keys;
+        if (stats.key_count > 0) {
+            memcpy(merged.keys + merged.key_count, stats.keys, sizeof(SDBHotKey) * stats.key_count);
+        }
+        merged.key_count += stats.key_count;
+        merged.accesses += stats.accesses;
+        free(stats.keys);
     }
-    return NULL;
+    if (merged.key_count == 0) return merged;
+
+    // Keep as many keys as one shard would report
+    qsort(merged.keys, merged.key_count, sizeof(SDBHotKey), hot_key_compare);
+    int keep = (int)set->shards[0]->hot_keys;
+    for (int i = keep; i < merged.key_count; i++) free(merged.keys[i].key);
+    if (merged.key_count > keep) merged.key_count = keep;
+    return merged;
 }
 
 /*******************************************************************************
- * Batch Operations
+ * Background Scrubbing
  ******************************************************************************/
-void sdb_batch_execute(SDB* sdb, SDBOperation* ops, size_t count) {
-    for (size_t i = 0; i < count; i++) {
-        sdb_table_set(sdb, ops[i].table, ops[i].key, ops[i].value);
+/**
+ * @brief Lowers the calling thread to the idle I/O class
+ * 
+ * Its reads are then only served when the disk has nothing else to do.
+ */
+static void scrub_set_idle_priority(void) {
+#if defined(__linux__) && defined(SYS_ioprio_set)
+    const int who_process = 1;      // IOPRIO_WHO_PROCESS, 0 means this thread
+    const int class_idle = 3;       // IOPRIO_CLASS_IDLE
+    syscall(SYS_ioprio_set, who_process, 0, class_idle << 13);
+#endif
+}
+
+/**
+ * @brief Waits until a deadline or until the scrubber is stopped
+ * 
+ * @return 1 if the scrubber was stopped, 0 otherwise
+ */
+static int scrub_wait(SDBScrubber* scrubber, const struct timespec* deadline) {
+    pthread_mutex_lock(&scrubber->lock);
+    while (!scrubber->stop &&
+           pthread_cond_timedwait(&scrubber->wake, &scrubber->lock, deadline) != ETIMEDOUT) {
+    }
+    int stop = scrubber->stop;
+    pthread_mutex_unlock(&scrubber->lock);
+    return stop;
+}
+
+/**
+ * @brief Reads part of a file, bypassing the page cache when possible
+ * 
+ * With O_DIRECT the read is widened to whole pages into an aligned buffer.
+ * Without it the pages are dropped from the cache again after the read.
+ * 
+ * @param buffer Aligned buffer, grown as needed
+ * @param capacity Size of buffer
+ * @return Pointer to the requested bytes inside buffer, or NULL on failure
+ */
+static unsigned char* scrub_read(int fd, int direct, uint64_t offset, size_t len,
+                                 unsigned char** buffer, size_t* capacity) {
+    uint64_t start = direct ? offset & ~(uint64_t)(POOL_BLOCK_SIZE - 1) : offset;
+    uint64_t end = offset + len;
+    if (direct) end = (end + POOL_BLOCK_SIZE - 1) & ~(uint64_t)(POOL_BLOCK_SIZE - 1);
+    size_t span = (size_t)(end - start);
+
+    if (span > *capacity) {
+        void* grown = NULL;
+        if (posix_memalign(&grown, POOL_BLOCK_SIZE, span) != 0) return NULL;
+        free(*buffer);
+        *buffer = (unsigned char*)grown;
+        *capacity = span;
+    }
+
+    ssize_t n = pread(fd, *buffer, span, (off_t)start);
+    if (!direct) SDB_FADVISE(fd, start, span, DONTNEED);
+    if (n < 0 || (uint64_t)n < offset - start + len) return NULL;
+    return *buffer + (offset - start);
+}
+
+/**
+ * @brief Appends a corrupt block to the quarantine file
+ * 
+ * Each record is the magic, the block's offset and length, and the bytes
+ * exactly as they were found.
+ */
+static int scrub_quarantine(SDBScrubber* scrubber, uint64_t offset, const unsigned char* data, uint32_t len) {
+    size_t path_len = strlen(scrubber->path) + strlen(".quarantine") + 1;
+    char* path = (char*)malloc(path_len);
+    if (!path) return -1;
+    snprintf(path, path_len, "%s.quarantine", scrubber->path);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    free(path);
+    if (fd < 0) return -1;
+
+    unsigned char header[16];
+    put_u32(header, SDB_QUARANTINE_MAGIC);
+    put_u64(header + 4, offset);
+    put_u32(header + 12, len);
+    int ok = write(fd, header, sizeof(header)) == (ssize_t)sizeof(header) &&
+             write(fd, data, len) == (ssize_t)len && fsync(fd) == 0;
+    close(fd);
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Remembers a corrupt block so later passes do not report it again
+ * 
+ * @return 1 if the block is new, 0 if it was already reported
+ */
+static int scrub_remember(SDBScrubber* scrubber, const struct stat* st, uint64_t offset) {
+    if (scrubber->reported_dev != st->st_dev || scrubber->reported_ino != st->st_ino) {
+        // The file was replaced by a save, so all its blocks are new
+        scrubber->reported_dev = st->st_dev;
+        scrubber->reported_ino = st->st_ino;
+        scrubber->reported_count = 0;
+    }
+    for (size_t i = 0; i < scrubber->reported_count; i++) {
+        if (scrubber->reported[i] == offset) return 0;
+    }
+    uint64_t* grown = (uint64_t*)realloc(scrubber->reported, sizeof(uint64_t) * (scrubber->reported_count + 1));
+    if (grown) {
+        scrubber->reported = grown;
+        scrubber->reported[scrubber->reported_count++] = offset;
+    }
+    return 1;
+}
+
+/**
+ * @brief Verifies every block of the snapshot once
+ * 
+ * @return 1 if the scrubber was stopped during the pass, 0 otherwise
+ */
+static int scrub_pass(SDBScrubber* scrubber) {
+    // Header and footer are small unaligned reads, so they go through a
+    // buffered descriptor; blocks are read directly where supported
+    int fd = open(scrubber->path, O_RDONLY);
+    if (fd < 0) return 0;
+    int direct_fd = SDB_O_DIRECT ? open(scrubber->path, O_RDONLY | SDB_O_DIRECT) : -1;
+
+    struct stat st;
+    unsigned char header[2 * sizeof(uint32_t)];
+    if (fstat(fd, &st) != 0 || pread(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+        get_u32(header) != SDB_MAGIC || get_u32(header + 4) < 3) {
+        // Older formats have no checksums; nothing to verify until the next save
+        SDB_FADVISE(fd, 0, 0, DONTNEED);
+        if (direct_fd >= 0) close(direct_fd);
+        close(fd);
+        return 0;
+    }
+
+    SDBFileInfo info = {0};
+    SDBBlockInfo* blocks = NULL;
+    uint32_t block_count = 0;
+    if (footer_read(fd, 3, &info, &blocks, &block_count, NULL) != 0) {
+        // Without the footer the blocks cannot be located; report the file once
+        block_count = 0;
+        if (scrub_remember(scrubber, &st, (uint64_t)st.st_size)) {
+            pthread_mutex_lock(&scrubber->lock);
+            scrubber->stats.corrupt_blocks++;
+            pthread_mutex_unlock(&scrubber->lock);
+            if (scrubber->options.on_corrupt) {
+                scrubber->options.on_corrupt(scrubber->path, (uint64_t)st.st_size, NULL, scrubber->options.ctx);
+            }
+        }
+    }
+
+    unsigned char* buffer = NULL;
+    size_t capacity = 0;
+    uint64_t bytes = 0;
+    int stopped = 0;
+    struct timespec start;
+    clock_now(&start);
+
+    for (uint32_t b = 0; b < block_count && !stopped; b++) {
+        const SDBBlockInfo* block = &blocks[b];
+        uint64_t len = SDB_BLOCK_HEADER + (uint64_t)block->comp_len;
+        unsigned char* data = NULL;
+        if (block->offset + len <= (uint64_t)st.st_size) {
+            if (direct_fd >= 0) {
+                data = scrub_read(direct_fd, 1, block->offset, (size_t)len, &buffer, &capacity);
+                if (!data && errno == EINVAL) {
+                    // Not every file system supports direct I/O
+                    close(direct_fd);
+                    direct_fd = -1;
+                }
+            }
+            if (direct_fd < 0) data = scrub_read(fd, 0, block->offset, (size_t)len, &buffer, &capacity);
+        }
+
+        int intact = data && block_check(data, block);
+
+        if (!intact && scrub_remember(scrubber, &st, block->offset)) {
+            int quarantined = data && scrubber->options.quarantine &&
+                              scrub_quarantine(scrubber, block->offset, data, (uint32_t)len) == 0;
+            pthread_mutex_lock(&scrubber->lock);
+            scrubber->stats.corrupt_blocks++;
+            if (quarantined) scrubber->stats.quarantined++;
+            pthread_mutex_unlock(&scrubber->lock);
+
+            if (scrubber->options.on_corrupt) {
+                const char* table = block->table < (uint32_t)info.table_count ? info.tables[block->table].name : NULL;
+                scrubber->options.on_corrupt(scrubber->path, block->offset, table, scrubber->options.ctx);
+            }
+        }
+
+        pthread_mutex_lock(&scrubber->lock);
+        scrubber->stats.blocks_checked++;
+        scrubber->stats.bytes_checked += len;
+        stopped = scrubber->stop;
+        pthread_mutex_unlock(&scrubber->lock);
+
+        // Sleep until the bytes read so far fit under the rate limit
+        bytes += len;
+        if (!stopped && scrubber->options.rate_limit > 0) {
+            double seconds = (double)bytes / (double)scrubber->options.rate_limit;
+            struct timespec deadline = start;
+            deadline.tv_sec += (time_t)seconds;
+            deadline.tv_nsec += (long)((seconds - (double)(time_t)seconds) * 1e9);
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            stopped = scrub_wait(scrubber, &deadline);
+        }
+    }
+
+    SDB_FADVISE(fd, 0, 0, DONTNEED);
+    free(buffer);
+    free(blocks);
+    sdb_free_file_info(info);
+    if (direct_fd >= 0) close(direct_fd);
+    close(fd);
+    return stopped;
+}
+
+static void* scrub_worker(void* arg) {
+    SDBScrubber* scrubber = (SDBScrubber*)arg;
+    scrub_set_idle_priority();
+
+    for (;;) {
+        int stopped = scrub_pass(scrubber);
+        pthread_mutex_lock(&scrubber->lock);
+        if (!stopped) scrubber->stats.passes++;
+        pthread_mutex_unlock(&scrubber->lock);
+        if (stopped || scrubber->options.interval == 0) break;
+
+        struct timespec deadline;
+        clock_now(&deadline);
+        deadline.tv_sec += scrubber->options.interval;
+        if (scrub_wait(scrubber, &deadline)) break;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Returns scrub options with sensible defaults
+ * 
+ * Defaults: 4 MiB/s, one pass per hour, corrupt blocks are quarantined.
+ * 
+ * @return The default options
+ */
+SDBScrubOptions sdb_scrub_options_default(void) {
+    SDBScrubOptions options;
+    options.rate_limit = 4 * 1024 * 1024;
+    options.interval = 3600;
+    options.quarantine = 1;
+    options.on_corrupt = NULL;
+    options.ctx = NULL;
+    return options;
+}
+
+/**
+ * @brief Starts verifying the database file's block checksums in the background
+ * 
+ * The scrubber runs on its own thread at idle I/O priority and reads with
+ * direct I/O where the file system allows it, so it neither competes with
+ * foreground I/O nor evicts the page cache. It re-reads the file at
+ * sdb->path on every pass, so blocks written by later saves are covered.
+ * 
+ * @param sdb The database (not paged)
+ * @param options The scrub options, or NULL for the defaults
+ * @return 0 on success, -1 on failure or if a scrubber is already running
+ */
+int sdb_scrub_start(SDB* sdb, const SDBScrubOptions* options) {
+    if (!sdb || sdb->pager || sdb->scrubber) return -1;
+
+    SDBScrubber* scrubber = (SDBScrubber*)calloc(1, sizeof(SDBScrubber));
+    if (!scrubber) return -1;
+    scrubber->path = strdup(sdb->path);
+    scrubber->options = options ? *options : sdb_scrub_options_default();
+    pthread_mutex_init(&scrubber->lock, NULL);
+    pthread_cond_init(&scrubber->wake, NULL);
+
+    if (!scrubber->path || pthread_create(&scrubber->thread, NULL, scrub_worker, scrubber) != 0) {
+        pthread_cond_destroy(&scrubber->wake);
+        pthread_mutex_destroy(&scrubber->lock);
+        free(scrubber->path);
+        free(scrubber);
+        return -1;
     }
-    // Single save at the end
-    sdb_save(sdb);
+    sdb->scrubber = scrubber;
+    return 0;
+}
+
+/**
+ * @brief Stops the background scrubber and waits for it to exit
+ * 
+ * Called by sdb_close(). Does nothing if no scrubber is running.
+ * 
+ * @param sdb The database
+ */
+void sdb_scrub_stop(SDB* sdb) {
+    if (!sdb || !sdb->scrubber) return;
+    SDBScrubber* scrubber = sdb->scrubber;
+
+    pthread_mutex_lock(&scrubber->lock);
+    scrubber->stop = 1;
+    pthread_cond_signal(&scrubber->wake);
+    pthread_mutex_unlock(&scrubber->lock);
+    pthread_join(scrubber->thread, NULL);
+
+    pthread_cond_destroy(&scrubber->wake);
+    pthread_mutex_destroy(&scrubber->lock);
+    free(scrubber->reported);
+    free(scrubber->path);
+    free(scrubber);
+    sdb->scrubber = NULL;
+}
+
+/**
+ * @brief Returns what the scrubber has found so far
+ * 
+ * @param sdb The database
+ * @return The counters; all zero if no scrubber is running
+ */
+SDBScrubStats sdb_scrub_stats(SDB* sdb) {
+    SDBScrubStats stats = {0};
+    if (!sdb || !sdb->scrubber) return stats;
+
+    pthread_mutex_lock(&sdb->scrubber->lock);
+    stats = sdb->scrubber->stats;
+    pthread_mutex_unlock(&sdb->scrubber->lock);
+    return stats;
 }
 
 /*******************************************************************************
@@ -665,6 +8373,70 @@ static void write_to_buffer(unsigned char** buffer, size_t* buffer_size,
     *current_size += size;
 }
 
+/**
+ * @brief Reads the clock that pthread_cond_timedwait() measures deadlines on
+ */
+static void clock_now(struct timespec* now) {
+#ifdef CLOCK_REALTIME
+    clock_gettime(CLOCK_REALTIME, now);
+#else
+    now->tv_sec = time(NULL);
+    now->tv_nsec = 0;
+#endif
+}
+
+/**
+ * @brief Returns a monotonic time in microseconds, for measuring durations
+ */
+static uint64_t clock_us(void) {
+    struct timespec now;
+#ifdef CLOCK_MONOTONIC
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+    clock_now(&now);
+#endif
+    return (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+/**
+ * @brief Takes sdb->lock and counts how long the caller waited for it
+ */
+static void database_lock(SDB* sdb) {
+    if (pthread_mutex_trylock(&sdb->lock) != 0) {
+        uint64_t start = clock_us();
+        pthread_mutex_lock(&sdb->lock);
+        uint64_t waited = clock_us() - start;
+        sdb->lock_stats.contended++;
+        sdb->lock_stats.wait_us += waited;
+        if (waited > sdb->lock_stats.max_wait_us) sdb->lock_stats.max_wait_us = waited;
+    }
+    sdb->lock_stats.acquisitions++;
+}
+
+/**
+ * @brief Returns how often callers had to wait for the database lock
+ * 
+ * Waits inside the library, such as writers held back by checkpoints, are
+ * not included; they are counted in sdb_checkpoint_stats(). Lock-free
+ * reads of ordered tables do not take the lock.
+ * 
+ * @param sdb The database
+ * @return The counters since the database was opened
+ */
+SDBLockStats sdb_lock_stats(SDB* sdb) {
+    database_lock(sdb);
+    SDBLockStats stats = sdb->lock_stats;
+    pthread_mutex_unlock(&sdb->lock);
+    return stats;
+}
+
+static size_t hash_bytes(const char* data, size_t len) {
+    size_t hash = 5381;
+    for (size_t i = 0; i < len; i++)
+        hash = ((hash << 5) + hash) + (unsigned char)data[i];
+    return hash;
+}
+
 static size_t hash_string(const char* str) {
     size_t hash = 5381;
     int c;
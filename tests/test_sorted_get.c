@@ -0,0 +1,83 @@
+/**
+ * @file test_sorted_get.c
+ * @brief Checks that values read from an unloaded sorted table stay valid
+ *
+ * A reopened database reads its tables from the snapshot without loading
+ * them. The values such lookups return must survive later lookups, and
+ * loading the table afterwards, just like values of a loaded table.
+ *
+ * Build and run with: cc -O2 -pthread -o test-sorted-get tests/test_sorted_get.c && ./test-sorted-get
+ *
+ * @author Johannes (Jotrorox) Müller
+ * @copyright Copyright (c) 2024
+ */
+
+#include "../sdb.h"
+
+#define TEST_PATH "test_sorted_get.sdb"
+#define TEST_KEYS 10000
+
+static int failures = 0;
+
+static void check(int ok, const char* what) {
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failures++;
+    }
+}
+
+static void remove_files(void) {
+    unlink(TEST_PATH);
+    unlink(TEST_PATH ".wal");
+}
+
+static SDB* open_database(void) {
+    SDBOptions options = sdb_options_default();
+    options.wal_sync = 0;
+    return sdb_open_ex(TEST_PATH, &options);
+}
+
+int main(void) {
+    remove_files();
+
+    SDB* db = open_database();
+    if (!db) {
+        fprintf(stderr, "FAIL: cannot create %s\n", TEST_PATH);
+        return 1;
+    }
+    sdb_table_create(db, "t");
+    char key[32];
+    char value[64];
+    for (int i = 0; i < TEST_KEYS; i++) {
+        snprintf(key, sizeof(key), "k%05d", i);
+        snprintf(value, sizeof(value), "value of key %d", i);
+        sdb_table_set(db, "t", key, value);
+    }
+    sdb_close(db);
+
+    // The reopened table is read from the snapshot, one block at a time
+    db = open_database();
+    if (!db) {
+        fprintf(stderr, "FAIL: cannot reopen %s\n", TEST_PATH);
+        return 1;
+    }
+    const char* a = sdb_table_get(db, "t", "k00001");
+    const char* b = sdb_table_get(db, "t", "k09998");
+    check(a && strcmp(a, "value of key 1") == 0, "first get");
+    check(b && strcmp(b, "value of key 9998") == 0, "second get");
+    check(a && strcmp(a, "value of key 1") == 0, "first get after the second");
+    check(sdb_table_get(db, "t", "missing") == NULL, "missing key");
+    check(a && strcmp(a, "value of key 1") == 0, "first get after a miss");
+
+    // A write loads the whole table; the values already returned stay put
+    sdb_table_set(db, "t", "k00002", "changed");
+    check(a && strcmp(a, "value of key 1") == 0, "first get after loading");
+    check(b && strcmp(b, "value of key 9998") == 0, "second get after loading");
+    check(a == sdb_table_get(db, "t", "k00001"), "loaded value is the one returned before");
+    sdb_close(db);
+    remove_files();
+
+    if (failures > 0) return 1;
+    printf("ok\n");
+    return 0;
+}
@@ -0,0 +1,1440 @@
+/**
+ * @file sdb_bench.c
+ * @brief Benchmarks for SDB
+ *
+ * Each command builds its databases in a scratch directory, measures them
+ * and removes them again.
+ *
+ * scale: mixed reads and writes at 1, 2, 4 ... N threads against a single
+ * database and against a sharded set, with the throughput, the time spent
+ * waiting for database locks and the latency percentiles of every thread
+ * count.
+ *
+ * open: databases of growing sizes in every codec and format, with the
+ * time sdb_open_ex takes, the peak memory while opening and the time to
+ * the first get, once with the files dropped from the page cache and once
+ * with them cached.
+ *
+ * memory: a table of --keys entries loaded into memory, with the bytes per
+ * entry taken by entry structs, keys, values, object headers, the index,
+ * arena slack and malloc, next to what the allocator and the kernel report.
+ *
+ * amplification: random sets into an empty database with a log, with a
+ * snapshot on every set, and as a page file, with the bytes written to disk
+ * over the bytes set and the disk space over the live data as they grow.
+ *
+ * compare: a suite of scale, open and memory metrics, run several times,
+ * saved as JSON and checked against an earlier run; the exit status is 1
+ * if a metric got significantly worse.
+ *
+ * Build with: cc -O2 -pthread -o sdb-bench tools/sdb_bench.c -lm
+ *
+ * @author Johannes (Jotrorox) Müller
+ * @copyright Copyright (c) 2024
+ */
+
+#include "../sdb.h"
+#include <math.h>
+#include <sys/wait.h>
+
+#define LATENCY_BUCKETS 512
+#define BENCH_TABLE "bench"
+#define MAX_SIZES 16
+#define MAX_KEY_SIZE 1024
+#define MAX_LOG_RING (1024ULL * 1024 * 1024)   // Largest log the log format fills
+#define MAX_RUNS 64
+
+enum {
+    FORMAT_BLOCKS = 1,      // Sorted snapshot, as written by a save
+    FORMAT_FROZEN = 2,      // Frozen table with a key index
+    FORMAT_PAGED = 4,       // Page file
+    FORMAT_LOG = 8          // Everything still in the log, replayed on open
+};
+
+enum {
+    MODE_LOG = 1,           // Write-ahead log with background checkpoints
+    MODE_SAVE = 2,          // No log, a snapshot on every write
+    MODE_PAGED = 4          // Page file
+};
+
+typedef struct {
+    size_t min;
+    size_t max;
+} SizeRange;
+
+typedef struct {
+    const char* dir;        // Where the databases are created
+    int threads;            // Highest thread count
+    double seconds;         // Measured time per run
+    size_t keys;            // Entries of every database
+    SizeRange key_size;     // Sizes are picked uniformly from the range
+    SizeRange value_size;
+    int read_percent;
+    int shards;
+    int ordered;            // Use ordered tables
+    int wal_sync;
+    uint64_t sizes[MAX_SIZES];      // Entry counts of the open benchmark
+    int size_count;
+    unsigned codecs;        // Bit per SDBCompressType
+    unsigned formats;       // FORMAT_* bits
+    unsigned modes;         // MODE_* bits of the amplification benchmark
+    int runs;               // Runs of the suite compare measures
+    double threshold;       // Percent a metric may get worse before compare fails
+    const char* baseline;   // Results compare checks against, or NULL
+    const char* save;       // Where compare writes its results, or NULL
+} Settings;
+
+/*
+ * Latencies are counted in buckets that keep the top four bits of the
+ * time in nanoseconds, so percentiles are exact to within 1/8.
+ */
+typedef struct {
+    uint64_t counts[LATENCY_BUCKETS];
+    uint64_t total;
+    uint64_t max_ns;
+} Latency;
+
+typedef struct {
+    SDB* db;                // Either a database
+    SDBShardSet* set;       // or a sharded set
+    char** paths;
+    int path_count;
+} Target;
+
+static int bench_files = 0;
+
+/*******************************************************************************
+ * Common
+ ******************************************************************************/
+static uint64_t now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + (uint64_t)now.tv_nsec;
+}
+
+static uint64_t random_next(uint64_t* state) {
+    // xorshift64*
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+/**
+ * @brief Picks a size in a range for entry n, the same size on every call
+ */
+static size_t entry_size(const SizeRange* range, uint64_t n, uint64_t salt) {
+    uint64_t state = ((n + 1) * 0x9E3779B97F4A7C15ULL) ^ salt;
+    return range->min + (size_t)(random_next(&state) % (range->max - range->min + 1));
+}
+
+/**
+ * @brief Writes the key of entry n; keys sort in the order of n
+ *
+ * @param key At least MAX_KEY_SIZE + 1 bytes
+ * @return Its length, at least 15
+ */
+static uint32_t entry_key(const Settings* settings, uint64_t n, char* key) {
+    int len = snprintf(key, MAX_KEY_SIZE + 1, "key%012llu", (unsigned long long)n);
+    size_t size = entry_size(&settings->key_size, n, 1);
+    while ((size_t)len < size) key[len++] = 'k';
+    key[len] = '\0';
+    return (uint32_t)len;
+}
+
+/**
+ * @brief Returns the value of entry n, which is a suffix of pattern
+ */
+static const char* entry_value(const Settings* settings, const char* pattern, uint64_t n) {
+    return pattern + settings->value_size.max - entry_size(&settings->value_size, n, 2);
+}
+
+static const char* size_text(const SizeRange* range, char* text, size_t size) {
+    if (range->min == range->max) snprintf(text, size, "%zu", range->min);
+    else snprintf(text, size, "%zu-%zu", range->min, range->max);
+    return text;
+}
+
+static unsigned latency_bucket(uint64_t ns) {
+    if (ns < 16) return (unsigned)ns;
+    unsigned shift = 60 - (unsigned)__builtin_clzll(ns);
+    return shift * 8 + (unsigned)(ns >> shift);
+}
+
+static uint64_t latency_bucket_ns(unsigned bucket) {
+    if (bucket < 16) return bucket;
+    unsigned shift = bucket / 8 - 1;
+    return (uint64_t)(bucket % 8 + 8) << shift;
+}
+
+static void latency_add(Latency* latency, uint64_t ns) {
+    latency->counts[latency_bucket(ns)]++;
+    latency->total++;
+    if (ns > latency->max_ns) latency->max_ns = ns;
+}
+
+static void latency_merge(Latency* into, const Latency* from) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++) into->counts[i] += from->counts[i];
+    into->total += from->total;
+    if (from->max_ns > into->max_ns) into->max_ns = from->max_ns;
+}
+
+/**
+ * @brief Returns the latency below which a fraction of the samples fall, in microseconds
+ */
+static double latency_percentile(const Latency* latency, double fraction) {
+    uint64_t rank = (uint64_t)(fraction * (double)latency->total);
+    uint64_t seen = 0;
+    for (unsigned i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += latency->counts[i];
+        if (seen > rank) return (double)latency_bucket_ns(i) / 1000.0;
+    }
+    return (double)latency->max_ns / 1000.0;
+}
+
+static void remove_database(const char* path) {
+    static const char* suffixes[] = { "", ".wal", ".cold", ".cold.tmp", ".tmp", ".quarantine" };
+    char buffer[4096];
+    for (size_t i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+        snprintf(buffer, sizeof(buffer), "%s%s", path, suffixes[i]);
+        unlink(buffer);
+    }
+}
+
+/**
+ * @brief Opens a fresh database, or a sharded set of shards fresh databases
+ */
+static int target_open(Target* target, const Settings* settings, int shards) {
+    memset(target, 0, sizeof(Target));
+    target->path_count = shards ? shards : 1;
+    target->paths = (char**)calloc(target->path_count, sizeof(char*));
+    for (int i = 0; i < target->path_count; i++) {
+        char path[4096];
+        snprintf(path, sizeof(path), "%s/sdb-bench-%d-%d.sdb", settings->dir, (int)getpid(), bench_files++);
+        remove_database(path);
+        target->paths[i] = strdup(path);
+    }
+
+    SDBOptions options = sdb_options_default();
+    options.wal_sync = settings->wal_sync;
+    if (shards) {
+        target->set = sdb_sharded_open((const char**)target->paths, shards, SDB_SHARD_BY_KEY, &options);
+        if (!target->set) return -1;
+        sdb_sharded_table_create(target->set, BENCH_TABLE);
+        if (settings->ordered) sdb_sharded_table_set_ordered(target->set, BENCH_TABLE);
+    } else {
+        target->db = sdb_open_ex(target->paths[0], &options);
+        if (!target->db) return -1;
+        sdb_table_create(target->db, BENCH_TABLE);
+        if (settings->ordered) sdb_table_set_ordered(target->db, BENCH_TABLE);
+    }
+    return 0;
+}
+
+static void target_close(Target* target) {
+    if (target->set) sdb_sharded_close(target->set);
+    if (target->db) sdb_close(target->db);
+    for (int i = 0; i < target->path_count; i++) {
+        remove_database(target->paths[i]);
+        free(target->paths[i]);
+    }
+    free(target->paths);
+}
+
+static void target_set(Target* target, const char* key, const char* value) {
+    if (target->set) sdb_sharded_table_set(target->set, BENCH_TABLE, key, value);
+    else sdb_table_set(target->db, BENCH_TABLE, key, value);
+}
+
+/**
+ * @brief Reads a key; the threads share the target, so the value is a copy
+ */
+static void target_get(Target* target, const char* key) {
+    char* value = target->set ? sdb_sharded_table_get_copy(target->set, BENCH_TABLE, key)
+                              : sdb_table_get_copy(target->db, BENCH_TABLE, key);
+    free(value);
+}
+
+/**
+ * @brief Adds up the lock counters of every database of a target
+ */
+static SDBLockStats target_lock_stats(Target* target) {
+    SDBLockStats total = {0};
+    int count = target->set ? target->set->shard_count : 1;
+    for (int i = 0; i < count; i++) {
+        SDBLockStats stats = sdb_lock_stats(target->set ? target->set->shards[i] : target->db);
+        total.acquisitions += stats.acquisitions;
+        total.contended += stats.contended;
+        total.wait_us += stats.wait_us;
+        if (stats.max_wait_us > total.max_wait_us) total.max_wait_us = stats.max_wait_us;
+    }
+    return total;
+}
+
+/**
+ * @brief Reads a field of /proc/self/status in KiB, or 0 where there is none
+ */
+static long status_kib(const char* field) {
+    FILE* file = fopen("/proc/self/status", "r");
+    if (!file) return 0;
+    char line[256];
+    long kib = 0;
+    size_t len = strlen(field);
+    while (fgets(line, sizeof(line), file)) {
+        if (strncmp(line, field, len) == 0 && line[len] == ':') {
+            kib = atol(line + len + 1);
+            break;
+        }
+    }
+    fclose(file);
+    return kib;
+}
+
+/**
+ * @brief Drops a file from the page cache, if it exists and the system allows it
+ */
+static void drop_cached(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+    fsync(fd);
+    SDB_FADVISE(fd, 0, 0, DONTNEED);
+    close(fd);
+}
+
+static uint64_t file_size(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/**
+ * @brief Allocates the string every value is a suffix of
+ */
+static char* make_value(size_t size) {
+    char* value = (char*)malloc(size + 1);
+    if (!value) return NULL;
+    for (size_t i = 0; i < size; i++) value[i] = (char)('a' + i % 26);
+    value[size] = '\0';
+    return value;
+}
+
+/*******************************************************************************
+ * Scale
+ ******************************************************************************/
+typedef struct {
+    Target* target;
+    const Settings* settings;
+    const char* pattern;
+    int ready;              // Workers waiting for the start
+    int start;
+    int stop;
+} ScaleRun;
+
+typedef struct {
+    double throughput;      // Operations per second
+    double contended;       // Share of lock acquisitions that had to wait
+    double wait_share;      // Share of the threads' time spent waiting for a lock
+    Latency latency;
+} ScaleResult;
+
+typedef struct {
+    ScaleRun* run;
+    pthread_t thread;
+    uint64_t seed;
+    Latency latency;
+} ScaleWorker;
+
+static void* scale_worker(void* arg) {
+    ScaleWorker* worker = (ScaleWorker*)arg;
+    ScaleRun* run = worker->run;
+    char key[MAX_KEY_SIZE + 1];
+
+    __atomic_fetch_add(&run->ready, 1, __ATOMIC_ACQ_REL);
+    while (!__atomic_load_n(&run->start, __ATOMIC_ACQUIRE)) sched_yield();
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)) {
+        uint64_t r = random_next(&worker->seed);
+        uint64_t n = (r >> 8) % run->settings->keys;
+        entry_key(run->settings, n, key);
+        const char* value = entry_value(run->settings, run->pattern, n);
+        uint64_t start = now_ns();
+        if ((int)(r % 100) < run->settings->read_percent) target_get(run->target, key);
+        else target_set(run->target, key, value);
+        latency_add(&worker->latency, now_ns() - start);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Fills a fresh target and runs the mixed workload on threads threads
+ *
+ * @return 0 on success, -1 if the databases could not be created
+ */
+static int scale_measure(const Settings* settings, int shards, int threads, const char* pattern,
+                         ScaleResult* result) {
+    Target target;
+    if (target_open(&target, settings, shards) != 0) {
+        fprintf(stderr, "sdb-bench: cannot create a database in %s\n", settings->dir);
+        target_close(&target);
+        return -1;
+    }
+    char key[MAX_KEY_SIZE + 1];
+    for (size_t i = 0; i < settings->keys; i++) {
+        entry_key(settings, i, key);
+        target_set(&target, key, entry_value(settings, pattern, i));
+    }
+
+    ScaleRun run = { &target, settings, pattern, 0, 0, 0 };
+    ScaleWorker* workers = (ScaleWorker*)calloc(threads, sizeof(ScaleWorker));
+    for (int i = 0; i < threads; i++) {
+        workers[i].run = &run;
+        workers[i].seed = 0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1);
+        pthread_create(&workers[i].thread, NULL, scale_worker, &workers[i]);
+    }
+    while (__atomic_load_n(&run.ready, __ATOMIC_ACQUIRE) < threads) sched_yield();
+
+    SDBLockStats before = target_lock_stats(&target);
+    uint64_t start = now_ns();
+    __atomic_store_n(&run.start, 1, __ATOMIC_RELEASE);
+    struct timespec duration = { (time_t)settings->seconds,
+                                 (long)((settings->seconds - (double)(time_t)settings->seconds) * 1e9) };
+    nanosleep(&duration, NULL);
+    __atomic_store_n(&run.stop, 1, __ATOMIC_RELAXED);
+
+    memset(result, 0, sizeof(ScaleResult));
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+        latency_merge(&result->latency, &workers[i].latency);
+    }
+    double elapsed = (double)(now_ns() - start) / 1e9;
+    SDBLockStats after = target_lock_stats(&target);
+    free(workers);
+    target_close(&target);
+
+    size_t acquisitions = after.acquisitions - before.acquisitions;
+    size_t contended = after.contended - before.contended;
+    result->throughput = (double)result->latency.total / elapsed;
+    result->contended = acquisitions ? (double)contended / (double)acquisitions : 0.0;
+    result->wait_share = (double)(after.wait_us - before.wait_us) / (elapsed * 1e6 * threads);
+    return 0;
+}
+
+/**
+ * @brief Runs the mixed workload on threads threads and prints one line
+ *
+ * @param baseline Throughput of one thread on the same target, or 0 if this is the run with one thread
+ * @return The throughput in operations per second
+ */
+static double scale_run(const Settings* settings, int shards, int threads, const char* pattern, double baseline) {
+    ScaleResult result;
+    if (scale_measure(settings, shards, threads, pattern, &result) != 0) return 0;
+    const Latency* latency = &result.latency;
+    printf("%-8s %7d %11.0f %7.2fx %9.1f%% %9.1f%% %9.1f %9.1f %9.1f %9.1f\n",
+           shards ? "sharded" : "single", threads, result.throughput,
+           baseline > 0 ? result.throughput / baseline : 1.0, 100.0 * result.contended, 100.0 * result.wait_share,
+           latency_percentile(latency, 0.50), latency_percentile(latency, 0.99),
+           latency_percentile(latency, 0.999), (double)latency->max_ns / 1000.0);
+    fflush(stdout);
+    return result.throughput;
+}
+
+static int cmd_scale(const Settings* settings) {
+    char* value = make_value(settings->value_size.max);
+    if (!value) return 1;
+
+    char key_text[64], value_text[64];
+    printf("%zu keys of %s bytes, values of %s bytes, %d%% reads, %.1f s per run, %ld CPUs%s%s\n",
+           settings->keys, size_text(&settings->key_size, key_text, sizeof(key_text)),
+           size_text(&settings->value_size, value_text, sizeof(value_text)), settings->read_percent, settings->seconds,
+           sysconf(_SC_NPROCESSORS_ONLN), settings->ordered ? ", ordered tables" : "",
+           settings->wal_sync ? ", synced log" : "");
+    printf("%-8s %7s %11s %8s %10s %10s %9s %9s %9s %9s\n", "target", "threads", "ops/s", "scaling",
+           "contended", "lock wait", "p50 us", "p99 us", "p99.9 us", "max us");
+
+    // Thread counts double up to the highest one, which is always included
+    for (int sharded = 0; sharded <= 1; sharded++) {
+        double baseline = 0;
+        for (int threads = 1; threads <= settings->threads; threads *= 2) {
+            double throughput = scale_run(settings, sharded ? settings->shards : 0, threads, value, baseline);
+            if (threads == 1) baseline = throughput;
+            if (threads < settings->threads && threads * 2 > settings->threads) {
+                scale_run(settings, sharded ? settings->shards : 0, settings->threads, value, baseline);
+            }
+        }
+    }
+    free(value);
+    return 0;
+}
+
+/*******************************************************************************
+ * Open
+ ******************************************************************************/
+/*
+ * Every database is built and opened in a child process, so each open
+ * starts from a process that has not touched the data, and its peak
+ * memory is its own.
+ */
+typedef struct {
+    int ok;
+    double open_ms;
+    double get_ms;          // First get after the open
+    long peak_kib;          // Peak resident memory above the process before the open
+} OpenResult;
+
+static const char* codec_name(SDBCompressType codec) {
+    return codec == SDB_COMPRESS_NONE ? "none" : codec == SDB_COMPRESS_RLE ? "rle" : "lz77";
+}
+
+static const char* format_name(unsigned format) {
+    return format == FORMAT_BLOCKS ? "blocks" : format == FORMAT_FROZEN ? "frozen"
+         : format == FORMAT_PAGED ? "paged" : "log";
+}
+
+/**
+ * @brief Returns the options a format is built and opened with
+ */
+static SDBOptions open_options(unsigned format, SDBCompressType codec, uint64_t entries, const Settings* settings) {
+    SDBOptions options = sdb_options_default();
+    options.compress_type = codec;
+    options.wal_sync = 0;
+    if (format == FORMAT_PAGED) options.storage_mode = SDB_STORAGE_PAGED;
+    if (format == FORMAT_LOG) {
+        // A ring twice the size of the records, and no checkpoint before it is full
+        uint64_t ring = 2 * entries * (settings->key_size.max + settings->value_size.max + 64);
+        options.wal_size = ring < SDB_DEFAULT_WAL_SIZE ? SDB_DEFAULT_WAL_SIZE : (size_t)ring;
+        options.checkpoint_log_size = options.wal_size;
+        options.log_soft_limit = options.wal_size;
+        options.log_hard_limit = options.wal_size;
+        options.checkpoint_interval = 0;
+        options.recovery_target_ms = 0;
+    }
+    return options;
+}
+
+/**
+ * @brief Writes a sorted snapshot of entries keys straight through the block writer
+ */
+static int build_blocks(const char* path, SDBCompressType codec, uint64_t entries, const Settings* settings,
+                        const char* pattern) {
+    FILE* file = fopen(path, "wb");
+    if (!file) return -1;
+    SDBBlockWriter writer;
+    block_writer_init(&writer, file, codec, SDB_SORTED_BLOCK_SIZE);
+    block_writer_sort(&writer, 1);
+    char key[MAX_KEY_SIZE + 1];
+    for (uint64_t i = 0; i < entries && !writer.failed; i++) {
+        uint32_t key_len = entry_key(settings, i, key);
+        const char* value = entry_value(settings, pattern, i);
+        block_writer_add(&writer, 0, key, key_len, value, (uint32_t)strlen(value));
+    }
+    char* names[1] = { (char*)BENCH_TABLE };
+    int ok = block_writer_finish(&writer, names, 1) == 0;
+    ok = ok && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0) ok = 0;
+    return ok ? 0 : -1;
+}
+
+/**
+ * @brief Builds a database in one format; runs in a child process
+ */
+static int build_database(const char* path, unsigned format, SDBCompressType codec, uint64_t entries,
+                          const Settings* settings, const char* pattern) {
+    SDBOptions options = open_options(format, codec, entries, settings);
+    if ((format == FORMAT_BLOCKS || format == FORMAT_FROZEN) &&
+        build_blocks(path, codec, entries, settings, pattern) != 0) {
+        return -1;
+    }
+    SDB* db = sdb_open_ex(path, &options);
+    if (!db) return -1;
+
+    // Opening once also creates the log, which later opens reuse
+    if (format == FORMAT_BLOCKS || format == FORMAT_FROZEN) {
+        int result = format == FORMAT_FROZEN ? sdb_table_freeze(db, BENCH_TABLE) : 0;
+        sdb_close(db);
+        return result;
+    }
+
+    sdb_table_create(db, BENCH_TABLE);
+    SDBOperation ops[256];
+    char* keys = (char*)malloc(256 * (MAX_KEY_SIZE + 1));
+    if (!keys) return -1;
+    for (uint64_t i = 0; i < entries;) {
+        size_t count = 0;
+        for (; count < 256 && i < entries; count++, i++) {
+            ops[count].table = (char*)BENCH_TABLE;
+            ops[count].key = keys + count * (MAX_KEY_SIZE + 1);
+            ops[count].value = (char*)entry_value(settings, pattern, i);
+            entry_key(settings, i, ops[count].key);
+        }
+        sdb_batch_execute(db, ops, count);
+    }
+    free(keys);
+    if (format == FORMAT_PAGED) {
+        sdb_close(db);
+        return 0;
+    }
+
+    // Leave without closing, as a crash would, so that the log is replayed
+    SDBWal* wal = db->wal;
+    if (!wal || wal->head != 0 || wal->checkpoints != 0) return -1;
+    if (msync(wal->map, wal->map_size, MS_SYNC) != 0) return -1;
+    return 0;
+}
+
+/**
+ * @brief Opens a database and reads one key; runs in a child process
+ */
+static OpenResult open_database(const char* path, unsigned format, SDBCompressType codec, uint64_t entries,
+                                const Settings* settings) {
+    OpenResult result = {0};
+    SDBOptions options = open_options(format, codec, entries, settings);
+    long before = status_kib("VmRSS");
+    uint64_t start = now_ns();
+    SDB* db = sdb_open_ex(path, &options);
+    uint64_t opened = now_ns();
+    if (!db) return result;
+
+    char key[MAX_KEY_SIZE + 1];
+    uint64_t seed = now_ns() | 1;
+    entry_key(settings, random_next(&seed) % entries, key);
+    char* value = sdb_table_get(db, BENCH_TABLE, key);
+    uint64_t got = now_ns();
+
+    result.ok = value != NULL;
+    result.open_ms = (double)(opened - start) / 1e6;
+    result.get_ms = (double)(got - opened) / 1e6;
+    long peak = status_kib("VmHWM");
+    result.peak_kib = peak > before ? peak - before : 0;
+    return result;
+}
+
+/**
+ * @brief Runs a build or an open in a child process
+ *
+ * @param open_run 0 to build the database, 1 to open it
+ * @param cold Drop the files from the page cache first
+ */
+static OpenResult open_child(const char* path, unsigned format, SDBCompressType codec, uint64_t entries,
+                             const Settings* settings, const char* pattern, int open_run, int cold) {
+    OpenResult result = {0};
+    int fds[2];
+    if (pipe(fds) != 0) return result;
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        if (open_run) {
+            if (cold) {
+                char sidecar[4096 + 8];
+                drop_cached(path);
+                snprintf(sidecar, sizeof(sidecar), "%s.wal", path);
+                drop_cached(sidecar);
+            }
+            result = open_database(path, format, codec, entries, settings);
+        } else {
+            result.ok = build_database(path, format, codec, entries, settings, pattern) == 0;
+        }
+        if (write(fds[1], &result, sizeof(result)) != (ssize_t)sizeof(result)) _exit(1);
+        _exit(0);
+    }
+    close(fds[1]);
+    if (pid > 0) {
+        if (read(fds[0], &result, sizeof(result)) != (ssize_t)sizeof(result)) result.ok = 0;
+        waitpid(pid, NULL, 0);
+    }
+    close(fds[0]);
+    return result;
+}
+
+static void open_print(const OpenResult* result) {
+    if (!result->ok) {
+        printf(" %9s %9s %9s", "failed", "-", "-");
+        return;
+    }
+    printf(" %9.2f %9.3f %9.1f", result->open_ms, result->get_ms, (double)result->peak_kib / 1024.0);
+}
+
+static int cmd_open(const Settings* settings) {
+    char* value = make_value(settings->value_size.max);
+    if (!value) return 1;
+
+    char key_text[64], value_text[64];
+    printf("keys of %s bytes, values of %s bytes; cold runs drop the files from the page cache first\n",
+           size_text(&settings->key_size, key_text, sizeof(key_text)),
+           size_text(&settings->value_size, value_text, sizeof(value_text)));
+    printf("%-7s %-5s %11s %9s | %9s %9s %9s | %9s %9s %9s\n", "format", "codec", "entries", "file MB",
+           "cold ms", "get ms", "peak MB", "warm ms", "get ms", "peak MB");
+    for (unsigned format = FORMAT_BLOCKS; format <= FORMAT_LOG; format <<= 1) {
+        if (!(settings->formats & format)) continue;
+        for (int codec = SDB_COMPRESS_NONE; codec <= SDB_COMPRESS_LZ77; codec++) {
+            if (!(settings->codecs & (1u << codec))) continue;
+            for (int i = 0; i < settings->size_count; i++) {
+                uint64_t entries = settings->sizes[i];
+                SDBOptions options = open_options(format, (SDBCompressType)codec, entries, settings);
+                if (format == FORMAT_LOG && options.wal_size > MAX_LOG_RING) continue;
+
+                char path[4096];
+                snprintf(path, sizeof(path), "%s/sdb-bench-%d-%d.sdb", settings->dir, (int)getpid(), bench_files++);
+                remove_database(path);
+                OpenResult built = open_child(path, format, (SDBCompressType)codec, entries, settings, value, 0, 0);
+                uint64_t bytes = file_size(path);
+                if (format == FORMAT_LOG) {
+                    char wal[4096 + 8];
+                    snprintf(wal, sizeof(wal), "%s.wal", path);
+                    bytes += file_size(wal);
+                }
+                printf("%-7s %-5s %11llu %9.1f |", format_name(format),
+                       format == FORMAT_PAGED || format == FORMAT_LOG ? "-" : codec_name((SDBCompressType)codec),
+                       (unsigned long long)entries, (double)bytes / (1024.0 * 1024.0));
+                if (built.ok) {
+                    OpenResult cold = open_child(path, format, (SDBCompressType)codec, entries, settings, value, 1, 1);
+                    OpenResult warm = open_child(path, format, (SDBCompressType)codec, entries, settings, value, 1, 0);
+                    open_print(&cold);
+                    printf(" |");
+                    open_print(&warm);
+                } else {
+                    printf(" %s", "could not build the database");
+                }
+                printf("\n");
+                fflush(stdout);
+                remove_database(path);
+            }
+
+            // Page files and logs do not depend on the codec
+            if (format == FORMAT_PAGED || format == FORMAT_LOG) break;
+        }
+    }
+    free(value);
+    return 0;
+}
+
+/*******************************************************************************
+ * Memory
+ ******************************************************************************/
+#if defined(__GLIBC__) && __GLIBC_PREREQ(2, 33)
+#include <malloc.h>
+
+/**
+ * @brief Returns the bytes malloc has handed out and not taken back
+ */
+static size_t malloc_bytes(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+#else
+static size_t malloc_bytes(void) {
+    return 0;
+}
+#endif
+
+typedef struct {
+    const char* name;
+    double bytes;           // Counted over all entries
+} MemoryRow;
+
+static void memory_print(const char* name, double bytes, size_t entries, double total) {
+    printf("%-22s %12.1f %12.1f %8.1f%%\n", name, bytes / (1024.0 * 1024.0), bytes / (double)entries,
+           total > 0 ? 100.0 * bytes / total : 0.0);
+}
+
+/**
+ * @brief Walks the entries of a loaded table, filling the breakdown
+ *
+ * Arena objects carry a header and are padded to 8 bytes; the header of
+ * each key and value is found just before it.
+ */
+static void memory_entries(const SDBTable* table, MemoryRow* rows) {
+    const SDBEntryList* list = table->entries;
+    double objects = 0;
+    for (const SDBEntry* e = list->head; e; e = e->next) {
+        rows[0].bytes += sizeof(SDBEntry);
+        rows[1].bytes += (double)strlen(e->key) + 1;
+        rows[2].bytes += (double)e->value_len + 1;
+        objects += ((const SDBArenaObject*)e->key - 1)->size;
+        if (e->value) objects += ((const SDBArenaObject*)e->value - 1)->size;
+    }
+    rows[3].bytes = objects - rows[1].bytes - rows[2].bytes;
+    rows[4].bytes = (double)list->capacity * sizeof(SDBEntry*);
+    rows[5].bytes = (double)(list->arena.mapped - list->arena.live);
+}
+
+/**
+ * @brief Walks the skiplist of an ordered table, filling the breakdown
+ *
+ * Nodes hold their links and key in one allocation and values carry a
+ * header; the links are counted as the index.
+ */
+static void memory_skiplist(const SDBTable* table, MemoryRow* rows) {
+    for (const SDBSkipNode* node = table->ordered->head->next[0]; node; node = node->next[0]) {
+        rows[0].bytes += sizeof(SDBSkipNode);
+        rows[1].bytes += (double)node->key_len + 1;
+        rows[2].bytes += (double)node->value->len + 1;
+        rows[3].bytes += sizeof(SDBSkipValue);
+        rows[4].bytes += (double)node->height * sizeof(SDBSkipNode*);
+    }
+}
+
+typedef struct {
+    MemoryRow rows[7];
+    size_t entries;
+    int ordered;
+    int has_malloc;         // Whether malloc reports its bytes
+    double allocated;       // Bytes malloc handed out plus arena blocks mapped
+    double rss;             // Growth of the anonymous resident memory
+} MemoryReport;
+
+/**
+ * @brief Loads a table of --keys entries and breaks down the memory it takes
+ *
+ * @return 0 on success, -1 if the table could not be built or loaded
+ */
+static int memory_measure(const Settings* settings, MemoryReport* report) {
+    char* value = make_value(settings->value_size.max);
+    if (!value) return -1;
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sdb-bench-%d-%d.sdb", settings->dir, (int)getpid(), bench_files++);
+    remove_database(path);
+    OpenResult built = open_child(path, FORMAT_BLOCKS, SDB_COMPRESS_NONE, settings->keys, settings, value, 0, 0);
+    free(value);
+    if (!built.ok) {
+        fprintf(stderr, "sdb-bench: could not build %s\n", path);
+        remove_database(path);
+        return -1;
+    }
+
+    long rss_before = status_kib("RssAnon");
+    size_t malloc_before = malloc_bytes();
+    SDBOptions options = open_options(FORMAT_BLOCKS, SDB_COMPRESS_NONE, settings->keys, settings);
+    SDB* db = sdb_open_ex(path, &options);
+    SDBTable* table = db ? sdb_table_find(db, BENCH_TABLE) : NULL;
+    if (!table || (settings->ordered && sdb_table_set_ordered(db, BENCH_TABLE) != 0)) {
+        fprintf(stderr, "sdb-bench: could not load %s\n", path);
+        if (db) sdb_close(db);
+        remove_database(path);
+        return -1;
+    }
+    if (!table->ordered) table_load_blocks(db, table);
+    long rss_after = status_kib("RssAnon");
+    size_t malloc_after = malloc_bytes();
+
+    static const char* const names[] = { "entry structs", "keys", "values", "headers and padding", "index",
+                                         "arena slack", "malloc overhead" };
+    MemoryRow* rows = report->rows;
+    memset(report, 0, sizeof(MemoryReport));
+    for (int i = 0; i < 7; i++) rows[i].name = names[i];
+    size_t arena_mapped = 0;
+    report->entries = settings->keys;
+    report->ordered = table->ordered != NULL;
+    if (table->ordered) {
+        memory_skiplist(table, rows);
+    } else {
+        memory_entries(table, rows);
+        arena_mapped = table->entries->arena.mapped;
+        report->entries = table->entries->count;
+    }
+
+    // Whatever malloc handed out beyond the structures it holds is its own
+    // chunk overhead, plus the table and file state of the database
+    double malloced = (double)(malloc_after - malloc_before);
+    double structs = rows[0].bytes + rows[4].bytes;
+    if (table->ordered) structs += rows[1].bytes + rows[2].bytes + rows[3].bytes;
+    report->has_malloc = malloc_before || malloc_after;
+    rows[6].bytes = report->has_malloc ? malloced - structs : 0;
+    report->allocated = malloced + (double)arena_mapped;
+    report->rss = (double)(rss_after - rss_before) * 1024.0;
+
+    sdb_close(db);
+    remove_database(path);
+    return 0;
+}
+
+static double memory_total(const MemoryReport* report) {
+    double total = 0;
+    for (int i = 0; i < 7; i++) total += report->rows[i].bytes;
+    return total;
+}
+
+static int cmd_memory(const Settings* settings) {
+    MemoryReport report;
+    if (memory_measure(settings, &report) != 0) return 1;
+
+    const MemoryRow* rows = report.rows;
+    size_t entries = report.entries;
+    double total = memory_total(&report);
+    double payload = rows[1].bytes + rows[2].bytes;
+    char key_text[64], value_text[64];
+    printf("%zu entries, keys of %s bytes, values of %s bytes, %s table\n", entries,
+           size_text(&settings->key_size, key_text, sizeof(key_text)),
+           size_text(&settings->value_size, value_text, sizeof(value_text)), report.ordered ? "ordered" : "hash");
+    printf("%-22s %12s %12s %9s\n", "", "MB", "bytes/entry", "share");
+    for (int i = 0; i < 7; i++) memory_print(rows[i].name, rows[i].bytes, entries, total);
+    printf("\n");
+    memory_print("accounted", total, entries, total);
+    if (report.has_malloc) memory_print("allocator reported", report.allocated, entries, total);
+    memory_print("RSS (anonymous)", report.rss, entries, total);
+    printf("overhead over keys and values: %.1f bytes/entry (%.2fx)\n",
+           (total - payload) / (double)entries, payload > 0 ? total / payload : 0.0);
+    return 0;
+}
+
+/*******************************************************************************
+ * Amplification
+ ******************************************************************************/
+static const char* mode_name(unsigned mode) {
+    return mode == MODE_LOG ? "log" : mode == MODE_SAVE ? "save" : "paged";
+}
+
+static double megabytes(uint64_t bytes) {
+    return (double)bytes / (1024.0 * 1024.0);
+}
+
+static void amplification_print(unsigned mode, double seconds, const SDBWriteStats* stats) {
+    uint64_t cold = stats->cold_bytes + stats->compaction_bytes;
+    uint64_t physical = stats->log_bytes + stats->snapshot_bytes + stats->page_bytes + cold;
+    printf("%-6s %7.1f %10.1f %10.1f %10.1f %10.1f %10.1f %9.2fx", mode_name(mode), seconds,
+           megabytes(stats->user_bytes), megabytes(stats->log_bytes), megabytes(stats->snapshot_bytes),
+           megabytes(stats->page_bytes), megabytes(cold),
+           stats->user_bytes ? (double)physical / (double)stats->user_bytes : 0.0);
+
+    // Page files do not know how much of them is live
+    if (stats->live_bytes) {
+        printf(" %10.1f %10.1f %9.2fx\n", megabytes(stats->live_bytes), megabytes(stats->file_bytes),
+               (double)stats->file_bytes / (double)stats->live_bytes);
+    } else {
+        printf(" %10s %10.1f %10s\n", "-", megabytes(stats->file_bytes), "-");
+    }
+    fflush(stdout);
+}
+
+/**
+ * @brief Writes random keys into an empty database, printing the
+ *        amplification ten times along the way
+ */
+static int amplification_run(const Settings* settings, unsigned mode, SDBCompressType codec, const char* pattern) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sdb-bench-%d-%d.sdb", settings->dir, (int)getpid(), bench_files++);
+    remove_database(path);
+
+    SDBOptions options = sdb_options_default();
+    options.compress_type = codec;
+    options.wal_sync = settings->wal_sync;
+    if (mode == MODE_SAVE) options.wal_size = 0;
+    if (mode == MODE_PAGED) options.storage_mode = SDB_STORAGE_PAGED;
+    SDB* db = sdb_open_ex(path, &options);
+    if (!db) {
+        fprintf(stderr, "sdb-bench: could not open %s\n", path);
+        return -1;
+    }
+    sdb_table_create(db, BENCH_TABLE);
+    if (settings->ordered && mode != MODE_PAGED) sdb_table_set_ordered(db, BENCH_TABLE);
+
+    char key[MAX_KEY_SIZE + 1];
+    uint64_t seed = 0x2545F4914F6CDD1DULL;
+    uint64_t start = now_ns();
+    uint64_t interval = (uint64_t)(settings->seconds * 1e9 / 10);
+    uint64_t report = start + interval;
+    for (int reports = 0; reports < 10;) {
+        uint64_t n = random_next(&seed) % settings->keys;
+        entry_key(settings, n, key);
+        sdb_table_set(db, BENCH_TABLE, key, entry_value(settings, pattern, n));
+
+        uint64_t now = now_ns();
+        if (now < report) continue;
+        SDBWriteStats stats = sdb_write_stats(db);
+        amplification_print(mode, (double)(now - start) / 1e9, &stats);
+        report += interval;
+        reports++;
+    }
+    sdb_close(db);
+    remove_database(path);
+    return 0;
+}
+
+static int cmd_amplification(const Settings* settings) {
+    char* value = make_value(settings->value_size.max);
+    if (!value) return 1;
+
+    // Compression would hide amplification, so snapshots are only
+    // compressed when the codecs are narrowed down
+    SDBCompressType codec = SDB_COMPRESS_NONE;
+    if (settings->codecs != 7) {
+        while (!(settings->codecs & (1u << codec))) codec = (SDBCompressType)(codec + 1);
+    }
+
+    char key_text[64], value_text[64];
+    printf("%zu keys of %s bytes, values of %s bytes, random sets, %s snapshots%s\n", settings->keys,
+           size_text(&settings->key_size, key_text, sizeof(key_text)),
+           size_text(&settings->value_size, value_text, sizeof(value_text)), codec_name(codec),
+           settings->wal_sync ? ", synced log" : "");
+    printf("%-6s %7s %10s %10s %10s %10s %10s %10s %10s %10s %10s\n", "mode", "s", "user MB", "log MB",
+           "snap MB", "pages MB", "cold MB", "write amp", "live MB", "disk MB", "space amp");
+    int result = 0;
+    for (unsigned mode = MODE_LOG; mode <= MODE_PAGED; mode <<= 1) {
+        if ((settings->modes & mode) && amplification_run(settings, mode, codec, value) != 0) result = 1;
+    }
+    free(value);
+    return result;
+}
+
+/*******************************************************************************
+ * Compare
+ ******************************************************************************/
+/*
+ * compare runs a fixed suite several times, interleaved so that drift of
+ * the machine hits every metric alike, and compares each metric with a
+ * baseline using Welch's t-test. A metric regresses when it got worse by
+ * more than the threshold and the difference is significant at 95%.
+ */
+typedef struct {
+    const char* name;
+    const char* unit;
+    int higher_is_better;
+    double samples[MAX_RUNS];
+    int count;
+} Metric;
+
+enum {
+    METRIC_SINGLE_OPS,
+    METRIC_SINGLE_P99,
+    METRIC_SHARDED_OPS,
+    METRIC_SHARDED_P99,
+    METRIC_OPEN_MS,
+    METRIC_GET_MS,
+    METRIC_MEMORY,
+    METRIC_COUNT
+};
+
+static void metrics_init(Metric* metrics) {
+    static const Metric defaults[METRIC_COUNT] = {
+        { "scale.single.throughput", "ops/s", 1, {0}, 0 },
+        { "scale.single.p99", "us", 0, {0}, 0 },
+        { "scale.sharded.throughput", "ops/s", 1, {0}, 0 },
+        { "scale.sharded.p99", "us", 0, {0}, 0 },
+        { "open.blocks.warm", "ms", 0, {0}, 0 },
+        { "open.blocks.first_get", "ms", 0, {0}, 0 },
+        { "memory.bytes_per_entry", "bytes", 0, {0}, 0 }
+    };
+    memcpy(metrics, defaults, sizeof(defaults));
+}
+
+static void metric_add(Metric* metric, double value) {
+    if (metric->count < MAX_RUNS) metric->samples[metric->count++] = value;
+}
+
+/**
+ * @brief Two-sided 95% quantile of Student's t distribution
+ */
+static double t_critical(double df) {
+    static const double table[30] = {
+        12.706, 4.303, 3.182, 2.776, 2.571, 2.447, 2.365, 2.306, 2.262, 2.228,
+        2.201, 2.179, 2.160, 2.145, 2.131, 2.120, 2.110, 2.101, 2.093, 2.086,
+        2.080, 2.074, 2.069, 2.064, 2.060, 2.056, 2.052, 2.048, 2.045, 2.042
+    };
+    if (df < 1) return table[0];
+    if (df <= 30) return table[(int)df - 1];
+    return 1.96 + 2.4 / df;
+}
+
+static double metric_mean(const Metric* metric) {
+    double sum = 0;
+    for (int i = 0; i < metric->count; i++) sum += metric->samples[i];
+    return metric->count ? sum / metric->count : 0.0;
+}
+
+static double metric_variance(const Metric* metric) {
+    if (metric->count < 2) return 0.0;
+    double mean = metric_mean(metric);
+    double sum = 0;
+    for (int i = 0; i < metric->count; i++) sum += (metric->samples[i] - mean) * (metric->samples[i] - mean);
+    return sum / (metric->count - 1);
+}
+
+/**
+ * @brief Half the width of the 95% confidence interval of the mean
+ */
+static double metric_interval(const Metric* metric) {
+    if (metric->count < 2) return 0.0;
+    return t_critical(metric->count - 1) * sqrt(metric_variance(metric) / metric->count);
+}
+
+/**
+ * @brief Whether two metrics differ significantly, by Welch's t-test at 95%
+ *
+ * A metric with fewer than two samples has no variance to test against,
+ * so it never differs.
+ */
+static int metric_differs(const Metric* a, const Metric* b) {
+    if (a->count < 2 || b->count < 2) return 0;
+    double va = metric_variance(a) / a->count;
+    double vb = metric_variance(b) / b->count;
+    double diff = metric_mean(a) - metric_mean(b);
+    if (va + vb == 0) return diff != 0;
+    double t = fabs(diff) / sqrt(va + vb);
+    double df = (va + vb) * (va + vb) /
+                ((a->count > 1 ? va * va / (a->count - 1) : 0) + (b->count > 1 ? vb * vb / (b->count - 1) : 0));
+    return t > t_critical(df);
+}
+
+static void config_text(const Settings* settings, char* text, size_t size) {
+    char key_text[64], value_text[64];
+    snprintf(text, size, "keys=%zu key-size=%s value-size=%s reads=%d seconds=%g threads=%d shards=%d ordered=%d sync=%d",
+             settings->keys, size_text(&settings->key_size, key_text, sizeof(key_text)),
+             size_text(&settings->value_size, value_text, sizeof(value_text)), settings->read_percent,
+             settings->seconds, settings->threads, settings->shards, settings->ordered, settings->wal_sync);
+}
+
+static int results_save(const char* path, const char* config, const Metric* metrics) {
+    FILE* file = fopen(path, "w");
+    if (!file) return -1;
+    fprintf(file, "{\n  \"sdb_version\": \"%s\",\n  \"config\": \"%s\",\n  \"metrics\": [\n", SDB_VERSION, config);
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        fprintf(file, "    {\"name\": \"%s\", \"unit\": \"%s\", \"higher_is_better\": %s, \"samples\": [",
+                metrics[m].name, metrics[m].unit, metrics[m].higher_is_better ? "true" : "false");
+        for (int i = 0; i < metrics[m].count; i++) {
+            fprintf(file, "%s%.10g", i ? ", " : "", metrics[m].samples[i]);
+        }
+        fprintf(file, "]}%s\n", m + 1 < METRIC_COUNT ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+/**
+ * @brief Copies the string value of field out of a JSON object
+ *
+ * @return Just after the value, or NULL if the field is missing
+ */
+static const char* json_string(const char* json, const char* field, char* out, size_t size) {
+    char quoted[64];
+    snprintf(quoted, sizeof(quoted), "\"%s\"", field);
+    const char* at = strstr(json, quoted);
+    if (!at || !(at = strchr(at + strlen(quoted), '"'))) return NULL;
+    const char* end = strchr(++at, '"');
+    if (!end) return NULL;
+    size_t len = (size_t)(end - at) < size - 1 ? (size_t)(end - at) : size - 1;
+    memcpy(out, at, len);
+    out[len] = '\0';
+    return end + 1;
+}
+
+/**
+ * @brief Reads results written by results_save into metrics of the same names
+ *
+ * Metrics the file does not have keep no samples.
+ *
+ * @return 0 on success, -1 if the file cannot be read
+ */
+static int results_load(const char* path, char* config, size_t config_size, Metric* metrics) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return -1;
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char* json = size >= 0 ? (char*)malloc((size_t)size + 1) : NULL;
+    int ok = json && fread(json, 1, (size_t)size, file) == (size_t)size;
+    fclose(file);
+    if (!ok) {
+        free(json);
+        return -1;
+    }
+    json[size] = '\0';
+
+    if (!json_string(json, "config", config, config_size)) config[0] = '\0';
+    char name[128];
+    for (const char* at = json; (at = json_string(at, "name", name, sizeof(name))) != NULL;) {
+        const char* samples = strstr(at, "\"samples\"");
+        if (!samples || !(samples = strchr(samples, '['))) break;
+        Metric* metric = NULL;
+        for (int m = 0; m < METRIC_COUNT; m++) {
+            if (strcmp(metrics[m].name, name) == 0) metric = &metrics[m];
+        }
+        char* end = (char*)samples + 1;
+        for (;;) {
+            char* next;
+            double value = strtod(end, &next);
+            if (next == end) break;
+            if (metric) metric_add(metric, value);
+            end = next;
+            while (*end == ',' || *end == ' ' || *end == '\n') end++;
+        }
+        at = end;
+    }
+    free(json);
+    return 0;
+}
+
+/**
+ * @brief Runs the suite once, adding a sample to every metric
+ */
+static int compare_run(const Settings* settings, const char* pattern, Metric* metrics) {
+    ScaleResult scale;
+    for (int shards = 0; shards <= settings->shards; shards += settings->shards) {
+        if (scale_measure(settings, shards, settings->threads, pattern, &scale) != 0) return -1;
+        metric_add(&metrics[shards ? METRIC_SHARDED_OPS : METRIC_SINGLE_OPS], scale.throughput);
+        metric_add(&metrics[shards ? METRIC_SHARDED_P99 : METRIC_SINGLE_P99],
+                   latency_percentile(&scale.latency, 0.99));
+    }
+
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/sdb-bench-%d-%d.sdb", settings->dir, (int)getpid(), bench_files++);
+    remove_database(path);
+    OpenResult built = open_child(path, FORMAT_BLOCKS, SDB_COMPRESS_LZ77, settings->keys, settings, pattern, 0, 0);
+    OpenResult opened = built.ok ? open_child(path, FORMAT_BLOCKS, SDB_COMPRESS_LZ77, settings->keys, settings,
+                                              pattern, 1, 0) : built;
+    remove_database(path);
+    if (!opened.ok) return -1;
+    metric_add(&metrics[METRIC_OPEN_MS], opened.open_ms);
+    metric_add(&metrics[METRIC_GET_MS], opened.get_ms);
+
+    MemoryReport memory;
+    if (memory_measure(settings, &memory) != 0) return -1;
+    metric_add(&metrics[METRIC_MEMORY], memory_total(&memory) / (double)memory.entries);
+    return 0;
+}
+
+static int cmd_compare(const Settings* settings) {
+    Metric baseline[METRIC_COUNT];
+    Metric current[METRIC_COUNT];
+    metrics_init(baseline);
+    metrics_init(current);
+    char config[512], baseline_config[512];
+    config_text(settings, config, sizeof(config));
+    if (settings->baseline && results_load(settings->baseline, baseline_config, sizeof(baseline_config),
+                                           baseline) != 0) {
+        fprintf(stderr, "sdb-bench: cannot read %s\n", settings->baseline);
+        return 2;
+    }
+
+    char* value = make_value(settings->value_size.max);
+    if (!value) return 2;
+    printf("%d runs, %s\n", settings->runs, config);
+    for (int run = 0; run < settings->runs; run++) {
+        if (compare_run(settings, value, current) != 0) {
+            free(value);
+            return 2;
+        }
+        printf("run %d of %d done\n", run + 1, settings->runs);
+        fflush(stdout);
+    }
+    free(value);
+    if (settings->save && results_save(settings->save, config, current) != 0) {
+        fprintf(stderr, "sdb-bench: cannot write %s\n", settings->save);
+        return 2;
+    }
+
+    if (settings->baseline && strcmp(config, baseline_config) != 0) {
+        printf("warning: the baseline was measured with %s\n", baseline_config);
+    }
+    printf("%-26s %-6s %14s %8s %14s %8s %8s  %s\n", "metric", "unit", "baseline", "+-95%", "current", "+-95%",
+           "change", "verdict");
+    int regressions = 0;
+    for (int m = 0; m < METRIC_COUNT; m++) {
+        const Metric* now = &current[m];
+        const Metric* base = &baseline[m];
+        double mean = metric_mean(now);
+        printf("%-26s %-6s", now->name, now->unit);
+        if (base->count == 0) {
+            printf(" %14s %8s %14.2f %7.1f%% %8s  %s\n", "-", "-", mean,
+                   mean ? 100.0 * metric_interval(now) / mean : 0.0, "-", settings->baseline ? "no baseline" : "");
+            continue;
+        }
+
+        // Positive changes are improvements, whichever way the metric goes
+        double base_mean = metric_mean(base);
+        double change = base_mean ? 100.0 * (mean - base_mean) / base_mean : 0.0;
+        if (!now->higher_is_better) change = -change;
+        const char* verdict = base->count < 2 ? "too few runs" : "same";
+        if (metric_differs(now, base) && fabs(change) > settings->threshold) {
+            verdict = change > 0 ? "better" : "REGRESSION";
+            if (change < 0) regressions++;
+        }
+        printf(" %14.2f %7.1f%% %14.2f %7.1f%% %+7.1f%%  %s\n", base_mean,
+               base_mean ? 100.0 * metric_interval(base) / base_mean : 0.0, mean,
+               mean ? 100.0 * metric_interval(now) / mean : 0.0, change, verdict);
+    }
+    if (regressions > 0) printf("%d of %d metrics regressed\n", regressions, METRIC_COUNT);
+    return regressions > 0 ? 1 : 0;
+}
+
+/**
+ * @brief Parses a comma-separated list of names into bits
+ *
+ * @return The bits, or 0 if a name is unknown
+ */
+static unsigned parse_names(const char* list, const char* const* names, int count) {
+    unsigned bits = 0;
+    char* copy = strdup(list);
+    for (char* name = strtok(copy, ","); name; name = strtok(NULL, ",")) {
+        int found = -1;
+        for (int i = 0; i < count; i++) {
+            if (strcmp(name, names[i]) == 0) found = i;
+        }
+        if (found < 0) {
+            bits = 0;
+            break;
+        }
+        bits |= 1u << found;
+    }
+    free(copy);
+    return bits;
+}
+
+/**
+ * @brief Parses "n" or "min-max"
+ *
+ * @return 0 on success, -1 if the range is malformed
+ */
+static int parse_range(const char* text, SizeRange* range) {
+    char* end;
+    range->min = (size_t)strtoull(text, &end, 10);
+    range->max = range->min;
+    if (*end == '-') range->max = (size_t)strtoull(end + 1, &end, 10);
+    return end == text || *end || range->max < range->min ? -1 : 0;
+}
+
+/*******************************************************************************
+ * Main
+ ******************************************************************************/
+static void usage(void) {
+    fprintf(stderr,
+            "usage: sdb-bench <command> [options]\n"
+            "\n"
+            "commands:\n"
+            "  scale                  mixed reads and writes at 1, 2, 4 ... N threads,\n"
+            "                         on one database and on a sharded set\n"
+            "  open                   open time, peak memory and first get by size, codec\n"
+            "                         and format, with a cold and a warm page cache\n"
+            "  memory                 memory per entry of a loaded table, broken down into\n"
+            "                         entry structs, keys, values, index and arena slack\n"
+            "  amplification          bytes written to disk and disk space over the bytes\n"
+            "                         written and held, while one writer sets random keys\n"
+            "  compare                run a suite of scale, open and memory metrics --runs\n"
+            "                         times, save it with --save and check it against a\n"
+            "                         --baseline; exits with 1 if a metric regressed\n"
+            "\n"
+            "options:\n"
+            "  --dir <path>           directory for the scratch databases (default: .)\n"
+            "  --threads <n>          highest thread count (default: number of CPUs)\n"
+            "  --seconds <s>          measured time per run (default: 2)\n"
+            "  --keys <n>             distinct keys, all written before measuring (default: 100000)\n"
+            "  --key-size <bytes>     key size, or min-max for uniformly distributed sizes;\n"
+            "                         keys are at least 15 bytes (default: 15)\n"
+            "  --value-size <bytes>   value size, or min-max (default: 100)\n"
+            "  --reads <percent>      share of reads in the mix (default: 90)\n"
+            "  --shards <n>           shards of the sharded set (default: 4)\n"
+            "  --ordered              use ordered tables\n"
+            "  --sync                 flush the log before each write returns (default: off)\n"
+            "  --sizes <n,...>        entry counts to open (default: 1000,10000,100000,1000000)\n"
+            "  --codecs <names>       none,rle,lz77 (default: all); amplification uses the\n"
+            "                         first of them in this order, and none by default\n"
+            "  --formats <names>      blocks,frozen,paged,log (default: all); log skips sizes\n"
+            "                         whose records would not fit a 1 GiB log\n"
+            "  --modes <names>        log,save,paged for amplification (default: all); save\n"
+            "                         writes a snapshot on every set instead of a log\n"
+            "  --runs <n>             runs of the compare suite, at least 2 (default: 5)\n"
+            "  --threshold <percent>  change a regression must exceed, besides being\n"
+            "                         significant at 95%% (default: 5)\n"
+            "  --baseline <file>      results of an earlier compare --save\n"
+            "  --save <file>          where compare writes its results as JSON\n");
+}
+
+int main(int argc, char** argv) {
+    static const char* const codecs[] = { "none", "rle", "lz77" };
+    static const char* const formats[] = { "blocks", "frozen", "paged", "log" };
+    static const char* const modes[] = { "log", "save", "paged" };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    Settings settings;
+    memset(&settings, 0, sizeof(Settings));
+    settings.dir = ".";
+    settings.threads = cpus > 0 ? (int)cpus : 1;
+    settings.seconds = 2.0;
+    settings.keys = 100000;
+    settings.key_size.min = settings.key_size.max = 15;
+    settings.value_size.min = settings.value_size.max = 100;
+    settings.read_percent = 90;
+    settings.shards = 4;
+    for (uint64_t size = 1000; size <= 1000000; size *= 10) settings.sizes[settings.size_count++] = size;
+    settings.codecs = 7;
+    settings.formats = 15;
+    settings.modes = 7;
+    settings.runs = 5;
+    settings.threshold = 5.0;
+
+    if (argc < 2) {
+        usage();
+        return 2;
+    }
+    for (int i = 2; i < argc; i++) {
+        const char* arg = argv[i];
+        int has_value = i + 1 < argc;
+        if (strcmp(arg, "--dir") == 0 && has_value) {
+            settings.dir = argv[++i];
+        } else if (strcmp(arg, "--threads") == 0 && has_value) {
+            settings.threads = atoi(argv[++i]);
+        } else if (strcmp(arg, "--seconds") == 0 && has_value) {
+            settings.seconds = atof(argv[++i]);
+        } else if (strcmp(arg, "--keys") == 0 && has_value) {
+            settings.keys = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--key-size") == 0 && has_value) {
+            if (parse_range(argv[++i], &settings.key_size) != 0 || settings.key_size.max > MAX_KEY_SIZE) {
+                usage();
+                return 2;
+            }
+        } else if (strcmp(arg, "--value-size") == 0 && has_value) {
+            if (parse_range(argv[++i], &settings.value_size) != 0) {
+                usage();
+                return 2;
+            }
+        } else if (strcmp(arg, "--reads") == 0 && has_value) {
+            settings.read_percent = atoi(argv[++i]);
+        } else if (strcmp(arg, "--shards") == 0 && has_value) {
+            settings.shards = atoi(argv[++i]);
+        } else if (strcmp(arg, "--ordered") == 0) {
+            settings.ordered = 1;
+        } else if (strcmp(arg, "--sync") == 0) {
+            settings.wal_sync = 1;
+        } else if (strcmp(arg, "--sizes") == 0 && has_value) {
+            const char* list = argv[++i];
+            settings.size_count = 0;
+            while (*list && settings.size_count < MAX_SIZES) {
+                char* end;
+                settings.sizes[settings.size_count++] = strtoull(list, &end, 10);
+                list = *end == ',' ? end + 1 : end;
+            }
+        } else if (strcmp(arg, "--codecs") == 0 && has_value) {
+            settings.codecs = parse_names(argv[++i], codecs, 3);
+        } else if (strcmp(arg, "--formats") == 0 && has_value) {
+            settings.formats = parse_names(argv[++i], formats, 4);
+        } else if (strcmp(arg, "--runs") == 0 && has_value) {
+            settings.runs = atoi(argv[++i]);
+        } else if (strcmp(arg, "--threshold") == 0 && has_value) {
+            settings.threshold = strtod(argv[++i], NULL);
+        } else if (strcmp(arg, "--baseline") == 0 && has_value) {
+            settings.baseline = argv[++i];
+        } else if (strcmp(arg, "--save") == 0 && has_value) {
+            settings.save = argv[++i];
+        } else if (strcmp(arg, "--modes") == 0 && has_value) {
+            settings.modes = parse_names(argv[++i], modes, 3);
+        } else {
+            usage();
+            return 2;
+        }
+    }
+    if (settings.threads < 1 || settings.seconds <= 0 || settings.keys == 0 || settings.shards < 1 ||
+        settings.read_percent < 0 || settings.read_percent > 100 || !settings.codecs || !settings.formats ||
+        !settings.modes || settings.runs < 2 || settings.runs > MAX_RUNS || settings.threshold < 0) {
+        usage();
+        return 2;
+    }
+
+    const char* command = argv[1];
+    if (strcmp(command, "scale") == 0) return cmd_scale(&settings);
+    if (strcmp(command, "open") == 0) return cmd_open(&settings);
+    if (strcmp(command, "memory") == 0) return cmd_memory(&settings);
+    if (strcmp(command, "amplification") == 0) return cmd_amplification(&settings);
+    if (strcmp(command, "compare") == 0) return cmd_compare(&settings);
+
+    usage();
+    return 2;
+}
@@ -0,0 +1,1035 @@
+/**
+ * @file sdb_tool.c
+ * @brief Offline maintenance tool for SDB files
+ *
+ * Converts, verifies, salvages and compacts database files, and reports
+ * how much of their disk space is live data. Every command streams its
+ * input: format 3 files are processed one block at a time, older formats
+ * are decoded incrementally, so memory use does not depend on the size of
+ * the database. The exception is compact and space, which remember every
+ * distinct key: about 56 bytes per key at a 50% load factor, plus the
+ * key itself.
+ *
+ * Build with: cc -O2 -o sdb-tool tools/sdb_tool.c
+ *
+ * @author Johannes (Jotrorox) Müller
+ * @copyright Copyright (c) 2024
+ */
+
+#include "../sdb.h"
+#include <stdarg.h>
+
+#define STREAM_WINDOW (64 * 1024)  // LZ77 offsets are 16 bits
+#define SCAN_CHUNK (1024 * 1024)
+
+typedef int (*EntryFn)(void* ctx, uint32_t table, const char* key, uint32_t key_len,
+                       const char* value, uint32_t value_len);
+
+typedef struct {
+    char** names;
+    int count;
+} NameList;
+
+typedef struct {
+    FILE* file;
+    uint64_t remaining;         // Compressed bytes not read yet
+    SDBCompressType codec;      // How the payload is actually encoded
+    unsigned char in[STREAM_WINDOW];
+    size_t in_pos;
+    size_t in_len;
+    unsigned char history[STREAM_WINDOW];
+    uint64_t produced;
+    unsigned run_left;          // Pending RLE run
+    unsigned char run_byte;
+    size_t match_offset;        // Pending LZ77 match
+    unsigned match_left;
+} PayloadStream;
+
+static int problems = 0;
+
+static void problem(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    fprintf(stderr, "sdb-tool: ");
+    vfprintf(stderr, fmt, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    problems++;
+}
+
+/*******************************************************************************
+ * Table Names
+ ******************************************************************************/
+static void names_set(NameList* names, uint32_t index, const char* name) {
+    if ((int)index >= names->count) {
+        names->names = (char**)realloc(names->names, sizeof(char*) * (index + 1));
+        for (int i = names->count; i <= (int)index; i++) {
+            char placeholder[32];
+            snprintf(placeholder, sizeof(placeholder), "salvaged_%d", i);
+            names->names[i] = strdup(placeholder);
+        }
+        names->count = index + 1;
+    }
+    if (name) {
+        free(names->names[index]);
+        names->names[index] = strdup(name);
+    }
+}
+
+static void names_free(NameList* names) {
+    for (int i = 0; i < names->count; i++) {
+        free(names->names[i]);
+    }
+    free(names->names);
+    names->names = NULL;
+    names->count = 0;
+}
+
+/*******************************************************************************
+ * Streaming Decoder for Format 1 and 2 Payloads
+ ******************************************************************************/
+static int stream_byte(PayloadStream* ps, unsigned char* out) {
+    if (ps->in_pos == ps->in_len) {
+        if (ps->remaining == 0) return -1;
+        size_t want = ps->remaining < sizeof(ps->in) ? (size_t)ps->remaining : sizeof(ps->in);
+        ps->in_len = fread(ps->in, 1, want, ps->file);
+        ps->in_pos = 0;
+        if (ps->in_len == 0) return -1;
+        ps->remaining -= ps->in_len;
+    }
+    *out = ps->in[ps->in_pos++];
+    return 0;
+}
+
+static int stream_next(PayloadStream* ps, unsigned char* out) {
+    for (;;) {
+        if (ps->run_left > 0) {
+            ps->run_left--;
+            *out = ps->run_byte;
+            break;
+        }
+        if (ps->match_left > 0) {
+            ps->match_left--;
+            *out = ps->history[(ps->produced - ps->match_offset) % STREAM_WINDOW];
+            break;
+        }
+
+        unsigned char a, b, c;
+        if (stream_byte(ps, &a) != 0) return -1;
+        if (ps->codec == SDB_COMPRESS_NONE) {
+            *out = a;
+            break;
+        }
+        if (ps->codec == SDB_COMPRESS_RLE) {
+            if (stream_byte(ps, &b) != 0) return -1;
+            ps->run_left = a;
+            ps->run_byte = b;
+            continue;
+        }
+        if (a == 0) {
+            if (stream_byte(ps, &b) != 0) return -1;
+            *out = b;
+            break;
+        }
+        unsigned char len;
+        if (stream_byte(ps, &b) != 0 || stream_byte(ps, &c) != 0 || stream_byte(ps, &len) != 0) return -1;
+        ps->match_offset = b | (c << 8);
+        if (ps->match_offset == 0 || ps->match_offset > ps->produced) return -1;
+        ps->match_left = len;
+    }
+
+    ps->history[ps->produced % STREAM_WINDOW] = *out;
+    ps->produced++;
+    return 0;
+}
+
+static int stream_read(PayloadStream* ps, void* dst, size_t len) {
+    unsigned char* out = (unsigned char*)dst;
+    for (size_t i = 0; i < len; i++) {
+        if (stream_next(ps, &out[i]) != 0) return -1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * Input Scanners
+ ******************************************************************************/
+/**
+ * @brief Streams the entries of a format 1 or 2 file
+ *
+ * Entries decoded before any damage are still passed to fn.
+ *
+ * @return 0 if the whole payload decoded cleanly, -1 otherwise
+ */
+static int scan_legacy(FILE* file, uint32_t version, SDBCompressType codec, NameList* names,
+                       EntryFn fn, void* ctx) {
+    size_t compressed_size, original_size;
+    if (fread(&compressed_size, sizeof(size_t), 1, file) != 1 ||
+        fread(&original_size, sizeof(size_t), 1, file) != 1) {
+        problem("truncated header");
+        return -1;
+    }
+
+    PayloadStream* ps = (PayloadStream*)calloc(1, sizeof(PayloadStream));
+    if (!ps) return -1;
+    ps->file = file;
+    ps->remaining = compressed_size;
+    ps->codec = codec;
+    if (version < 2 && codec != SDB_COMPRESS_RLE) ps->codec = SDB_COMPRESS_LZ77;
+
+    int result = 0;
+    char* key = NULL;
+    char* value = NULL;
+    int table_count;
+    if (stream_read(ps, &table_count, sizeof(int)) != 0 || table_count < 0) {
+        problem("payload: cannot read table count");
+        result = -1;
+    }
+
+    for (int i = 0; result == 0 && i < table_count; i++) {
+        int name_len, entry_count;
+        if (stream_read(ps, &name_len, sizeof(int)) != 0 || name_len < 0 || (size_t)name_len > original_size) {
+            problem("payload: table %d has a damaged name", i);
+            result = -1;
+            break;
+        }
+        char* name = (char*)malloc(name_len + 1);
+        if (!name || stream_read(ps, name, name_len) != 0) {
+            free(name);
+            problem("payload: table %d has a damaged name", i);
+            result = -1;
+            break;
+        }
+        name[name_len] = '\0';
+        names_set(names, i, name);
+        free(name);
+
+        if (stream_read(ps, &entry_count, sizeof(int)) != 0 || entry_count < 0) {
+            problem("payload: table %d has a damaged entry count", i);
+            result = -1;
+            break;
+        }
+
+        for (int j = 0; j < entry_count; j++) {
+            int key_len, value_len;
+            if (stream_read(ps, &key_len, sizeof(int)) != 0 ||
+                stream_read(ps, &value_len, sizeof(int)) != 0 ||
+                key_len < 0 || value_len < 0 ||
+                (size_t)key_len + (size_t)value_len > original_size) {
+                problem("payload: table %d entry %d is damaged", i, j);
+                result = -1;
+                break;
+            }
+            key = (char*)realloc(key, key_len + 1);
+            value = (char*)realloc(value, value_len + 1);
+            if (!key || !value ||
+                stream_read(ps, key, key_len) != 0 || stream_read(ps, value, value_len) != 0) {
+                problem("payload: table %d entry %d is damaged", i, j);
+                result = -1;
+                break;
+            }
+            if (fn(ctx, (uint32_t)i, key, key_len, value, value_len) != 0) {
+                result = -1;
+                break;
+            }
+        }
+    }
+
+    if (result == 0 && (ps->produced != original_size || ps->remaining != 0 || ps->in_pos != ps->in_len)) {
+        problem("payload: decoded %llu of %zu bytes", (unsigned long long)ps->produced, original_size);
+        result = -1;
+    }
+
+    free(key);
+    free(value);
+    free(ps);
+    return result;
+}
+
+/**
+ * @brief Streams the entries of a format 3 file, one block at a time
+ *
+ * @return 0 if every block verified, -1 otherwise
+ */
+static int scan_blocked(int fd, NameList* names, EntryFn fn, void* ctx) {
+    SDBFileInfo info = {0};
+    SDBBlockInfo* blocks = NULL;
+    uint32_t block_count = 0;
+    if (footer_read(fd, 3, &info, &blocks, &block_count, NULL) != 0) {
+        problem("footer is damaged; try salvage");
+        sdb_free_file_info(info);
+        free(blocks);
+        return -1;
+    }
+    for (int i = 0; i < info.table_count; i++) {
+        names_set(names, i, info.tables[i].name);
+    }
+
+    int result = 0;
+    for (uint32_t b = 0; b < block_count; b++) {
+        SDBBlockInfo stored;
+        unsigned char* raw = block_read(fd, blocks[b].offset, &stored, 1);
+        if (!raw || stored.crc != blocks[b].crc) {
+            problem("block %u at offset %llu is damaged", b, (unsigned long long)blocks[b].offset);
+            free(raw);
+            result = -1;
+            continue;
+        }
+
+        size_t pos = 0;
+        for (uint32_t j = 0; j < stored.entry_count; j++) {
+            const char *key, *value;
+            uint32_t key_len, value_len;
+            pos = block_next_entry(raw, stored.raw_len, pos, &key, &key_len, &value, &value_len);
+            if (pos == 0) {
+                problem("block %u: entry %u is malformed", b, j);
+                result = -1;
+                break;
+            }
+            if (fn(ctx, stored.table, key, key_len, value, value_len) != 0) {
+                result = -1;
+                break;
+            }
+        }
+        free(raw);
+    }
+
+    sdb_free_file_info(info);
+    free(blocks);
+    return result;
+}
+
+/**
+ * @brief Releases a paged database opened by the tool without syncing it
+ */
+static void close_paged_readonly(SDB* sdb) {
+    pager_close(sdb->pager);
+    for (int i = 0; i < sdb->table_count; i++) {
+        free(sdb->tables[i].name);
+    }
+    free(sdb->tables);
+    free(sdb->scratch);
+    free(sdb->path);
+    free(sdb);
+}
+
+/**
+ * @brief Streams the entries of a page file through a small buffer pool
+ *
+ * @return 0 on success, -1 otherwise
+ */
+static int scan_paged(const char* path, NameList* names, EntryFn fn, void* ctx) {
+    SDBOptions options = sdb_options_default();
+    options.storage_mode = SDB_STORAGE_PAGED;
+    options.pool_pages = 64;
+    SDB* sdb = sdb_open_ex(path, &options);
+    if (!sdb) {
+        problem("cannot open page file");
+        return -1;
+    }
+
+    int result = 0;
+    SDBPager* pager = sdb->pager;
+    for (int i = 0; result == 0 && i < sdb->table_count; i++) {
+        names_set(names, i, sdb->tables[i].name);
+
+        uint32_t root_page = sdb->tables[i].root_page;
+        unsigned char* root = pager_pin(pager, root_page);
+        if (!root) {
+            problem("table %s: cannot read root page", sdb->tables[i].name);
+            result = -1;
+            break;
+        }
+
+        uint32_t bucket_count = (1u << get_u32(root + SDB_ROOT_LEVEL)) + get_u32(root + SDB_ROOT_SPLIT);
+        for (uint32_t b = 0; result == 0 && b < bucket_count; b++) {
+            uint32_t page_id = paged_bucket_head(pager, root, b, 0);
+            while (result == 0 && page_id != 0) {
+                unsigned char* page = pager_pin(pager, page_id);
+                if (!page) {
+                    result = -1;
+                    break;
+                }
+                size_t off = SDB_BUCKET_HEADER;
+                for (uint16_t r = 0; r < get_u16(page + SDB_BUCKET_COUNT); r++) {
+                    unsigned char* rec = page + off;
+                    size_t key_len;
+                    char* owned;
+                    const char* key = paged_record_key(pager, rec, &key_len, &owned);
+                    const char* value = key ? paged_read_value(sdb, rec) : NULL;
+                    int stop = !value || fn(ctx, (uint32_t)i, key, key_len, value, get_u32(rec + 4)) != 0;
+                    free(owned);
+                    if (stop) {
+                        result = -1;
+                        break;
+                    }
+                    off += paged_record_size(rec);
+                }
+                uint32_t next = get_u32(page + SDB_BUCKET_NEXT);
+                pager_unpin(pager, page_id, 0);
+                page_id = next;
+            }
+        }
+        pager_unpin(pager, root_page, 0);
+    }
+
+    close_paged_readonly(sdb);
+    return result;
+}
+
+/**
+ * @brief Streams every entry of a database file of any format
+ *
+ * @param path The input file
+ * @param names Receives the table names
+ * @param fn Called for every entry, in file order
+ * @param ctx Passed to fn
+ * @param codec If not NULL, receives the codec of the input
+ * @return 0 if the input was read without damage, -1 otherwise
+ */
+static int scan_file(const char* path, NameList* names, EntryFn fn, void* ctx, SDBCompressType* codec) {
+    FILE* file = fopen(path, "rb");
+    if (!file) {
+        problem("cannot open %s", path);
+        return -1;
+    }
+    SDB_FADVISE(fileno(file), 0, 0, SEQUENTIAL);
+
+    uint32_t magic = 0, version = 0;
+    SDBCompressType stored_codec = SDB_COMPRESS_LZ77;
+    if (fread(&magic, sizeof(uint32_t), 1, file) != 1 || fread(&version, sizeof(uint32_t), 1, file) != 1) {
+        fclose(file);
+        problem("%s: truncated header", path);
+        return -1;
+    }
+    if (magic == SDB_PAGED_MAGIC) {
+        fclose(file);
+        if (codec) *codec = SDB_COMPRESS_LZ77;
+        return scan_paged(path, names, fn, ctx);
+    }
+    if (magic != SDB_MAGIC || version == 0 || version > SDB_FILE_VERSION ||
+        fread(&stored_codec, sizeof(SDBCompressType), 1, file) != 1) {
+        fclose(file);
+        problem("%s: not an SDB file or unsupported version", path);
+        return -1;
+    }
+    if (codec) *codec = stored_codec;
+
+    int result = version >= 3 ? scan_blocked(fileno(file), names, fn, ctx)
+                              : scan_legacy(file, version, stored_codec, names, fn, ctx);
+    SDB_FADVISE(fileno(file), 0, 0, DONTNEED);
+    fclose(file);
+    return result;
+}
+
+/*******************************************************************************
+ * Output
+ ******************************************************************************/
+typedef struct {
+    SDBBlockWriter writer;
+    FILE* file;
+    char* tmp_path;
+    const char* path;
+    uint64_t entries;
+} Output;
+
+static int output_open(Output* out, const char* path, SDBCompressType codec, size_t block_size) {
+    memset(out, 0, sizeof(Output));
+    size_t len = strlen(path) + 5;
+    out->tmp_path = (char*)malloc(len);
+    snprintf(out->tmp_path, len, "%s.tmp", path);
+    out->path = path;
+    out->file = fopen(out->tmp_path, "wb");
+    if (!out->file) {
+        problem("cannot create %s", out->tmp_path);
+        free(out->tmp_path);
+        return -1;
+    }
+    block_writer_init(&out->writer, out->file, codec, block_size);
+    return 0;
+}
+
+static int output_add(void* ctx, uint32_t table, const char* key, uint32_t key_len,
+                      const char* value, uint32_t value_len) {
+    Output* out = (Output*)ctx;
+    block_writer_add(&out->writer, table, key, key_len, value, value_len);
+    out->entries++;
+    return out->writer.failed ? -1 : 0;
+}
+
+/**
+ * @brief Finishes the output and moves it into place, or discards it
+ *
+ * @return 0 on success, -1 on failure
+ */
+static int output_close(Output* out, const NameList* names, int keep) {
+    int ok = block_writer_finish(&out->writer, names->names, names->count) == 0;
+    ok = ok && fflush(out->file) == 0 && fsync(fileno(out->file)) == 0;
+    if (ok) SDB_FADVISE(fileno(out->file), 0, 0, DONTNEED);
+    if (fclose(out->file) != 0) ok = 0;
+    if (keep && ok && rename(out->tmp_path, out->path) == 0) {
+        free(out->tmp_path);
+        return 0;
+    }
+    if (keep && !ok) problem("cannot write %s", out->path);
+    unlink(out->tmp_path);
+    free(out->tmp_path);
+    return -1;
+}
+
+/*******************************************************************************
+ * Commands
+ ******************************************************************************/
+typedef struct {
+    int codec;                  // -1 keeps the input codec
+    size_t block_size;
+} Settings;
+
+static int cmd_convert(const char* in, const char* out_path, const Settings* settings) {
+    SDBFileInfo info = sdb_peek_info(in);
+    SDBCompressType codec = info.storage_mode == SDB_STORAGE_PAGED ? SDB_COMPRESS_LZ77 : info.compress_type;
+    sdb_free_file_info(info);
+    if (settings->codec >= 0) codec = (SDBCompressType)settings->codec;
+
+    Output out;
+    NameList names = {0};
+    if (output_open(&out, out_path, codec, settings->block_size) != 0) return 1;
+
+    int scanned = scan_file(in, &names, output_add, &out, NULL);
+    if (scanned != 0) problem("%s is damaged; use salvage to recover what is intact", in);
+    int result = output_close(&out, &names, scanned == 0);
+    if (result == 0) {
+        printf("converted %llu entries in %d tables to format %d\n",
+               (unsigned long long)out.entries, names.count, SDB_FILE_VERSION);
+    }
+    names_free(&names);
+    return result == 0 ? 0 : 1;
+}
+
+typedef struct {
+    uint64_t* entries;          // Per table entry count
+    uint64_t* bytes;            // Per table key and value bytes
+    int table_count;
+    uint64_t total;
+} Tally;
+
+static int tally_add(void* ctx, uint32_t table, const char* key, uint32_t key_len,
+                     const char* value, uint32_t value_len) {
+    Tally* tally = (Tally*)ctx;
+    (void)key;
+    (void)value;
+    if ((int)table >= tally->table_count) {
+        int count = table + 1;
+        tally->entries = (uint64_t*)realloc(tally->entries, sizeof(uint64_t) * count);
+        tally->bytes = (uint64_t*)realloc(tally->bytes, sizeof(uint64_t) * count);
+        for (int i = tally->table_count; i < count; i++) {
+            tally->entries[i] = 0;
+            tally->bytes[i] = 0;
+        }
+        tally->table_count = count;
+    }
+    tally->entries[table]++;
+    tally->bytes[table] += key_len + value_len;
+    tally->total++;
+    return 0;
+}
+
+/**
+ * @brief Checks that the blocks of a format 3 file tile the data region
+ */
+static void verify_block_layout(const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return;
+
+    SDBFileInfo info = {0};
+    SDBBlockInfo* blocks = NULL;
+    uint32_t block_count = 0;
+    uint64_t footer_offset = 0;
+    if (footer_read(fd, 3, &info, &blocks, &block_count, &footer_offset) == 0) {
+        uint64_t expected = 2 * sizeof(uint32_t) + sizeof(SDBCompressType);
+        for (uint32_t b = 0; b < block_count; b++) {
+            if (blocks[b].offset != expected) {
+                problem("block %u starts at %llu, expected %llu", b,
+                        (unsigned long long)blocks[b].offset, (unsigned long long)expected);
+            }
+            if (blocks[b].table >= (uint32_t)info.table_count) {
+                problem("block %u belongs to unknown table %u", b, blocks[b].table);
+            }
+
+            SDBBlockInfo stored;
+            unsigned char* raw = block_read(fd, blocks[b].offset, &stored, 0);
+            if (raw && (stored.table != blocks[b].table || stored.entry_count != blocks[b].entry_count ||
+                        stored.raw_len != blocks[b].raw_len || stored.comp_len != blocks[b].comp_len ||
+                        stored.codec != blocks[b].codec)) {
+                problem("block %u does not match its index entry", b);
+            }
+
+            // Sorted blocks must start with their key in the sparse index
+            if (raw && info.block_keys && info.block_keys[b]) {
+                const char *key, *value;
+                uint32_t key_len, value_len, restarts;
+                size_t end = block_restarts(raw, stored.raw_len, &restarts);
+                if (end == 0 || block_next_entry(raw, end, 0, &key, &key_len, &value, &value_len) == 0 ||
+                    key_compare(key, key_len, info.block_keys[b], (uint32_t)strlen(info.block_keys[b])) != 0) {
+                    problem("block %u does not match its sparse index entry", b);
+                }
+            }
+
+            // A block without entries is the key index of a frozen table
+            if (raw && stored.entry_count == 0 && blocks[b].table < (uint32_t)info.table_count) {
+                uint64_t table_keys = info.tables[blocks[b].table].entry_count;
+                if (stored.codec != SDB_COMPRESS_NONE || stored.raw_len < SDB_KEY_INDEX_TRAILER ||
+                    get_u64(raw + stored.raw_len - 16) >= stored.raw_len - SDB_KEY_INDEX_TRAILER ||
+                    get_u64(raw + stored.raw_len - 8) != table_keys) {
+                    problem("block %u is not a key index of its table's %llu keys", b,
+                            (unsigned long long)table_keys);
+                }
+            }
+            free(raw);
+            expected = blocks[b].offset + SDB_BLOCK_HEADER + blocks[b].comp_len;
+        }
+        if (expected != footer_offset) {
+            problem("data ends at %llu but the footer starts at %llu",
+                    (unsigned long long)expected, (unsigned long long)footer_offset);
+        }
+    }
+    sdb_free_file_info(info);
+    free(blocks);
+    close(fd);
+}
+
+static int cmd_verify(const char* path) {
+    SDBFileInfo info = sdb_peek_info(path);
+    if (info.format_version == 0) {
+        problem("%s: not an SDB file or unsupported version", path);
+        return 1;
+    }
+    if (info.format_version >= 3 && info.storage_mode == SDB_STORAGE_MEMORY) {
+        verify_block_layout(path);
+    }
+
+    Tally tally = {0};
+    NameList names = {0};
+    scan_file(path, &names, tally_add, &tally, NULL);
+
+    // The directory in the footer (or root pages) must match the data.
+    // Root pages count record bytes rather than key and value bytes.
+    int paged = info.storage_mode == SDB_STORAGE_PAGED;
+    for (int i = 0; i < info.table_count; i++) {
+        uint64_t entries = i < tally.table_count ? tally.entries[i] : 0;
+        uint64_t bytes = i < tally.table_count ? tally.bytes[i] : 0;
+        if (entries != info.tables[i].entry_count || (!paged && bytes != info.tables[i].data_size)) {
+            problem("table %s: directory lists %llu entries / %llu bytes, data has %llu / %llu",
+                    info.tables[i].name, (unsigned long long)info.tables[i].entry_count,
+                    (unsigned long long)info.tables[i].data_size,
+                    (unsigned long long)entries, (unsigned long long)bytes);
+        }
+    }
+    if (info.table_count >= 0 && tally.table_count > info.table_count) {
+        problem("data references %d tables, directory lists %d", tally.table_count, info.table_count);
+    }
+
+    if (problems == 0) {
+        printf("%s: ok (%s format %u, %d tables, %llu entries, %u blocks)\n", path,
+               paged ? "paged" : "file", info.format_version,
+               names.count, (unsigned long long)tally.total, info.block_count);
+    }
+    sdb_free_file_info(info);
+    names_free(&names);
+    free(tally.entries);
+    free(tally.bytes);
+    return problems == 0 ? 0 : 1;
+}
+
+/**
+ * @brief Recovers every intact block of a damaged format 3 file
+ *
+ * The file is searched for block headers, so blocks are found even when
+ * the footer or the space between blocks is damaged.
+ */
+static int salvage_blocked(const char* in, Output* out, NameList* names, uint64_t* blocks_found) {
+    int fd = open(in, O_RDONLY);
+    if (fd < 0) return -1;
+    SDB_FADVISE(fd, 0, 0, SEQUENTIAL);
+
+    // Table names come from the footer when it survived
+    SDBFileInfo info = {0};
+    uint32_t block_count = 0;
+    if (footer_read(fd, 3, &info, NULL, &block_count, NULL) == 0) {
+        for (int i = 0; i < info.table_count; i++) {
+            names_set(names, i, info.tables[i].name);
+        }
+    } else {
+        problem("footer is damaged; tables will be named salvaged_<n>");
+    }
+    sdb_free_file_info(info);
+
+    struct stat st;
+    fstat(fd, &st);
+    unsigned char* chunk = (unsigned char*)malloc(SCAN_CHUNK);
+    uint64_t offset = 2 * sizeof(uint32_t) + sizeof(SDBCompressType);
+    while (chunk && offset + SDB_BLOCK_HEADER <= (uint64_t)st.st_size) {
+        ssize_t n = pread(fd, chunk, SCAN_CHUNK, (off_t)offset);
+        if (n < (ssize_t)sizeof(uint32_t)) break;
+
+        uint64_t next = offset + n - (sizeof(uint32_t) - 1);
+        for (ssize_t i = 0; i + (ssize_t)sizeof(uint32_t) <= n; i++) {
+            if (get_u32(chunk + i) != SDB_BLOCK_MAGIC) continue;
+
+            uint64_t at = offset + i;
+            unsigned char header[SDB_BLOCK_HEADER];
+            if (pread(fd, header, SDB_BLOCK_HEADER, (off_t)at) != SDB_BLOCK_HEADER ||
+                get_u32(header + 16) > (uint64_t)st.st_size - at) {
+                continue;
+            }
+
+            SDBBlockInfo stored;
+            unsigned char* raw = block_read(fd, at, &stored, 1);
+            if (!raw) continue;
+
+            names_set(names, stored.table, NULL);
+            size_t pos = 0;
+            for (uint32_t j = 0; j < stored.entry_count; j++) {
+                const char *key, *value;
+                uint32_t key_len, value_len;
+                pos = block_next_entry(raw, stored.raw_len, pos, &key, &key_len, &value, &value_len);
+                if (pos == 0) break;
+                output_add(out, stored.table, key, key_len, value, value_len);
+            }
+            free(raw);
+            (*blocks_found)++;
+
+            // Continue right after the recovered block
+            next = at + SDB_BLOCK_HEADER + stored.comp_len;
+            break;
+        }
+        offset = next;
+    }
+
+    free(chunk);
+    SDB_FADVISE(fd, 0, 0, DONTNEED);
+    close(fd);
+    return 0;
+}
+
+static int cmd_salvage(const char* in, const char* out_path, const Settings* settings) {
+    SDBFileInfo info = sdb_peek_info(in);
+    uint32_t version = info.format_version;
+    SDBCompressType codec = info.storage_mode == SDB_STORAGE_PAGED ? SDB_COMPRESS_LZ77 : info.compress_type;
+    SDBStorageMode mode = info.storage_mode;
+    sdb_free_file_info(info);
+    if (settings->codec >= 0) codec = (SDBCompressType)settings->codec;
+
+    Output out;
+    NameList names = {0};
+    if (output_open(&out, out_path, codec, settings->block_size) != 0) return 1;
+
+    uint64_t blocks = 0;
+    if (version >= 3 && mode == SDB_STORAGE_MEMORY) {
+        salvage_blocked(in, &out, &names, &blocks);
+    } else if (version == 0) {
+        // Unreadable header: the blocks may still be intact
+        salvage_blocked(in, &out, &names, &blocks);
+    } else {
+        // Older formats are one stream; keep everything up to the damage
+        scan_file(in, &names, output_add, &out, NULL);
+    }
+
+    int result = output_close(&out, &names, 1);
+    if (result == 0) {
+        printf("salvaged %llu entries in %d tables", (unsigned long long)out.entries, names.count);
+        if (blocks) printf(" from %llu intact blocks", (unsigned long long)blocks);
+        printf("\n");
+    }
+    names_free(&names);
+    return result == 0 ? 0 : 1;
+}
+
+/*******************************************************************************
+ * Compaction
+ ******************************************************************************/
+typedef struct {
+    uint64_t* hashes;           // 0 marks an empty slot
+    uint64_t* last;             // Ordinal of the last copy of each key
+    uint64_t* spots;            // Offset of each key in keys
+    size_t capacity;
+    size_t count;
+    unsigned char* keys;        // Table index, key length and bytes of every distinct key
+    size_t keys_used;
+    size_t keys_size;
+    uint64_t ordinal;
+    int failed;
+    Output* out;                // NULL to only count the copies kept
+    uint64_t dropped;
+    uint64_t kept_bytes;        // Keys and values of the copies kept
+} Dedup;
+
+static uint64_t dedup_hash(uint32_t table, const char* key, uint32_t key_len) {
+    uint64_t hash = 1469598103934665603ull ^ ((uint64_t)table * 0x9E3779B97F4A7C15ull);
+    for (uint32_t i = 0; i < key_len; i++) {
+        hash = (hash ^ (unsigned char)key[i]) * 1099511628211ull;
+    }
+    return hash ? hash : 1;
+}
+
+static int dedup_key_equal(const Dedup* d, uint64_t spot, uint32_t table, const char* key, uint32_t key_len) {
+    const unsigned char* stored = d->keys + spot;
+    return get_u32(stored) == table && get_u32(stored + 4) == key_len &&
+           memcmp(stored + 8, key, key_len) == 0;
+}
+
+// Hashes only narrow the search; keys whose hashes collide are told apart by their bytes
+static size_t dedup_slot(const Dedup* d, uint64_t hash, uint32_t table, const char* key, uint32_t key_len) {
+    size_t slot = hash & (d->capacity - 1);
+    while (d->hashes[slot] != 0 &&
+           (d->hashes[slot] != hash || !dedup_key_equal(d, d->spots[slot], table, key, key_len))) {
+        slot = (slot + 1) & (d->capacity - 1);
+    }
+    return slot;
+}
+
+static int dedup_grow(Dedup* d) {
+    size_t capacity = d->capacity ? d->capacity * 2 : 1024;
+    Dedup grown = *d;
+    grown.capacity = capacity;
+    grown.hashes = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    grown.last = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    grown.spots = (uint64_t*)calloc(capacity, sizeof(uint64_t));
+    if (!grown.hashes || !grown.last || !grown.spots) {
+        free(grown.hashes);
+        free(grown.last);
+        free(grown.spots);
+        return -1;
+    }
+    // Every key is distinct, so each one takes the first free slot
+    for (size_t i = 0; i < d->capacity; i++) {
+        if (d->hashes[i] == 0) continue;
+        size_t slot = d->hashes[i] & (capacity - 1);
+        while (grown.hashes[slot] != 0) slot = (slot + 1) & (capacity - 1);
+        grown.hashes[slot] = d->hashes[i];
+        grown.last[slot] = d->last[i];
+        grown.spots[slot] = d->spots[i];
+    }
+    free(d->hashes);
+    free(d->last);
+    free(d->spots);
+    *d = grown;
+    return 0;
+}
+
+static int dedup_store_key(Dedup* d, uint32_t table, const char* key, uint32_t key_len, uint64_t* spot) {
+    size_t need = 8 + (size_t)key_len;
+    if (d->keys_used + need > d->keys_size) {
+        size_t size = d->keys_size ? d->keys_size : 64 * 1024;
+        while (d->keys_used + need > size) size *= 2;
+        unsigned char* grown = (unsigned char*)realloc(d->keys, size);
+        if (!grown) return -1;
+        d->keys = grown;
+        d->keys_size = size;
+    }
+    unsigned char* stored = d->keys + d->keys_used;
+    put_u32(stored, table);
+    put_u32(stored + 4, key_len);
+    memcpy(stored + 8, key, key_len);
+    *spot = d->keys_used;
+    d->keys_used += need;
+    return 0;
+}
+
+static void dedup_free(Dedup* d) {
+    free(d->hashes);
+    free(d->last);
+    free(d->spots);
+    free(d->keys);
+}
+
+static int dedup_record(void* ctx, uint32_t table, const char* key, uint32_t key_len,
+                        const char* value, uint32_t value_len) {
+    Dedup* d = (Dedup*)ctx;
+    (void)value;
+    (void)value_len;
+    if ((d->count + 1) * 2 > d->capacity && dedup_grow(d) != 0) {
+        d->failed = 1;
+        return -1;
+    }
+    uint64_t hash = dedup_hash(table, key, key_len);
+    size_t slot = dedup_slot(d, hash, table, key, key_len);
+    if (d->hashes[slot] == 0) {
+        if (dedup_store_key(d, table, key, key_len, &d->spots[slot]) != 0) {
+            d->failed = 1;
+            return -1;
+        }
+        d->hashes[slot] = hash;
+        d->count++;
+    }
+    d->last[slot] = d->ordinal++;
+    return 0;
+}
+
+static int dedup_emit(void* ctx, uint32_t table, const char* key, uint32_t key_len,
+                      const char* value, uint32_t value_len) {
+    Dedup* d = (Dedup*)ctx;
+    uint64_t ordinal = d->ordinal++;
+    if (d->last[dedup_slot(d, dedup_hash(table, key, key_len), table, key, key_len)] != ordinal) {
+        d->dropped++;
+        return 0;
+    }
+    d->kept_bytes += key_len + value_len;
+    return d->out ? output_add(d->out, table, key, key_len, value, value_len) : 0;
+}
+
+/**
+ * @brief Rewrites a file into full blocks, keeping only the last copy of each key
+ *
+ * Two streaming passes: the first remembers every distinct key and where
+ * its last copy is, the second writes only those copies.
+ */
+static int cmd_compact(const char* in, const char* out_path, const Settings* settings) {
+    SDBFileInfo info = sdb_peek_info(in);
+    uint64_t before = info.file_size;
+    SDBCompressType codec = info.storage_mode == SDB_STORAGE_PAGED ? SDB_COMPRESS_LZ77 : info.compress_type;
+    sdb_free_file_info(info);
+    if (settings->codec >= 0) codec = (SDBCompressType)settings->codec;
+
+    Dedup d = {0};
+    NameList names = {0};
+    if (scan_file(in, &names, dedup_record, &d, NULL) != 0 || d.failed) {
+        problem("%s is damaged; use salvage first", in);
+        names_free(&names);
+        dedup_free(&d);
+        return 1;
+    }
+
+    Output out;
+    if (output_open(&out, out_path, codec, settings->block_size) != 0) {
+        names_free(&names);
+        dedup_free(&d);
+        return 1;
+    }
+    d.out = &out;
+    d.ordinal = 0;
+    int scanned = scan_file(in, &names, dedup_emit, &d, NULL);
+    int result = output_close(&out, &names, scanned == 0);
+
+    if (result == 0) {
+        struct stat st;
+        uint64_t after = stat(out_path, &st) == 0 ? (uint64_t)st.st_size : 0;
+        printf("compacted %llu entries (%llu superseded copies dropped), %llu -> %llu bytes\n",
+               (unsigned long long)out.entries, (unsigned long long)d.dropped,
+               (unsigned long long)before, (unsigned long long)after);
+    }
+    names_free(&names);
+    dedup_free(&d);
+    return result == 0 ? 0 : 1;
+}
+
+/*******************************************************************************
+ * Space
+ ******************************************************************************/
+static uint64_t path_bytes(const char* path, const char* suffix) {
+    char full[4096];
+    snprintf(full, sizeof(full), "%s%s", path, suffix);
+    struct stat st;
+    return stat(full, &st) == 0 ? (uint64_t)st.st_size : 0;
+}
+
+/**
+ * @brief Reports how much of the disk space of a database holds live data
+ *
+ * Live data is the keys and values of the last copy of each key in the
+ * file. The log and the cold segment next to it take space as well; the
+ * log reserves its whole ring up front and is replayed over the file, so
+ * none of it is counted as live.
+ */
+static int cmd_space(const char* path) {
+    Dedup d = {0};
+    NameList names = {0};
+    int scanned = scan_file(path, &names, dedup_record, &d, NULL) == 0 && !d.failed;
+    if (scanned) {
+        d.ordinal = 0;
+        scanned = scan_file(path, &names, dedup_emit, &d, NULL) == 0;
+    }
+    names_free(&names);
+    dedup_free(&d);
+    if (!scanned) {
+        problem("%s is damaged; use salvage first", path);
+        return 1;
+    }
+
+    uint64_t file = path_bytes(path, "");
+    uint64_t wal = path_bytes(path, ".wal");
+    uint64_t cold = path_bytes(path, ".cold");
+    uint64_t disk = file + wal + cold;
+    printf("live data     %14llu bytes in %llu keys, %llu superseded copies\n", (unsigned long long)d.kept_bytes,
+           (unsigned long long)d.count, (unsigned long long)d.dropped);
+    printf("database file %14llu bytes\n", (unsigned long long)file);
+    printf("log           %14llu bytes\n", (unsigned long long)wal);
+    printf("cold segment  %14llu bytes\n", (unsigned long long)cold);
+    if (d.kept_bytes > 0) {
+        printf("space amplification %.2fx, %.2fx for the database file alone\n",
+               (double)disk / (double)d.kept_bytes, (double)file / (double)d.kept_bytes);
+    }
+    return 0;
+}
+
+/*******************************************************************************
+ * Main
+ ******************************************************************************/
+static void usage(void) {
+    fprintf(stderr,
+            "usage: sdb-tool <command> [options] <files>\n"
+            "\n"
+            "commands:\n"
+            "  convert <in> <out>   rewrite any SDB file (format 1-3 or paged) as format %d\n"
+            "  verify <file>        check checksums and index consistency\n"
+            "  salvage <in> <out>   recover the intact parts of a damaged file\n"
+            "  compact <in> <out>   drop superseded copies of keys and repack blocks\n"
+            "  space <file>         live data against the disk space of the file, its log\n"
+            "                       and its cold segment\n"
+            "\n"
+            "options:\n"
+            "  --codec none|rle|lz77  codec of the output (default: codec of the input)\n"
+            "  --block-size <bytes>   target block size of the output (default: %d)\n",
+            SDB_FILE_VERSION, SDB_BLOCK_SIZE);
+}
+
+int main(int argc, char** argv) {
+    Settings settings = { -1, SDB_BLOCK_SIZE };
+    const char* files[2] = { NULL, NULL };
+    int file_count = 0;
+
+    if (argc < 2) {
+        usage();
+        return 2;
+    }
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--codec") == 0 && i + 1 < argc) {
+            const char* name = argv[++i];
+            settings.codec = strcmp(name, "none") == 0 ? SDB_COMPRESS_NONE
+                           : strcmp(name, "rle") == 0 ? SDB_COMPRESS_RLE
+                           : strcmp(name, "lz77") == 0 ? SDB_COMPRESS_LZ77 : -2;
+            if (settings.codec == -2) {
+                usage();
+                return 2;
+            }
+        } else if (strcmp(argv[i], "--block-size") == 0 && i + 1 < argc) {
+            settings.block_size = (size_t)strtoull(argv[++i], NULL, 10);
+            if (settings.block_size < 1024) settings.block_size = 1024;
+        } else if (file_count < 2) {
+            files[file_count++] = argv[i];
+        } else {
+            usage();
+            return 2;
+        }
+    }
+
+    const char* command = argv[1];
+    if (strcmp(command, "verify") == 0 && file_count == 1) return cmd_verify(files[0]);
+    if (strcmp(command, "convert") == 0 && file_count == 2) return cmd_convert(files[0], files[1], &settings);
+    if (strcmp(command, "salvage") == 0 && file_count == 2) return cmd_salvage(files[0], files[1], &settings);
+    if (strcmp(command, "compact") == 0 && file_count == 2) return cmd_compact(files[0], files[1], &settings);
+    if (strcmp(command, "space") == 0 && file_count == 1) return cmd_space(files[0]);
+
+    usage();
+    return 2;
+}